@@ -0,0 +1,36 @@
+// BalboaSpaBench.cpp : Micro benchmarks for the spa comms library.
+//
+//  Usage: BalboaSpaBench [--benchmark_filter=<substring>] [--benchmark_out=<file.json>]
+//
+//  Results are JSON, in the same layout Google Benchmark writes, so two runs
+//  can be compared with its tools/compare.py.  Run a Release build.
+//
+//  Exits with 2 if any benchmark reported an error, e.g. a check that
+//  failed, so a CI step running it fails too.
+
+#include "stdafx.h"
+#include "Benchmark.h"
+#pragma comment(lib, "Ws2_32.lib")
+
+#include "crc.h"
+
+
+int main(int argc, char *argv[])
+{
+	WSADATA wsaData;
+
+	int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+	if (iResult != 0)
+	{
+		fprintf(stderr, "WSAStartup failed: %d\n", iResult);
+		return 1;
+	}
+
+	F_CRC_InicializaTabla();
+
+	iResult = RunBenchmarks(argc, argv);
+
+	WSACleanup();
+	return iResult;
+}
@@ -0,0 +1,405 @@
+#include "stdafx.h"
+#include "Benchmark.h"
+
+#include <thread>
+#include <time.h>
+
+
+//  Replacement global allocator, so every benchmark can report how many
+//  heap allocations it makes per iteration.  Also counted per thread, for
+//  checking one path without noise from others; see ReplayBudget.h.
+static std::atomic<UINT64> g_uiAllocations(0);
+static thread_local ThreadAllocations t_Allocations = {0, 0};
+
+void *
+operator new(
+	size_t cbSize)
+{
+	g_uiAllocations.fetch_add(1, std::memory_order_relaxed);
+	t_Allocations.m_cAllocations++;
+	t_Allocations.m_cbAllocated += cbSize;
+
+	void *p = malloc(cbSize != 0 ? cbSize : 1);
+
+	if (p == NULL)
+	{
+		throw std::bad_alloc();
+	}
+
+	return p;
+}
+
+void
+operator delete(
+	void *p) noexcept
+{
+	free(p);
+}
+
+UINT64
+GetAllocationCount(void)
+{
+	return g_uiAllocations.load(std::memory_order_relaxed);
+}
+
+ThreadAllocations
+GetThreadAllocations(void)
+{
+	return t_Allocations;
+}
+
+
+static ULONGLONG
+GetThreadCpuTime(void)
+{
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+
+	GetThreadTimes(GetCurrentThread(), &ftCreation, &ftExit, &ftKernel, &ftUser);
+
+	//  100ns units.
+	return (((ULONGLONG)ftKernel.dwHighDateTime << 32) + ftKernel.dwLowDateTime) +
+		(((ULONGLONG)ftUser.dwHighDateTime << 32) + ftUser.dwLowDateTime);
+}
+
+static LONGLONG
+GetCounter(void)
+{
+	LARGE_INTEGER liCounter;
+
+	QueryPerformanceCounter(&liCounter);
+	return liCounter.QuadPart;
+}
+
+
+CBenchState::CBenchState(
+	UINT64 uiIterations,
+	INT64 iArg)
+	: m_uiIterations(uiIterations), m_uiRemaining(uiIterations), m_iArg(iArg),
+	m_uiItems(0), m_uiBytes(0),
+	m_fStarted(FALSE), m_fRunning(FALSE),
+	m_llStartCounter(0), m_ullStartCpu(0), m_uiStartAllocations(0),
+	m_llElapsedCounter(0), m_ullElapsedCpu(0), m_uiAllocations(0)
+{}
+
+BOOL
+CBenchState::KeepRunning(void)
+{
+	if (!m_fStarted)
+	{
+		m_fStarted = TRUE;
+		ResumeTiming();
+	}
+
+	if ((m_uiRemaining > 0) && m_strError.empty())
+	{
+		m_uiRemaining--;
+		return TRUE;
+	}
+
+	PauseTiming();
+	return FALSE;
+}
+
+void
+CBenchState::PauseTiming(void)
+{
+	if (m_fRunning)
+	{
+		m_llElapsedCounter += GetCounter() - m_llStartCounter;
+		m_ullElapsedCpu += GetThreadCpuTime() - m_ullStartCpu;
+		m_uiAllocations += GetAllocationCount() - m_uiStartAllocations;
+		m_fRunning = FALSE;
+	}
+}
+
+void
+CBenchState::ResumeTiming(void)
+{
+	if (!m_fRunning)
+	{
+		m_fRunning = TRUE;
+		m_uiStartAllocations = GetAllocationCount();
+		m_ullStartCpu = GetThreadCpuTime();
+		m_llStartCounter = GetCounter();
+	}
+}
+
+void
+CBenchState::SetCounter(
+	const char *szName,
+	double dValue,
+	BOOL fPerIteration)
+{
+	Counter NewCounter = {szName, dValue, fPerIteration};
+
+	m_Counters.push_back(NewCounter);
+}
+
+void
+CBenchState::SkipWithError(
+	const char *szError)
+{
+	m_strError = szError;
+}
+
+
+struct BenchmarkEntry
+{
+	string m_strName;
+	BenchmarkProc m_pProc;
+	INT64 m_iArg;
+};
+
+static std::vector<BenchmarkEntry> &
+GetRegistry(void)
+{
+	//  Function static, so registration order between files doesn't matter.
+	static std::vector<BenchmarkEntry> Registry;
+
+	return Registry;
+}
+
+CBenchmarkRegistration::CBenchmarkRegistration(
+	const char *szName,
+	BenchmarkProc pProc,
+	std::initializer_list<INT64> Args)
+{
+	if (Args.size() == 0)
+	{
+		BenchmarkEntry Entry = {szName, pProc, 0};
+
+		GetRegistry().push_back(Entry);
+	}
+
+	for (auto pArg = Args.begin(); pArg != Args.end(); pArg++)
+	{
+		char szArg[32];
+
+		sprintf_s(szArg, "/%lld", (long long)*pArg);
+
+		BenchmarkEntry Entry = {string(szName) + szArg, pProc, *pArg};
+
+		GetRegistry().push_back(Entry);
+	}
+}
+
+
+class CBenchRunner
+{
+public:
+	CBenchRunner(FILE *fhOut, double dMinTime);
+
+	void Run(const BenchmarkEntry &);
+	void Finish(void);
+
+	//  Benchmarks that called SkipWithError(), e.g. a failed check.
+	UINT GetErrorCount(void) const { return m_cErrors; };
+
+private:
+	void Report(const BenchmarkEntry &, const CBenchState &);
+
+	FILE *m_fhOut;
+	double m_dMinTime;
+	double m_dCounterFrequency;
+	BOOL m_fFirst;
+	UINT m_cErrors;
+};
+
+CBenchRunner::CBenchRunner(
+	FILE *fhOut,
+	double dMinTime)
+	: m_fhOut(fhOut), m_dMinTime(dMinTime), m_fFirst(TRUE), m_cErrors(0)
+{
+	LARGE_INTEGER liFrequency;
+
+	QueryPerformanceFrequency(&liFrequency);
+	m_dCounterFrequency = (double)liFrequency.QuadPart;
+
+	char szDate[64];
+	time_t tNow = time(NULL);
+	tm tmNow;
+
+	localtime_s(&tmNow, &tNow);
+	strftime(szDate, sizeof(szDate), "%Y-%m-%dT%H:%M:%S", &tmNow);
+
+	fprintf(m_fhOut, "{\n  \"context\": {\n");
+	fprintf(m_fhOut, "    \"date\": \"%s\",\n", szDate);
+	fprintf(m_fhOut, "    \"executable\": \"BalboaSpaBench\",\n");
+	fprintf(m_fhOut, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#ifdef _DEBUG
+	fprintf(m_fhOut, "    \"library_build_type\": \"debug\"\n");
+#else
+	fprintf(m_fhOut, "    \"library_build_type\": \"release\"\n");
+#endif
+	fprintf(m_fhOut, "  },\n  \"benchmarks\": [\n");
+}
+
+void
+CBenchRunner::Run(
+	const BenchmarkEntry &Entry)
+{
+	UINT64 uiIterations = 1;
+
+	for (;;)
+	{
+		CBenchState State(uiIterations, Entry.m_iArg);
+
+		Entry.m_pProc(State);
+
+		double dElapsed = State.m_llElapsedCounter / m_dCounterFrequency;
+
+		if (!State.m_strError.empty() ||
+			(dElapsed >= m_dMinTime) ||
+			(uiIterations >= 1000000000))
+		{
+			Report(Entry, State);
+			break;
+		}
+
+		//  Aim a little past the minimum time, but don't grow too fast off
+		//  a noisy short run.
+		double dMultiplier = (m_dMinTime * 1.4) / (dElapsed > 1e-9 ? dElapsed : 1e-9);
+
+		if (dMultiplier > 10.0)
+		{
+			dMultiplier = 10.0;
+		}
+
+		UINT64 uiNext = (UINT64)(uiIterations * dMultiplier);
+
+		uiIterations = (uiNext > uiIterations) ? uiNext : uiIterations + 1;
+	}
+}
+
+void
+CBenchRunner::Report(
+	const BenchmarkEntry &Entry,
+	const CBenchState &State)
+{
+	double dRealTime = State.m_llElapsedCounter / m_dCounterFrequency;
+	double dCpuTime = State.m_ullElapsedCpu / 1e7;
+	double dIterations = (double)State.m_uiIterations;
+
+	fprintf(m_fhOut, "%s    {\n", m_fFirst ? "" : ",\n");
+	m_fFirst = FALSE;
+
+	fprintf(m_fhOut, "      \"name\": \"%s\",\n", Entry.m_strName.c_str());
+	fprintf(m_fhOut, "      \"run_name\": \"%s\",\n", Entry.m_strName.c_str());
+	fprintf(m_fhOut, "      \"run_type\": \"iteration\",\n");
+
+	if (!State.m_strError.empty())
+	{
+		fprintf(m_fhOut, "      \"error_occurred\": true,\n");
+		fprintf(m_fhOut, "      \"error_message\": \"%s\",\n", State.m_strError.c_str());
+
+		fprintf(stderr, "%s failed: %s\n", Entry.m_strName.c_str(), State.m_strError.c_str());
+		m_cErrors++;
+	}
+
+	fprintf(m_fhOut, "      \"iterations\": %llu,\n", (unsigned long long)State.m_uiIterations);
+	fprintf(m_fhOut, "      \"real_time\": %.4f,\n", dRealTime * 1e9 / dIterations);
+	fprintf(m_fhOut, "      \"cpu_time\": %.4f,\n", dCpuTime * 1e9 / dIterations);
+	fprintf(m_fhOut, "      \"time_unit\": \"ns\",\n");
+
+	if ((State.m_uiBytes != 0) && (dRealTime > 0))
+	{
+		fprintf(m_fhOut, "      \"bytes_per_second\": %.4f,\n", State.m_uiBytes / dRealTime);
+	}
+
+	if ((State.m_uiItems != 0) && (dRealTime > 0))
+	{
+		fprintf(m_fhOut, "      \"items_per_second\": %.4f,\n", State.m_uiItems / dRealTime);
+	}
+
+	for (auto pCounter = State.m_Counters.cbegin(); pCounter != State.m_Counters.cend(); pCounter++)
+	{
+		fprintf(m_fhOut, "      \"%s\": %.4f,\n", pCounter->m_strName.c_str(),
+				pCounter->m_fPerIteration ? pCounter->m_dValue / dIterations : pCounter->m_dValue);
+	}
+
+	fprintf(m_fhOut, "      \"allocs_per_iter\": %.4f\n    }", State.m_uiAllocations / dIterations);
+	fflush(m_fhOut);
+
+	//  Progress to the console when the results are going to a file.
+	if (m_fhOut != stdout)
+	{
+		wprintf_s(L"%-40S %12.1f ns %12llu\n", Entry.m_strName.c_str(),
+				  dRealTime * 1e9 / dIterations, (unsigned long long)State.m_uiIterations);
+	}
+}
+
+void
+CBenchRunner::Finish(void)
+{
+	fprintf(m_fhOut, "\n  ]\n}\n");
+}
+
+
+int
+RunBenchmarks(
+	int argc,
+	char *argv[])
+{
+	const char *szFilter = NULL;
+	const char *szOutFile = NULL;
+	double dMinTime = 0.5;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char szFilterArg[] = "--benchmark_filter=";
+		const char szOutArg[] = "--benchmark_out=";
+		const char szMinTimeArg[] = "--benchmark_min_time=";
+
+		if (strncmp(argv[i], szFilterArg, sizeof(szFilterArg) - 1) == 0)
+		{
+			szFilter = argv[i] + sizeof(szFilterArg) - 1;
+		}
+		else if (strncmp(argv[i], szOutArg, sizeof(szOutArg) - 1) == 0)
+		{
+			szOutFile = argv[i] + sizeof(szOutArg) - 1;
+		}
+		else if (strncmp(argv[i], szMinTimeArg, sizeof(szMinTimeArg) - 1) == 0)
+		{
+			dMinTime = atof(argv[i] + sizeof(szMinTimeArg) - 1);
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--benchmark_filter=<substring>] "
+					"[--benchmark_out=<file.json>] [--benchmark_min_time=<seconds>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	FILE *fhOut = stdout;
+
+	if (szOutFile != NULL)
+	{
+		if (fopen_s(&fhOut, szOutFile, "w") != 0)
+		{
+			fprintf(stderr, "Unable to open %s\n", szOutFile);
+			return 1;
+		}
+	}
+
+	CBenchRunner Runner(fhOut, dMinTime);
+
+	const std::vector<BenchmarkEntry> &Registry = GetRegistry();
+
+	for (auto pEntry = Registry.cbegin(); pEntry != Registry.cend(); pEntry++)
+	{
+		if ((szFilter == NULL) || (strstr(pEntry->m_strName.c_str(), szFilter) != NULL))
+		{
+			Runner.Run(*pEntry);
+		}
+	}
+
+	Runner.Finish();
+
+	if (fhOut != stdout)
+	{
+		fclose(fhOut);
+	}
+
+	//  So that a failed check fails a build step.
+	return (Runner.GetErrorCount() != 0) ? 2 : 0;
+}
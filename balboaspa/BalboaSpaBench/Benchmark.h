@@ -0,0 +1,102 @@
+#pragma once
+
+//  A very small benchmark harness, modelled on Google Benchmark.  Each
+//  benchmark is a function taking a CBenchState; the body loops on
+//  KeepRunning() and the harness picks the iteration count.
+//
+//  Results are emitted in Google Benchmark's JSON layout so the usual
+//  comparison tools can be pointed at two result files.
+
+class CBenchState
+{
+public:
+	CBenchState(UINT64 uiIterations, INT64 iArg);
+
+	BOOL KeepRunning(void);
+	INT64 Range(void) const { return m_iArg; };
+	UINT64 Iterations(void) const { return m_uiIterations; };
+
+	//  Exclude setup work from the measurement.
+	void PauseTiming(void);
+	void ResumeTiming(void);
+
+	void SetItemsProcessed(UINT64 uiItems) { m_uiItems = uiItems; };
+	void SetBytesProcessed(UINT64 uiBytes) { m_uiBytes = uiBytes; };
+
+	//  Reported as-is, unless fPerIteration is set.
+	void SetCounter(const char *szName, double dValue, BOOL fPerIteration = FALSE);
+
+	void SkipWithError(const char *szError);
+
+private:
+	friend class CBenchRunner;
+
+	UINT64 m_uiIterations;
+	UINT64 m_uiRemaining;
+	INT64 m_iArg;
+
+	UINT64 m_uiItems;
+	UINT64 m_uiBytes;
+
+	BOOL m_fStarted;
+	BOOL m_fRunning;
+	LONGLONG m_llStartCounter;
+	ULONGLONG m_ullStartCpu;
+	UINT64 m_uiStartAllocations;
+
+	LONGLONG m_llElapsedCounter;
+	ULONGLONG m_ullElapsedCpu;
+	UINT64 m_uiAllocations;
+
+	struct Counter
+	{
+		string m_strName;
+		double m_dValue;
+		BOOL m_fPerIteration;
+	};
+	std::vector<Counter> m_Counters;
+
+	string m_strError;
+};
+
+
+typedef void (*BenchmarkProc)(CBenchState &);
+
+//  Registers 'szName' once per argument (as "szName/arg"), or once with no
+//  suffix if there are no arguments.
+class CBenchmarkRegistration
+{
+public:
+	CBenchmarkRegistration(const char *szName, BenchmarkProc,
+						   std::initializer_list<INT64> Args = {});
+};
+
+#define BENCHMARK(Proc, ...) \
+	static CBenchmarkRegistration Proc##_Registration(#Proc, Proc, { __VA_ARGS__ })
+
+
+//  Keep the optimizer from discarding a computed value.
+template <typename T>
+inline void DoNotOptimize(const T &Value)
+{
+	static const void * volatile pSink;
+
+	pSink = &Value;
+}
+
+
+//  Heap allocations made by this process, all threads.  Counted by the
+//  replacement operator new in Benchmark.cpp.
+UINT64 GetAllocationCount(void);
+
+//  The same, for the calling thread only, with the bytes asked for.
+struct ThreadAllocations
+{
+	UINT64 m_cAllocations;
+	UINT64 m_cbAllocated;
+};
+
+ThreadAllocations GetThreadAllocations(void);
+
+//  Returns 0, 1 for bad arguments, or 2 if any benchmark reported an error.
+int RunBenchmarks(int argc, char *argv[]);
@@ -0,0 +1,2655 @@
+#include "stdafx.h"
+#include "Benchmark.h"
+#include "ReplayBudget.h"
+#include "SpaSimulator.h"
+#include "MessageFormat.h"
+#include "crc.h"
+
+
+//  Builds a complete, correctly checksummed frame around 'Payload'.
+static CByteArray
+MakeFrame(
+	UINT uiMessageID,
+	std::initializer_list<BYTE> Payload)
+{
+	CByteArray Frame(cMessageOverhead + Payload.size());
+
+	Frame[0] = byMessageTerminator;
+	Frame[1] = (BYTE)(Frame.size() - 2);
+	Frame[2] = (uiMessageID >> 16) & 0xff;
+	Frame[3] = (uiMessageID >> 8) & 0xff;
+	Frame[4] = (uiMessageID) & 0xff;
+	std::copy(Payload.begin(), Payload.end(), Frame.begin() + uiPayloadStartOffset);
+	Frame[Frame.size() - 2] = F_CRC_CalculaCheckSum(&Frame[1], (uint16_t)(Frame.size() - 3));
+	Frame[Frame.size() - 1] = byMessageTerminator;
+
+	return Frame;
+}
+
+
+//  Sample payloads, taken from Protocol.txt.
+static CByteArray
+MakeStatusFrame(
+	BYTE byMinute)
+{
+	return MakeFrame(msStatus,
+					 {0x00, 0x00, 0x64, 0x0c, byMinute, 0x00, 0x00, 0x00, 0x00, 0x00, 0x34, 0x06,
+					 0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x66, 0x00, 0x00, 0x00});
+}
+
+static CByteArray
+MakeConfigResponseFrame(void)
+{
+	return MakeFrame(msConfigResponse,
+					 {0x02, 0x02, 0x80, 0x00, 0x15, 0x27, 0x10, 0xab, 0xd2, 0x00, 0x00, 0x00, 0x00,
+					 0x00, 0x00, 0x00, 0x00, 0x00, 0x15, 0x27, 0xff, 0xff, 0x10, 0xab, 0xd2});
+}
+
+static CByteArray
+MakeFilterConfigFrame(void)
+{
+	return MakeFrame(msFilterConfig, {0x14, 0x00, 0x02, 0x00, 0x88, 0x00, 0x01, 0x1e});
+}
+
+static CByteArray
+MakeVersionInfoFrame(void)
+{
+	return MakeFrame(msControlConfig,
+					 {0x64, 0xdc, 0x11, 0x00, 0x42, 0x46, 0x42, 0x50, 0x32, 0x30, 0x20, 0x20, 0x01,
+					 0x3d, 0x12, 0x38, 0x2e, 0x01, 0x0a, 0x04, 0x00});
+}
+
+static CByteArray
+MakeControlConfig2Frame(void)
+{
+	return MakeFrame(msControlConfig2, {0x0a, 0x00, 0x01, 0xd0, 0x00, 0x44});
+}
+
+
+class CCountingCallback :
+	public IMonitorCallback
+{
+public:
+	CCountingCallback() : m_uiMessages(0) {};
+
+	void ProcessStatusMessage(const StatusMessage &Message) { Touch(Message.m_CurrentTemp); };
+	void ProcessConfigResponse(const ConfigResponseMessage &Message) { Touch(Message.m_strMACAddress[0]); };
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &Message) { Touch(Message.m_Filter1StartTime.m_Hour); };
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &Message) { Touch(Message.CurrentSetup); };
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &Message) { Touch(Message.m_RawMessage[0]); };
+	void ProcessUnknownMessageRaw(const CByteArray &Message) { Touch(Message[0]); };
+
+	void Dispose(void) {};
+
+	UINT64 m_uiMessages;
+
+private:
+	void Touch(BYTE by) { DoNotOptimize(by); m_uiMessages++; };
+};
+
+
+static CSpaAddress
+MakeDummyAddress(void)
+{
+	sockaddr_in saAddress;
+
+	memset(&saAddress, 0, sizeof(saAddress));
+	saAddress.sin_family = AF_INET;
+	saAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	return CSpaAddress(saAddress, "00-15-27-00-00-00");
+}
+
+
+//  Frames per second through the stream stitching code, with the input
+//  arriving in reads of Range() bytes.
+static void
+BM_Stitching(
+	CBenchState &State)
+{
+	const UINT cFrames = 64;
+	CByteArray Stream;
+
+	for (UINT i = 0; i < cFrames; i++)
+	{
+		CByteArray Frame = MakeStatusFrame((BYTE)(i % 60));
+
+		Stream.insert(Stream.end(), Frame.begin(), Frame.end());
+	}
+
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, FALSE);
+	const size_t cbRead = (size_t)State.Range();
+
+	while (State.KeepRunning())
+	{
+		for (size_t uiOffset = 0; uiOffset < Stream.size(); uiOffset += cbRead)
+		{
+			size_t cbChunk = (std::min)(cbRead, Stream.size() - uiOffset);
+
+			Spa.ReplayIncomingData(&Stream[uiOffset], cbChunk);
+		}
+	}
+
+	State.SetItemsProcessed(Callback.m_uiMessages);
+	State.SetBytesProcessed(State.Iterations() * Stream.size());
+}
+BENCHMARK(BM_Stitching, 1, 7, 15, 31, 64, 256, 1024, 4096);
+
+
+//  Decode and dispatch cost of one complete frame.
+static void
+DecodeFrame(
+	CBenchState &State,
+	const CByteArray &Frame)
+{
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, FALSE);
+
+	//  The first of each type allocates its buffers.
+	Spa.ReplayIncomingData(&Frame[0], Frame.size());
+
+	UINT64 uiAllocations = GetAllocationCount();
+	UINT64 uiStartMessages = Callback.m_uiMessages;
+
+	while (State.KeepRunning())
+	{
+		Spa.ReplayIncomingData(&Frame[0], Frame.size());
+	}
+
+	State.SetCounter("allocs_per_message", (double)(GetAllocationCount() - uiAllocations), TRUE);
+	State.SetItemsProcessed(Callback.m_uiMessages - uiStartMessages);
+}
+
+static void BM_DecodeStatus(CBenchState &State) { DecodeFrame(State, MakeStatusFrame(30)); }
+static void BM_DecodeConfigResponse(CBenchState &State) { DecodeFrame(State, MakeConfigResponseFrame()); }
+static void BM_DecodeFilterConfig(CBenchState &State) { DecodeFrame(State, MakeFilterConfigFrame()); }
+static void BM_DecodeVersionInfo(CBenchState &State) { DecodeFrame(State, MakeVersionInfoFrame()); }
+static void BM_DecodeControlConfig2(CBenchState &State) { DecodeFrame(State, MakeControlConfig2Frame()); }
+static void BM_DecodeUnknown(CBenchState &State) { DecodeFrame(State, MakeFrame(msSetTempRange, {0x00, 0x00})); }
+
+BENCHMARK(BM_DecodeStatus);
+BENCHMARK(BM_DecodeConfigResponse);
+BENCHMARK(BM_DecodeFilterConfig);
+BENCHMARK(BM_DecodeVersionInfo);
+BENCHMARK(BM_DecodeControlConfig2);
+BENCHMARK(BM_DecodeUnknown);
+
+
+//  Same as BM_DecodeStatus, but with the status coalescing on, so the
+//  repeated frame is compared and dropped.
+static void
+BM_DecodeStatusCoalesced(
+	CBenchState &State)
+{
+	CByteArray Frame = MakeStatusFrame(30);
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, TRUE);
+
+	while (State.KeepRunning())
+	{
+		Spa.ReplayIncomingData(&Frame[0], Frame.size());
+	}
+}
+BENCHMARK(BM_DecodeStatusCoalesced);
+
+
+//  A spa streaming changing statuses, split across reads, with the odd
+//  configuration reply, through everything CSpaComms does with a status
+//  (the latest state, raw and decoded delivery).  Once running this should
+//  make no heap allocations at all; it fails if it does.
+static void
+BM_StatusSteadyState(
+	CBenchState &State)
+{
+	CByteArray Frames[2] = {MakeStatusFrame(30), MakeStatusFrame(31)};
+	CByteArray ConfigResponse = MakeConfigResponseFrame();
+	const size_t cbFirstRead = 10;
+
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, TRUE);
+	UINT uiFrame = 0;
+
+	auto StreamStatus = [&]()
+	{
+		const CByteArray &Frame = Frames[uiFrame++ % 2];
+
+		Spa.ReplayIncomingData(&Frame[0], cbFirstRead);
+		Spa.ReplayIncomingData(&Frame[cbFirstRead], Frame.size() - cbFirstRead);
+
+		if (uiFrame % 64 == 0)
+		{
+			Spa.ReplayIncomingData(&ConfigResponse[0], ConfigResponse.size());
+		}
+	};
+
+	for (UINT i = 0; i < 64; i++)
+	{
+		StreamStatus();
+	}
+
+	UINT64 uiAllocations = GetAllocationCount();
+
+	while (State.KeepRunning())
+	{
+		StreamStatus();
+	}
+
+	uiAllocations = GetAllocationCount() - uiAllocations;
+
+	_ASSERT(uiAllocations == 0);
+	if (uiAllocations != 0)
+	{
+		State.SkipWithError("Steady state statuses allocated");
+	}
+
+	State.SetCounter("allocs_per_status", (double)uiAllocations, TRUE);
+	State.SetItemsProcessed(State.Iterations());
+}
+BENCHMARK(BM_StatusSteadyState);
+
+
+//  The receive path's budget: a minute of statuses, with the replies to a
+//  client polling the configuration, should make no allocations and take
+//  under 2us a message at the 99th percentile.  Fails the run otherwise.
+static void
+BM_ReplayBudget(
+	CBenchState &State)
+{
+	const ReplayBudget Budget = {0, 0, 2.0};
+	CByteArray Capture;
+
+	for (UINT i = 0; i < 60; i++)
+	{
+		CByteArray Frame = MakeStatusFrame((BYTE)i);
+
+		Capture.insert(Capture.end(), Frame.begin(), Frame.end());
+
+		if (i % 20 == 0)
+		{
+			for (auto Reply : {MakeConfigResponseFrame(), MakeFilterConfigFrame(), MakeVersionInfoFrame(), MakeControlConfig2Frame()})
+			{
+				Capture.insert(Capture.end(), Reply.begin(), Reply.end());
+			}
+		}
+	}
+
+	CheckReplayBudget(State, Capture, Budget);
+}
+BENCHMARK(BM_ReplayBudget);
+
+
+//  A status frame with a reply of each other kind, as when a client polls
+//  the spa's configuration, through a full subscription and through a status
+//  only one, which should see the other replies at next to no cost.
+static void
+DecodeMixedTraffic(
+	CBenchState &State,
+	DWORD dwDecoded,
+	DWORD dwRaw)
+{
+	CByteArray Stream;
+	const CByteArray Frames[] =
+	{
+		MakeStatusFrame(30), MakeConfigResponseFrame(), MakeFilterConfigFrame(),
+		MakeVersionInfoFrame(), MakeControlConfig2Frame()
+	};
+
+	for (UINT i = 0; i < _countof(Frames); i++)
+	{
+		Stream.insert(Stream.end(), Frames[i].begin(), Frames[i].end());
+	}
+
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, FALSE);
+
+	Spa.SetSubscriptions(dwDecoded, dwRaw);
+
+	while (State.KeepRunning())
+	{
+		Spa.ReplayIncomingData(&Stream[0], Stream.size());
+	}
+
+	State.SetItemsProcessed(State.Iterations() * _countof(Frames));
+}
+
+static void BM_DecodeMixedAll(CBenchState &State) { DecodeMixedTraffic(State, smmAll, smmAll); }
+static void BM_DecodeMixedStatusOnly(CBenchState &State) { DecodeMixedTraffic(State, smmStatus, smmNone); }
+
+BENCHMARK(BM_DecodeMixedAll);
+BENCHMARK(BM_DecodeMixedStatusOnly);
+
+
+//  The same decode through CSpaMonitor, with the handler known at compile
+//  time, for comparison with the virtual IMonitorCallback path above.
+class CStaticCountingHandler :
+	public CMonitorHandler
+{
+public:
+	CStaticCountingHandler() : m_uiMessages(0) {};
+
+	void ProcessStatusMessage(const StatusMessage &Message) { DoNotOptimize(Message.m_CurrentTemp); m_uiMessages++; };
+
+	UINT64 m_uiMessages;
+};
+
+//  Handles nothing, so nothing beyond the framing should be left.
+class CEmptyHandler :
+	public CMonitorHandler
+{
+};
+
+template <class Handler>
+static void
+DecodeFrameStatic(
+	CBenchState &State,
+	const CByteArray &Frame,
+	Handler &MessageHandler)
+{
+	CSpaMonitor<Handler> Monitor(MessageHandler, FALSE);
+
+	while (State.KeepRunning())
+	{
+		Monitor.ProcessIncomingData(&Frame[0], Frame.size());
+	}
+
+	State.SetItemsProcessed(State.Iterations());
+}
+
+static void
+BM_DecodeStatusStatic(
+	CBenchState &State)
+{
+	CStaticCountingHandler Handler;
+
+	DecodeFrameStatic(State, MakeStatusFrame(30), Handler);
+}
+BENCHMARK(BM_DecodeStatusStatic);
+
+static void
+BM_DecodeStatusEmptyHandler(
+	CBenchState &State)
+{
+	CEmptyHandler Handler;
+
+	DecodeFrameStatic(State, MakeStatusFrame(30), Handler);
+}
+BENCHMARK(BM_DecodeStatusEmptyHandler);
+
+
+//  Takes a lock and signals a waiter for each call, as a UI or logging
+//  consumer does.
+class CLockingCallback :
+	public IMonitorCallback
+{
+public:
+	CLockingCallback() : m_uiMessages(0) { m_hEvent = CreateEvent(NULL, FALSE, FALSE, NULL); };
+	~CLockingCallback() { CloseHandle(m_hEvent); };
+
+	void ProcessStatusMessage(const StatusMessage &Message)
+	{
+		std::lock_guard<std::mutex> lg(m_mutex);
+
+		m_LastStatus = Message;
+		m_uiMessages++;
+		SetEvent(m_hEvent);
+	};
+
+	void ProcessMessageBatch(const SpaMessage *pMessages, size_t cMessages)
+	{
+		std::lock_guard<std::mutex> lg(m_mutex);
+
+		for (size_t i = 0; i < cMessages; i++)
+		{
+			if (pMessages[i].m_Type == smtStatus)
+			{
+				m_LastStatus = *pMessages[i].m_pStatus;
+			}
+		}
+		m_uiMessages += cMessages;
+		SetEvent(m_hEvent);
+	};
+
+	void Dispose(void) {};
+
+	UINT64 m_uiMessages;
+
+private:
+	std::mutex m_mutex;
+	HANDLE m_hEvent;
+	StatusInfo m_LastStatus;
+};
+
+
+//  Range() frames arriving in one read, as after a stall, delivered a call
+//  per message or as a single batch.
+static void
+Delivery(
+	CBenchState &State,
+	BOOL fBatch)
+{
+	CByteArray Stream;
+
+	for (INT64 i = 0; i < State.Range(); i++)
+	{
+		CByteArray Frame = MakeStatusFrame((BYTE)(i % 60));
+
+		Stream.insert(Stream.end(), Frame.begin(), Frame.end());
+	}
+
+	CLockingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, FALSE);
+
+	Spa.SetBatchDelivery(fBatch);
+
+	while (State.KeepRunning())
+	{
+		Spa.ReplayIncomingData(&Stream[0], Stream.size());
+	}
+
+	State.SetItemsProcessed(Callback.m_uiMessages);
+}
+
+static void BM_DeliveryPerMessage(CBenchState &State) { Delivery(State, FALSE); }
+static void BM_DeliveryBatched(CBenchState &State) { Delivery(State, TRUE); }
+
+BENCHMARK(BM_DeliveryPerMessage, 1, 4, 16, 64);
+BENCHMARK(BM_DeliveryBatched, 1, 4, 16, 64);
+
+
+//  Unsubscribes, and subscribes again, from inside each of its callbacks.
+class CResubscribingObserver :
+	public IMonitorCallback
+{
+public:
+	CResubscribingObserver(CSpaComms &Spa) : m_Spa(Spa), m_uiMessages(0), m_fResubscribed(TRUE) {};
+
+	void ProcessStatusMessage(const StatusMessage &)
+	{
+		m_fResubscribed &= m_Spa.Unsubscribe(this) && m_Spa.Subscribe(this, smmStatus);
+		m_uiMessages++;
+	};
+
+	void Dispose(void) {};
+
+	UINT64 m_uiMessages;
+	BOOL m_fResubscribed;
+
+private:
+	CSpaComms &m_Spa;
+};
+
+
+//  Subscribes and unsubscribes another observer, over and over, from a
+//  thread of its own.
+class CObserverChurn
+{
+public:
+	CObserverChurn(CSpaComms &Spa) : m_Spa(Spa), m_hThread(0), m_fShutDown(FALSE), m_cChanges(0) {};
+	~CObserverChurn() { Stop(); };
+
+	BOOL Start(void);
+	void Stop(void);
+
+	UINT64 GetChanges(void) const { return m_cChanges; };
+
+private:
+	static unsigned __stdcall ThreadProc(void *pContext);
+
+	CSpaComms &m_Spa;
+	CCountingCallback m_Observer;
+	HANDLE m_hThread;
+	std::atomic<BOOL> m_fShutDown;
+	std::atomic<UINT64> m_cChanges;
+
+	//  Disallowed operations.
+	const CObserverChurn & operator=(const CObserverChurn &) { return *this; };
+};
+
+
+BOOL
+CObserverChurn::Start(void)
+{
+	m_fShutDown = FALSE;
+	m_hThread = (HANDLE)_beginthreadex(NULL, 0, CObserverChurn::ThreadProc, this, 0, NULL);
+
+	return (m_hThread != 0);
+}
+
+
+void
+CObserverChurn::Stop(void)
+{
+	m_fShutDown = TRUE;
+
+	if (m_hThread != 0)
+	{
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = 0;
+	}
+}
+
+
+unsigned __stdcall
+CObserverChurn::ThreadProc(
+	void *pContext)
+{
+	CObserverChurn *pThis = (CObserverChurn *)pContext;
+
+	while (!pThis->m_fShutDown)
+	{
+		if (pThis->m_Spa.Subscribe(&pThis->m_Observer, smmStatus) &&
+			pThis->m_Spa.Unsubscribe(&pThis->m_Observer))
+		{
+			pThis->m_cChanges += 2;
+		}
+	}
+
+	return 0;
+}
+
+
+//  Range() statuses in a read, each delivered to an observer that
+//  unsubscribes and subscribes itself again from inside the callback, while
+//  another thread changes the list too.  A subscriber on another thread
+//  waiting out a delivery mustn't hold up the callback's own changes, so
+//  this would hang if it did; it fails if the observer missed a status.
+static void
+BM_ObserverChurn(
+	CBenchState &State)
+{
+	CByteArray Stream;
+
+	for (INT64 i = 0; i < State.Range(); i++)
+	{
+		CByteArray Frame = MakeStatusFrame((BYTE)(i % 60));
+
+		Stream.insert(Stream.end(), Frame.begin(), Frame.end());
+	}
+
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, FALSE);
+	CResubscribingObserver Observer(Spa);
+	CObserverChurn Churn(Spa);
+
+	if (!Spa.Subscribe(&Observer, smmStatus) || !Churn.Start())
+	{
+		State.SkipWithError("Unable to start");
+		return;
+	}
+
+	while (State.KeepRunning())
+	{
+		Spa.ReplayIncomingData(&Stream[0], Stream.size());
+	}
+
+	Churn.Stop();
+	Spa.Unsubscribe(&Observer);
+
+	BOOL fDelivered = Observer.m_fResubscribed && (Observer.m_uiMessages == Callback.m_uiMessages);
+
+	_ASSERT(fDelivered);
+	if (!fDelivered)
+	{
+		State.SkipWithError("Observer missed a status");
+	}
+
+	State.SetItemsProcessed(Callback.m_uiMessages);
+	State.SetCounter("list_changes", (double)Churn.GetChanges());
+}
+BENCHMARK(BM_ObserverChurn, 1, 16);
+
+
+static void
+BM_CRC(
+	CBenchState &State)
+{
+	CByteArray Buffer((size_t)State.Range());
+
+	for (size_t i = 0; i < Buffer.size(); i++)
+	{
+		Buffer[i] = (BYTE)(i * 31);
+	}
+
+	while (State.KeepRunning())
+	{
+		crc Result = F_CRC_CalculaCheckSum(&Buffer[0], (uint16_t)Buffer.size());
+
+		DoNotOptimize(Result);
+	}
+
+	State.SetBytesProcessed(State.Iterations() * Buffer.size());
+}
+BENCHMARK(BM_CRC, 8, 24, 31, 255, 4096);
+
+
+//  Building outgoing messages, as the Send*Request() methods do.
+static void
+EncodeMessage(
+	CBenchState &State,
+	SpaCommandMessageID ID,
+	UINT uiPayloadLength)
+{
+	while (State.KeepRunning())
+	{
+		CByteArray Message;
+
+		FillInMessageOverhead(Message, ID, uiPayloadLength);
+		for (UINT i = 0; i < uiPayloadLength; i++)
+		{
+			Message[uiPayloadStartOffset + i] = (BYTE)i;
+		}
+		FillInMessageCRC(Message);
+
+		DoNotOptimize(Message[Message.size() - 2]);
+	}
+
+	State.SetItemsProcessed(State.Iterations());
+}
+
+static void BM_EncodeConfigRequest(CBenchState &State) { EncodeMessage(State, msConfigRequest, 0); }
+static void BM_EncodeToggleRequest(CBenchState &State) { EncodeMessage(State, msToggleItemRequest, 2); }
+static void BM_EncodeSetFilterConfigRequest(CBenchState &State) { EncodeMessage(State, msSetFilterConfigRequest, 8); }
+
+BENCHMARK(BM_EncodeConfigRequest);
+BENCHMARK(BM_EncodeToggleRequest);
+BENCHMARK(BM_EncodeSetFilterConfigRequest);
+
+
+//  Polling the latest state snapshot; allocations per poll should be zero.
+static void
+BM_GetLatestStatus(
+	CBenchState &State)
+{
+	CByteArray Frame = MakeStatusFrame(30);
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, TRUE);
+	StatusInfo Status;
+
+	Spa.ReplayIncomingData(&Frame[0], Frame.size());
+
+	UINT64 uiAllocations = GetAllocationCount();
+
+	while (State.KeepRunning())
+	{
+		Spa.GetLatestStatus(Status);
+		DoNotOptimize(Status.m_CurrentTemp);
+	}
+
+	State.SetCounter("allocs_per_poll", (double)(GetAllocationCount() - uiAllocations), TRUE);
+	State.SetItemsProcessed(State.Iterations());
+}
+BENCHMARK(BM_GetLatestStatus);
+
+
+//  The "nothing changed" check a poller makes before bothering to copy.
+static void
+BM_GetStateVersion(
+	CBenchState &State)
+{
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, TRUE);
+	UINT uiLastVersion = 0;
+
+	while (State.KeepRunning())
+	{
+		UINT uiVersion = Spa.GetStateVersion();
+
+		if (uiVersion != uiLastVersion)
+		{
+			uiLastVersion = uiVersion;
+		}
+		DoNotOptimize(uiLastVersion);
+	}
+}
+BENCHMARK(BM_GetStateVersion);
+
+
+//  A day of once a second status, changing about as often as a real spa:
+//  temperature drifting a degree at a time, the heater cycling, the pump
+//  and lights used now and then.
+static void
+MakeStatusDay(
+	std::vector<StatusInfo> &Day)
+{
+	const UINT cSecondsPerDay = 24 * 60 * 60;
+	StatusInfo Status;
+
+	memset(&Status, 0, sizeof(Status));
+	Status.m_CurrentTemp = 100;
+	Status.m_SetPointTemp = 102;
+
+	Day.resize(cSecondsPerDay);
+
+	for (UINT i = 0; i < cSecondsPerDay; i++)
+	{
+		Status.m_Time.m_Hour = (BYTE)(i / 3600);
+		Status.m_Time.m_Minute = (BYTE)((i / 60) % 60);
+
+		if ((i % 600) == 0)
+		{
+			Status.m_fHeating = !Status.m_fHeating;
+		}
+		if ((i % 300) == 0)
+		{
+			Status.m_CurrentTemp += Status.m_fHeating ? 1 : -1;
+		}
+
+		Status.m_Pump1Status = ((i % 14400) < 900) ? psHigh : psOff;
+		Status.m_fLights = ((i % 43200) < 3600);
+
+		Day[i] = Status;
+	}
+}
+
+
+static void
+BM_HistoryAppend(
+	CBenchState &State)
+{
+	std::vector<StatusInfo> Day;
+
+	MakeStatusDay(Day);
+
+	size_t cbEncoded = 0;
+
+	while (State.KeepRunning())
+	{
+		CStatusHistory History;
+
+		for (size_t i = 0; i < Day.size(); i++)
+		{
+			History.Append(i, Day[i]);
+		}
+
+		cbEncoded = History.GetEncodedSize();
+		DoNotOptimize(cbEncoded);
+	}
+
+	//  Compare against the 31 byte raw frame each status arrives as.
+	State.SetCounter("bytes_per_record", (double)cbEncoded / Day.size());
+	State.SetCounter("ratio_vs_raw", (31.0 * Day.size()) / cbEncoded);
+	State.SetItemsProcessed(State.Iterations() * Day.size());
+}
+BENCHMARK(BM_HistoryAppend);
+
+
+class CHistoryVisitor :
+	public IStatusHistoryVisitor
+{
+public:
+	CHistoryVisitor() : m_uiSum(0) {};
+
+	void OnStatus(LONGLONG, const StatusInfo &Status)
+	{
+		m_uiSum += Status.m_CurrentTemp;
+	};
+
+	UINT64 m_uiSum;
+};
+
+//  Scan a range of Range() seconds from the middle of the day.
+static void
+BM_HistoryScan(
+	CBenchState &State)
+{
+	std::vector<StatusInfo> Day;
+	CStatusHistory History;
+
+	MakeStatusDay(Day);
+	for (size_t i = 0; i < Day.size(); i++)
+	{
+		History.Append(i, Day[i]);
+	}
+
+	LONGLONG llStart = (Day.size() - State.Range()) / 2;
+	size_t cVisited = 0;
+
+	while (State.KeepRunning())
+	{
+		CHistoryVisitor Visitor;
+
+		cVisited = History.Scan(llStart, llStart + State.Range(), Visitor);
+		DoNotOptimize(Visitor.m_uiSum);
+	}
+
+	State.SetItemsProcessed(State.Iterations() * cVisited);
+}
+BENCHMARK(BM_HistoryScan, 60, 3600, 86400);
+
+
+//  Per status cost of keeping the minute, hour and day rollups current.
+static void
+BM_RollupAddStatus(
+	CBenchState &State)
+{
+	std::vector<StatusInfo> Day;
+
+	MakeStatusDay(Day);
+
+	while (State.KeepRunning())
+	{
+		CStatusRollups Rollups;
+
+		for (size_t i = 0; i < Day.size(); i++)
+		{
+			Rollups.AddStatus(i, Day[i]);
+		}
+
+		StatusRollup Rollup;
+
+		Rollups.GetCurrentRollup(rpDay, Rollup);
+		DoNotOptimize(Rollup.m_uiHeatingSeconds);
+	}
+
+	State.SetItemsProcessed(State.Iterations() * Day.size());
+}
+BENCHMARK(BM_RollupAddStatus);
+
+
+//  Stands in for a fleet of spas on the loopback network: spa n listens on
+//  127.0.1.(n + 1), port 4257, and sends a status frame as soon as a
+//  connection is accepted.
+class CFleetSimulator
+{
+public:
+	CFleetSimulator() : m_hThread(0), m_fShutDown(FALSE) {};
+	~CFleetSimulator() { Stop(); };
+
+	BOOL Start(UINT cSpas);
+	void Stop(void);
+
+	//  Closes the accepted connections, between runs.
+	void CloseConnections(void);
+
+	static CSpaAddress GetSpaAddress(UINT uiSpa);
+
+private:
+	static unsigned int __stdcall ThreadProc(void *);
+	unsigned int ThreadProc(void);
+
+	std::vector<SOCKET> m_ListenSockets;
+
+	std::mutex m_mutex;
+	std::vector<SOCKET> m_Connections;
+
+	HANDLE m_hThread;
+	volatile BOOL m_fShutDown;
+};
+
+
+CSpaAddress
+CFleetSimulator::GetSpaAddress(
+	UINT uiSpa)
+{
+	sockaddr_in saAddress;
+
+	memset(&saAddress, 0, sizeof(saAddress));
+	saAddress.sin_family = AF_INET;
+	saAddress.sin_addr.s_addr = htonl((INADDR_LOOPBACK & 0xffff0000) + 0x100 + uiSpa + 1);
+
+	return CSpaAddress(saAddress, "00-15-27-00-00-00");
+}
+
+
+BOOL
+CFleetSimulator::Start(
+	UINT cSpas)
+{
+	//  All of the listen sockets have to fit in one select().
+	if (cSpas > FD_SETSIZE)
+	{
+		return FALSE;
+	}
+
+	for (UINT i = 0; i < cSpas; i++)
+	{
+		sockaddr_in saListen = GetSpaAddress(i).m_SpaAddress;
+		SOCKET ListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		BOOL fReuse = TRUE;
+
+		saListen.sin_port = htons(4257);
+
+		if (ListenSocket == INVALID_SOCKET)
+		{
+			Stop();
+			return FALSE;
+		}
+
+		m_ListenSockets.push_back(ListenSocket);
+
+		setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&fReuse, sizeof(fReuse));
+
+		if ((bind(ListenSocket, (const sockaddr *)&saListen, sizeof(saListen)) == SOCKET_ERROR) ||
+			(listen(ListenSocket, SOMAXCONN) == SOCKET_ERROR))
+		{
+			Stop();
+			return FALSE;
+		}
+	}
+
+	m_fShutDown = FALSE;
+	m_hThread = (HANDLE)_beginthreadex(NULL, 0, CFleetSimulator::ThreadProc, this, 0, NULL);
+
+	if (m_hThread == 0)
+	{
+		Stop();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CFleetSimulator::Stop(void)
+{
+	m_fShutDown = TRUE;
+
+	if (m_hThread != 0)
+	{
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = 0;
+	}
+
+	for (auto pSocket = m_ListenSockets.cbegin(); pSocket != m_ListenSockets.cend(); pSocket++)
+	{
+		closesocket(*pSocket);
+	}
+	m_ListenSockets.clear();
+
+	CloseConnections();
+}
+
+
+void
+CFleetSimulator::CloseConnections(void)
+{
+	std::lock_guard<std::mutex> lg(m_mutex);
+
+	for (auto pSocket = m_Connections.cbegin(); pSocket != m_Connections.cend(); pSocket++)
+	{
+		closesocket(*pSocket);
+	}
+	m_Connections.clear();
+}
+
+
+unsigned int __stdcall
+CFleetSimulator::ThreadProc(
+	void *pParam)
+{
+	return ((CFleetSimulator *)pParam)->ThreadProc();
+}
+
+
+unsigned int
+CFleetSimulator::ThreadProc(void)
+{
+	CByteArray Status = MakeStatusFrame(30);
+
+	while (!m_fShutDown)
+	{
+		fd_set fsListen;
+		timeval tvTimeout;
+
+		FD_ZERO(&fsListen);
+		for (auto pSocket = m_ListenSockets.cbegin(); pSocket != m_ListenSockets.cend(); pSocket++)
+		{
+			FD_SET(*pSocket, &fsListen);
+		}
+
+		tvTimeout.tv_sec = 0;
+		tvTimeout.tv_usec = 50 * 1000;
+
+		if (select(0, &fsListen, NULL, NULL, &tvTimeout) <= 0)
+		{
+			continue;
+		}
+
+		for (auto pSocket = m_ListenSockets.cbegin(); pSocket != m_ListenSockets.cend(); pSocket++)
+		{
+			if (!FD_ISSET(*pSocket, &fsListen))
+			{
+				continue;
+			}
+
+			SOCKET Connection = accept(*pSocket, NULL, NULL);
+
+			if (Connection != INVALID_SOCKET)
+			{
+				send(Connection, (const char *)&Status[0], (int)Status.size(), 0);
+
+				std::lock_guard<std::mutex> lg(m_mutex);
+
+				m_Connections.push_back(Connection);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+//  Notes the time the last spa of the fleet sends its first status.
+class CStreamingCallback :
+	public IMonitorCallback
+{
+public:
+	CStreamingCallback(std::atomic<UINT> &cStreaming, UINT cSpas, std::atomic<LONGLONG> &llAllStreaming)
+		: m_cStreaming(cStreaming), m_cSpas(cSpas), m_llAllStreaming(llAllStreaming), m_fStreaming(FALSE)
+	{};
+
+	void ProcessStatusMessage(const StatusMessage &)
+	{
+		if (!m_fStreaming)
+		{
+			m_fStreaming = TRUE;
+
+			if (++m_cStreaming == m_cSpas)
+			{
+				LARGE_INTEGER liNow;
+
+				QueryPerformanceCounter(&liNow);
+				m_llAllStreaming = liNow.QuadPart;
+			}
+		}
+	};
+
+	void Dispose(void) {};
+
+private:
+	std::atomic<UINT> &m_cStreaming;
+	UINT m_cSpas;
+	std::atomic<LONGLONG> &m_llAllStreaming;
+	BOOL m_fStreaming;
+
+	//  Disallowed operations.
+	const CStreamingCallback & operator=(const CStreamingCallback &) { return *this; };
+};
+
+
+//  Hands each connection to its CSpaComms as soon as it's up.
+class CStartMonitors :
+	public ISpaConnectCallback
+{
+public:
+	CStartMonitors(std::vector<std::unique_ptr<CSpaComms>> &Spas, CSpaCompletionPort *pPort = NULL)
+		: m_Spas(Spas), m_pPort(pPort)
+	{};
+
+	BOOL OnSpaConnected(size_t uiSpa, SOCKET SpaSocket)
+	{
+		if (m_pPort != NULL)
+		{
+			return m_Spas[uiSpa]->StartMonitor(SpaSocket, m_pPort);
+		}
+
+		return m_Spas[uiSpa]->StartMonitor(SpaSocket);
+	};
+
+private:
+	std::vector<std::unique_ptr<CSpaComms>> &m_Spas;
+	CSpaCompletionPort *m_pPort;
+
+	//  Disallowed operations.
+	const CStartMonitors & operator=(const CStartMonitors &) { return *this; };
+};
+
+
+//  Time from starting a fleet of Range() spas until every one of them has
+//  sent a status, reported as ms_to_all_streaming.  The first spa in the
+//  list doesn't answer, as happens when one is powered off.
+static void
+FleetStartup(
+	CBenchState &State,
+	BOOL fParallel)
+{
+	UINT cSpas = (UINT)State.Range();
+	CFleetSimulator Simulator;
+
+	if (!Simulator.Start(cSpas))
+	{
+		State.SkipWithError("Unable to listen on 127.0.1.x:4257");
+		return;
+	}
+
+	LARGE_INTEGER liFrequency;
+	double dTotalMs = 0.0;
+
+	QueryPerformanceFrequency(&liFrequency);
+
+	while (State.KeepRunning())
+	{
+		State.PauseTiming();
+
+		std::atomic<UINT> cStreaming(0);
+		std::atomic<LONGLONG> llAllStreaming(0);
+		std::vector<std::unique_ptr<CStreamingCallback>> Callbacks;
+		std::vector<std::unique_ptr<CSpaComms>> Spas;
+		SpaAddressVector Addresses;
+
+		//  Nothing listens on the address after the fleet's.
+		Addresses.push_back(CFleetSimulator::GetSpaAddress(cSpas));
+		for (UINT i = 0; i < cSpas; i++)
+		{
+			Addresses.push_back(CFleetSimulator::GetSpaAddress(i));
+		}
+
+		for (auto pAddress = Addresses.cbegin(); pAddress != Addresses.cend(); pAddress++)
+		{
+			Callbacks.push_back(std::make_unique<CStreamingCallback>(cStreaming, cSpas, llAllStreaming));
+			Spas.push_back(std::make_unique<CSpaComms>(*pAddress, Callbacks.back().get(), FALSE));
+		}
+
+		LARGE_INTEGER liStart;
+
+		QueryPerformanceCounter(&liStart);
+		State.ResumeTiming();
+
+		if (fParallel)
+		{
+			CStartMonitors StartMonitors(Spas);
+			SpaConnectOptions Options;
+
+			Options.m_dwAttemptTimeoutMs = 500;
+			ConnectToSpas(Addresses, &StartMonitors, Options);
+		}
+		else
+		{
+			for (auto pSpa = Spas.begin(); pSpa != Spas.end(); pSpa++)
+			{
+				(*pSpa)->StartMonitor();
+			}
+		}
+
+		ULONGLONG ullGiveUp = GetTickCount64() + 10000;
+
+		while ((cStreaming < cSpas) && (GetTickCount64() < ullGiveUp))
+		{
+			Sleep(1);
+		}
+
+		State.PauseTiming();
+
+		if (cStreaming < cSpas)
+		{
+			State.SkipWithError("Not all spas streamed");
+			break;
+		}
+
+		dTotalMs += (double)(llAllStreaming - liStart.QuadPart) * 1000.0 / liFrequency.QuadPart;
+
+		for (auto pSpa = Spas.begin(); pSpa != Spas.end(); pSpa++)
+		{
+			(*pSpa)->EndMonitor();
+		}
+		Simulator.CloseConnections();
+
+		State.ResumeTiming();
+	}
+
+	State.SetCounter("ms_to_all_streaming", dTotalMs / State.Iterations());
+	State.SetItemsProcessed(State.Iterations() * cSpas);
+}
+
+//  One blocking StartMonitor() after another.
+static void BM_FleetStartupSequential(CBenchState &State) { FleetStartup(State, FALSE); }
+
+//  ConnectToSpas(), each spa started as its connection completes.
+static void BM_FleetStartupParallel(CBenchState &State) { FleetStartup(State, TRUE); }
+
+BENCHMARK(BM_FleetStartupSequential, 1, 8, 32);
+BENCHMARK(BM_FleetStartupParallel, 1, 8, 32);
+
+
+//  Sample lease and ARP files are in Fixtures, next to this file.
+static std::wstring
+GetFixturePath(
+	const WCHAR *szFileName)
+{
+	std::wstring strPath(__FILEW__);
+
+	strPath.erase(strPath.find_last_of(L"\\/") + 1);
+
+	return strPath + L"Fixtures\\" + szFileName;
+}
+
+
+//  Passive discovery's lease and ARP file parsing, one sample of each format
+//  it reads; fails unless exactly the spas in them are found.
+static void
+BM_PassiveDiscoveryFixtures(
+	CBenchState &State)
+{
+	static const WCHAR *szFixtures[] =
+	{
+		L"dnsmasq.leases", L"dhcpd.leases", L"arp-a-windows.txt", L"arp-a-linux.txt", L"proc-net-arp.txt"
+	};
+
+	//  In order of first appearance; a later entry moves a spa.
+	static const struct
+	{
+		const char *szMACAddress;
+		const char *szIpAddr;
+	} Expected[] =
+	{
+		{"00-15-27-10-AB-D2", "192.168.1.52"},		//  dnsmasq, moved by /proc/net/arp
+		{"00-15-27-A0-00-01", "192.168.1.51"},		//  dnsmasq
+		{"00-15-27-B0-00-02", "192.168.1.62"},		//  dhcpd, the later lease
+		{"00-15-27-C0-00-03", "192.168.1.70"},		//  arp -a, Windows
+		{"00-15-27-C0-00-04", "192.168.1.71"},		//  arp -a, Linux
+		{"00-15-27-D0-00-05", "192.168.1.80"},		//  /proc/net/arp
+	};
+
+	PassiveDiscoveryOptions Options;
+	SpaAddressVector Candidates;
+	BOOL fRead = FALSE;
+
+	Options.m_fNeighbourTable = FALSE;
+
+	for (UINT i = 0; i < _countof(szFixtures); i++)
+	{
+		Options.m_LeaseFiles.push_back(GetFixturePath(szFixtures[i]));
+	}
+
+	while (State.KeepRunning())
+	{
+		fRead = FindSpaCandidates(Options, Candidates);
+	}
+
+	BOOL fMatched = fRead && (Candidates.size() == _countof(Expected));
+
+	for (UINT i = 0; fMatched && (i < _countof(Expected)); i++)
+	{
+		char szIpAddr[INET_ADDRSTRLEN];
+
+		inet_ntop(AF_INET, &Candidates[i].m_SpaAddress.sin_addr, szIpAddr, sizeof(szIpAddr));
+
+		fMatched = (Candidates[i].m_strMACAddress == Expected[i].szMACAddress) &&
+			(strcmp(szIpAddr, Expected[i].szIpAddr) == 0);
+	}
+
+	_ASSERT(fMatched);
+	if (!fMatched)
+	{
+		State.SkipWithError("Fixture candidates didn't match");
+	}
+
+	State.SetItemsProcessed(State.Iterations() * _countof(szFixtures));
+}
+BENCHMARK(BM_PassiveDiscoveryFixtures);
+
+
+//  A site full of spas behind one loopback address: accepts any number of
+//  connections and sends each of them a status every interval.
+class CStatusStreamer
+{
+public:
+	CStatusStreamer() : m_ListenSocket(INVALID_SOCKET), m_hThread(0), m_fShutDown(FALSE), m_dwIntervalMs(0) {};
+	~CStatusStreamer() { Stop(); };
+
+	BOOL Start(DWORD dwIntervalMs);
+	void Stop(void);
+
+	static CSpaAddress GetSpaAddress(void);
+
+	//  Kernel and user time of the streamer's thread, in 100 ns units, to
+	//  take out of the process's.
+	ULONGLONG GetCpuTime(void) const;
+
+private:
+	static unsigned int __stdcall ThreadProc(void *);
+	unsigned int ThreadProc(void);
+
+	SOCKET m_ListenSocket;
+	std::vector<SOCKET> m_Connections;			//  Streamer thread only
+
+	HANDLE m_hThread;
+	volatile BOOL m_fShutDown;
+	DWORD m_dwIntervalMs;
+};
+
+
+static ULONGLONG
+FileTimeToULL(
+	const FILETIME &ft)
+{
+	return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+
+static ULONGLONG
+GetProcessCpuTime(void)
+{
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+
+	GetProcessTimes(GetCurrentProcess(), &ftCreation, &ftExit, &ftKernel, &ftUser);
+
+	return FileTimeToULL(ftKernel) + FileTimeToULL(ftUser);
+}
+
+
+CSpaAddress
+CStatusStreamer::GetSpaAddress(void)
+{
+	sockaddr_in saAddress;
+
+	memset(&saAddress, 0, sizeof(saAddress));
+	saAddress.sin_family = AF_INET;
+	saAddress.sin_addr.s_addr = htonl((INADDR_LOOPBACK & 0xffff0000) + 0x201);
+
+	return CSpaAddress(saAddress, "00-15-27-00-00-00");
+}
+
+
+BOOL
+CStatusStreamer::Start(
+	DWORD dwIntervalMs)
+{
+	sockaddr_in saListen = GetSpaAddress().m_SpaAddress;
+	BOOL fReuse = TRUE;
+
+	saListen.sin_port = htons(4257);
+	m_ListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if (m_ListenSocket == INVALID_SOCKET)
+	{
+		return FALSE;
+	}
+
+	setsockopt(m_ListenSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&fReuse, sizeof(fReuse));
+
+	if ((bind(m_ListenSocket, (const sockaddr *)&saListen, sizeof(saListen)) == SOCKET_ERROR) ||
+		(listen(m_ListenSocket, SOMAXCONN) == SOCKET_ERROR))
+	{
+		Stop();
+		return FALSE;
+	}
+
+	m_dwIntervalMs = dwIntervalMs;
+	m_fShutDown = FALSE;
+	m_hThread = (HANDLE)_beginthreadex(NULL, 0, CStatusStreamer::ThreadProc, this, 0, NULL);
+
+	if (m_hThread == 0)
+	{
+		Stop();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CStatusStreamer::Stop(void)
+{
+	m_fShutDown = TRUE;
+
+	if (m_hThread != 0)
+	{
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = 0;
+	}
+
+	if (m_ListenSocket != INVALID_SOCKET)
+	{
+		closesocket(m_ListenSocket);
+		m_ListenSocket = INVALID_SOCKET;
+	}
+
+	for (auto pSocket = m_Connections.cbegin(); pSocket != m_Connections.cend(); pSocket++)
+	{
+		closesocket(*pSocket);
+	}
+	m_Connections.clear();
+}
+
+
+ULONGLONG
+CStatusStreamer::GetCpuTime(void) const
+{
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+
+	GetThreadTimes(m_hThread, &ftCreation, &ftExit, &ftKernel, &ftUser);
+
+	return FileTimeToULL(ftKernel) + FileTimeToULL(ftUser);
+}
+
+
+unsigned int __stdcall
+CStatusStreamer::ThreadProc(
+	void *pParam)
+{
+	return ((CStatusStreamer *)pParam)->ThreadProc();
+}
+
+
+unsigned int
+CStatusStreamer::ThreadProc(void)
+{
+	CByteArray Status = MakeStatusFrame(30);
+	ULONGLONG ullNextRound = GetTickCount64();
+
+	while (!m_fShutDown)
+	{
+		ULONGLONG ullNow = GetTickCount64();
+
+		if (ullNow >= ullNextRound)
+		{
+			for (auto pSocket = m_Connections.cbegin(); pSocket != m_Connections.cend(); pSocket++)
+			{
+				send(*pSocket, (const char *)&Status[0], (int)Status.size(), 0);
+			}
+
+			ullNextRound = ullNow + m_dwIntervalMs;
+			continue;
+		}
+
+		fd_set fsListen;
+		timeval tvTimeout;
+
+		FD_ZERO(&fsListen);
+		FD_SET(m_ListenSocket, &fsListen);
+
+		tvTimeout.tv_sec = 0;
+		tvTimeout.tv_usec = (long)(ullNextRound - ullNow) * 1000;
+
+		if (select(0, &fsListen, NULL, NULL, &tvTimeout) > 0)
+		{
+			SOCKET Connection = accept(m_ListenSocket, NULL, NULL);
+
+			if (Connection != INVALID_SOCKET)
+			{
+				m_Connections.push_back(Connection);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+class CStatusCounter :
+	public IMonitorCallback
+{
+public:
+	CStatusCounter() : m_cStatuses(0) {};
+
+	void ProcessStatusMessage(const StatusMessage &) { m_cStatuses.fetch_add(1, std::memory_order_relaxed); };
+
+	void Dispose(void) {};
+
+	std::atomic<UINT64> m_cStatuses;
+};
+
+
+//  Range() spas streaming a status every 10 ms, each iteration being one
+//  round of statuses from all of them, received either by a thread per spa
+//  or through a single completion port.  Reports the system calls made per
+//  status, and the CPU time (less the streamer's) to handle a status from
+//  each of 1000 spas, i.e. a second's worth of a 1000 spa site.
+static void
+FleetStreaming(
+	CBenchState &State,
+	BOOL fPort)
+{
+	UINT cSpas = (UINT)State.Range();
+	CStatusStreamer Streamer;
+	CSpaCompletionPort Port;
+
+	if (!Streamer.Start(10))
+	{
+		State.SkipWithError("Unable to listen on 127.0.2.1:4257");
+		return;
+	}
+
+	if (fPort && !Port.Start())
+	{
+		State.SkipWithError("Unable to start the completion port");
+		return;
+	}
+
+	CStatusCounter Counter;
+	std::vector<std::unique_ptr<CSpaComms>> Spas;
+	SpaAddressVector Addresses(cSpas, CStatusStreamer::GetSpaAddress());
+
+	for (UINT i = 0; i < cSpas; i++)
+	{
+		Spas.push_back(std::make_unique<CSpaComms>(Addresses[i], &Counter, FALSE));
+	}
+
+	CStartMonitors StartMonitors(Spas, fPort ? &Port : NULL);
+
+	if (ConnectToSpas(Addresses, &StartMonitors) != cSpas)
+	{
+		State.SkipWithError("Unable to connect every spa");
+		return;
+	}
+
+	//  Settle, then measure from here.
+	ULONGLONG ullGiveUp = GetTickCount64() + 10000;
+
+	while ((Counter.m_cStatuses < 2 * cSpas) && (GetTickCount64() < ullGiveUp))
+	{
+		Sleep(1);
+	}
+
+	auto GetSystemCalls = [&]() -> UINT64
+	{
+		UINT64 cCalls = Port.GetSystemCallCount();
+
+		for (auto pSpa = Spas.cbegin(); pSpa != Spas.cend(); pSpa++)
+		{
+			cCalls += (*pSpa)->GetSystemCallCount();
+		}
+
+		return cCalls;
+	};
+
+	UINT64 cStartStatuses = Counter.m_cStatuses;
+	UINT64 cStartCalls = GetSystemCalls();
+	ULONGLONG ullStartCpu = GetProcessCpuTime() - Streamer.GetCpuTime();
+	UINT64 cTarget = cStartStatuses;
+
+	while (State.KeepRunning())
+	{
+		cTarget += cSpas;
+
+		while (Counter.m_cStatuses < cTarget)
+		{
+			Sleep(1);
+		}
+	}
+
+	UINT64 cStatuses = Counter.m_cStatuses - cStartStatuses;
+	UINT64 cCalls = GetSystemCalls() - cStartCalls;
+	double dCpuMs = (double)(GetProcessCpuTime() - Streamer.GetCpuTime() - ullStartCpu) / 10000.0;
+
+	for (auto pSpa = Spas.begin(); pSpa != Spas.end(); pSpa++)
+	{
+		(*pSpa)->EndMonitor();
+	}
+
+	State.SetCounter("syscalls_per_status", (double)cCalls / cStatuses);
+	State.SetCounter("cpu_ms_per_1000_spas", dCpuMs * 1000.0 / cStatuses);
+	State.SetItemsProcessed(cStatuses);
+}
+
+//  CSpaComms::StartMonitor(SOCKET): select() and recv() on a thread per spa.
+static void BM_FleetStreamingThreads(CBenchState &State) { FleetStreaming(State, FALSE); }
+
+//  CSpaComms::StartMonitor(SOCKET, CSpaCompletionPort *).
+static void BM_FleetStreamingPort(CBenchState &State) { FleetStreaming(State, TRUE); }
+
+BENCHMARK(BM_FleetStreamingThreads, 64, 256, 1000);
+BENCHMARK(BM_FleetStreamingPort, 64, 256, 1000);
+
+
+//  Changes the fleet's shard count, and checks that only the spas that had
+//  to move did, that they're streaming again on their new shards with their
+//  latest status kept, and that the shards' totals still add up.  Counters
+//  are the spas' own, parallel to Addresses.
+static BOOL
+RebalanceFleet(
+	CSpaFleet &Fleet,
+	const SpaAddressVector &Addresses,
+	const std::vector<std::unique_ptr<CStatusCounter>> &Counters,
+	UINT cShards,
+	UINT &cMoved)
+{
+	const UINT cOldShards = Fleet.GetShardCount();
+	std::vector<UINT> OldShards(Addresses.size());
+	std::vector<UINT64> OldStatuses(Addresses.size());
+
+	for (size_t i = 0; i < Addresses.size(); i++)
+	{
+		if (!Fleet.GetSpaShard(Addresses[i].m_strMACAddress, OldShards[i]))
+		{
+			return FALSE;
+		}
+
+		OldStatuses[i] = Counters[i]->m_cStatuses;
+	}
+
+	if (!Fleet.SetShardCount(cShards))
+	{
+		return FALSE;
+	}
+
+	std::vector<size_t> Moved;
+
+	for (size_t i = 0; i < Addresses.size(); i++)
+	{
+		UINT uiShard;
+		StatusInfo Status;
+
+		if (!Fleet.GetSpaShard(Addresses[i].m_strMACAddress, uiShard) ||
+			!Fleet.GetLatestStatus(Addresses[i].m_strMACAddress, Status) ||
+			(Status.m_Time.m_Minute != 30))
+		{
+			return FALSE;
+		}
+
+		if (uiShard == OldShards[i])
+		{
+			continue;
+		}
+
+		//  Growing, a spa only moves to a new shard; shrinking, only off a
+		//  shard that's gone.
+		if ((cShards > cOldShards) ? (uiShard < cOldShards) : (OldShards[i] < cShards))
+		{
+			return FALSE;
+		}
+
+		Moved.push_back(i);
+	}
+
+	//  About (bigger - smaller) / bigger of them, by the hash.
+	UINT cLarger = (std::max)(cShards, cOldShards);
+	double dExpected = (double)Addresses.size() * (cLarger - (std::min)(cShards, cOldShards)) / cLarger;
+
+	cMoved = (UINT)Moved.size();
+
+	if ((cMoved < dExpected / 2) || (cMoved > dExpected * 3 / 2))
+	{
+		return FALSE;
+	}
+
+	ULONGLONG ullGiveUp = GetTickCount64() + 5000;
+
+	for (auto pMoved = Moved.cbegin(); pMoved != Moved.cend(); pMoved++)
+	{
+		while (Counters[*pMoved]->m_cStatuses <= OldStatuses[*pMoved])
+		{
+			if (GetTickCount64() >= ullGiveUp)
+			{
+				return FALSE;
+			}
+
+			Sleep(1);
+		}
+	}
+
+	UINT cSpas = 0;
+	UINT cConnected = 0;
+
+	for (UINT i = 0; i < cShards; i++)
+	{
+		FleetShardMetrics Metrics;
+
+		if (!Fleet.GetShardMetrics(i, Metrics))
+		{
+			return FALSE;
+		}
+
+		cSpas += Metrics.m_cSpas;
+		cConnected += Metrics.m_cConnected;
+	}
+
+	return (Fleet.GetShardCount() == cShards) && (cSpas == Addresses.size()) && (cConnected == Addresses.size());
+}
+
+
+//  CSpaFleet::SetShardCount() with Range() spas streaming from 127.0.2.1,
+//  each iteration growing the fleet from 4 shards to 5 and back; see
+//  RebalanceFleet() for what's checked.  Reports the spas moved per
+//  rebalance (moved_per_rebalance), about a fifth of them.
+static void
+BM_FleetRebalance(
+	CBenchState &State)
+{
+	const UINT cShards = 4;
+	UINT cSpas = (UINT)State.Range();
+	CStatusStreamer Streamer;
+
+	if (!Streamer.Start(10))
+	{
+		State.SkipWithError("Unable to listen on 127.0.2.1:4257");
+		return;
+	}
+
+	//  All at the streamer's address, told apart by MAC address.
+	SpaAddressVector Addresses;
+	std::vector<std::unique_ptr<CStatusCounter>> Counters;
+	std::vector<IMonitorCallback *> Callbacks;
+
+	for (UINT i = 0; i < cSpas; i++)
+	{
+		char szMACAddress[32];
+
+		sprintf_s(szMACAddress, "00-15-27-01-%02X-%02X", (i >> 8) & 0xff, i & 0xff);
+		Addresses.push_back(CSpaAddress(CStatusStreamer::GetSpaAddress().m_SpaAddress, szMACAddress));
+		Counters.push_back(std::make_unique<CStatusCounter>());
+		Callbacks.push_back(Counters.back().get());
+	}
+
+	//  After the counters, so that it goes first.
+	CSpaFleet Fleet;
+
+	if (!Fleet.Start(cShards) || (Fleet.AddSpas(Addresses, Callbacks) != cSpas))
+	{
+		State.SkipWithError("Unable to connect every spa");
+		return;
+	}
+
+	ULONGLONG ullGiveUp = GetTickCount64() + 10000;
+
+	for (UINT i = 0; i < cSpas; i++)
+	{
+		while ((Counters[i]->m_cStatuses == 0) && (GetTickCount64() < ullGiveUp))
+		{
+			Sleep(1);
+		}
+	}
+
+	UINT64 cMoved = 0;
+
+	while (State.KeepRunning())
+	{
+		UINT cGrown;
+		UINT cShrunk;
+
+		if (!RebalanceFleet(Fleet, Addresses, Counters, cShards + 1, cGrown) ||
+			!RebalanceFleet(Fleet, Addresses, Counters, cShards, cShrunk))
+		{
+			_ASSERT(FALSE);
+			State.SkipWithError("Rebalancing moved the wrong spas, or lost one");
+			break;
+		}
+
+		cMoved += cGrown + cShrunk;
+	}
+
+	Fleet.Stop();
+
+	State.SetCounter("moved_per_rebalance", (double)cMoved / (2 * State.Iterations()));
+	State.SetItemsProcessed(cMoved);
+}
+BENCHMARK(BM_FleetRebalance, 256);
+
+
+static PROCESS_MEMORY_COUNTERS_EX
+GetProcessMemory(void)
+{
+	PROCESS_MEMORY_COUNTERS_EX Counters;
+
+	memset(&Counters, 0, sizeof(Counters));
+	Counters.cb = sizeof(Counters);
+	GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&Counters, sizeof(Counters));
+
+	return Counters;
+}
+
+
+//  The most the process grew by building a fleet of each size.
+struct FleetMemoryGrowth
+{
+	double m_dResident;
+	double m_dCommitted;
+};
+
+
+//  Memory for Range() spas, each with a status, filter config and version
+//  info decoded, and half a status waiting to be completed.  The spas are
+//  fed with ReplayIncomingData() rather than connected, so this is the
+//  library's own state; a completion port adds its per connection state,
+//  and a socket, on top.  Reports resident and committed bytes per spa, and
+//  the fleet's resident total (the growth from before it was built, not the
+//  whole process), for sizing a gateway.
+//
+//  A fleet built on memory freed by an earlier one (or an earlier
+//  benchmark) hardly grows the process, so the growth reported is the
+//  largest seen for Range() in this process, normally the first fleet's;
+//  run it on its own, with --benchmark_filter=FleetMemory, for figures to
+//  size by.  heap_bytes_per_spa, what the spas asked the heap for, doesn't
+//  depend on that.
+static void
+BM_FleetMemory(
+	CBenchState &State)
+{
+	static std::map<INT64, FleetMemoryGrowth> LargestGrowth;
+
+	const size_t cSpas = (size_t)State.Range();
+
+	CByteArray Traffic;
+
+	for (auto Frame : {MakeStatusFrame(30), MakeFilterConfigFrame(), MakeVersionInfoFrame()})
+	{
+		Traffic.insert(Traffic.end(), Frame.begin(), Frame.end());
+	}
+
+	CByteArray Status = MakeStatusFrame(31);
+
+	Traffic.insert(Traffic.end(), Status.begin(), Status.begin() + Status.size() / 2);
+
+	CCountingCallback Callback;
+	CSpaAddress Address = MakeDummyAddress();
+	std::vector<std::unique_ptr<CSpaComms>> Spas;
+
+	Spas.reserve(cSpas);
+
+	FleetMemoryGrowth &Growth = LargestGrowth[State.Range()];
+	UINT64 cbHeap = 0;
+
+	while (State.KeepRunning())
+	{
+		PROCESS_MEMORY_COUNTERS_EX Before = GetProcessMemory();
+		ThreadAllocations AllocationsBefore = GetThreadAllocations();
+
+		for (size_t i = 0; i < cSpas; i++)
+		{
+			Spas.push_back(std::make_unique<CSpaComms>(Address, &Callback));
+			Spas.back()->ReplayIncomingData(&Traffic[0], Traffic.size());
+		}
+
+		State.PauseTiming();
+
+		PROCESS_MEMORY_COUNTERS_EX After = GetProcessMemory();
+
+		cbHeap = GetThreadAllocations().m_cbAllocated - AllocationsBefore.m_cbAllocated;
+		Growth.m_dResident = (std::max)(Growth.m_dResident, (double)After.WorkingSetSize - (double)Before.WorkingSetSize);
+		Growth.m_dCommitted = (std::max)(Growth.m_dCommitted, (double)After.PrivateUsage - (double)Before.PrivateUsage);
+
+		Spas.clear();
+
+		State.ResumeTiming();
+	}
+
+	State.SetCounter("resident_bytes_per_spa", Growth.m_dResident / cSpas);
+	State.SetCounter("committed_bytes_per_spa", Growth.m_dCommitted / cSpas);
+	State.SetCounter("fleet_resident_mb", Growth.m_dResident / (1024 * 1024));
+	State.SetCounter("heap_bytes_per_spa", (double)cbHeap / cSpas);
+	State.SetCounter("state_bytes", (double)CSpaComms::GetConnectionStateSize());
+	State.SetItemsProcessed(State.Iterations() * cSpas);
+}
+BENCHMARK(BM_FleetMemory, 1000, 10000);
+
+
+//  Waits for the spa to show every command sent.  The spa only sends its
+//  filter config when asked, so a new one has to be asked for.
+static BOOL
+AwaitCommandEffects(
+	CSpaComms &Spa,
+	const CCommandLatency &Latency,
+	BOOL fAskForFilterConfig = FALSE)
+{
+	ULONGLONG ullGiveUp = GetTickCount64() + 5000;
+
+	while (Latency.GetPendingCount() != 0)
+	{
+		if (GetTickCount64() >= ullGiveUp)
+		{
+			return FALSE;
+		}
+
+		if (fAskForFilterConfig)
+		{
+			Spa.SendFilterConfigRequest();
+		}
+
+		Sleep(10);
+	}
+
+	return TRUE;
+}
+
+
+//  Command to effect latency against CSpaSimulator, which applies commands
+//  Range() ms after they arrive and sends a status every 50ms.  Each
+//  iteration toggles the lights, sets the temp and sets the filter config,
+//  one at a time, and reports the median and 99th percentile latency of
+//  each (e.g. toggle_p99_ms).  Real spas are measured the same way by
+//  BalboaSpaProbe.
+static void
+BM_CommandLatency(
+	CBenchState &State)
+{
+	const DWORD dwStatusPeriodMs = 50;
+	CSpaSimulator Simulator;
+
+	if (!Simulator.Start(dwStatusPeriodMs, (DWORD)State.Range()))
+	{
+		State.SkipWithError("Unable to listen on 127.0.3.1:4257");
+		return;
+	}
+
+	CCountingCallback Callback;
+	CCommandLatency Latency;
+	CSpaComms Spa(CSpaSimulator::GetSpaAddress(), &Callback);
+	StatusInfo Status;
+
+	Spa.AttachLatencyTracker(&Latency);
+
+	if (!Spa.StartMonitor())
+	{
+		State.SkipWithError("Unable to connect to the simulator");
+		return;
+	}
+
+	ULONGLONG ullGiveUp = GetTickCount64() + 5000;
+
+	while (!Spa.GetLatestStatus(Status) && (GetTickCount64() < ullGiveUp))
+	{
+		Sleep(1);
+	}
+
+	FilterConfigInfo FilterConfig;
+
+	memset(&FilterConfig, 0, sizeof(FilterConfig));
+	FilterConfig.m_Filter1StartTime.m_Hour = 20;
+
+	UINT uiIteration = 0;
+
+	while (State.KeepRunning())
+	{
+		FilterConfig.m_uiFilter1Duration = 60 + (uiIteration % 2) * 30;
+
+		BOOL fSent = Spa.SendToggleRequest(CSpaComms::tsiLights) && AwaitCommandEffects(Spa, Latency) &&
+			Spa.SendSetTempRequest(100 + (uiIteration % 2), tsFahrenheight) && AwaitCommandEffects(Spa, Latency) &&
+			Spa.SendSetFilterConfigRequest(FilterConfig) && AwaitCommandEffects(Spa, Latency, TRUE);
+
+		if (!fSent)
+		{
+			State.SkipWithError("A command didn't take effect");
+			break;
+		}
+
+		uiIteration++;
+	}
+
+	Spa.EndMonitor();
+
+	static const char *szCommandNames[sctCommandTypeCount] = {"toggle", "set_temp", "set_filter_config"};
+
+	for (UINT i = 0; i < sctCommandTypeCount; i++)
+	{
+		CommandLatencyHistogram Histogram;
+		string strName(szCommandNames[i]);
+
+		Latency.GetHistogram((SpaCommandType)i, Histogram);
+		State.SetCounter((strName + "_p50_ms").c_str(), (double)Histogram.GetPercentileMs(0.5));
+		State.SetCounter((strName + "_p99_ms").c_str(), (double)Histogram.GetPercentileMs(0.99));
+		State.SetCounter((strName + "_mean_ms").c_str(), Histogram.GetMeanMs());
+	}
+
+	State.SetItemsProcessed(Simulator.GetCommandCount());
+}
+BENCHMARK(BM_CommandLatency, 0, 250, 1000);
+
+
+//  The time as far as BM_SchedulerWheel's scheduler knows.
+static ULONGLONG ullSchedulerTimeMs;
+
+static ULONGLONG WINAPI
+GetSchedulerTime(void)
+{
+	return ullSchedulerTimeMs;
+}
+
+
+//  Schedules actions for every level of the wheel, beyond it, repeating and
+//  cancelled, steps the clock a tick at a time and then jumps it days on,
+//  and checks each ran once, in order, at its own tick.  Actions are told
+//  apart by their m_uiTemp.
+static BOOL
+CheckSchedulerWheel(
+	CSpaComms &Spa)
+{
+	//  Just before every level but the top wraps.
+	const ULONGLONG ullStartTick = (1ULL << 18) - 3;
+	const ULONGLONG ullSpanTicks = 1ULL << 24;
+
+	ullSchedulerTimeMs = ullStartTick * dwSchedulerTickMs;
+
+	CSpaScheduler Scheduler(0, GetSchedulerTime);
+	ScheduledAction Action;
+
+	memset(&Action, 0, sizeof(Action));
+	Action.m_Type = satSetTemp;
+
+	static const struct
+	{
+		UINT uiID;
+		ULONGLONG ullDelayTicks;
+	} OneShots[] =
+	{
+		{1, 1},							//  Level 0
+		{2, 5},							//  Level 0, across the wrap
+		{3, 70},						//  Level 1
+		{4, 67},						//  Level 1, due as its slot is cascaded
+		{5, 5000},						//  Level 2
+		{6, 4099},						//  Level 2, due as its slot is cascaded
+		{7, 300000},					//  Level 3
+		{8, ullSpanTicks + 1000},		//  Beyond the wheel, carried over
+	};
+
+	std::vector<std::pair<ULONGLONG, UINT>> Expected;
+	ScheduleHandle hFirst = 0;
+
+	for (UINT i = 0; i < _countof(OneShots); i++)
+	{
+		Action.m_uiTemp = OneShots[i].uiID;
+
+		ScheduleHandle hSchedule = Scheduler.Schedule(&Spa, OneShots[i].ullDelayTicks * dwSchedulerTickMs, Action);
+
+		if (hSchedule == 0)
+		{
+			return FALSE;
+		}
+
+		hFirst = (i == 0) ? hSchedule : hFirst;
+		Expected.push_back(std::make_pair(ullStartTick + OneShots[i].ullDelayTicks, OneShots[i].uiID));
+	}
+
+	//  Every 100 ticks from 10 ticks on, until cancelled after the steps.
+	const ULONGLONG ullSteppedTicks = 6000;
+
+	Action.m_uiTemp = 9;
+	ScheduleHandle hRepeat = Scheduler.Schedule(&Spa, 10 * dwSchedulerTickMs, Action, 100 * dwSchedulerTickMs);
+
+	for (ULONGLONG ullTick = 10; ullTick <= ullSteppedTicks; ullTick += 100)
+	{
+		Expected.push_back(std::make_pair(ullStartTick + ullTick, 9U));
+	}
+
+	//  Cancelled straight away; its entry is reused by the next action, which
+	//  the stale handle mustn't cancel.
+	Action.m_uiTemp = 10;
+	ScheduleHandle hCancelled = Scheduler.Schedule(&Spa, 20 * dwSchedulerTickMs, Action);
+
+	BOOL fOK = (hRepeat != 0) && (hCancelled != 0) && Scheduler.Cancel(hCancelled) && !Scheduler.Cancel(hCancelled);
+
+	Action.m_uiTemp = 11;
+	ScheduleHandle hReused = Scheduler.Schedule(&Spa, 30 * dwSchedulerTickMs, Action);
+
+	fOK = fOK && (hReused != 0) && (hReused != hCancelled) && !Scheduler.Cancel(hCancelled);
+	Expected.push_back(std::make_pair(ullStartTick + 30, 11U));
+
+	std::sort(Expected.begin(), Expected.end());
+
+	std::vector<ScheduledRun> Runs;
+
+	for (ULONGLONG ullTick = 1; ullTick <= ullSteppedTicks; ullTick++)
+	{
+		ullSchedulerTimeMs = (ullStartTick + ullTick) * dwSchedulerTickMs;
+		Scheduler.RunDue(&Runs);
+	}
+
+	//  Run once, so gone; the repeating one is still pending.
+	fOK = fOK && !Scheduler.Cancel(hFirst) && Scheduler.Cancel(hRepeat);
+
+	//  Every tick missed is caught up, in one go.
+	ullSchedulerTimeMs = (ullStartTick + ullSpanTicks + 2000) * dwSchedulerTickMs;
+	fOK = fOK && (Scheduler.RunDue(&Runs) == 2);
+
+	SpaSchedulerStats Stats;
+
+	Scheduler.GetStats(Stats);
+	fOK = fOK && (Stats.m_cPending == 0) && (Runs.size() == Expected.size());
+
+	for (size_t i = 0; fOK && (i < Runs.size()); i++)
+	{
+		fOK = (Runs[i].m_ullTick == Expected[i].first) && (Runs[i].m_Action.m_uiTemp == Expected[i].second);
+	}
+
+	return fOK;
+}
+
+
+//  CSpaScheduler's timer wheel: scheduling and cancelling an action an hour
+//  out, which should be O(1).  Fails unless CheckSchedulerWheel() passes
+//  first.
+static void
+BM_SchedulerWheel(
+	CBenchState &State)
+{
+	CCountingCallback Callback;
+	CSpaComms Spa(MakeDummyAddress(), &Callback, FALSE);
+
+	BOOL fChecked = CheckSchedulerWheel(Spa);
+
+	_ASSERT(fChecked);
+	if (!fChecked)
+	{
+		State.SkipWithError("Scheduled actions didn't run in order, at their times");
+		return;
+	}
+
+	CSpaScheduler Scheduler(0);
+	ScheduledAction Action;
+
+	memset(&Action, 0, sizeof(Action));
+	Action.m_Type = satToggle;
+	Action.m_ToggleItem = CSpaComms::tsiLights;
+
+	while (State.KeepRunning())
+	{
+		Scheduler.Cancel(Scheduler.Schedule(&Spa, 60 * 60 * 1000, Action));
+	}
+
+	State.SetItemsProcessed(State.Iterations());
+}
+BENCHMARK(BM_SchedulerWheel);
+
+
+//  The time as far as BM_ConfigRefresh's CConfigRefreshes know.
+static ULONGLONG ullRefreshTimeMs;
+
+static ULONGLONG WINAPI
+GetRefreshTime(void)
+{
+	return ullRefreshTimeMs;
+}
+
+
+//  Sets of configs, one bit per SpaConfigItem.
+const UINT rqConfig = 1 << sciConfig;
+const UINT rqFilterConfig = 1 << sciFilterConfig;
+const UINT rqVersionInfo = 1 << sciVersionInfo;
+const UINT rqControlConfig2 = 1 << sciControlConfig2;
+const UINT rqAll = rqConfig | rqFilterConfig | rqVersionInfo | rqControlConfig2;
+
+
+//  Moves the clock on by ullAfterMs, hands Refresh the status, and checks it
+//  asked for just the configs in uiExpected.
+static BOOL
+ExpectRefreshRequests(
+	CConfigRefresh &Refresh,
+	const StatusMessage &Status,
+	ULONGLONG ullAfterMs,
+	UINT uiExpected)
+{
+	ConfigRefreshStats Before;
+	ConfigRefreshStats After;
+
+	Refresh.GetStats(Before);
+
+	ullRefreshTimeMs += ullAfterMs;
+	Refresh.ProcessStatusMessage(Status);
+
+	Refresh.GetStats(After);
+
+	for (UINT i = 0; i < sciConfigItemCount; i++)
+	{
+		if (After.m_cRequests[i] - Before.m_cRequests[i] != ((uiExpected >> i) & 1))
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+//  Answers the configs in uiItems as the spa would.
+static void
+AnswerRefreshRequests(
+	CConfigRefresh &Refresh,
+	UINT uiItems,
+	const FilterConfigInfo &FilterConfig,
+	DWORD dwSignature)
+{
+	if (uiItems & rqConfig)
+	{
+		Refresh.ProcessConfigResponse(ConfigResponseMessage());
+	}
+
+	if (uiItems & rqFilterConfig)
+	{
+		FilterConfigResponseMessage Response;
+
+		(FilterConfigInfo &)Response = FilterConfig;
+		Refresh.ProcessFilterConfigResponse(Response);
+	}
+
+	if (uiItems & rqVersionInfo)
+	{
+		VersionInfoResponseMessage Response;
+
+		memset(Response.SoftwareID, 0, sizeof(Response.SoftwareID));
+		Response.CurrentSetup = 0;
+		Response.ConfigurationSignature = dwSignature;
+		Refresh.ProcessVersionInfoResponse(Response);
+	}
+
+	if (uiItems & rqControlConfig2)
+	{
+		Refresh.ProcessControlConfig2Response(ControlConfig2ResponseMessage());
+	}
+}
+
+
+//  Walks a CConfigRefresh through each status transition it looks out for,
+//  on a spa with filter 1 from 00:05 to 01:05, and checks what each asks
+//  for.  Background refreshes are kept out of the way; see
+//  CheckSteadyHour().
+static BOOL
+CheckRefreshTransitions(
+	CSpaComms &Spa,
+	UINT64 &cRequests)
+{
+	const UINT rqSettings = rqFilterConfig | rqControlConfig2;
+	const UINT rqSetup = rqConfig | rqFilterConfig | rqControlConfig2;
+
+	static const struct
+	{
+		ULONGLONG ullAfterMs;				//  Since the last status
+		BYTE byHour;
+		BYTE byMinute;
+		BOOL fCircPumpRunning;
+		BOOL fHeating;
+		BOOL fPriming;
+		DWORD dwSignature;					//  Sent, unasked for, before the status; 0 for none
+		UINT uiExpected;
+		UINT uiAnswered;
+	} Script[] =
+	{
+		//  The first status.
+		{0, 10, 0, FALSE, FALSE, FALSE, 0, rqAll, rqAll},
+
+		//  The clock moving on, then set a few minutes forward and back.
+		{60000, 10, 1, FALSE, FALSE, FALSE, 0, 0, 0},
+		{60000, 10, 6, FALSE, FALSE, FALSE, 0, rqSettings, rqSettings},
+		{60000, 10, 0, FALSE, FALSE, FALSE, 0, rqSettings, rqSettings},
+
+		//  No status for half an hour, and the clock moved on with it.
+		{30 * 60000, 10, 30, FALSE, FALSE, FALSE, 0, 0, 0},
+
+		//  Across midnight.
+		{60000, 23, 59, FALSE, FALSE, FALSE, 0, rqSettings, rqSettings},
+		{60000, 0, 0, FALSE, FALSE, FALSE, 0, 0, 0},
+
+		//  The circ pump starting away from a filter cycle's start or end,
+		//  then stopping as heating starts.
+		{60000, 0, 1, TRUE, FALSE, FALSE, 0, rqFilterConfig, rqFilterConfig},
+		{60000, 0, 2, FALSE, TRUE, FALSE, 0, 0, 0},
+
+		//  Starting a minute before filter 1 starts, stopping as it ends, and
+		//  starting a minute later (still near) and two minutes later (not).
+		{2 * 60000, 0, 4, TRUE, TRUE, FALSE, 0, 0, 0},
+		{60 * 60000, 1, 5, FALSE, TRUE, FALSE, 0, 0, 0},
+		{60000, 1, 6, TRUE, TRUE, FALSE, 0, 0, 0},
+		{60000, 1, 7, FALSE, TRUE, FALSE, 0, rqFilterConfig, rqFilterConfig},
+
+		//  The spa restarting.
+		{60000, 1, 8, FALSE, TRUE, TRUE, 0, 0, 0},
+		{60000, 1, 9, FALSE, TRUE, FALSE, 0, rqAll, rqAll},
+
+		//  The clock set, and the requests left unanswered until they're
+		//  sent again, 10s on.
+		{60000, 5, 0, FALSE, TRUE, FALSE, 0, rqSettings, 0},
+		{5000, 5, 0, FALSE, TRUE, FALSE, 0, 0, 0},
+		{5000, 5, 0, FALSE, TRUE, FALSE, 0, rqSettings, rqSettings},
+
+		//  A new ConfigurationSignature.
+		{60000, 5, 1, FALSE, TRUE, FALSE, 2, rqSetup, rqSetup},
+	};
+
+	//  Longer than the script runs for.
+	CConfigRefresh Refresh(&Spa, 24 * 60 * 60 * 1000, GetRefreshTime);
+	StatusMessage Status;
+	StatusInfo &Info = Status;
+	FilterConfigInfo FilterConfig;
+	DWORD dwSignature = 1;
+	BOOL fOK = TRUE;
+
+	memset(&Info, 0, sizeof(Info));
+	memset(&FilterConfig, 0, sizeof(FilterConfig));
+	FilterConfig.m_Filter1StartTime.m_Minute = 5;
+	FilterConfig.m_uiFilter1Duration = 60;
+
+	ullRefreshTimeMs = 1000000000;
+
+	for (UINT i = 0; fOK && (i < _countof(Script)); i++)
+	{
+		if (Script[i].dwSignature != 0)
+		{
+			dwSignature = Script[i].dwSignature;
+			AnswerRefreshRequests(Refresh, rqVersionInfo, FilterConfig, dwSignature);
+		}
+
+		Info.m_Time.m_Hour = Script[i].byHour;
+		Info.m_Time.m_Minute = Script[i].byMinute;
+		Info.m_fCircPumpRunning = Script[i].fCircPumpRunning;
+		Info.m_fHeating = Script[i].fHeating;
+		Info.m_fPriming = Script[i].fPriming;
+
+		fOK = ExpectRefreshRequests(Refresh, Status, Script[i].ullAfterMs, Script[i].uiExpected);
+
+		AnswerRefreshRequests(Refresh, Script[i].uiAnswered, FilterConfig, dwSignature);
+	}
+
+	ConfigRefreshStats Stats;
+
+	Refresh.GetStats(Stats);
+	fOK = fOK && (Stats.m_cStatuses == _countof(Script)) && (Stats.m_cSignatureChanges == 1);
+
+	cRequests = 0;
+
+	for (UINT i = 0; i < sciConfigItemCount; i++)
+	{
+		cRequests += Stats.m_cRequests[i];
+	}
+
+	return fOK;
+}
+
+
+//  An hour of a spa left alone, sending a status a second, with a five
+//  minute background refresh: everything once, then one config in turn
+//  every five minutes.  Also counts what asking for all four on every status
+//  change (the clock, once a minute) would have sent.
+static BOOL
+CheckSteadyHour(
+	CSpaComms &Spa,
+	UINT64 &cRequests,
+	UINT64 &cRequestsOnChange)
+{
+	const DWORD dwBackgroundMs = 5 * 60 * 1000;
+
+	CConfigRefresh Refresh(&Spa, dwBackgroundMs, GetRefreshTime);
+	StatusMessage Status;
+	StatusInfo &Info = Status;
+	FilterConfigInfo FilterConfig;
+	UINT uiNextBackground = sciConfig;
+	BOOL fOK = TRUE;
+
+	memset(&Info, 0, sizeof(Info));
+	memset(&FilterConfig, 0, sizeof(FilterConfig));
+	Info.m_Time.m_Hour = 10;
+
+	ullRefreshTimeMs = 1000000000;
+	cRequests = 0;
+	cRequestsOnChange = 0;
+
+	for (UINT uiSecond = 0; fOK && (uiSecond < 60 * 60); uiSecond++)
+	{
+		UINT uiExpected = 0;
+
+		if (uiSecond == 0)
+		{
+			uiExpected = rqAll;
+		}
+		else if ((uiSecond % (dwBackgroundMs / 1000)) == 0)
+		{
+			uiExpected = 1 << uiNextBackground;
+			uiNextBackground = (uiNextBackground + 1) % sciConfigItemCount;
+		}
+
+		Info.m_Time.m_Minute = (BYTE)(uiSecond / 60);
+
+		if ((uiSecond % 60) == 0)
+		{
+			cRequestsOnChange += sciConfigItemCount;
+		}
+
+		fOK = ExpectRefreshRequests(Refresh, Status, (uiSecond == 0) ? 0 : 1000, uiExpected);
+
+		AnswerRefreshRequests(Refresh, uiExpected, FilterConfig, 1);
+	}
+
+	ConfigRefreshStats Stats;
+
+	Refresh.GetStats(Stats);
+
+	for (UINT i = 0; i < sciConfigItemCount; i++)
+	{
+		cRequests += Stats.m_cRequests[i];
+	}
+
+	return fOK;
+}
+
+
+//  CConfigRefresh against CSpaSimulator.  Fails unless
+//  CheckRefreshTransitions() and CheckSteadyHour() pass, a steady hour costs
+//  at most a tenth of the requests of asking for everything on each status
+//  change, and the simulator received every request sent.  Reports both
+//  (requests_per_hour, requests_per_hour_on_change), and times handing a
+//  status to a CConfigRefresh that has nothing to ask for.
+static void
+BM_ConfigRefresh(
+	CBenchState &State)
+{
+	CSpaSimulator Simulator;
+
+	if (!Simulator.Start(1000, 0))
+	{
+		State.SkipWithError("Unable to listen on 127.0.3.1:4257");
+		return;
+	}
+
+	CCountingCallback Callback;
+	CSpaComms Spa(CSpaSimulator::GetSpaAddress(), &Callback);
+	StatusInfo LatestStatus;
+
+	if (!Spa.StartMonitor())
+	{
+		State.SkipWithError("Unable to connect to the simulator");
+		return;
+	}
+
+	ULONGLONG ullGiveUp = GetTickCount64() + 5000;
+
+	while (!Spa.GetLatestStatus(LatestStatus) && (GetTickCount64() < ullGiveUp))
+	{
+		Sleep(1);
+	}
+
+	UINT64 cTransitionRequests = 0;
+	UINT64 cHourRequests = 0;
+	UINT64 cHourRequestsOnChange = 0;
+
+	BOOL fChecked = CheckRefreshTransitions(Spa, cTransitionRequests) &&
+		CheckSteadyHour(Spa, cHourRequests, cHourRequestsOnChange) &&
+		(cHourRequests * 10 <= cHourRequestsOnChange);
+
+	ullGiveUp = GetTickCount64() + 5000;
+
+	while (fChecked && (Simulator.GetConfigRequestCount() < cTransitionRequests + cHourRequests) &&
+		   (GetTickCount64() < ullGiveUp))
+	{
+		Sleep(1);
+	}
+
+	fChecked = fChecked && (Simulator.GetConfigRequestCount() == cTransitionRequests + cHourRequests);
+
+	_ASSERT(fChecked);
+	if (!fChecked)
+	{
+		Spa.EndMonitor();
+		State.SkipWithError("Config requests didn't follow the spa's status");
+		return;
+	}
+
+	CConfigRefresh Refresh(&Spa, 5 * 60 * 1000, GetRefreshTime);
+	StatusMessage Status;
+	StatusInfo &Info = Status;
+	FilterConfigInfo FilterConfig;
+
+	memset(&Info, 0, sizeof(Info));
+	memset(&FilterConfig, 0, sizeof(FilterConfig));
+
+	Refresh.ProcessStatusMessage(Status);
+	AnswerRefreshRequests(Refresh, rqAll, FilterConfig, 1);
+
+	while (State.KeepRunning())
+	{
+		Refresh.ProcessStatusMessage(Status);
+	}
+
+	Spa.EndMonitor();
+
+	State.SetCounter("requests_per_hour", (double)cHourRequests);
+	State.SetCounter("requests_per_hour_on_change", (double)cHourRequestsOnChange);
+	State.SetItemsProcessed(State.Iterations());
+}
+BENCHMARK(BM_ConfigRefresh);
+
+
+//  Publishes into a state segment and reads it back through a second, read
+//  only mapping, as another process would.  Also checks Create() refuses a
+//  section too big to size with a DWORD, and Open() refuses a header with
+//  more slots than its section holds, and keeps the count it checked.
+static BOOL
+CheckStateSegment(
+	const WCHAR *szName)
+{
+	const UINT cSlots = 8;
+	const UINT uiSlot = cSlots - 1;
+
+	CSpaStateSegment Writer;
+	CSpaStateSegment Reader;
+
+	if (!Writer.Create(cSlots, szName) || !Reader.Open(szName) || (Reader.GetSlotCount() != cSlots))
+	{
+		return FALSE;
+	}
+
+	StatusInfo Status;
+	FilterConfigInfo FilterConfig;
+	VersionInfoResponseMessage VersionInfo;
+
+	memset(&Status, 0, sizeof(Status));
+	Status.m_Time.m_Hour = 13;
+	Status.m_Time.m_Minute = 37;
+	Status.m_CurrentTemp = 101;
+	Status.m_SetPointTemp = 104;
+	Status.m_Pump2Status = psHigh;
+	Status.m_fLights = TRUE;
+
+	memset(&FilterConfig, 0, sizeof(FilterConfig));
+	FilterConfig.m_Filter1StartTime.m_Hour = 20;
+	FilterConfig.m_uiFilter1Duration = 120;
+	FilterConfig.m_fFilter2Enabled = TRUE;
+	FilterConfig.m_Filter2StartTime.m_Hour = 8;
+	FilterConfig.m_Filter2StartTime.m_Minute = 30;
+	FilterConfig.m_uiFilter2Duration = 90;
+
+	VersionInfo.m_strModelName = "BFBP20S";
+	VersionInfo.SoftwareID[0] = 0x64;
+	VersionInfo.SoftwareID[1] = 0xc9;
+	VersionInfo.SoftwareID[2] = 0x00;
+	VersionInfo.CurrentSetup = 4;
+	VersionInfo.ConfigurationSignature = 0x12345678;
+
+	Writer.SetMACAddress(uiSlot, "00-15-27-00-00-01");
+	Writer.PublishStatus(uiSlot, Status);
+	Writer.PublishFilterConfig(uiSlot, FilterConfig);
+	Writer.PublishVersionInfo(uiSlot, VersionInfo);
+
+	StateSegmentSlot Slot;
+
+	//  Four updates, two sequence steps each.
+	BOOL fOK = Reader.ReadSlot(uiSlot, Slot) &&
+		(Slot.m_lSequence == 8) &&
+		(Slot.m_dwFlags == (ssfStatus | ssfFilterConfig | ssfVersionInfo)) &&
+		(strcmp(Slot.m_szMACAddress, "00-15-27-00-00-01") == 0) &&
+		(Slot.m_Hour == 13) && (Slot.m_Minute == 37) &&
+		(Slot.m_CurrentTemp == 101) && (Slot.m_SetPointTemp == 104) &&
+		(Slot.m_Pump2Status == psHigh) && (Slot.m_fLights == 1) && (Slot.m_fHeating == 0) &&
+		(Slot.m_Filter1Hour == 20) && (Slot.m_wFilter1Duration == 120) &&
+		(Slot.m_fFilter2Enabled == 1) && (Slot.m_Filter2Hour == 8) && (Slot.m_Filter2Minute == 30) &&
+		(Slot.m_wFilter2Duration == 90) &&
+		(memcmp(Slot.m_SoftwareID, VersionInfo.SoftwareID, sizeof(Slot.m_SoftwareID)) == 0) &&
+		(Slot.m_CurrentSetup == 4) && (Slot.m_dwConfigurationSignature == 0x12345678) &&
+		(strcmp(Slot.m_szModelName, "BFBP20S") == 0) &&
+		Reader.ReadSlot(0, Slot) && (Slot.m_lSequence == 0) &&
+		!Reader.ReadSlot(cSlots, Slot);
+
+	Reader.Close();
+	Writer.Close();
+
+	fOK = fOK && !Writer.Create(0xffffffff, szName);
+
+	//  A section with room for one slot, whose header claims a thousand.
+	HANDLE hForged = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+										sizeof(StateSegmentHeader) + sizeof(StateSegmentSlot), szName);
+	StateSegmentHeader *pForged = NULL;
+
+	if (hForged != NULL)
+	{
+		pForged = (StateSegmentHeader *)MapViewOfFile(hForged, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	}
+
+	if (pForged != NULL)
+	{
+		pForged->m_dwVersion = dwStateSegmentVersion;
+		pForged->m_cbHeader = sizeof(StateSegmentHeader);
+		pForged->m_cbSlot = sizeof(StateSegmentSlot);
+		pForged->m_cSlots = 1000;
+		pForged->m_dwMagic = dwStateSegmentMagic;
+
+		fOK = fOK && !Reader.Open(szName);
+
+		pForged->m_cSlots = 1;
+		fOK = fOK && Reader.Open(szName) && (Reader.GetSlotCount() == 1);
+
+		pForged->m_cSlots = 1000;
+		fOK = fOK && (Reader.GetSlotCount() == 1) && !Reader.ReadSlot(1, Slot);
+
+		Reader.Close();
+		UnmapViewOfFile(pForged);
+	}
+	else
+	{
+		fOK = FALSE;
+	}
+
+	if (hForged != NULL)
+	{
+		CloseHandle(hForged);
+	}
+
+	return fOK;
+}
+
+
+//  Reading a slot through a read only mapping of the state segment, as an
+//  exporter or UI in another process would.  Fails unless
+//  CheckStateSegment() passes first.
+static void
+BM_StateSegmentRead(
+	CBenchState &State)
+{
+	const WCHAR *szName = L"Local\\BalboaSpaBenchState";
+
+	BOOL fChecked = CheckStateSegment(szName);
+
+	_ASSERT(fChecked);
+	if (!fChecked)
+	{
+		State.SkipWithError("State segment didn't read back what was published, or trusted a bad header");
+		return;
+	}
+
+	CSpaStateSegment Writer;
+	CSpaStateSegment Reader;
+	StatusInfo Status;
+	StateSegmentSlot Slot;
+
+	memset(&Status, 0, sizeof(Status));
+	Status.m_CurrentTemp = 101;
+
+	if (!Writer.Create(1, szName) || !Reader.Open(szName))
+	{
+		State.SkipWithError("Unable to create the state segment");
+		return;
+	}
+
+	Writer.PublishStatus(0, Status);
+
+	while (State.KeepRunning())
+	{
+		Reader.ReadSlot(0, Slot);
+		DoNotOptimize(Slot.m_CurrentTemp);
+	}
+
+	State.SetItemsProcessed(State.Iterations());
+}
+BENCHMARK(BM_StateSegmentRead);
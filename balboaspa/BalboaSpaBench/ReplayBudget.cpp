@@ -0,0 +1,180 @@
+#include "stdafx.h"
+#include "Benchmark.h"
+#include "ReplayBudget.h"
+#include "MessageFormat.h"
+
+
+static LONGLONG
+GetCounter(void)
+{
+	LARGE_INTEGER liCounter;
+
+	QueryPerformanceCounter(&liCounter);
+	return liCounter.QuadPart;
+}
+
+
+//  Notes when the first callback for a message is entered.
+class CTimingCallback :
+	public IMonitorCallback
+{
+public:
+	CTimingCallback() : m_llEntered(0) {};
+
+	void ProcessStatusMessage(const StatusMessage &Message) { Enter(); DoNotOptimize(Message.m_CurrentTemp); };
+	void ProcessConfigResponse(const ConfigResponseMessage &Message) { Enter(); DoNotOptimize(Message.m_strMACAddress); };
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &Message) { Enter(); DoNotOptimize(Message.m_uiFilter1Duration); };
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &Message) { Enter(); DoNotOptimize(Message.m_strModelName); };
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &Message) { Enter(); DoNotOptimize(Message.m_RawMessage); };
+	void ProcessUnknownMessageRaw(const CByteArray &Message) { Enter(); DoNotOptimize(Message); };
+
+	void Dispose(void) {};
+
+	LONGLONG m_llEntered;
+
+private:
+	void Enter(void)
+	{
+		if (m_llEntered == 0)
+		{
+			m_llEntered = GetCounter();
+		}
+	};
+};
+
+
+//  In counter ticks; sorts Samples.
+static LONGLONG
+GetPercentile(
+	std::vector<LONGLONG> &Samples,
+	double dPercentile)
+{
+	if (Samples.empty())
+	{
+		return 0;
+	}
+
+	std::sort(Samples.begin(), Samples.end());
+
+	size_t uiIndex = (size_t)(dPercentile * (Samples.size() - 1) + 0.5);
+
+	return Samples[uiIndex];
+}
+
+
+BOOL
+CheckReplayBudget(
+	CBenchState &State,
+	const CByteArray &Capture,
+	const ReplayBudget &Budget)
+{
+	//  Where each message starts and ends in the capture.
+	std::vector<std::pair<size_t, size_t>> Messages;
+	CMessageFramer Framer;
+	const BYTE *pMessage;
+	size_t cbMessage;
+
+	Framer.AddData(&Capture[0], Capture.size());
+
+	while (Framer.GetNextMessage(pMessage, cbMessage))
+	{
+		Messages.push_back(std::make_pair((size_t)(pMessage - &Capture[0]), cbMessage));
+	}
+
+	if (Messages.empty())
+	{
+		State.SkipWithError("Capture has no messages");
+		return FALSE;
+	}
+
+	sockaddr_in saAddress;
+
+	memset(&saAddress, 0, sizeof(saAddress));
+	saAddress.sin_family = AF_INET;
+	saAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	CTimingCallback Callback;
+	CSpaComms Spa(CSpaAddress(saAddress, "00-15-27-00-00-00"), &Callback, FALSE);
+
+	Spa.ReplayIncomingData(&Capture[0], Capture.size());
+
+	std::vector<LONGLONG> Decode;
+	std::vector<LONGLONG> Dispatch;
+	std::vector<LONGLONG> Total;
+	UINT64 cAllocations = 0;
+	UINT64 cbAllocated = 0;
+	UINT64 cMaxAllocations = 0;
+	UINT64 cbMaxAllocated = 0;
+
+	while (State.KeepRunning())
+	{
+		for (auto pEntry = Messages.cbegin(); pEntry != Messages.cend(); pEntry++)
+		{
+			Callback.m_llEntered = 0;
+
+			ThreadAllocations Before = GetThreadAllocations();
+			LONGLONG llStart = GetCounter();
+
+			Spa.ReplayIncomingData(&Capture[pEntry->first], pEntry->second);
+
+			LONGLONG llEnd = GetCounter();
+			ThreadAllocations After = GetThreadAllocations();
+
+			//  Nothing passed on (e.g. not subscribed) is all decoding.
+			LONGLONG llEntered = (Callback.m_llEntered != 0) ? Callback.m_llEntered : llEnd;
+
+			State.PauseTiming();
+
+			Decode.push_back(llEntered - llStart);
+			Dispatch.push_back(llEnd - llEntered);
+			Total.push_back(llEnd - llStart);
+
+			cAllocations += After.m_cAllocations - Before.m_cAllocations;
+			cbAllocated += After.m_cbAllocated - Before.m_cbAllocated;
+			cMaxAllocations = (std::max)(cMaxAllocations, After.m_cAllocations - Before.m_cAllocations);
+			cbMaxAllocated = (std::max)(cbMaxAllocated, After.m_cbAllocated - Before.m_cbAllocated);
+
+			State.ResumeTiming();
+		}
+	}
+
+	LARGE_INTEGER liFrequency;
+
+	QueryPerformanceFrequency(&liFrequency);
+
+	const double dUsPerTick = 1000000.0 / liFrequency.QuadPart;
+	const double cMessages = (double)Total.size();
+	double dP99Us = GetPercentile(Total, 0.99) * dUsPerTick;
+
+	State.SetCounter("decode_p50_us", GetPercentile(Decode, 0.50) * dUsPerTick);
+	State.SetCounter("decode_p99_us", GetPercentile(Decode, 0.99) * dUsPerTick);
+	State.SetCounter("dispatch_p50_us", GetPercentile(Dispatch, 0.50) * dUsPerTick);
+	State.SetCounter("dispatch_p99_us", GetPercentile(Dispatch, 0.99) * dUsPerTick);
+	State.SetCounter("p99_us", dP99Us);
+	State.SetCounter("allocs_per_message", cAllocations / cMessages);
+	State.SetCounter("bytes_per_message", cbAllocated / cMessages);
+	State.SetItemsProcessed((UINT64)cMessages);
+
+	char szError[128];
+
+	if (cMaxAllocations > Budget.m_cMaxAllocations)
+	{
+		sprintf_s(szError, "%llu allocations for one message, budget %llu", cMaxAllocations, Budget.m_cMaxAllocations);
+	}
+	else if (cbMaxAllocated > Budget.m_cbMaxAllocated)
+	{
+		sprintf_s(szError, "%llu bytes allocated for one message, budget %llu", cbMaxAllocated, Budget.m_cbMaxAllocated);
+	}
+	else if (dP99Us > Budget.m_dMaxP99Us)
+	{
+		sprintf_s(szError, "p99 of %.2f us per message, budget %.2f us", dP99Us, Budget.m_dMaxP99Us);
+	}
+	else
+	{
+		return TRUE;
+	}
+
+	State.SkipWithError(szError);
+
+	return FALSE;
+}
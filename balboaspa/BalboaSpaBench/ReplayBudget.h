@@ -0,0 +1,36 @@
+#pragma once
+
+//  Holds the receive path to a budget, so that a change that makes it
+//  allocate, or slows it down, fails a run rather than being found in the
+//  field.  A capture of the spa's byte stream is replayed through a
+//  CSpaComms a message at a time, counting this thread's heap allocations
+//  and timing each message in two parts: decoding (from the bytes being
+//  handed over until the callback is entered) and dispatch (the callback,
+//  and getting back out).
+//
+//    static void
+//    BM_MyCaptureBudget(CBenchState &State)
+//    {
+//        const ReplayBudget Budget = {0, 0, 2.0};
+//
+//        CheckReplayBudget(State, LoadMyCapture(), Budget);
+//    }
+//
+//  The capture is replayed once before measuring, so buffers kept from one
+//  message to the next are already allocated.
+
+struct ReplayBudget
+{
+	//  Per message.
+	UINT64 m_cMaxAllocations;
+	UINT64 m_cbMaxAllocated;
+
+	//  99th percentile of decoding and dispatch together, per message.
+	double m_dMaxP99Us;
+};
+
+
+//  Replays the capture once per iteration of State, and reports the
+//  percentiles and allocations as counters.  FALSE, with the benchmark
+//  failed by SkipWithError(), if any part of the budget was exceeded.
+BOOL CheckReplayBudget(CBenchState &, const CByteArray &Capture, const ReplayBudget &);
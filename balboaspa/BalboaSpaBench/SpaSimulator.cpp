@@ -0,0 +1,365 @@
+#include "stdafx.h"
+#include "SpaSimulator.h"
+#include "MessageFormat.h"
+#include "crc.h"
+
+
+//  Sample payloads, taken from Protocol.txt; see the decoder in
+//  SpaMonitor.h for where each field is.
+static const BYTE InitialStatus[24] =
+{
+	0x00, 0x00, 0x64, 0x0c, 0x1e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x34, 0x06,
+	0x00, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x66, 0x00, 0x00, 0x00
+};
+
+static const BYTE InitialFilterConfig[8] = {0x14, 0x00, 0x02, 0x00, 0x88, 0x00, 0x01, 0x1e};
+
+//  Offsets into the status payload.
+const UINT uiHeatingModeOffset = 5;
+const UINT uiTempScaleOffset = 9;
+const UINT uiHeatRangeOffset = 10;
+const UINT uiPumpsOffset = 11;
+const UINT uiLightsOffset = 14;
+const UINT uiSetPointOffset = 20;
+
+
+CSpaSimulator::CSpaSimulator()
+	: m_dwStatusPeriodMs(0), m_dwEffectDelayMs(0),
+	m_ListenSocket(INVALID_SOCKET), m_hThread(0), m_fShutDown(FALSE), m_cCommands(0), m_cConfigRequests(0)
+{
+	memcpy(m_Status, InitialStatus, sizeof(m_Status));
+	memcpy(m_FilterConfig, InitialFilterConfig, sizeof(m_FilterConfig));
+}
+
+CSpaSimulator::~CSpaSimulator()
+{
+	Stop();
+}
+
+
+CSpaAddress
+CSpaSimulator::GetSpaAddress(void)
+{
+	sockaddr_in saAddress;
+
+	memset(&saAddress, 0, sizeof(saAddress));
+	saAddress.sin_family = AF_INET;
+	saAddress.sin_addr.s_addr = htonl((INADDR_LOOPBACK & 0xffff0000) + 0x301);
+
+	return CSpaAddress(saAddress, "00-15-27-00-00-01");
+}
+
+
+BOOL
+CSpaSimulator::Start(
+	DWORD dwStatusPeriodMs,
+	DWORD dwEffectDelayMs)
+{
+	sockaddr_in saListen = GetSpaAddress().m_SpaAddress;
+	BOOL fReuse = TRUE;
+
+	if (m_hThread != 0)
+	{
+		return FALSE;
+	}
+
+	m_dwStatusPeriodMs = dwStatusPeriodMs;
+	m_dwEffectDelayMs = dwEffectDelayMs;
+
+	saListen.sin_port = htons(4257);
+
+	m_ListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if (m_ListenSocket == INVALID_SOCKET)
+	{
+		return FALSE;
+	}
+
+	setsockopt(m_ListenSocket, SOL_SOCKET, SO_REUSEADDR, (const char *)&fReuse, sizeof(fReuse));
+
+	if ((bind(m_ListenSocket, (const sockaddr *)&saListen, sizeof(saListen)) == SOCKET_ERROR) ||
+		(listen(m_ListenSocket, 1) == SOCKET_ERROR))
+	{
+		Stop();
+		return FALSE;
+	}
+
+	m_fShutDown = FALSE;
+	m_hThread = (HANDLE)_beginthreadex(NULL, 0, CSpaSimulator::ThreadProc, this, 0, NULL);
+
+	if (m_hThread == 0)
+	{
+		Stop();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CSpaSimulator::Stop(void)
+{
+	m_fShutDown = TRUE;
+
+	if (m_hThread != 0)
+	{
+		WaitForSingleObject(m_hThread, INFINITE);
+		CloseHandle(m_hThread);
+		m_hThread = 0;
+	}
+
+	if (m_ListenSocket != INVALID_SOCKET)
+	{
+		closesocket(m_ListenSocket);
+		m_ListenSocket = INVALID_SOCKET;
+	}
+
+	m_Delayed.clear();
+}
+
+
+unsigned int __stdcall
+CSpaSimulator::ThreadProc(
+	void *pParam)
+{
+	return ((CSpaSimulator *)pParam)->ThreadProc();
+}
+
+
+unsigned int
+CSpaSimulator::ThreadProc(void)
+{
+	SOCKET Connection = INVALID_SOCKET;
+	CMessageFramer Framer;
+	ULONGLONG ullNextStatus = 0;
+
+	while (!m_fShutDown)
+	{
+		ULONGLONG ullNow = GetTickCount64();
+		ULONGLONG ullWake = ullNow + 50;
+		fd_set fsRead;
+		timeval tvTimeout;
+
+		if (Connection != INVALID_SOCKET)
+		{
+			ullWake = (std::min)(ullWake, ullNextStatus);
+		}
+
+		if (!m_Delayed.empty())
+		{
+			ullWake = (std::min)(ullWake, m_Delayed.front().m_ullDue);
+		}
+
+		ULONGLONG ullWait = (ullWake > ullNow) ? ullWake - ullNow : 0;
+
+		FD_ZERO(&fsRead);
+		FD_SET(m_ListenSocket, &fsRead);
+		if (Connection != INVALID_SOCKET)
+		{
+			FD_SET(Connection, &fsRead);
+		}
+
+		tvTimeout.tv_sec = 0;
+		tvTimeout.tv_usec = (long)(ullWait * 1000);
+
+		if (select(0, &fsRead, NULL, NULL, &tvTimeout) > 0)
+		{
+			if (FD_ISSET(m_ListenSocket, &fsRead))
+			{
+				SOCKET NewConnection = accept(m_ListenSocket, NULL, NULL);
+
+				if (NewConnection != INVALID_SOCKET)
+				{
+					if (Connection != INVALID_SOCKET)
+					{
+						closesocket(Connection);
+					}
+
+					Connection = NewConnection;
+					Framer.Reset();
+					ullNextStatus = GetTickCount64();
+				}
+			}
+			else if ((Connection != INVALID_SOCKET) && FD_ISSET(Connection, &fsRead))
+			{
+				BYTE RecvBuffer[1024];
+				int cbReceived = recv(Connection, (char *)RecvBuffer, sizeof(RecvBuffer), 0);
+
+				if (cbReceived <= 0)
+				{
+					closesocket(Connection);
+					Connection = INVALID_SOCKET;
+				}
+				else
+				{
+					const BYTE *pMessage;
+					size_t cbMessage;
+
+					Framer.AddData(RecvBuffer, cbReceived);
+
+					while (Framer.GetNextMessage(pMessage, cbMessage))
+					{
+						OnMessage(Connection, pMessage, cbMessage);
+					}
+				}
+			}
+		}
+
+		ullNow = GetTickCount64();
+
+		while (!m_Delayed.empty() && (m_Delayed.front().m_ullDue <= ullNow))
+		{
+			ApplyCommand(m_Delayed.front().m_Message);
+			m_Delayed.pop_front();
+		}
+
+		if ((Connection != INVALID_SOCKET) && (ullNow >= ullNextStatus))
+		{
+			SendFrame(Connection, msStatus, m_Status, sizeof(m_Status));
+			ullNextStatus = ullNow + m_dwStatusPeriodMs;
+		}
+	}
+
+	if (Connection != INVALID_SOCKET)
+	{
+		closesocket(Connection);
+	}
+
+	return 0;
+}
+
+
+void
+CSpaSimulator::OnMessage(
+	SOCKET Connection,
+	const BYTE *pMessage,
+	size_t cbMessage)
+{
+	if (cbMessage < cMessageOverhead)
+	{
+		return;
+	}
+
+	//  As a real spa does, so a request sent with a bad CRC never takes
+	//  effect.
+	if (F_CRC_CalculaCheckSum(&pMessage[1], (uint16_t)(cbMessage - 3)) != pMessage[cbMessage - 2])
+	{
+		return;
+	}
+
+	UINT uiMessageID = (pMessage[2] << 16) + (pMessage[3] << 8) + pMessage[4];
+
+	switch (uiMessageID)
+	{
+	case msConfigRequest:
+		m_cConfigRequests++;
+		break;
+
+	//  Also version info and control config 2 requests.
+	case msFilterConfigRequest:
+		if (pMessage[uiPayloadStartOffset] == 0x01)
+		{
+			SendFrame(Connection, msFilterConfig, m_FilterConfig, sizeof(m_FilterConfig));
+		}
+
+		m_cConfigRequests++;
+		break;
+
+	case msToggleItemRequest:
+	case msSetTempRequest:
+	case msSetTempScaleRequest:
+	case msSetFilterConfigRequest:
+		{
+			DelayedCommand Command;
+
+			Command.m_ullDue = GetTickCount64() + m_dwEffectDelayMs;
+			Command.m_Message.assign(pMessage, pMessage + cbMessage);
+			m_Delayed.push_back(Command);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+void
+CSpaSimulator::ApplyCommand(
+	const CByteArray &Message)
+{
+	UINT uiMessageID = (Message[2] << 16) + (Message[3] << 8) + Message[4];
+	const BYTE *pPayload = &Message[uiPayloadStartOffset];
+	size_t cbPayload = Message.size() - cMessageOverhead;
+
+	switch (uiMessageID)
+	{
+	case msToggleItemRequest:
+		switch (pPayload[0])
+		{
+		case CSpaComms::tsiPump1:
+			m_Status[uiPumpsOffset] = (m_Status[uiPumpsOffset] & ~0x03) | (((m_Status[uiPumpsOffset] & 0x03) + 1) % 3);
+			break;
+
+		case CSpaComms::tsiPump2:
+			m_Status[uiPumpsOffset] = (m_Status[uiPumpsOffset] & ~0x0c) | (((((m_Status[uiPumpsOffset] >> 2) & 0x03) + 1) % 3) << 2);
+			break;
+
+		case CSpaComms::tsiLights:
+			m_Status[uiLightsOffset] ^= 0x03;
+			break;
+
+		case CSpaComms::tsiHeatMode:
+			m_Status[uiHeatingModeOffset] ^= 0x01;
+			break;
+
+		case CSpaComms::tsiTempRange:
+			m_Status[uiHeatRangeOffset] ^= 0x04;
+			break;
+		}
+		break;
+
+	case msSetTempRequest:
+		m_Status[uiSetPointOffset] = pPayload[0];
+		break;
+
+	case msSetTempScaleRequest:
+		if ((cbPayload >= 2) && (pPayload[0] == 0x01))
+		{
+			m_Status[uiTempScaleOffset] = (m_Status[uiTempScaleOffset] & ~0x01) | (pPayload[1] & 0x01);
+		}
+		break;
+
+	case msSetFilterConfigRequest:
+		if (cbPayload >= sizeof(m_FilterConfig))
+		{
+			memcpy(m_FilterConfig, pPayload, sizeof(m_FilterConfig));
+		}
+		break;
+	}
+
+	m_cCommands++;
+}
+
+
+void
+CSpaSimulator::SendFrame(
+	SOCKET Connection,
+	UINT uiMessageID,
+	const BYTE *pPayload,
+	size_t cbPayload)
+{
+	CByteArray Frame(cMessageOverhead + cbPayload);
+
+	Frame[0] = byMessageTerminator;
+	Frame[1] = (BYTE)(Frame.size() - 2);
+	Frame[2] = (uiMessageID >> 16) & 0xff;
+	Frame[3] = (uiMessageID >> 8) & 0xff;
+	Frame[4] = (uiMessageID) & 0xff;
+	memcpy(&Frame[uiPayloadStartOffset], pPayload, cbPayload);
+	Frame[Frame.size() - 2] = F_CRC_CalculaCheckSum(&Frame[1], (uint16_t)(Frame.size() - 3));
+	Frame[Frame.size() - 1] = byMessageTerminator;
+
+	send(Connection, (const char *)&Frame[0], (int)Frame.size(), 0);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+//  Stands in for a single spa on 127.0.3.1:4257 that acts on commands: it
+//  streams statuses, and applies toggles, set temp, set temp scale and set
+//  filter config requests dwEffectDelayMs after they arrive, so that the
+//  next status (or filter config response) shows them.  Filter config
+//  requests are answered straight away.  Other messages, and any with a bad
+//  CRC, are ignored.
+//
+//  One connection at a time; a new one replaces the last.
+
+class CSpaSimulator
+{
+public:
+	CSpaSimulator();
+	~CSpaSimulator();
+
+	BOOL Start(DWORD dwStatusPeriodMs, DWORD dwEffectDelayMs);
+	void Stop(void);
+
+	static CSpaAddress GetSpaAddress(void);
+
+	//  Commands acted on so far.
+	UINT GetCommandCount(void) const { return m_cCommands; };
+
+	//  Config, filter config, version info and control config 2 requests
+	//  received so far, answered or not.
+	UINT GetConfigRequestCount(void) const { return m_cConfigRequests; };
+
+private:
+	struct DelayedCommand
+	{
+		ULONGLONG m_ullDue;
+		CByteArray m_Message;
+	};
+
+	static unsigned int __stdcall ThreadProc(void *);
+	unsigned int ThreadProc(void);
+
+	//  Simulator thread only.
+	void OnMessage(SOCKET, const BYTE *, size_t);
+	void ApplyCommand(const CByteArray &);
+	void SendFrame(SOCKET, UINT uiMessageID, const BYTE *pPayload, size_t cbPayload);
+
+	DWORD m_dwStatusPeriodMs;
+	DWORD m_dwEffectDelayMs;
+
+	SOCKET m_ListenSocket;
+	HANDLE m_hThread;
+	volatile BOOL m_fShutDown;
+
+	//  Simulator thread only.
+	BYTE m_Status[24];
+	BYTE m_FilterConfig[8];
+	std::deque<DelayedCommand> m_Delayed;
+
+	std::atomic<UINT> m_cCommands;
+	std::atomic<UINT> m_cConfigRequests;
+
+	//  Disallowed operations.
+	const CSpaSimulator & operator=(const CSpaSimulator &) { return *this; };
+};
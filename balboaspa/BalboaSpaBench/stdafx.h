@@ -0,0 +1,19 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <psapi.h>
+#include <process.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
+
+#include "BalboaSpaComms.h"
@@ -0,0 +1,160 @@
+// BalboaSpaBroker.cpp : Shares one connection to each spa among local clients.
+//
+//  Usage: BalboaSpaBroker [<base listen address>]
+//
+//  The n'th spa discovered is served on <base listen address> + n, port 4257
+//  (default base is 127.0.0.1).  Point clients at that address rather than at
+//  the spa; the whole 127.x.x.x range is loopback, so several spas can be
+//  brokered on one machine without needing a different port for each.
+
+#include "stdafx.h"
+#include "SpaBroker.h"
+#pragma comment(lib, "Ws2_32.lib")
+
+#include "crc.h"
+
+
+//  Spas that have moved, or are new, since the cache was written.
+class CRevalidationCallback :
+	public IDiscoveryCallback
+{
+public:
+	BOOL OnSpaFound(const CSpaAddress &Spa)
+	{
+		char szIpAddr[64];
+
+		inet_ntop(AF_INET, &Spa.m_SpaAddress.sin_addr, szIpAddr, sizeof(szIpAddr));
+		printf("Spa %s is now at %s; restart to serve it.\n", Spa.m_strMACAddress.c_str(), szIpAddr);
+
+		return TRUE;
+	};
+};
+
+static CRevalidationCallback RevalidationCallback;
+
+
+int main(int argc, char *argv[])
+{
+	WSADATA wsaData;
+
+	int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+	if (iResult != 0)
+	{
+		printf("WSAStartup failed: %d\n", iResult);
+		return 1;
+	}
+
+	F_CRC_InicializaTabla();
+
+	in_addr BaseAddress;
+
+	BaseAddress.s_addr = htonl(INADDR_LOOPBACK);
+	if ((argc > 1) && (inet_pton(AF_INET, argv[1], &BaseAddress) != 1))
+	{
+		printf("Invalid listen address: %s\n", argv[1]);
+		WSACleanup();
+		return 1;
+	}
+
+	//  Reconnect to wherever the spas were last time, if they're still there,
+	//  or to any in the neighbour table; only fall back to waiting for a
+	//  discovery broadcast if there are none.
+	CDiscoveryCache Cache(L"BalboaSpaBroker.cache");
+	SpaAddressVector Spas;
+	std::vector<SOCKET> Sockets;
+
+	Cache.Load();
+
+	if (Cache.ConnectCachedSpas(Spas, Sockets) != 0)
+	{
+		printf("Connected to cached spas.\n");
+
+		//  Drop the ones that didn't answer; revalidation will report them
+		//  if they've moved.
+		for (size_t i = Spas.size(); i-- > 0;)
+		{
+			if (Sockets[i] == INVALID_SOCKET)
+			{
+				Spas.erase(Spas.begin() + i);
+				Sockets.erase(Sockets.begin() + i);
+			}
+		}
+
+		Cache.StartRevalidation(&RevalidationCallback);
+	}
+	else if (FindSpasPassively(Spas, Sockets) != 0)
+	{
+		//  Spas the machine has talked to recently are in the neighbour
+		//  table; the broadcast picks up any others.
+		printf("Found spas in the neighbour table.\n");
+
+		for (auto pSpa = Spas.cbegin(); pSpa < Spas.cend(); pSpa++)
+		{
+			Cache.Update(*pSpa);
+		}
+
+		Cache.StartRevalidation(&RevalidationCallback);
+	}
+	else
+	{
+		if (!DiscoverSpas(Spas, DiscoveryOptions()))
+		{
+			printf("Error discovering spas\n");
+		}
+
+		for (auto pSpa = Spas.cbegin(); pSpa < Spas.cend(); pSpa++)
+		{
+			Cache.Update(*pSpa);
+		}
+		Cache.Save();
+
+		Sockets.assign(Spas.size(), INVALID_SOCKET);
+	}
+
+	printf("Found %lld spas.\n", (long long)Spas.size());
+
+	{
+		CSpaBroker Broker;
+		ULONG ulNextAddress = ntohl(BaseAddress.s_addr);
+
+		for (auto pSpa = Spas.cbegin(); pSpa < Spas.cend(); pSpa++)
+		{
+			sockaddr_in ListenAddress;
+
+			memset(&ListenAddress, 0, sizeof(ListenAddress));
+			ListenAddress.sin_family = AF_INET;
+			ListenAddress.sin_addr.s_addr = htonl(ulNextAddress++);
+
+			char szSpaAddr[64];
+			char szListenAddr[64];
+
+			inet_ntop(AF_INET, &pSpa->m_SpaAddress.sin_addr, szSpaAddr, sizeof(szSpaAddr));
+			inet_ntop(AF_INET, &ListenAddress.sin_addr, szListenAddr, sizeof(szListenAddr));
+
+			printf("\t MAC: %s, IP: %s, served on %s\n", pSpa->m_strMACAddress.c_str(), szSpaAddr, szListenAddr);
+
+			Broker.AddSpa(*pSpa, ListenAddress, Sockets[pSpa - Spas.cbegin()]);
+		}
+
+		if (Spas.size() > 0)
+		{
+			if (!Broker.Start())
+			{
+				printf("Unable to start broker.\n");
+			}
+			else
+			{
+				printf("Hit a key to exit.\n");
+				_getch();
+			}
+
+			Broker.Stop();
+		}
+	}
+
+	Cache.StopRevalidation();
+
+	WSACleanup();
+	return 0;
+}
@@ -0,0 +1,820 @@
+#include "stdafx.h"
+#include "SpaBroker.h"
+#include "MessageFormat.h"
+
+using std::mutex;
+using std::lock_guard;
+
+
+const u_short usSpaPort = 4257;
+
+//  Leave the spa some breathing room between commands.
+const ULONGLONG cmsCommandSpacing = 100;
+
+//  How often to retry a spa that has dropped its connection.
+const ULONGLONG cmsRestartInterval = 5000;
+
+//  A client this far behind isn't reading; drop it rather than buffer forever.
+const size_t cMaxQueuedFrames = 256;
+
+
+struct CSpaBroker::Client
+{
+	Client(SOCKET s) : m_Socket(s), m_uiSendOffset(0), m_fDrop(FALSE) {};
+
+	SOCKET m_Socket;
+	CMessageFramer m_Framer;
+
+	std::deque<SharedFrame> m_SendQueue;
+	size_t m_uiSendOffset;		//  Into m_SendQueue.front()
+
+	BOOL m_fDrop;
+};
+
+
+class CSpaBroker::CBrokeredSpa :
+	public IMonitorCallback
+{
+public:
+	CBrokeredSpa(CSpaBroker &, const CSpaAddress &, const sockaddr_in &);
+
+	CSpaBroker &m_Broker;
+	CSpaAddress m_Address;
+	CSpaComms m_Spa;
+
+	sockaddr_in m_ListenAddress;
+	SOCKET m_ListenSocket;
+
+	std::vector<std::unique_ptr<Client>> m_Clients;
+
+	//  Last of each response seen, for answering clients directly.
+	SharedFrame m_Status;
+	SharedFrame m_ConfigResponse;
+	SharedFrame m_FilterConfig;
+	SharedFrame m_VersionInfo;
+	SharedFrame m_ControlConfig2;
+
+	std::deque<CByteArray> m_Commands;
+	ULONGLONG m_ullLastCommand;
+
+	//  Already connected, e.g. by CDiscoveryCache; used for the first start.
+	SOCKET m_InitialSocket;
+
+	BOOL m_fFailed;
+	ULONGLONG m_ullLastRestart;
+
+private:
+	void ProcessStatusMessage(const StatusMessage &Message)
+	{
+		m_Broker.Publish(*this, Message.m_RawMessage, &m_Status);
+	};
+	void ProcessConfigResponse(const ConfigResponseMessage &Message)
+	{
+		m_Broker.Publish(*this, Message.m_RawMessage, &m_ConfigResponse);
+	};
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &Message)
+	{
+		m_Broker.Publish(*this, Message.m_RawMessage, &m_FilterConfig);
+	};
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &Message)
+	{
+		m_Broker.Publish(*this, Message.m_RawMessage, &m_VersionInfo);
+	};
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &Message)
+	{
+		m_Broker.Publish(*this, Message.m_RawMessage, &m_ControlConfig2);
+	};
+	void ProcessSetTempRangeResponse(const SetTempRangeResponseMessage &Message)
+	{
+		m_Broker.Publish(*this, Message.m_RawMessage, NULL);
+	};
+	void ProcessUnknownMessageRaw(const CByteArray &Message)
+	{
+		m_Broker.Publish(*this, Message, NULL);
+	};
+
+	void Dispose(void)
+	{
+		//  Owned by the broker, nothing to do.
+	};
+	void OnFatalError(void)
+	{
+		m_Broker.OnSpaFailed(*this);
+	};
+};
+
+
+CSpaBroker::CBrokeredSpa::CBrokeredSpa(
+	CSpaBroker &Broker,
+	const CSpaAddress &SpaAddress,
+	const sockaddr_in &ListenAddress)
+	: m_Broker(Broker), m_Address(SpaAddress),
+	//  No coalescing, clients should see the same 1 Hz stream the spa sends.
+	m_Spa(SpaAddress, this, FALSE),
+	m_ListenAddress(ListenAddress), m_ListenSocket(INVALID_SOCKET),
+	m_ullLastCommand(0), m_InitialSocket(INVALID_SOCKET),
+	m_fFailed(FALSE), m_ullLastRestart(0)
+{}
+
+
+//  Builds one of the request messages, as the CSpaComms::Send*Request()
+//  methods do.  Requests have at most one non-zero payload byte.
+static CByteArray
+MakeRequest(
+	SpaCommandMessageID ID,
+	UINT uiPayloadLength,
+	UINT uiSetOffset = 0,
+	BYTE bySetValue = 0x01)
+{
+	CByteArray Request;
+
+	FillInMessageOverhead(Request, ID, uiPayloadLength);
+	if (uiPayloadLength != 0)
+	{
+		Request[uiPayloadStartOffset + uiSetOffset] = bySetValue;
+	}
+	FillInMessageCRC(Request);
+
+	return Request;
+}
+
+static CByteArray
+MakeFilterConfigRequest(void)
+{
+	return MakeRequest(msFilterConfigRequest, 3);
+}
+
+
+CSpaBroker::CSpaBroker()
+	: m_WakeSocket(INVALID_SOCKET), m_hIoThread(0), m_fShutDown(FALSE)
+{
+	memset(&m_WakeAddress, 0, sizeof(m_WakeAddress));
+}
+
+CSpaBroker::~CSpaBroker()
+{
+	Stop();
+}
+
+
+BOOL
+CSpaBroker::AddSpa(
+	const CSpaAddress &Spa,
+	const sockaddr_in &ListenAddress,
+	SOCKET ConnectedSocket)
+{
+	if (m_hIoThread != 0)
+	{
+		return FALSE;
+	}
+
+	sockaddr_in Address = ListenAddress;
+
+	if (Address.sin_port == 0)
+	{
+		Address.sin_port = htons(usSpaPort);
+	}
+
+	m_Spas.push_back(std::make_unique<CBrokeredSpa>(*this, Spa, Address));
+	m_Spas.back()->m_InitialSocket = ConnectedSocket;
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaBroker::Start(void)
+{
+	if (m_hIoThread != 0)
+	{
+		//  Already running
+		return FALSE;
+	}
+
+	//  Loopback datagram socket the monitor threads poke to wake up the I/O
+	//  thread when there's something new to send.
+	m_WakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (m_WakeSocket == INVALID_SOCKET)
+	{
+		return FALSE;
+	}
+
+	int iAddressSize = sizeof(m_WakeAddress);
+
+	m_WakeAddress.sin_family = AF_INET;
+	m_WakeAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	m_WakeAddress.sin_port = 0;
+
+	if ((bind(m_WakeSocket, (const sockaddr *)&m_WakeAddress, sizeof(m_WakeAddress)) == SOCKET_ERROR) ||
+		(getsockname(m_WakeSocket, (sockaddr *)&m_WakeAddress, &iAddressSize) == SOCKET_ERROR))
+	{
+		Stop();
+		return FALSE;
+	}
+
+	u_long ulNonBlocking = 1;
+	ioctlsocket(m_WakeSocket, FIONBIO, &ulNonBlocking);
+
+	if (!m_StateSegment.Create((UINT)m_Spas.size()))
+	{
+		//  Not fatal, clients can still connect.
+		_RPTWN(_CRT_WARN, L"Unable to create state segment: %d\n", GetLastError());
+	}
+
+	SpaAddressVector ConnectAddresses;
+
+	m_Connecting.clear();
+
+	for (auto pSpa = m_Spas.begin(); pSpa != m_Spas.end(); pSpa++)
+	{
+		CBrokeredSpa &Spa = **pSpa;
+
+		if (m_StateSegment.GetSlotCount() != 0)
+		{
+			Spa.m_Spa.AttachStateSegment(&m_StateSegment, (UINT)(pSpa - m_Spas.begin()));
+		}
+
+		Spa.m_ListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+		if ((Spa.m_ListenSocket == INVALID_SOCKET) ||
+			(bind(Spa.m_ListenSocket, (const sockaddr *)&Spa.m_ListenAddress, sizeof(Spa.m_ListenAddress)) == SOCKET_ERROR) ||
+			(listen(Spa.m_ListenSocket, SOMAXCONN) == SOCKET_ERROR))
+		{
+			_RPTWN(_CRT_WARN, L"Unable to listen for clients: %d\n", WSAGetLastError());
+			Stop();
+			return FALSE;
+		}
+
+		BOOL fStarted;
+
+		if (Spa.m_InitialSocket != INVALID_SOCKET)
+		{
+			fStarted = Spa.m_Spa.StartMonitor(Spa.m_InitialSocket);
+
+			if (!fStarted)
+			{
+				closesocket(Spa.m_InitialSocket);
+			}
+			Spa.m_InitialSocket = INVALID_SOCKET;
+		}
+		else
+		{
+			//  Connected below, along with the others.
+			ConnectAddresses.push_back(Spa.m_Address);
+			m_Connecting.push_back(&Spa);
+			fStarted = TRUE;
+		}
+
+		if (!fStarted)
+		{
+			StartFailed(Spa);
+		}
+
+		//  Prime the caches.
+		QueueCommand(Spa, MakeRequest(msConfigRequest, 0));
+		QueueCommand(Spa, MakeFilterConfigRequest());
+		QueueCommand(Spa, MakeRequest(msFilterConfigRequest, 3, 0, 0x02));		//  Version info
+		QueueCommand(Spa, MakeRequest(msControlConfigRequest, 3, 2));		//  Control config 2
+	}
+
+	//  All at once, rather than one blocking connect after another; each spa
+	//  is monitored as soon as its connection is up, and an unreachable one
+	//  doesn't hold up the rest.
+	if (!ConnectAddresses.empty())
+	{
+		ConnectToSpas(ConnectAddresses, this);
+		m_Connecting.clear();
+	}
+
+	m_fShutDown = FALSE;
+	m_hIoThread = (HANDLE)_beginthreadex(NULL, 0, CSpaBroker::IoThreadProc, this, 0, NULL);
+
+	if (m_hIoThread == 0)
+	{
+		Stop();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaBroker::OnSpaConnected(
+	size_t uiSpa,
+	SOCKET SpaSocket)
+{
+	CBrokeredSpa &Spa = *m_Connecting[uiSpa];
+
+	if (!Spa.m_Spa.StartMonitor(SpaSocket))
+	{
+		StartFailed(Spa);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CSpaBroker::OnSpaConnectFailed(
+	size_t uiSpa)
+{
+	StartFailed(*m_Connecting[uiSpa]);
+}
+
+
+//  Keep going, the I/O thread will retry.
+void
+CSpaBroker::StartFailed(
+	CBrokeredSpa &Spa)
+{
+	Spa.m_fFailed = TRUE;
+	Spa.m_ullLastRestart = GetTickCount64();
+}
+
+
+void
+CSpaBroker::Stop(void)
+{
+	m_fShutDown = TRUE;
+
+	if (m_hIoThread != 0)
+	{
+		Wake();
+		WaitForSingleObject(m_hIoThread, INFINITE);
+		CloseHandle(m_hIoThread);
+		m_hIoThread = 0;
+	}
+
+	//  Not under the lock, the monitor threads may need it to finish up.
+	for (auto pSpa = m_Spas.begin(); pSpa != m_Spas.end(); pSpa++)
+	{
+		(*pSpa)->m_Spa.EndMonitor();
+	}
+
+	for (auto pSpa = m_Spas.begin(); pSpa != m_Spas.end(); pSpa++)
+	{
+		CBrokeredSpa &Spa = **pSpa;
+
+		if (Spa.m_InitialSocket != INVALID_SOCKET)
+		{
+			//  Never started.
+			closesocket(Spa.m_InitialSocket);
+			Spa.m_InitialSocket = INVALID_SOCKET;
+		}
+
+		for (auto pClient = Spa.m_Clients.begin(); pClient != Spa.m_Clients.end(); pClient++)
+		{
+			closesocket((*pClient)->m_Socket);
+		}
+		Spa.m_Clients.clear();
+		Spa.m_Commands.clear();
+
+		if (Spa.m_ListenSocket != INVALID_SOCKET)
+		{
+			closesocket(Spa.m_ListenSocket);
+			Spa.m_ListenSocket = INVALID_SOCKET;
+		}
+	}
+
+	if (m_WakeSocket != INVALID_SOCKET)
+	{
+		closesocket(m_WakeSocket);
+		m_WakeSocket = INVALID_SOCKET;
+	}
+
+	for (auto pSpa = m_Spas.begin(); pSpa != m_Spas.end(); pSpa++)
+	{
+		(*pSpa)->m_Spa.AttachStateSegment(NULL, 0);
+	}
+	m_StateSegment.Close();
+}
+
+
+void
+CSpaBroker::Wake(void)
+{
+	BYTE byWake = 0;
+
+	sendto(m_WakeSocket, (const char *)&byWake, 1, 0, (const sockaddr *)&m_WakeAddress, sizeof(m_WakeAddress));
+}
+
+
+void
+CSpaBroker::Publish(
+	CBrokeredSpa &Spa,
+	const CByteArray &Message,
+	SharedFrame *pCache)
+{
+	//  One copy, shared by every client's send queue.
+	SharedFrame Frame = std::make_shared<const CByteArray>(Message);
+
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		if (pCache != NULL)
+		{
+			*pCache = Frame;
+		}
+
+		for (auto pClient = Spa.m_Clients.begin(); pClient != Spa.m_Clients.end(); pClient++)
+		{
+			Client &Client = **pClient;
+
+			if (Client.m_SendQueue.size() >= cMaxQueuedFrames)
+			{
+				Client.m_fDrop = TRUE;
+			}
+			else
+			{
+				Client.m_SendQueue.push_back(Frame);
+			}
+		}
+	}
+
+	Wake();
+}
+
+
+void
+CSpaBroker::OnSpaFailed(
+	CBrokeredSpa &Spa)
+{
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		Spa.m_fFailed = TRUE;
+		Spa.m_ullLastRestart = 0;
+	}
+
+	Wake();
+}
+
+
+unsigned int __stdcall
+CSpaBroker::IoThreadProc(
+	void *pParam)
+{
+	return ((CSpaBroker *)pParam)->IoThreadProc();
+}
+
+
+unsigned int
+CSpaBroker::IoThreadProc(void)
+{
+	std::vector<WSAPOLLFD> PollFds;
+
+	//  Parallel to PollFds; which spa and client each entry is for.
+	std::vector<std::pair<CBrokeredSpa *, Client *>> PollOwners;
+
+	while (!m_fShutDown)
+	{
+		RestartFailedSpas();
+
+		PollFds.clear();
+		PollOwners.clear();
+
+		{
+			lock_guard<mutex> lg(m_mutex);
+
+			WSAPOLLFD Fd;
+
+			Fd.fd = m_WakeSocket;
+			Fd.events = POLLRDNORM;
+			Fd.revents = 0;
+			PollFds.push_back(Fd);
+			PollOwners.push_back(std::make_pair((CBrokeredSpa *)NULL, (Client *)NULL));
+
+			for (auto pSpa = m_Spas.begin(); pSpa != m_Spas.end(); pSpa++)
+			{
+				CBrokeredSpa &Spa = **pSpa;
+
+				Fd.fd = Spa.m_ListenSocket;
+				Fd.events = POLLRDNORM;
+				PollFds.push_back(Fd);
+				PollOwners.push_back(std::make_pair(&Spa, (Client *)NULL));
+
+				for (auto pClient = Spa.m_Clients.begin(); pClient != Spa.m_Clients.end(); pClient++)
+				{
+					Client &Client = **pClient;
+
+					Fd.fd = Client.m_Socket;
+					Fd.events = POLLRDNORM | (Client.m_SendQueue.empty() ? 0 : POLLWRNORM);
+					PollFds.push_back(Fd);
+					PollOwners.push_back(std::make_pair(&Spa, &Client));
+				}
+			}
+		}
+
+		//  Short enough timeout to keep the command queues moving.
+		int iResult = WSAPoll(&PollFds[0], (ULONG)PollFds.size(), (INT)cmsCommandSpacing);
+
+		if (iResult == SOCKET_ERROR)
+		{
+			_RPTWN(_CRT_WARN, L"WSAPoll failed: %d\n", WSAGetLastError());
+			Sleep((DWORD)cmsCommandSpacing);
+			continue;
+		}
+
+		lock_guard<mutex> lg(m_mutex);
+
+		for (size_t i = 0; i < PollFds.size(); i++)
+		{
+			if (PollFds[i].revents == 0)
+			{
+				continue;
+			}
+
+			CBrokeredSpa *pSpa = PollOwners[i].first;
+			Client *pClient = PollOwners[i].second;
+
+			if (pSpa == NULL)
+			{
+				char Drain[64];
+
+				while (recv(m_WakeSocket, Drain, sizeof(Drain), 0) > 0)
+				{}
+			}
+			else if (pClient == NULL)
+			{
+				AcceptClient(*pSpa);
+			}
+			else
+			{
+				if (PollFds[i].revents & (POLLRDNORM | POLLHUP | POLLERR))
+				{
+					ReadClient(*pSpa, *pClient);
+				}
+
+				if (!pClient->m_fDrop)
+				{
+					FlushClient(*pClient);
+				}
+			}
+		}
+
+		//  Flush anything published since the poll set was built, and drop
+		//  whoever has gone away or fallen too far behind.
+		for (auto pSpa = m_Spas.begin(); pSpa != m_Spas.end(); pSpa++)
+		{
+			auto &Clients = (*pSpa)->m_Clients;
+
+			for (auto pClient = Clients.begin(); pClient != Clients.end();)
+			{
+				if (!(*pClient)->m_fDrop)
+				{
+					FlushClient(**pClient);
+				}
+
+				if ((*pClient)->m_fDrop)
+				{
+					closesocket((*pClient)->m_Socket);
+					pClient = Clients.erase(pClient);
+				}
+				else
+				{
+					pClient++;
+				}
+			}
+		}
+
+		SendPendingCommands();
+	}
+
+	return 0;
+}
+
+
+void
+CSpaBroker::AcceptClient(
+	CBrokeredSpa &Spa)
+{
+	SOCKET ClientSocket = accept(Spa.m_ListenSocket, NULL, NULL);
+
+	if (ClientSocket == INVALID_SOCKET)
+	{
+		return;
+	}
+
+	u_long ulNonBlocking = 1;
+	DWORD fNoDelay = TRUE;
+
+	ioctlsocket(ClientSocket, FIONBIO, &ulNonBlocking);
+	setsockopt(ClientSocket, IPPROTO_TCP, TCP_NODELAY, (const char *)&fNoDelay, sizeof(fNoDelay));
+
+	Spa.m_Clients.push_back(std::make_unique<Client>(ClientSocket));
+
+	//  A directly connected client would get a status straight away, so
+	//  don't make this one wait for the next.
+	if (Spa.m_Status)
+	{
+		Spa.m_Clients.back()->m_SendQueue.push_back(Spa.m_Status);
+	}
+}
+
+
+void
+CSpaBroker::ReadClient(
+	CBrokeredSpa &Spa,
+	Client &Client)
+{
+	BYTE RecvBuffer[256];
+
+	int iResult = recv(Client.m_Socket, (char *)RecvBuffer, sizeof(RecvBuffer), 0);
+
+	if (iResult == 0)
+	{
+		//  Client closed the connection.
+		Client.m_fDrop = TRUE;
+		return;
+	}
+
+	if (iResult == SOCKET_ERROR)
+	{
+		if (WSAGetLastError() != WSAEWOULDBLOCK)
+		{
+			Client.m_fDrop = TRUE;
+		}
+		return;
+	}
+
+	CByteArray Message;
+
+	Client.m_Framer.AddData(RecvBuffer, iResult);
+
+	while (!Client.m_fDrop && Client.m_Framer.GetNextMessage(Message))
+	{
+		HandleClientMessage(Spa, Client, Message);
+	}
+}
+
+
+void
+CSpaBroker::FlushClient(
+	Client &Client)
+{
+	while (!Client.m_SendQueue.empty())
+	{
+		const CByteArray &Frame = *Client.m_SendQueue.front();
+		int cbRemaining = (int)(Frame.size() - Client.m_uiSendOffset);
+
+		int iResult = send(Client.m_Socket, (const char *)&Frame[Client.m_uiSendOffset], cbRemaining, 0);
+
+		if (iResult == SOCKET_ERROR)
+		{
+			if (WSAGetLastError() != WSAEWOULDBLOCK)
+			{
+				Client.m_fDrop = TRUE;
+			}
+			return;
+		}
+
+		if (iResult < cbRemaining)
+		{
+			//  Socket buffer is full, pick up here next time.
+			Client.m_uiSendOffset += iResult;
+			return;
+		}
+
+		Client.m_SendQueue.pop_front();
+		Client.m_uiSendOffset = 0;
+	}
+}
+
+
+void
+CSpaBroker::HandleClientMessage(
+	CBrokeredSpa &Spa,
+	Client &Client,
+	const CByteArray &Message)
+{
+	//  The framer only goes by the length byte, and clients are anyone on
+	//  the machine; one that can't frame a message isn't worth keeping.
+	if ((Message.size() < cMessageOverhead) ||
+		(Message[0] != byMessageTerminator) ||
+		(Message[Message.size() - 1] != byMessageTerminator))
+	{
+		Client.m_fDrop = TRUE;
+		return;
+	}
+
+	UINT uiMessageID = (Message[2] << 16) + (Message[3] << 8) + Message[4];
+	SharedFrame Cached;
+
+	switch (uiMessageID)
+	{
+	case msConfigRequest:
+		Cached = Spa.m_ConfigResponse;
+		break;
+
+	//  Also msControlConfigRequest, the payload says which.
+	case msFilterConfigRequest:
+		if (Message.size() == cMessageOverhead + 3)
+		{
+			if (Message[uiPayloadStartOffset] == 0x01)
+			{
+				Cached = Spa.m_FilterConfig;
+			}
+			else if (Message[uiPayloadStartOffset] == 0x02)
+			{
+				Cached = Spa.m_VersionInfo;
+			}
+			else if (Message[uiPayloadStartOffset + 2] == 0x01)
+			{
+				Cached = Spa.m_ControlConfig2;
+			}
+		}
+		break;
+
+	case msSetFilterConfigRequest:
+		//  About to change.  Pass it on, then ask for the new settings,
+		//  which the spa sends to every client (including us).
+		Spa.m_FilterConfig.reset();
+		QueueCommand(Spa, Message);
+		QueueCommand(Spa, MakeFilterConfigRequest());
+		return;
+	}
+
+	if (Cached)
+	{
+		Client.m_SendQueue.push_back(Cached);
+		return;
+	}
+
+	QueueCommand(Spa, Message);
+}
+
+
+void
+CSpaBroker::QueueCommand(
+	CBrokeredSpa &Spa,
+	const CByteArray &Message)
+{
+	//  Two clients sending the same command at the same time (most likely
+	//  both toggling the same pump) would just undo each other, so only the
+	//  first one goes to the spa.
+	for (auto pCommand = Spa.m_Commands.cbegin(); pCommand != Spa.m_Commands.cend(); pCommand++)
+	{
+		if (*pCommand == Message)
+		{
+			return;
+		}
+	}
+
+	Spa.m_Commands.push_back(Message);
+}
+
+
+void
+CSpaBroker::SendPendingCommands(void)
+{
+	ULONGLONG ullNow = GetTickCount64();
+
+	for (auto pSpa = m_Spas.begin(); pSpa != m_Spas.end(); pSpa++)
+	{
+		CBrokeredSpa &Spa = **pSpa;
+
+		if (!Spa.m_fFailed &&
+			!Spa.m_Commands.empty() &&
+			(ullNow - Spa.m_ullLastCommand >= cmsCommandSpacing))
+		{
+			Spa.m_Spa.SendRawMessage(Spa.m_Commands.front());
+			Spa.m_Commands.pop_front();
+			Spa.m_ullLastCommand = ullNow;
+		}
+	}
+}
+
+
+void
+CSpaBroker::RestartFailedSpas(void)
+{
+	ULONGLONG ullNow = GetTickCount64();
+
+	for (auto pSpa = m_Spas.begin(); pSpa != m_Spas.end(); pSpa++)
+	{
+		CBrokeredSpa &Spa = **pSpa;
+		BOOL fRestart;
+
+		{
+			lock_guard<mutex> lg(m_mutex);
+
+			fRestart = Spa.m_fFailed && (ullNow - Spa.m_ullLastRestart >= cmsRestartInterval);
+		}
+
+		if (fRestart)
+		{
+			//  Not under the lock; EndMonitor() waits for the monitor thread.
+			Spa.m_Spa.EndMonitor();
+
+			BOOL fStarted = Spa.m_Spa.StartMonitor();
+
+			lock_guard<mutex> lg(m_mutex);
+
+			Spa.m_fFailed = !fStarted;
+			Spa.m_ullLastRestart = ullNow;
+		}
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+//  Holds a single connection to each spa, and re-serves the spa's own framed
+//  protocol to any number of local clients.  A client is just a CSpaComms
+//  (or anything else speaking the protocol) pointed at the broker's listen
+//  address instead of at the spa.
+//
+//  - Frames from the spa are fanned out to every client of that spa.  Each
+//    frame is allocated once, and shared by all of the client send queues.
+//  - Configuration, filter, version and control config 2 requests are
+//    answered from the last response seen, without bothering the spa.
+//  - Everything else a client sends is queued, and passed on to the spa one
+//    command at a time.
+//  - The latest state of each spa is also published in the shared memory
+//    state segment, slot n for the n'th spa added.
+
+typedef std::shared_ptr<const CByteArray> SharedFrame;
+
+class CSpaBroker :
+	private ISpaConnectCallback
+{
+public:
+	CSpaBroker();
+	~CSpaBroker();
+
+	//  Clients connecting to ListenAddress are served by 'Spa'.  Port 4257 is
+	//  used if the address doesn't have one, as that's what CSpaComms expects.
+	//  ConnectedSocket, if given, is an already open connection to the spa
+	//  (see ConnectToSpas()); the broker takes ownership of it if successful.
+	BOOL AddSpa(const CSpaAddress &Spa, const sockaddr_in &ListenAddress,
+				SOCKET ConnectedSocket = INVALID_SOCKET);
+
+	BOOL Start(void);
+	void Stop(void);
+
+private:
+	class CBrokeredSpa;
+	struct Client;
+
+	static unsigned int __stdcall IoThreadProc(void *);
+	unsigned int IoThreadProc(void);
+
+	//  ISpaConnectCallback, for the spas Start() connects.
+	BOOL OnSpaConnected(size_t uiSpa, SOCKET);
+	void OnSpaConnectFailed(size_t uiSpa);
+	void StartFailed(CBrokeredSpa &);
+
+	//  Called from the spa monitor threads.
+	void Publish(CBrokeredSpa &, const CByteArray &, SharedFrame *pCache);
+	void OnSpaFailed(CBrokeredSpa &);
+
+	//  I/O thread only.
+	void AcceptClient(CBrokeredSpa &);
+	void ReadClient(CBrokeredSpa &, Client &);
+	void FlushClient(Client &);
+	void HandleClientMessage(CBrokeredSpa &, Client &, const CByteArray &);
+	void QueueCommand(CBrokeredSpa &, const CByteArray &);
+	void SendPendingCommands(void);
+	void RestartFailedSpas(void);
+
+	void Wake(void);
+
+	std::vector<std::unique_ptr<CBrokeredSpa>> m_Spas;
+	std::vector<CBrokeredSpa *> m_Connecting;		//  Only during Start()
+	CSpaStateSegment m_StateSegment;
+
+	//  Guards clients, caches and command queues; they're touched by both the
+	//  I/O thread and the spa monitor threads.
+	std::mutex m_mutex;
+
+	SOCKET m_WakeSocket;
+	sockaddr_in m_WakeAddress;
+
+	HANDLE m_hIoThread;
+	volatile BOOL m_fShutDown;
+
+	//  Disallowed operations.
+	const CSpaBroker & operator=(const CSpaBroker &) { return *this; };
+};
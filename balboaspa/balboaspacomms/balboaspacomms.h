@@ -1,11 +1,27 @@
 #pragma once
 
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
 
 typedef unsigned char BYTE;
 typedef std::vector<BYTE> CByteArray;
 using std::string;
 
+#include "CompletionPort.h"
 #include "Discovery.h"
+#include "DiscoveryCache.h"
 #include "MonitorCallback.h"
+#include "DispatchQueue.h"
+#include "ObserverList.h"
+#include "PassiveDiscovery.h"
 #include "SpaComms.h"
+#include "CommandLatency.h"
+#include "ConfigRefresh.h"
+#include "SpaFleet.h"
+#include "SpaMonitor.h"
+#include "SpaScheduler.h"
+#include "StateSegment.h"
+#include "StatusHistory.h"
+#include "StatusRollup.h"
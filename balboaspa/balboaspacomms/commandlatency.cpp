@@ -0,0 +1,402 @@
+#include "stdafx.h"
+#include "Discovery.h"
+#include "MonitorCallback.h"
+#include "ObserverList.h"
+#include "SpaComms.h"
+#include "CommandLatency.h"
+
+using std::mutex;
+using std::lock_guard;
+
+
+const ULONGLONG ullFirstBucketLimitMs = 32;
+
+
+ULONGLONG
+GetLatencyBucketLimitMs(
+	UINT uiBucket)
+{
+	if (uiBucket >= cLatencyBuckets - 1)
+	{
+		return ULLONG_MAX;
+	}
+
+	return ullFirstBucketLimitMs << uiBucket;
+}
+
+
+ULONGLONG
+CommandLatencyHistogram::GetPercentileMs(
+	double dFraction) const
+{
+	if (m_cCompleted == 0)
+	{
+		return 0;
+	}
+
+	UINT64 cWanted = (UINT64)(dFraction * m_cCompleted + 0.5);
+	UINT64 cSoFar = 0;
+
+	for (UINT i = 0; i < cLatencyBuckets; i++)
+	{
+		cSoFar += m_cBuckets[i];
+
+		if (cSoFar >= cWanted)
+		{
+			return (std::min)(GetLatencyBucketLimitMs(i), m_ullMaxMs);
+		}
+	}
+
+	return m_ullMaxMs;
+}
+
+
+double
+CommandLatencyHistogram::GetMeanMs(void) const
+{
+	return (m_cCompleted != 0) ? (double)m_ullTotalMs / m_cCompleted : 0.0;
+}
+
+
+CCommandLatency::CCommandLatency(
+	DWORD dwTimeoutMs)
+	: m_dwTimeoutMs(dwTimeoutMs)
+{
+	Clear();
+}
+
+
+void
+CCommandLatency::Clear(void)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	m_fHaveStatus = FALSE;
+	memset(&m_LatestStatus, 0, sizeof(m_LatestStatus));
+	memset(m_Pending, 0, sizeof(m_Pending));
+	memset(m_Histograms, 0, sizeof(m_Histograms));
+}
+
+
+SpaCommandType
+CCommandLatency::GetCommandType(
+	PendingSlot Slot)
+{
+	switch (Slot)
+	{
+	case psSetTemp:
+		return sctSetTemp;
+
+	case psSetFilterConfig:
+		return sctSetFilterConfig;
+
+	default:
+		return sctToggle;
+	}
+}
+
+
+BOOL
+CCommandLatency::GetToggleSlot(
+	CSpaComms::ToggleSpaItem tsi,
+	PendingSlot &Slot)
+{
+	switch (tsi)
+	{
+	case CSpaComms::tsiPump1:
+		Slot = psPump1;
+		break;
+
+	case CSpaComms::tsiPump2:
+		Slot = psPump2;
+		break;
+
+	case CSpaComms::tsiLights:
+		Slot = psLights;
+		break;
+
+	case CSpaComms::tsiHeatMode:
+		Slot = psHeatMode;
+		break;
+
+	case CSpaComms::tsiTempRange:
+		Slot = psTempRange;
+		break;
+
+	default:
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+UINT
+CCommandLatency::GetToggleState(
+	PendingSlot Slot,
+	const StatusInfo &Status)
+{
+	switch (Slot)
+	{
+	case psPump1:
+		return Status.m_Pump1Status;
+
+	case psPump2:
+		return Status.m_Pump2Status;
+
+	case psLights:
+		return Status.m_fLights;
+
+	case psHeatMode:
+		return Status.m_HeatingMode;
+
+	case psTempRange:
+		return Status.m_HeatRange;
+
+	default:
+		_ASSERT(FALSE);
+		return 0;
+	}
+}
+
+
+//  Filter 2's times only count if it's enabled.
+BOOL
+CCommandLatency::IsSameFilterConfig(
+	const FilterConfigInfo &Wanted,
+	const FilterConfigInfo &Actual)
+{
+	if ((Wanted.m_Filter1StartTime.m_Hour != Actual.m_Filter1StartTime.m_Hour) ||
+		(Wanted.m_Filter1StartTime.m_Minute != Actual.m_Filter1StartTime.m_Minute) ||
+		(Wanted.m_uiFilter1Duration != Actual.m_uiFilter1Duration) ||
+		(!Wanted.m_fFilter2Enabled != !Actual.m_fFilter2Enabled))
+	{
+		return FALSE;
+	}
+
+	return !Wanted.m_fFilter2Enabled ||
+		((Wanted.m_Filter2StartTime.m_Hour == Actual.m_Filter2StartTime.m_Hour) &&
+		 (Wanted.m_Filter2StartTime.m_Minute == Actual.m_Filter2StartTime.m_Minute) &&
+		 (Wanted.m_uiFilter2Duration == Actual.m_uiFilter2Duration));
+}
+
+
+CCommandLatency::PendingCommand &
+CCommandLatency::StartCommand(
+	PendingSlot Slot,
+	ULONGLONG ullNow)
+{
+	PendingCommand &Command = m_Pending[Slot];
+	CommandLatencyHistogram &Histogram = m_Histograms[GetCommandType(Slot)];
+
+	ExpireCommands(ullNow);
+
+	if (Command.m_fPending)
+	{
+		Histogram.m_cSuperseded++;
+	}
+
+	Histogram.m_cSent++;
+
+	Command.m_fPending = TRUE;
+	Command.m_ullSent = ullNow;
+
+	return Command;
+}
+
+
+void
+CCommandLatency::CompleteCommand(
+	PendingSlot Slot,
+	ULONGLONG ullNow)
+{
+	PendingCommand &Command = m_Pending[Slot];
+	CommandLatencyHistogram &Histogram = m_Histograms[GetCommandType(Slot)];
+	ULONGLONG ullLatency = ullNow - Command.m_ullSent;
+	UINT uiBucket = 0;
+
+	while ((uiBucket < cLatencyBuckets - 1) && (ullLatency >= GetLatencyBucketLimitMs(uiBucket)))
+	{
+		uiBucket++;
+	}
+
+	if ((Histogram.m_cCompleted == 0) || (ullLatency < Histogram.m_ullMinMs))
+	{
+		Histogram.m_ullMinMs = ullLatency;
+	}
+
+	Histogram.m_ullMaxMs = (std::max)(Histogram.m_ullMaxMs, ullLatency);
+	Histogram.m_ullTotalMs += ullLatency;
+	Histogram.m_cBuckets[uiBucket]++;
+	Histogram.m_cCompleted++;
+
+	Command.m_fPending = FALSE;
+}
+
+
+void
+CCommandLatency::ExpireCommands(
+	ULONGLONG ullNow)
+{
+	for (UINT i = 0; i < psSlotCount; i++)
+	{
+		PendingCommand &Command = m_Pending[i];
+
+		if (Command.m_fPending && (ullNow - Command.m_ullSent >= m_dwTimeoutMs))
+		{
+			m_Histograms[GetCommandType((PendingSlot)i)].m_cTimedOut++;
+			Command.m_fPending = FALSE;
+		}
+	}
+}
+
+
+void
+CCommandLatency::OnToggleRequest(
+	CSpaComms::ToggleSpaItem tsi)
+{
+	PendingSlot Slot;
+
+	if (!GetToggleSlot(tsi, Slot))
+	{
+		return;
+	}
+
+	lock_guard<mutex> lg(m_mutex);
+
+	if (!m_fHaveStatus)
+	{
+		return;
+	}
+
+	PendingCommand &Command = StartCommand(Slot, GetTickCount64());
+
+	Command.m_uiBefore = GetToggleState(Slot, m_LatestStatus);
+}
+
+
+void
+CCommandLatency::OnSetTempRequest(
+	UINT uiTemp,
+	TempScale ts)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	PendingCommand &Command = StartCommand(psSetTemp, GetTickCount64());
+
+	Command.m_uiTemp = uiTemp;
+	Command.m_TempScale = ts;
+}
+
+
+void
+CCommandLatency::OnSetFilterConfigRequest(
+	const FilterConfigInfo &FilterConfig)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	PendingCommand &Command = StartCommand(psSetFilterConfig, GetTickCount64());
+
+	Command.m_FilterConfig = FilterConfig;
+}
+
+
+void
+CCommandLatency::ProcessStatusMessage(
+	const StatusMessage &Status)
+{
+	ULONGLONG ullNow = GetTickCount64();
+
+	lock_guard<mutex> lg(m_mutex);
+
+	ExpireCommands(ullNow);
+
+	for (UINT i = psPump1; i <= psTempRange; i++)
+	{
+		PendingSlot Slot = (PendingSlot)i;
+
+		if (m_Pending[Slot].m_fPending && (GetToggleState(Slot, Status) != m_Pending[Slot].m_uiBefore))
+		{
+			CompleteCommand(Slot, ullNow);
+		}
+	}
+
+	if (m_Pending[psSetTemp].m_fPending &&
+		(Status.m_SetPointTemp == m_Pending[psSetTemp].m_uiTemp) &&
+		(Status.m_TempScale == m_Pending[psSetTemp].m_TempScale))
+	{
+		CompleteCommand(psSetTemp, ullNow);
+	}
+
+	m_LatestStatus = Status;
+	m_fHaveStatus = TRUE;
+}
+
+
+void
+CCommandLatency::ProcessFilterConfigResponse(
+	const FilterConfigResponseMessage &FilterConfig)
+{
+	ULONGLONG ullNow = GetTickCount64();
+
+	lock_guard<mutex> lg(m_mutex);
+
+	ExpireCommands(ullNow);
+
+	if (m_Pending[psSetFilterConfig].m_fPending &&
+		IsSameFilterConfig(m_Pending[psSetFilterConfig].m_FilterConfig, FilterConfig))
+	{
+		CompleteCommand(psSetFilterConfig, ullNow);
+	}
+}
+
+
+//  Toggles aren't timed again until there's a status from the new
+//  connection to compare against.
+void
+CCommandLatency::OnFatalError(void)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	for (UINT i = 0; i < psSlotCount; i++)
+	{
+		if (m_Pending[i].m_fPending)
+		{
+			m_Histograms[GetCommandType((PendingSlot)i)].m_cAbandoned++;
+			m_Pending[i].m_fPending = FALSE;
+		}
+	}
+
+	m_fHaveStatus = FALSE;
+}
+
+
+void
+CCommandLatency::GetHistogram(
+	SpaCommandType Type,
+	CommandLatencyHistogram &Histogram) const
+{
+	_ASSERT(Type < sctCommandTypeCount);
+
+	lock_guard<mutex> lg(m_mutex);
+
+	Histogram = m_Histograms[Type];
+}
+
+
+UINT
+CCommandLatency::GetPendingCount(void) const
+{
+	lock_guard<mutex> lg(m_mutex);
+	UINT cPending = 0;
+
+	for (UINT i = 0; i < psSlotCount; i++)
+	{
+		if (m_Pending[i].m_fPending)
+		{
+			cPending++;
+		}
+	}
+
+	return cPending;
+}
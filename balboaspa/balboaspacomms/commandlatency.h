@@ -0,0 +1,135 @@
+#pragma once
+
+//  Measures how long the spa takes to act on commands: the time from
+//  sending a toggle, set temp or set filter config request until the first
+//  status (or, for filters, filter config response) showing its effect.
+//  See CSpaComms::AttachLatencyTracker(), which feeds it both the commands
+//  sent and the messages received.
+//
+//  A toggle takes effect when the item toggled changes from what the last
+//  status before it showed; set temp when the set point and scale match
+//  what was asked for (so asking for the set point it already has times
+//  just the wait for the next status); set filter config when a filter
+//  config response matches.  The spa only sends filter config when asked,
+//  so whoever sets it should follow up with SendFilterConfigRequest() until
+//  it shows.
+//
+//  Only one of each command (each toggle item, set temp, set filter config)
+//  is timed at a time; sending another before the first takes effect drops
+//  the first.  Toggles sent before the first status aren't timed.  Times
+//  are from GetTickCount64(), so are good to about 16ms; the spa only sends
+//  a status every second or so anyway.
+
+enum SpaCommandType
+{
+	sctToggle,
+	sctSetTemp,
+	sctSetFilterConfig,
+
+	sctCommandTypeCount
+};
+
+
+//  Bucket n counts latencies under GetLatencyBucketLimitMs(n), from 32ms
+//  doubling up to 32s; the last bucket counts anything longer.
+const UINT cLatencyBuckets = 12;
+
+ULONGLONG GetLatencyBucketLimitMs(UINT uiBucket);
+
+
+struct CommandLatencyHistogram
+{
+	UINT64 m_cSent;
+	UINT64 m_cCompleted;				//  In the buckets
+	UINT64 m_cTimedOut;					//  No effect seen in time
+	UINT64 m_cSuperseded;				//  Sent again before taking effect
+	UINT64 m_cAbandoned;				//  The connection failed first
+
+	UINT64 m_cBuckets[cLatencyBuckets];
+	ULONGLONG m_ullMinMs;
+	ULONGLONG m_ullMaxMs;
+	ULONGLONG m_ullTotalMs;
+
+	//  Upper limit of the bucket that the given fraction (e.g. 0.99) of
+	//  completed commands fall in, capped at the maximum.  0 if none have
+	//  completed.
+	ULONGLONG GetPercentileMs(double dFraction) const;
+	double GetMeanMs(void) const;
+};
+
+
+class CCommandLatency :
+	public IMonitorCallback
+{
+public:
+	//  A command not seen to take effect after dwTimeoutMs is given up on;
+	//  checked as messages arrive.
+	CCommandLatency(DWORD dwTimeoutMs = 30000);
+
+	//  From CSpaComms, just before each command is sent.
+	void OnToggleRequest(CSpaComms::ToggleSpaItem);
+	void OnSetTempRequest(UINT uiTemp, TempScale);
+	void OnSetFilterConfigRequest(const FilterConfigInfo &);
+
+	void GetHistogram(SpaCommandType, CommandLatencyHistogram &) const;
+
+	//  Commands still waiting to take effect.
+	UINT GetPendingCount(void) const;
+
+	void Clear(void);
+
+	//  IMonitorCallback, from the monitor thread.
+	void ProcessStatusMessage(const StatusMessage &);
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &);
+	void OnFatalError(void);
+
+	//  Its owner's to dispose of.
+	void Dispose(void) {};
+
+private:
+	//  One per toggle item, then set temp and set filter config.
+	enum PendingSlot
+	{
+		psPump1,
+		psPump2,
+		psLights,
+		psHeatMode,
+		psTempRange,
+		psSetTemp,
+		psSetFilterConfig,
+
+		psSlotCount
+	};
+
+	struct PendingCommand
+	{
+		BOOL m_fPending;
+		ULONGLONG m_ullSent;
+
+		UINT m_uiBefore;					//  Toggles: the item's state when sent
+		UINT m_uiTemp;
+		TempScale m_TempScale;
+		FilterConfigInfo m_FilterConfig;
+	};
+
+	static SpaCommandType GetCommandType(PendingSlot);
+	static BOOL GetToggleSlot(CSpaComms::ToggleSpaItem, PendingSlot &);
+	static UINT GetToggleState(PendingSlot, const StatusInfo &);
+	static BOOL IsSameFilterConfig(const FilterConfigInfo &, const FilterConfigInfo &);
+
+	//  Caller holds m_mutex for all of these.
+	PendingCommand &StartCommand(PendingSlot, ULONGLONG ullNow);
+	void CompleteCommand(PendingSlot, ULONGLONG ullNow);
+	void ExpireCommands(ULONGLONG ullNow);
+
+	DWORD m_dwTimeoutMs;
+
+	mutable std::mutex m_mutex;
+	BOOL m_fHaveStatus;
+	StatusInfo m_LatestStatus;
+	PendingCommand m_Pending[psSlotCount];
+	CommandLatencyHistogram m_Histograms[sctCommandTypeCount];
+
+	//  Disallowed operations.
+	const CCommandLatency & operator=(const CCommandLatency &) { return *this; };
+};
@@ -0,0 +1,560 @@
+#include "stdafx.h"
+#include "CompletionPort.h"
+
+#pragma comment(lib, "Ws2_32.lib")
+
+//  Completion keys for requests posted to the port thread; sockets are
+//  associated with their Connection as the key.
+const ULONG_PTR ckShutDown = 1;
+const ULONG_PTR ckAdd = 2;
+const ULONG_PTR ckRemove = 3;
+const ULONG_PTR ckSend = 4;
+
+//  Completions taken off the port per call.
+const ULONG cMaxCompletions = 64;
+
+const DWORD dwLivenessCheckMs = 1000;
+
+//  A status is 31 bytes; room for a few at once after a stall.
+const size_t cbPortRecvBuffer = 256;
+
+
+struct CSpaCompletionPort::Connection
+{
+	Connection(SOCKET s, ISpaPortClient *pClient)
+		: m_Socket(s), m_pClient(pClient), m_fSkipOnSuccess(FALSE), m_cPending(0),
+		m_ullLastReceive(0), m_fSendInFlight(FALSE), m_fRemoving(FALSE),
+		m_fFailed(FALSE), m_fSendQueued(FALSE)
+	{
+		memset(&m_RecvOverlapped, 0, sizeof(m_RecvOverlapped));
+		memset(&m_SendOverlapped, 0, sizeof(m_SendOverlapped));
+		m_hRemoved = CreateEvent(NULL, TRUE, FALSE, NULL);
+	};
+
+	~Connection() { CloseHandle(m_hRemoved); };
+
+	SOCKET m_Socket;
+	ISpaPortClient *m_pClient;
+
+	//  Port thread only.
+	OVERLAPPED m_RecvOverlapped;
+	OVERLAPPED m_SendOverlapped;
+	BYTE m_RecvBuffer[cbPortRecvBuffer];
+	CByteArray m_Sending;
+	BOOL m_fSkipOnSuccess;
+	UINT m_cPending;							//  Overlapped operations outstanding
+	ULONGLONG m_ullLastReceive;
+	BOOL m_fSendInFlight;
+	BOOL m_fRemoving;
+
+	std::atomic<BOOL> m_fFailed;
+	HANDLE m_hRemoved;
+
+	//  Frames from Send(), not yet passed to WSASend().
+	std::mutex m_mutex;
+	CByteArray m_Outgoing;
+	BOOL m_fSendQueued;							//  On the port's send queue, or sending
+};
+
+
+CSpaCompletionPort::CSpaCompletionPort(
+	DWORD dwLivenessTimeoutMs)
+	: m_dwLivenessTimeoutMs(dwLivenessTimeoutMs), m_hPort(NULL), m_hPortThread(0),
+	m_ullNextLivenessCheck(0), m_fSendPosted(FALSE), m_cSystemCalls(0)
+{}
+
+CSpaCompletionPort::~CSpaCompletionPort()
+{
+	Stop();
+}
+
+
+BOOL
+CSpaCompletionPort::Start(void)
+{
+	if (m_hPort != NULL)
+	{
+		return FALSE;
+	}
+
+	m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+
+	if (m_hPort == NULL)
+	{
+		return FALSE;
+	}
+
+	m_hPortThread = (HANDLE)_beginthreadex(NULL, 0, CSpaCompletionPort::PortThreadProc, this, 0, NULL);
+
+	if (m_hPortThread == 0)
+	{
+		CloseHandle(m_hPort);
+		m_hPort = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CSpaCompletionPort::Stop(void)
+{
+	if (m_hPortThread != 0)
+	{
+		Post(ckShutDown, NULL);
+		WaitForSingleObject(m_hPortThread, INFINITE);
+		CloseHandle(m_hPortThread);
+		m_hPortThread = 0;
+	}
+
+	_ASSERT(m_Connections.empty());
+
+	if (m_hPort != NULL)
+	{
+		CloseHandle(m_hPort);
+		m_hPort = NULL;
+	}
+}
+
+
+BOOL
+CSpaCompletionPort::Post(
+	ULONG_PTR ulKey,
+	Connection *pConnection)
+{
+	m_cSystemCalls.fetch_add(1, std::memory_order_relaxed);
+
+	return PostQueuedCompletionStatus(m_hPort, 0, ulKey, (LPOVERLAPPED)pConnection);
+}
+
+
+CSpaCompletionPort::Connection *
+CSpaCompletionPort::Add(
+	SOCKET SpaSocket,
+	ISpaPortClient *pClient)
+{
+	if (m_hPort == NULL)
+	{
+		return NULL;
+	}
+
+	std::unique_ptr<Connection> pConnection = std::make_unique<Connection>(SpaSocket, pClient);
+
+	if (CreateIoCompletionPort((HANDLE)SpaSocket, m_hPort, (ULONG_PTR)pConnection.get(), 0) == NULL)
+	{
+		_RPTWN(_CRT_WARN, L"Unable to add socket to completion port: %d\n", GetLastError());
+		return NULL;
+	}
+
+	//  Not available with some layered providers; then every receive goes
+	//  through the port.
+	pConnection->m_fSkipOnSuccess =
+		SetFileCompletionNotificationModes((HANDLE)SpaSocket, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS);
+
+	if (!Post(ckAdd, pConnection.get()))
+	{
+		//  The socket stays associated with the port, but nothing is posted
+		//  on it, so nothing will be queued for the Connection.
+		return NULL;
+	}
+
+	return pConnection.release();
+}
+
+
+void
+CSpaCompletionPort::Remove(
+	Connection *pConnection)
+{
+	if (pConnection == NULL)
+	{
+		return;
+	}
+
+	if (Post(ckRemove, pConnection))
+	{
+		WaitForSingleObject(pConnection->m_hRemoved, INFINITE);
+	}
+
+	delete pConnection;
+}
+
+
+BOOL
+CSpaCompletionPort::Send(
+	Connection *pConnection,
+	const CByteArray &Message)
+{
+	if (pConnection->m_fFailed)
+	{
+		return FALSE;
+	}
+
+	{
+		std::lock_guard<std::mutex> lg(pConnection->m_mutex);
+
+		pConnection->m_Outgoing.insert(pConnection->m_Outgoing.end(), Message.begin(), Message.end());
+
+		if (pConnection->m_fSendQueued)
+		{
+			//  Goes out with what's already waiting.
+			return TRUE;
+		}
+
+		pConnection->m_fSendQueued = TRUE;
+	}
+
+	std::lock_guard<std::mutex> lg(m_mutex);
+
+	m_SendQueue.push_back(pConnection);
+
+	if (!m_fSendPosted)
+	{
+		m_fSendPosted = Post(ckSend, NULL);
+	}
+
+	return TRUE;
+}
+
+
+unsigned int __stdcall
+CSpaCompletionPort::PortThreadProc(
+	void *pParam)
+{
+	return ((CSpaCompletionPort *)pParam)->PortThreadProc();
+}
+
+
+unsigned int
+CSpaCompletionPort::PortThreadProc(void)
+{
+	OVERLAPPED_ENTRY Entries[cMaxCompletions];
+
+	m_ullNextLivenessCheck = GetTickCount64() + dwLivenessCheckMs;
+
+	for (;;)
+	{
+		ULONG cEntries = 0;
+
+		m_cSystemCalls.fetch_add(1, std::memory_order_relaxed);
+
+		if (!GetQueuedCompletionStatusEx(m_hPort, Entries, cMaxCompletions, &cEntries, dwLivenessCheckMs, FALSE))
+		{
+			if (GetLastError() != WAIT_TIMEOUT)
+			{
+				_RPTWN(_CRT_WARN, L"GetQueuedCompletionStatusEx failed: %d\n", GetLastError());
+			}
+
+			cEntries = 0;
+		}
+
+		for (ULONG i = 0; i < cEntries; i++)
+		{
+			const OVERLAPPED_ENTRY &Entry = Entries[i];
+			Connection *pConnection = (Connection *)Entry.lpOverlapped;
+
+			switch (Entry.lpCompletionKey)
+			{
+			case ckShutDown:
+				return 0;
+
+			case ckAdd:
+				OnAdd(pConnection);
+				break;
+
+			case ckRemove:
+				OnRemove(pConnection);
+				break;
+
+			case ckSend:
+				OnSendQueued();
+				break;
+
+			default:
+				//  A socket operation; Internal holds its status.
+				pConnection = (Connection *)Entry.lpCompletionKey;
+
+				if (Entry.lpOverlapped == &pConnection->m_RecvOverlapped)
+				{
+					OnReceiveComplete(pConnection, (Entry.lpOverlapped->Internal == 0), Entry.dwNumberOfBytesTransferred);
+				}
+				else
+				{
+					OnSendComplete(pConnection, (Entry.lpOverlapped->Internal == 0));
+				}
+			}
+		}
+
+		if (GetTickCount64() >= m_ullNextLivenessCheck)
+		{
+			CheckLiveness();
+			m_ullNextLivenessCheck = GetTickCount64() + dwLivenessCheckMs;
+		}
+	}
+}
+
+
+void
+CSpaCompletionPort::OnAdd(
+	Connection *pConnection)
+{
+	m_Connections.push_back(pConnection);
+	pConnection->m_ullLastReceive = GetTickCount64();
+
+	PostReceive(pConnection);
+}
+
+
+void
+CSpaCompletionPort::OnRemove(
+	Connection *pConnection)
+{
+	pConnection->m_fRemoving = TRUE;
+	pConnection->m_fFailed = TRUE;
+
+	if (pConnection->m_cPending == 0)
+	{
+		FinishRemove(pConnection);
+	}
+	else
+	{
+		//  Finished when the last of them comes back aborted.
+		CancelIoEx((HANDLE)pConnection->m_Socket, NULL);
+	}
+}
+
+
+void
+CSpaCompletionPort::FinishRemove(
+	Connection *pConnection)
+{
+	auto pEntry = std::find(m_Connections.begin(), m_Connections.end(), pConnection);
+
+	if (pEntry != m_Connections.end())
+	{
+		*pEntry = m_Connections.back();
+		m_Connections.pop_back();
+	}
+
+	{
+		//  May still be on the send queue; don't let it be found there.
+		std::lock_guard<std::mutex> lg(m_mutex);
+
+		m_SendQueue.erase(std::remove(m_SendQueue.begin(), m_SendQueue.end(), pConnection), m_SendQueue.end());
+	}
+
+	SetEvent(pConnection->m_hRemoved);
+}
+
+
+void
+CSpaCompletionPort::Fail(
+	Connection *pConnection)
+{
+	if (!pConnection->m_fFailed.exchange(TRUE))
+	{
+		pConnection->m_pClient->OnSpaFailed();
+	}
+}
+
+
+//  Keeps a receive outstanding, handling any that complete straight away.
+void
+CSpaCompletionPort::PostReceive(
+	Connection *pConnection)
+{
+	while (!pConnection->m_fFailed)
+	{
+		WSABUF Buffer;
+		DWORD cbReceived = 0;
+		DWORD dwFlags = 0;
+
+		Buffer.buf = (char *)pConnection->m_RecvBuffer;
+		Buffer.len = sizeof(pConnection->m_RecvBuffer);
+
+		m_cSystemCalls.fetch_add(1, std::memory_order_relaxed);
+
+		if (WSARecv(pConnection->m_Socket, &Buffer, 1, &cbReceived, &dwFlags, &pConnection->m_RecvOverlapped, NULL) == 0)
+		{
+			if (!pConnection->m_fSkipOnSuccess)
+			{
+				//  The completion is queued anyway.
+				pConnection->m_cPending++;
+				return;
+			}
+
+			if (cbReceived == 0)
+			{
+				//  Closed by the spa.
+				Fail(pConnection);
+				return;
+			}
+
+			pConnection->m_ullLastReceive = GetTickCount64();
+			pConnection->m_pClient->OnSpaData(pConnection->m_RecvBuffer, cbReceived);
+		}
+		else if (WSAGetLastError() == WSA_IO_PENDING)
+		{
+			pConnection->m_cPending++;
+			return;
+		}
+		else
+		{
+			Fail(pConnection);
+			return;
+		}
+	}
+}
+
+
+void
+CSpaCompletionPort::OnReceiveComplete(
+	Connection *pConnection,
+	BOOL fSuccess,
+	DWORD cbReceived)
+{
+	pConnection->m_cPending--;
+
+	if (pConnection->m_fRemoving)
+	{
+		if (pConnection->m_cPending == 0)
+		{
+			FinishRemove(pConnection);
+		}
+		return;
+	}
+
+	if (pConnection->m_fFailed)
+	{
+		//  Cancelled by CheckLiveness().
+		return;
+	}
+
+	if (!fSuccess || (cbReceived == 0))
+	{
+		Fail(pConnection);
+		return;
+	}
+
+	pConnection->m_ullLastReceive = GetTickCount64();
+	pConnection->m_pClient->OnSpaData(pConnection->m_RecvBuffer, cbReceived);
+
+	PostReceive(pConnection);
+}
+
+
+void
+CSpaCompletionPort::OnSendQueued(void)
+{
+	std::vector<Connection *> SendQueue;
+
+	{
+		std::lock_guard<std::mutex> lg(m_mutex);
+
+		SendQueue.swap(m_SendQueue);
+		m_fSendPosted = FALSE;
+	}
+
+	for (auto pConnection = SendQueue.begin(); pConnection != SendQueue.end(); pConnection++)
+	{
+		StartSend(*pConnection);
+	}
+}
+
+
+//  Everything queued for the spa in one WSASend().
+void
+CSpaCompletionPort::StartSend(
+	Connection *pConnection)
+{
+	while (!pConnection->m_fSendInFlight && !pConnection->m_fRemoving)
+	{
+		{
+			std::lock_guard<std::mutex> lg(pConnection->m_mutex);
+
+			pConnection->m_Sending.clear();
+			pConnection->m_Sending.swap(pConnection->m_Outgoing);
+
+			if (pConnection->m_Sending.empty() || pConnection->m_fFailed)
+			{
+				pConnection->m_Outgoing.clear();
+				pConnection->m_fSendQueued = FALSE;
+				return;
+			}
+		}
+
+		WSABUF Buffer;
+		DWORD cbSent = 0;
+
+		Buffer.buf = (char *)&pConnection->m_Sending[0];
+		Buffer.len = (ULONG)pConnection->m_Sending.size();
+
+		m_cSystemCalls.fetch_add(1, std::memory_order_relaxed);
+
+		if (WSASend(pConnection->m_Socket, &Buffer, 1, &cbSent, 0, &pConnection->m_SendOverlapped, NULL) == 0)
+		{
+			if (!pConnection->m_fSkipOnSuccess)
+			{
+				pConnection->m_fSendInFlight = TRUE;
+				pConnection->m_cPending++;
+			}
+
+			//  Otherwise done already; see if more has been queued.
+		}
+		else if (WSAGetLastError() == WSA_IO_PENDING)
+		{
+			pConnection->m_fSendInFlight = TRUE;
+			pConnection->m_cPending++;
+		}
+		else
+		{
+			Fail(pConnection);
+		}
+	}
+}
+
+
+void
+CSpaCompletionPort::OnSendComplete(
+	Connection *pConnection,
+	BOOL fSuccess)
+{
+	pConnection->m_cPending--;
+	pConnection->m_fSendInFlight = FALSE;
+
+	if (pConnection->m_fRemoving)
+	{
+		if (pConnection->m_cPending == 0)
+		{
+			FinishRemove(pConnection);
+		}
+		return;
+	}
+
+	if (!fSuccess)
+	{
+		Fail(pConnection);
+	}
+
+	StartSend(pConnection);
+}
+
+
+//  The port's equivalent of the threaded monitor's select() timeouts.
+void
+CSpaCompletionPort::CheckLiveness(void)
+{
+	ULONGLONG ullNow = GetTickCount64();
+
+	for (auto ppConnection = m_Connections.begin(); ppConnection != m_Connections.end(); ppConnection++)
+	{
+		Connection *pConnection = *ppConnection;
+
+		if (!pConnection->m_fFailed && (ullNow - pConnection->m_ullLastReceive >= m_dwLivenessTimeoutMs))
+		{
+			Fail(pConnection);
+			CancelIoEx((HANDLE)pConnection->m_Socket, &pConnection->m_RecvOverlapped);
+		}
+	}
+}
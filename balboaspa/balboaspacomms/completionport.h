@@ -0,0 +1,93 @@
+#pragma once
+
+//  Monitors any number of spas from one thread.  A CSpaComms started with
+//  StartMonitor(SOCKET, CSpaCompletionPort *) keeps an overlapped receive
+//  posted on the port instead of a thread of its own sitting in select(),
+//  and the port thread takes completions off in batches.  Receives that can
+//  complete straight away do so without a completion packet, so a busy
+//  fleet costs about one system call per frame received, rather than the
+//  select() and recv() per frame of the threaded monitor.
+//
+//  Frames sent with the Send*Request() methods are queued; everything
+//  queued for a spa goes out in a single WSASend() the next time the port
+//  thread runs.
+//
+//  A spa that sends nothing for the liveness timeout is failed, the same as
+//  the threaded monitor does after 5 one second timeouts.
+
+class ISpaPortClient
+{
+public:
+	//  Both on the port thread, never at the same time for one connection.
+	virtual void OnSpaData(const BYTE *, size_t) = 0;
+
+	//  The connection dropped or went quiet; nothing more will be received.
+	virtual void OnSpaFailed(void) = 0;
+};
+
+
+class CSpaCompletionPort
+{
+public:
+	CSpaCompletionPort(DWORD dwLivenessTimeoutMs = 5000);
+	~CSpaCompletionPort();
+
+	BOOL Start(void);
+
+	//  Remove() every connection first.
+	void Stop(void);
+
+	struct Connection;
+
+	//  Starts receiving on a connected socket.  The socket is still the
+	//  caller's to close, but only after Remove().
+	Connection *Add(SOCKET, ISpaPortClient *);
+
+	//  Once this returns the client won't be called again.  Not to be called
+	//  from the port thread, i.e. from inside an ISpaPortClient method.
+	void Remove(Connection *);
+
+	//  Queues a frame to be sent.  FALSE once the connection has failed.
+	BOOL Send(Connection *, const CByteArray &);
+
+	//  Completion port and socket calls on the data path so far, for
+	//  comparison with CSpaComms::GetSystemCallCount().
+	UINT64 GetSystemCallCount(void) const { return m_cSystemCalls.load(std::memory_order_relaxed); };
+
+private:
+	static unsigned int __stdcall PortThreadProc(void *);
+	unsigned int PortThreadProc(void);
+
+	void OnAdd(Connection *);
+	void OnRemove(Connection *);
+	void OnSendQueued(void);
+	void OnReceiveComplete(Connection *, BOOL fSuccess, DWORD cbReceived);
+	void OnSendComplete(Connection *, BOOL fSuccess);
+
+	void PostReceive(Connection *);
+	void StartSend(Connection *);
+	void Fail(Connection *);
+	void FinishRemove(Connection *);
+	void CheckLiveness(void);
+
+	BOOL Post(ULONG_PTR ulKey, Connection *);
+
+	DWORD m_dwLivenessTimeoutMs;
+	HANDLE m_hPort;
+	HANDLE m_hPortThread;
+
+	//  Port thread only.
+	std::vector<Connection *> m_Connections;
+	ULONGLONG m_ullNextLivenessCheck;
+
+	//  Connections with frames to send, and whether the port thread has
+	//  already been woken to send them.
+	std::mutex m_mutex;
+	std::vector<Connection *> m_SendQueue;
+	BOOL m_fSendPosted;
+
+	std::atomic<UINT64> m_cSystemCalls;
+
+	//  Disallowed operations.
+	const CSpaCompletionPort & operator=(const CSpaCompletionPort &) { return *this; };
+};
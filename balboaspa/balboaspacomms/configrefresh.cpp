@@ -0,0 +1,379 @@
+#include "stdafx.h"
+#include "Discovery.h"
+#include "MonitorCallback.h"
+#include "ObserverList.h"
+#include "SpaComms.h"
+#include "ConfigRefresh.h"
+
+using std::mutex;
+using std::lock_guard;
+
+
+const UINT cMinutesPerDay = 24 * 60;
+
+
+CConfigRefresh::CConfigRefresh(
+	CSpaComms *pSpa,
+	DWORD dwBackgroundMs,
+	ConfigRefreshClock pClock)
+	: m_pSpa(pSpa), m_dwBackgroundMs(dwBackgroundMs), m_pClock(pClock), m_fStarted(FALSE),
+	m_fHaveStatus(FALSE), m_ullLastStatus(0), m_ullNextBackground(0), m_uiNextBackground(0),
+	m_dwConfigurationSignature(0)
+{
+	memset(m_State, 0, sizeof(m_State));
+	memset(&m_LastStatus, 0, sizeof(m_LastStatus));
+	memset(&m_FilterConfig, 0, sizeof(m_FilterConfig));
+	memset(&m_Stats, 0, sizeof(m_Stats));
+}
+
+CConfigRefresh::~CConfigRefresh()
+{
+	Stop();
+}
+
+
+BOOL
+CConfigRefresh::Start(void)
+{
+	if (m_fStarted)
+	{
+		return FALSE;
+	}
+
+	m_fStarted = m_pSpa->Subscribe(this, smmStatus | smmConfigResponse | smmFilterConfigResponse |
+								   smmVersionInfoResponse | smmControlConfig2Response);
+
+	return m_fStarted;
+}
+
+
+void
+CConfigRefresh::Stop(void)
+{
+	if (m_fStarted)
+	{
+		m_pSpa->Unsubscribe(this);
+		m_fStarted = FALSE;
+	}
+}
+
+
+void
+CConfigRefresh::Invalidate(
+	SpaConfigItem Item)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	SetStale(Item);
+}
+
+
+BOOL
+CConfigRefresh::GetConfigurationSignature(
+	DWORD &dwSignature) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	dwSignature = m_dwConfigurationSignature;
+
+	return m_State[sciVersionInfo].m_fHave;
+}
+
+
+BOOL
+CConfigRefresh::GetFilterConfig(
+	FilterConfigInfo &FilterConfig) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	FilterConfig = m_FilterConfig;
+
+	return m_State[sciFilterConfig].m_fHave;
+}
+
+
+void
+CConfigRefresh::GetStats(
+	ConfigRefreshStats &Stats) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	Stats = m_Stats;
+}
+
+
+//  Requests are sent once the lock is dropped, so a slow send doesn't hold
+//  up GetFilterConfig() and friends.
+void
+CConfigRefresh::ProcessStatusMessage(
+	const StatusMessage &Message)
+{
+	BOOL fSend[sciConfigItemCount];
+
+	{
+		lock_guard<mutex> lg(m_mutex);
+		ULONGLONG ullNow = m_pClock();
+
+		m_Stats.m_cStatuses++;
+
+		CheckStatus(Message, ullNow);
+
+		m_LastStatus = Message;
+		m_ullLastStatus = ullNow;
+		m_fHaveStatus = TRUE;
+
+		if (m_ullNextBackground == 0)
+		{
+			m_ullNextBackground = ullNow + m_dwBackgroundMs;
+		}
+		else if (ullNow >= m_ullNextBackground)
+		{
+			SetStale((SpaConfigItem)m_uiNextBackground);
+
+			m_uiNextBackground = (m_uiNextBackground + 1) % sciConfigItemCount;
+			m_ullNextBackground = ullNow + m_dwBackgroundMs;
+		}
+
+		for (UINT i = 0; i < sciConfigItemCount; i++)
+		{
+			ConfigState &State = m_State[i];
+
+			fSend[i] = State.m_fStale &&
+				((State.m_ullRequested == 0) || (ullNow - State.m_ullRequested >= dwConfigRequestTimeoutMs));
+
+			if (fSend[i])
+			{
+				State.m_ullRequested = ullNow;
+				m_Stats.m_cRequests[i]++;
+			}
+		}
+	}
+
+	//  In order; the spa wants a config request before a filter config one.
+	for (UINT i = 0; i < sciConfigItemCount; i++)
+	{
+		if (fSend[i])
+		{
+			SendRequest((SpaConfigItem)i);
+		}
+	}
+}
+
+
+void
+CConfigRefresh::ProcessConfigResponse(
+	const ConfigResponseMessage &)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	OnResponse(sciConfig);
+}
+
+
+//  Also sent, unasked for, when another client asks for it.
+void
+CConfigRefresh::ProcessFilterConfigResponse(
+	const FilterConfigResponseMessage &Message)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	m_FilterConfig = Message;
+	OnResponse(sciFilterConfig);
+}
+
+
+void
+CConfigRefresh::ProcessVersionInfoResponse(
+	const VersionInfoResponseMessage &Message)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	if (m_State[sciVersionInfo].m_fHave && (Message.ConfigurationSignature != m_dwConfigurationSignature))
+	{
+		SetStale(sciConfig);
+		SetStale(sciFilterConfig);
+		SetStale(sciControlConfig2);
+		m_Stats.m_cSignatureChanges++;
+	}
+
+	m_dwConfigurationSignature = Message.ConfigurationSignature;
+	OnResponse(sciVersionInfo);
+}
+
+
+void
+CConfigRefresh::ProcessControlConfig2Response(
+	const ControlConfig2ResponseMessage &)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	OnResponse(sciControlConfig2);
+}
+
+
+//  Requests in flight are lost with the connection, and the spa may have
+//  restarted, so ask for everything again once it's back; what's cached is
+//  kept to compare against.
+void
+CConfigRefresh::OnFatalError(void)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	for (UINT i = 0; i < sciConfigItemCount; i++)
+	{
+		SetStale((SpaConfigItem)i);
+		m_State[i].m_ullRequested = 0;
+	}
+
+	m_fHaveStatus = FALSE;
+}
+
+
+UINT
+CConfigRefresh::GetMinutes(
+	const SpaTime &Time)
+{
+	return (Time.m_Hour * 60 + Time.m_Minute) % cMinutesPerDay;
+}
+
+
+//  Within a minute, either way, across midnight.
+BOOL
+CConfigRefresh::IsNear(
+	UINT uiMinutes,
+	UINT uiOther)
+{
+	UINT uiDistance = (uiMinutes + cMinutesPerDay - uiOther) % cMinutesPerDay;
+
+	return (uiDistance <= 1) || (uiDistance >= cMinutesPerDay - 1);
+}
+
+
+void
+CConfigRefresh::CheckStatus(
+	const StatusInfo &Status,
+	ULONGLONG ullNow)
+{
+	if (!m_fHaveStatus)
+	{
+		for (UINT i = 0; i < sciConfigItemCount; i++)
+		{
+			if (!m_State[i].m_fHave)
+			{
+				SetStale((SpaConfigItem)i);
+			}
+		}
+
+		return;
+	}
+
+	if (m_LastStatus.m_fPriming && !Status.m_fPriming)
+	{
+		for (UINT i = 0; i < sciConfigItemCount; i++)
+		{
+			SetStale((SpaConfigItem)i);
+		}
+
+		return;
+	}
+
+	//  The clock moving on further than the time since the last status
+	//  allows, or back at all, was someone setting it.
+	UINT uiElapsedMinutes = (UINT)((ullNow - m_ullLastStatus) / 60000) + 1;
+	UINT uiClockMinutes = (GetMinutes(Status.m_Time) + cMinutesPerDay - GetMinutes(m_LastStatus.m_Time)) % cMinutesPerDay;
+
+	if ((uiClockMinutes > uiElapsedMinutes) ||
+		(Status.m_TempScale != m_LastStatus.m_TempScale) ||
+		(Status.m_f24Time != m_LastStatus.m_f24Time))
+	{
+		SetStale(sciFilterConfig);
+		SetStale(sciControlConfig2);
+	}
+
+	if ((Status.m_fCircPumpRunning != m_LastStatus.m_fCircPumpRunning) &&
+		(Status.m_fHeating == m_LastStatus.m_fHeating) &&
+		!IsNearFilterCycleEdge(Status.m_Time))
+	{
+		SetStale(sciFilterConfig);
+	}
+}
+
+
+BOOL
+CConfigRefresh::IsNearFilterCycleEdge(
+	const SpaTime &Time) const
+{
+	if (!m_State[sciFilterConfig].m_fHave)
+	{
+		return TRUE;
+	}
+
+	UINT uiNow = GetMinutes(Time);
+	UINT uiStart = GetMinutes(m_FilterConfig.m_Filter1StartTime);
+
+	if (IsNear(uiNow, uiStart) || IsNear(uiNow, (uiStart + m_FilterConfig.m_uiFilter1Duration) % cMinutesPerDay))
+	{
+		return TRUE;
+	}
+
+	if (m_FilterConfig.m_fFilter2Enabled)
+	{
+		uiStart = GetMinutes(m_FilterConfig.m_Filter2StartTime);
+
+		if (IsNear(uiNow, uiStart) || IsNear(uiNow, (uiStart + m_FilterConfig.m_uiFilter2Duration) % cMinutesPerDay))
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+void
+CConfigRefresh::SetStale(
+	SpaConfigItem Item)
+{
+	_ASSERT(Item < sciConfigItemCount);
+
+	m_State[Item].m_fStale = TRUE;
+}
+
+
+void
+CConfigRefresh::OnResponse(
+	SpaConfigItem Item)
+{
+	ConfigState &State = m_State[Item];
+
+	State.m_fHave = TRUE;
+	State.m_fStale = FALSE;
+	State.m_ullRequested = 0;
+
+	m_Stats.m_cResponses[Item]++;
+}
+
+
+BOOL
+CConfigRefresh::SendRequest(
+	SpaConfigItem Item)
+{
+	switch (Item)
+	{
+	case sciConfig:
+		return m_pSpa->SendConfigRequest();
+
+	case sciFilterConfig:
+		return m_pSpa->SendFilterConfigRequest();
+
+	case sciVersionInfo:
+		return m_pSpa->SendVerInfoRequest();
+
+	case sciControlConfig2:
+		return m_pSpa->SendControlConfig2Request();
+
+	default:
+		_ASSERT(FALSE);
+		return FALSE;
+	}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+//  Keeps a spa's configuration (config, filter config, version info and
+//  control config 2) up to date without asking for all of it on every
+//  status.  Each is asked for once to start with, and then only when a
+//  status suggests it may have changed:
+//
+//  -	The spa coming out of priming (it restarted): all of them.
+//  -	The clock being set, or the temp scale or 12/24 hour display changed
+//		(someone was in the settings): filter config and control config 2.
+//  -	The circ pump starting or stopping away from the start or end of a
+//		filter cycle, as last known (and not because heating did):
+//		filter config.
+//  -	A version info response with a different ConfigurationSignature
+//		than before (the setup changed): config, filter config and control
+//		config 2.
+//
+//  On top of that, one of them in turn is asked for every dwBackgroundMs,
+//  to catch anything the above miss.  A request not answered within
+//  dwConfigRequestTimeoutMs is sent again.
+//
+//  Everything is done as statuses arrive, so the requests are sent from
+//  the thread delivering them.  Subscribe with Start(); the spa must be
+//  decoding status and all four responses.
+
+enum SpaConfigItem
+{
+	sciConfig,
+	sciFilterConfig,
+	sciVersionInfo,
+	sciControlConfig2,
+
+	sciConfigItemCount
+};
+
+const DWORD dwConfigRequestTimeoutMs = 10000;
+
+//  Milliseconds, as from GetTickCount64().
+typedef ULONGLONG (WINAPI *ConfigRefreshClock)(void);
+
+
+struct ConfigRefreshStats
+{
+	UINT64 m_cStatuses;
+	UINT64 m_cRequests[sciConfigItemCount];
+	UINT64 m_cResponses[sciConfigItemCount];
+	UINT64 m_cSignatureChanges;
+};
+
+
+class CConfigRefresh :
+	public IMonitorCallback
+{
+public:
+	CConfigRefresh(CSpaComms *, DWORD dwBackgroundMs = 5 * 60 * 1000, ConfigRefreshClock = GetTickCount64);
+	~CConfigRefresh();
+
+	//  Subscribes to the spa; the first status asks for everything.
+	BOOL Start(void);
+	void Stop(void);
+
+	//  Ask for it again with the next status, e.g. after changing it.
+	void Invalidate(SpaConfigItem);
+
+	//  FALSE until the spa has sent it.
+	BOOL GetConfigurationSignature(DWORD &) const;
+	BOOL GetFilterConfig(FilterConfigInfo &) const;
+
+	void GetStats(ConfigRefreshStats &) const;
+
+	//  IMonitorCallback, from the thread delivering the spa's messages.
+	void ProcessStatusMessage(const StatusMessage &);
+	void ProcessConfigResponse(const ConfigResponseMessage &);
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &);
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &);
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &);
+	void OnFatalError(void);
+
+	//  Its owner's to dispose of.
+	void Dispose(void) {};
+
+private:
+	struct ConfigState
+	{
+		BOOL m_fHave;
+		BOOL m_fStale;
+		ULONGLONG m_ullRequested;				//  0 if no request outstanding
+	};
+
+	static UINT GetMinutes(const SpaTime &);
+	static BOOL IsNear(UINT uiMinutes, UINT uiOther);
+
+	//  Caller holds m_mutex for all of these.
+	void CheckStatus(const StatusInfo &, ULONGLONG ullNow);
+	BOOL IsNearFilterCycleEdge(const SpaTime &) const;
+	void SetStale(SpaConfigItem);
+	void OnResponse(SpaConfigItem);
+
+	BOOL SendRequest(SpaConfigItem);
+
+	CSpaComms *m_pSpa;
+	DWORD m_dwBackgroundMs;
+	ConfigRefreshClock m_pClock;
+	BOOL m_fStarted;
+
+	mutable std::mutex m_mutex;
+	ConfigState m_State[sciConfigItemCount];
+	BOOL m_fHaveStatus;
+	StatusInfo m_LastStatus;
+	ULONGLONG m_ullLastStatus;
+	ULONGLONG m_ullNextBackground;
+	UINT m_uiNextBackground;
+	DWORD m_dwConfigurationSignature;
+	FilterConfigInfo m_FilterConfig;
+	ConfigRefreshStats m_Stats;
+
+	//  Disallowed operations.
+	const CConfigRefresh & operator=(const CConfigRefresh &) { return *this; };
+};
@@ -3,6 +3,9 @@
 
 #include "Discovery.h"
 
+#include <iphlpapi.h>
+#pragma comment(lib, "Iphlpapi.lib")
+
 
 //  Spa listens on DiscoveryPort for a message.  Responds with "BWGSPA" and MAC address.
 //  Once you get the response, connect to port 4257 to control the spa.
@@ -11,6 +14,8 @@ const char *szDiscoveryMessage = "Discovery: Who is out there?";
 const char *szSignature = "BWGSPA         \r\n00-15-27-";
 const UINT uiMacOffset = 17;  //  Offset of mac address in string above.
 
+const u_short usConnectionPort = 4257;
+
 CSpaAddress::CSpaAddress(
 	const CSpaAddress &Source)
 {
@@ -31,27 +36,78 @@ BOOL CSpaAddress::operator==(const CSpaAddress &Other)
 		(m_SpaAddress.sin_port == Other.m_SpaAddress.sin_port);
 }
 
-BOOL DiscoverSpas(SpaAddressVector &Spas)
+UINT64
+HashMACAddress(
+	const string &strMACAddress)
 {
-	int iResult;
+	UINT64 uiHash = 14695981039346656037ULL;
 
-	Spas.clear();
+	for (auto pch = strMACAddress.cbegin(); pch != strMACAddress.cend(); pch++)
+	{
+		uiHash = (uiHash ^ (BYTE)toupper(*pch)) * 1099511628211ULL;
+	}
 
-	SOCKET ConnectSocket  = socket(AF_INET, SOCK_DGRAM,	IPPROTO_UDP);
+	return uiHash;
+}
 
-	if (ConnectSocket == INVALID_SOCKET)
+//  Checks for the spa's signature, and pulls out the MAC address.
+//  'pResponse' must be nul terminated.
+static BOOL
+ParseDiscoveryResponse(
+	const char *pResponse,
+	string &strMACAddress)
+{
+	if (strncmp(pResponse, szSignature, strlen(szSignature)) != 0)
+	{
+		_RPTWN(_CRT_WARN, L"Unexpected Response: %S", pResponse);
+		return FALSE;
+	}
+
+	size_t cchMACAddress = strlen(&pResponse[uiMacOffset]);
+
+	//  Strip the trailing CRLF.
+	strMACAddress.assign(&pResponse[uiMacOffset], (cchMACAddress >= 2) ? cchMACAddress - 2 : 0);
+
+	return TRUE;
+}
+
+
+static BOOL
+MakeBroadcastSocket(
+	SOCKET &BroadcastSocket)
+{
+	BroadcastSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (BroadcastSocket == INVALID_SOCKET)
 	{
 		_RPTWN(_CRT_WARN, L"Error at socket(): %ld\n", WSAGetLastError());
 		return FALSE;
 	}
 
 	DWORD fBroadcast = TRUE;
-	iResult = setsockopt(ConnectSocket, SOL_SOCKET, SO_BROADCAST, (const char *)&fBroadcast, sizeof(fBroadcast));
 
-	if (iResult == SOCKET_ERROR)
+	if (setsockopt(BroadcastSocket, SOL_SOCKET, SO_BROADCAST, (const char *)&fBroadcast, sizeof(fBroadcast)) == SOCKET_ERROR)
 	{
 		_RPTWN(_CRT_WARN, L"setsockopt failed with error: %d\n", WSAGetLastError());
-		closesocket(ConnectSocket);
+		closesocket(BroadcastSocket);
+		BroadcastSocket = INVALID_SOCKET;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+BOOL DiscoverSpas(SpaAddressVector &Spas)
+{
+	int iResult;
+
+	Spas.clear();
+
+	SOCKET ConnectSocket;
+
+	if (!MakeBroadcastSocket(ConnectSocket))
+	{
 		return FALSE;
 	}
 
@@ -115,14 +171,11 @@ BOOL DiscoverSpas(SpaAddressVector &Spas)
 				return FALSE;
 			}
 
-			if (strncmp(RecvBuffer, szSignature, strlen(szSignature)) != 0)
-			{
-				_RPTWN(_CRT_WARN, L"Unexpected Response: %S", RecvBuffer);
-			}
-			else
+			string strMACAddress;
+
+			if (ParseDiscoveryResponse(RecvBuffer, strMACAddress))
 			{
-				CSpaAddress NewSpa(saFrom, string(&RecvBuffer[uiMacOffset], 
-												  strlen(&RecvBuffer[uiMacOffset]) - 2));
+				CSpaAddress NewSpa(saFrom, strMACAddress);
 
 				Spas.push_back(NewSpa);
 			}
@@ -133,3 +186,659 @@ BOOL DiscoverSpas(SpaAddressVector &Spas)
 	return TRUE;
 }
 
+
+
+SpaConnectOptions::SpaConnectOptions()
+	: m_dwAttemptTimeoutMs(3000), m_cMaxPending(64)
+{}
+
+
+//  Starts a non-blocking connect to the spa's control port.
+static BOOL
+BeginConnect(
+	const CSpaAddress &Spa,
+	SOCKET &SpaSocket)
+{
+	SpaSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if (SpaSocket == INVALID_SOCKET)
+	{
+		return FALSE;
+	}
+
+	u_long ulNonBlocking = 1;
+	ioctlsocket(SpaSocket, FIONBIO, &ulNonBlocking);
+
+	sockaddr_in SpaAddressPort = Spa.m_SpaAddress;
+	SpaAddressPort.sin_port = htons(usConnectionPort);
+
+	if ((connect(SpaSocket, (const sockaddr *)&SpaAddressPort, sizeof(SpaAddressPort)) == 0) ||
+		(WSAGetLastError() == WSAEWOULDBLOCK))
+	{
+		return TRUE;
+	}
+
+	closesocket(SpaSocket);
+	SpaSocket = INVALID_SOCKET;
+
+	return FALSE;
+}
+
+
+UINT
+ConnectToSpas(
+	const SpaAddressVector &Spas,
+	ISpaConnectCallback *pCallback,
+	const SpaConnectOptions &Options)
+{
+	struct Attempt
+	{
+		size_t m_uiSpa;
+		SOCKET m_Socket;
+		ULONGLONG m_ullDeadline;
+	};
+
+	std::vector<Attempt> Pending;
+	size_t uiNextSpa = 0;
+	UINT cMaxPending = (std::min)((std::max)(Options.m_cMaxPending, 1u), (UINT)FD_SETSIZE);
+	UINT cConnected = 0;
+
+	while ((uiNextSpa < Spas.size()) || !Pending.empty())
+	{
+		//  Keep the window full.
+		while ((uiNextSpa < Spas.size()) && (Pending.size() < cMaxPending))
+		{
+			Attempt NewAttempt;
+
+			NewAttempt.m_uiSpa = uiNextSpa++;
+
+			if (BeginConnect(Spas[NewAttempt.m_uiSpa], NewAttempt.m_Socket))
+			{
+				NewAttempt.m_ullDeadline = GetTickCount64() + Options.m_dwAttemptTimeoutMs;
+				Pending.push_back(NewAttempt);
+			}
+			else
+			{
+				pCallback->OnSpaConnectFailed(NewAttempt.m_uiSpa);
+			}
+		}
+
+		if (Pending.empty())
+		{
+			continue;
+		}
+
+		fd_set fsConnected;
+		fd_set fsFailed;
+		ULONGLONG ullWake = Pending.front().m_ullDeadline;
+
+		FD_ZERO(&fsConnected);
+		FD_ZERO(&fsFailed);
+
+		for (auto pAttempt = Pending.cbegin(); pAttempt != Pending.cend(); pAttempt++)
+		{
+			FD_SET(pAttempt->m_Socket, &fsConnected);
+			FD_SET(pAttempt->m_Socket, &fsFailed);
+			ullWake = (std::min)(ullWake, pAttempt->m_ullDeadline);
+		}
+
+		ULONGLONG ullNow = GetTickCount64();
+		DWORD dwWait = (ullWake > ullNow) ? (DWORD)(ullWake - ullNow) : 0;
+		timeval tvTimeout;
+
+		tvTimeout.tv_sec = dwWait / 1000;
+		tvTimeout.tv_usec = (dwWait % 1000) * 1000;
+
+		//  Connected sockets become writable; failed ones show up in the
+		//  except set.
+		BOOL fSelectFailed = (select(0, NULL, &fsConnected, &fsFailed, &tvTimeout) == SOCKET_ERROR);
+
+		if (fSelectFailed)
+		{
+			_RPTWN(_CRT_WARN, L"select failed with error: %d\n", WSAGetLastError());
+		}
+
+		ullNow = GetTickCount64();
+
+		for (size_t i = Pending.size(); i-- > 0;)
+		{
+			Attempt &Attempt = Pending[i];
+
+			if (!fSelectFailed && FD_ISSET(Attempt.m_Socket, &fsConnected))
+			{
+				//  Back to blocking, which is what CSpaComms expects.
+				u_long ulNonBlocking = 0;
+				ioctlsocket(Attempt.m_Socket, FIONBIO, &ulNonBlocking);
+
+				cConnected++;
+
+				if (!pCallback->OnSpaConnected(Attempt.m_uiSpa, Attempt.m_Socket))
+				{
+					closesocket(Attempt.m_Socket);
+				}
+			}
+			else if (fSelectFailed || FD_ISSET(Attempt.m_Socket, &fsFailed) || (ullNow >= Attempt.m_ullDeadline))
+			{
+				closesocket(Attempt.m_Socket);
+				pCallback->OnSpaConnectFailed(Attempt.m_uiSpa);
+			}
+			else
+			{
+				continue;
+			}
+
+			Pending.erase(Pending.begin() + i);
+		}
+	}
+
+	return cConnected;
+}
+
+
+//  Collects the sockets for the all-at-once ConnectToSpas().
+class CConnectedSockets :
+	public ISpaConnectCallback
+{
+public:
+	CConnectedSockets(std::vector<SOCKET> &Sockets)
+		: m_Sockets(Sockets)
+	{};
+
+	BOOL OnSpaConnected(size_t uiSpa, SOCKET SpaSocket)
+	{
+		m_Sockets[uiSpa] = SpaSocket;
+		return TRUE;
+	};
+
+	std::vector<SOCKET> &m_Sockets;
+
+private:
+	//  Disallowed operations.
+	const CConnectedSockets & operator=(const CConnectedSockets &) { return *this; };
+};
+
+
+UINT
+ConnectToSpas(
+	const SpaAddressVector &Spas,
+	DWORD dwTimeoutMs,
+	std::vector<SOCKET> &Sockets)
+{
+	CConnectedSockets Callback(Sockets);
+	SpaConnectOptions Options;
+
+	Options.m_dwAttemptTimeoutMs = dwTimeoutMs;
+	Options.m_cMaxPending = FD_SETSIZE;
+
+	Sockets.assign(Spas.size(), INVALID_SOCKET);
+
+	return ConnectToSpas(Spas, &Callback, Options);
+}
+
+
+DiscoveryOptions::DiscoveryOptions()
+	: m_dwTimeoutMs(2000), m_cRetransmits(2), m_dwRetransmitIntervalMs(250), m_fAllInterfaces(TRUE)
+{}
+
+
+//  An IPv4 interface address, and the broadcast address of its subnet.
+struct InterfaceAddress
+{
+	in_addr m_LocalAddress;
+	in_addr m_BroadcastAddress;
+};
+
+static BOOL
+GetInterfaceAddresses(
+	std::vector<InterfaceAddress> &Interfaces)
+{
+	const ULONG ulFlags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER;
+
+	ULONG cbAdapters = 16 * 1024;
+	std::vector<BYTE> AdapterBuffer;
+	ULONG ulResult;
+
+	Interfaces.clear();
+
+	//  Adapters can come and go between the two calls.
+	for (UINT cTries = 0; cTries < 3; cTries++)
+	{
+		AdapterBuffer.resize(cbAdapters);
+
+		ulResult = GetAdaptersAddresses(AF_INET, ulFlags, NULL, (IP_ADAPTER_ADDRESSES *)AdapterBuffer.data(), &cbAdapters);
+
+		if (ulResult != ERROR_BUFFER_OVERFLOW)
+		{
+			break;
+		}
+	}
+
+	if (ulResult != NO_ERROR)
+	{
+		_RPTWN(_CRT_WARN, L"GetAdaptersAddresses failed with error: %lu\n", ulResult);
+		return FALSE;
+	}
+
+	for (auto pAdapter = (const IP_ADAPTER_ADDRESSES *)AdapterBuffer.data(); pAdapter != NULL; pAdapter = pAdapter->Next)
+	{
+		if ((pAdapter->OperStatus != IfOperStatusUp) || (pAdapter->IfType == IF_TYPE_SOFTWARE_LOOPBACK))
+		{
+			continue;
+		}
+
+		for (auto pUnicast = pAdapter->FirstUnicastAddress; pUnicast != NULL; pUnicast = pUnicast->Next)
+		{
+			const sockaddr_in *pAddress = (const sockaddr_in *)pUnicast->Address.lpSockaddr;
+			ULONG ulMask;
+
+			//  Point to point links (/31, /32) have no broadcast address.
+			if ((pAddress->sin_family != AF_INET) || (pUnicast->OnLinkPrefixLength > 30) ||
+				(ConvertLengthToIpv4Mask(pUnicast->OnLinkPrefixLength, &ulMask) != NO_ERROR))
+			{
+				continue;
+			}
+
+			InterfaceAddress Interface;
+
+			Interface.m_LocalAddress = pAddress->sin_addr;
+			Interface.m_BroadcastAddress.s_addr = pAddress->sin_addr.s_addr | ~ulMask;
+
+			Interfaces.push_back(Interface);
+		}
+	}
+
+	return TRUE;
+}
+
+
+//  Longest we sit in select() before checking for Stop().
+const DWORD cmsMaxWait = 50;
+
+
+CSpaDiscovery::CSpaDiscovery()
+	: m_pCallback(NULL), m_hDiscoveryThread(0), m_fShutDown(FALSE)
+{}
+
+CSpaDiscovery::~CSpaDiscovery()
+{
+	Stop();
+}
+
+
+BOOL
+CSpaDiscovery::Start(
+	IDiscoveryCallback *pCallback,
+	const DiscoveryOptions &Options)
+{
+	if ((m_hDiscoveryThread != 0) || (pCallback == NULL))
+	{
+		return FALSE;
+	}
+
+	if (Options.m_fAllInterfaces)
+	{
+		OpenInterfaceSockets();
+	}
+
+	if (m_Sockets.empty())
+	{
+		in_addr AnyAddress;
+		in_addr LimitedBroadcast;
+
+		AnyAddress.s_addr = htonl(INADDR_ANY);
+		LimitedBroadcast.s_addr = htonl(INADDR_BROADCAST);
+
+		if (!AddBroadcastSocket(AnyAddress, LimitedBroadcast))
+		{
+			return FALSE;
+		}
+	}
+
+	m_pCallback = pCallback;
+	m_Options = Options;
+	m_Found.clear();
+	m_fShutDown = FALSE;
+
+	m_hDiscoveryThread = (HANDLE)_beginthreadex(NULL, 0, CSpaDiscovery::DiscoveryThreadProc, this, 0, NULL);
+
+	if (m_hDiscoveryThread == 0)
+	{
+		CloseSockets();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CSpaDiscovery::Stop(void)
+{
+	m_fShutDown = TRUE;
+
+	if (m_hDiscoveryThread != 0)
+	{
+		WaitForSingleObject(m_hDiscoveryThread, INFINITE);
+		CloseHandle(m_hDiscoveryThread);
+		m_hDiscoveryThread = 0;
+	}
+
+	CloseSockets();
+}
+
+
+BOOL
+CSpaDiscovery::Wait(
+	DWORD dwTimeoutMs)
+{
+	if (m_hDiscoveryThread == 0)
+	{
+		return TRUE;
+	}
+
+	return (WaitForSingleObject(m_hDiscoveryThread, dwTimeoutMs) == WAIT_OBJECT_0);
+}
+
+
+//  One socket per interface, bound to that interface's address so the
+//  replies come back to it.  All of them are serviced by the one select()
+//  loop, so every interface is searched at the same time.
+BOOL
+CSpaDiscovery::OpenInterfaceSockets(void)
+{
+	std::vector<InterfaceAddress> Interfaces;
+
+	if (!GetInterfaceAddresses(Interfaces))
+	{
+		return FALSE;
+	}
+
+	//  select() can't wait on more than this.
+	if (Interfaces.size() > FD_SETSIZE)
+	{
+		Interfaces.resize(FD_SETSIZE);
+	}
+
+	for (auto pInterface = Interfaces.cbegin(); pInterface != Interfaces.cend(); pInterface++)
+	{
+		AddBroadcastSocket(pInterface->m_LocalAddress, pInterface->m_BroadcastAddress);
+	}
+
+	return !m_Sockets.empty();
+}
+
+
+BOOL
+CSpaDiscovery::AddBroadcastSocket(
+	const in_addr &LocalAddress,
+	const in_addr &BroadcastAddress)
+{
+	SOCKET BroadcastSocket;
+
+	if (!MakeBroadcastSocket(BroadcastSocket))
+	{
+		return FALSE;
+	}
+
+	if (LocalAddress.s_addr != htonl(INADDR_ANY))
+	{
+		sockaddr_in BindAddress;
+
+		memset(&BindAddress, 0, sizeof(BindAddress));
+		BindAddress.sin_family = AF_INET;
+		BindAddress.sin_addr = LocalAddress;
+
+		if (bind(BroadcastSocket, (const sockaddr *)&BindAddress, sizeof(BindAddress)) == SOCKET_ERROR)
+		{
+			_RPTWN(_CRT_WARN, L"bind failed with error: %d\n", WSAGetLastError());
+			closesocket(BroadcastSocket);
+			return FALSE;
+		}
+	}
+
+	sockaddr_in SendAddress;
+
+	memset(&SendAddress, 0, sizeof(SendAddress));
+	SendAddress.sin_family = AF_INET;
+	SendAddress.sin_port = htons(usDiscoveryPort);
+	SendAddress.sin_addr = BroadcastAddress;
+
+	m_Sockets.push_back(BroadcastSocket);
+	m_BroadcastAddresses.push_back(SendAddress);
+
+	return TRUE;
+}
+
+
+void
+CSpaDiscovery::CloseSockets(void)
+{
+	for (auto pSocket = m_Sockets.cbegin(); pSocket != m_Sockets.cend(); pSocket++)
+	{
+		closesocket(*pSocket);
+	}
+
+	m_Sockets.clear();
+	m_BroadcastAddresses.clear();
+}
+
+
+unsigned int __stdcall
+CSpaDiscovery::DiscoveryThreadProc(
+	void *pParam)
+{
+	return ((CSpaDiscovery *)pParam)->DiscoveryThreadProc();
+}
+
+
+unsigned int
+CSpaDiscovery::DiscoveryThreadProc(void)
+{
+	ULONGLONG ullNow = GetTickCount64();
+	ULONGLONG ullDeadline = ullNow + m_Options.m_dwTimeoutMs;
+	ULONGLONG ullNextSend = ullNow;
+	UINT cSent = 0;
+
+	BOOL fSuccess = TRUE;
+	BOOL fDone = FALSE;
+
+	while (!m_fShutDown && !fDone && (ullNow < ullDeadline))
+	{
+		if ((cSent <= m_Options.m_cRetransmits) && (ullNow >= ullNextSend))
+		{
+			if (!SendDiscoveryMessages())
+			{
+				fSuccess = FALSE;
+				break;
+			}
+
+			cSent++;
+			ullNextSend = ullNow + m_Options.m_dwRetransmitIntervalMs;
+		}
+
+		ULONGLONG ullWake = ullDeadline;
+
+		if (cSent <= m_Options.m_cRetransmits)
+		{
+			ullWake = (std::min)(ullWake, ullNextSend);
+		}
+
+		DWORD dwWait = (DWORD)(std::min)(ullWake - ullNow, (ULONGLONG)cmsMaxWait);
+
+		timeval tvTimeout;
+
+		tvTimeout.tv_sec = 0;
+		tvTimeout.tv_usec = dwWait * 1000;
+
+		fd_set fsIncoming;
+
+		FD_ZERO(&fsIncoming);
+		for (auto pSocket = m_Sockets.cbegin(); pSocket != m_Sockets.cend(); pSocket++)
+		{
+			FD_SET(*pSocket, &fsIncoming);
+		}
+
+		int iResult = select(0, &fsIncoming, NULL, NULL, &tvTimeout);
+
+		if (iResult == SOCKET_ERROR)
+		{
+			_RPTWN(_CRT_WARN, L"select failed with error: %d\n", WSAGetLastError());
+			fSuccess = FALSE;
+			break;
+		}
+
+		for (auto pSocket = m_Sockets.cbegin(); (iResult > 0) && !fDone && (pSocket != m_Sockets.cend()); pSocket++)
+		{
+			if (FD_ISSET(*pSocket, &fsIncoming))
+			{
+				ReceiveResponse(*pSocket, fDone);
+			}
+		}
+
+		ullNow = GetTickCount64();
+	}
+
+	m_pCallback->OnDiscoveryComplete(fSuccess);
+
+	return 0;
+}
+
+
+BOOL
+CSpaDiscovery::SendDiscoveryMessages(void)
+{
+	BOOL fSent = FALSE;
+
+	//  One interface being down shouldn't stop the others.
+	for (size_t i = 0; i < m_Sockets.size(); i++)
+	{
+		int iResult = sendto(m_Sockets[i], szDiscoveryMessage, (int)strlen(szDiscoveryMessage) + 1, 0,
+							 (const sockaddr *)&m_BroadcastAddresses[i], sizeof(m_BroadcastAddresses[i]));
+
+		if (iResult == SOCKET_ERROR)
+		{
+			_RPTWN(_CRT_WARN, L"sendto failed with error: %d\n", WSAGetLastError());
+		}
+		else
+		{
+			fSent = TRUE;
+		}
+	}
+
+	return fSent;
+}
+
+
+BOOL
+CSpaDiscovery::ReceiveResponse(
+	SOCKET ResponseSocket,
+	BOOL &fDone)
+{
+	char RecvBuffer[1024];
+	sockaddr_in saFrom;
+	int saSize = sizeof(saFrom);
+
+	int iResult = recvfrom(ResponseSocket, RecvBuffer, sizeof(RecvBuffer) - 1, 0, (sockaddr *)&saFrom, &saSize);
+
+	if (iResult == SOCKET_ERROR)
+	{
+		//  e.g. WSAECONNRESET from an ICMP unreachable; not fatal.
+		return FALSE;
+	}
+
+	RecvBuffer[iResult] = '\0';
+
+	string strMACAddress;
+
+	if (!ParseDiscoveryResponse(RecvBuffer, strMACAddress))
+	{
+		return FALSE;
+	}
+
+	CSpaAddress NewSpa(saFrom, strMACAddress);
+
+	//  Retransmits (and multiple interfaces) get repeat answers.
+	for (auto pSpa = m_Found.begin(); pSpa != m_Found.end(); pSpa++)
+	{
+		if (*pSpa == NewSpa)
+		{
+			return TRUE;
+		}
+	}
+
+	m_Found.push_back(NewSpa);
+
+	if (!m_pCallback->OnSpaFound(NewSpa))
+	{
+		fDone = TRUE;
+	}
+	else if (!m_Options.m_StopWhenFound.empty())
+	{
+		fDone = TRUE;
+
+		for (auto pMAC = m_Options.m_StopWhenFound.cbegin(); fDone && (pMAC != m_Options.m_StopWhenFound.cend()); pMAC++)
+		{
+			BOOL fFound = FALSE;
+
+			for (auto pSpa = m_Found.cbegin(); !fFound && (pSpa != m_Found.cend()); pSpa++)
+			{
+				fFound = (_stricmp(pSpa->m_strMACAddress.c_str(), pMAC->c_str()) == 0);
+			}
+
+			fDone = fFound;
+		}
+	}
+
+	return TRUE;
+}
+
+
+//  Collects the spas for the synchronous DiscoverSpas().
+class CDiscoveredSpas :
+	public IDiscoveryCallback
+{
+public:
+	CDiscoveredSpas(SpaAddressVector &Spas)
+		: m_Spas(Spas), m_fSuccess(FALSE)
+	{};
+
+	BOOL OnSpaFound(const CSpaAddress &Spa)
+	{
+		m_Spas.push_back(Spa);
+		return TRUE;
+	};
+
+	void OnDiscoveryComplete(BOOL fSuccess)
+	{
+		m_fSuccess = fSuccess;
+	};
+
+	SpaAddressVector &m_Spas;
+	BOOL m_fSuccess;
+
+private:
+	//  Disallowed operations.
+	const CDiscoveredSpas & operator=(const CDiscoveredSpas &) { return *this; };
+};
+
+
+BOOL
+DiscoverSpas(
+	SpaAddressVector &Spas,
+	const DiscoveryOptions &Options)
+{
+	CDiscoveredSpas Callback(Spas);
+	CSpaDiscovery Discovery;
+
+	Spas.clear();
+
+	if (!Discovery.Start(&Callback, Options))
+	{
+		return FALSE;
+	}
+
+	Discovery.Wait();
+	Discovery.Stop();
+
+	return Callback.m_fSuccess;
+}
@@ -18,4 +18,128 @@ public:
 
 typedef std::vector<CSpaAddress> SpaAddressVector;
 
+//  FNV-1a of the MAC address, ignoring case, so it doesn't matter how the
+//  address is written; e.g. for picking a spa's shard.
+UINT64 HashMACAddress(const string &strMACAddress);
+
 BOOL DiscoverSpas(SpaAddressVector &Spas);
+
+
+//  Connects to the control port of each spa at once, waiting at most
+//  dwTimeoutMs.  Sockets[i] is left connected (and blocking) to Spas[i],
+//  ready for CSpaComms::StartMonitor(SOCKET), or is INVALID_SOCKET.
+//  Returns the number connected.
+UINT ConnectToSpas(const SpaAddressVector &Spas, DWORD dwTimeoutMs, std::vector<SOCKET> &Sockets);
+
+
+//  Called on the connecting thread as each attempt finishes, so a spa can
+//  be started as soon as it's connected rather than when they all are.
+class ISpaConnectCallback
+{
+public:
+	//  The socket is connected and blocking.  Return TRUE if it's been taken
+	//  (e.g. by CSpaComms::StartMonitor(SOCKET)), FALSE to have it closed.
+	virtual BOOL OnSpaConnected(size_t uiSpa, SOCKET) = 0;
+
+	//  Refused, unreachable or timed out.
+	virtual void OnSpaConnectFailed(size_t uiSpa) {};
+};
+
+
+struct SpaConnectOptions
+{
+	SpaConnectOptions();
+
+	//  Each attempt gets this long, from when it's started.
+	DWORD m_dwAttemptTimeoutMs;
+
+	//  Attempts in progress at once, at most FD_SETSIZE.  The next spa is
+	//  started as soon as an earlier attempt finishes.
+	UINT m_cMaxPending;
+};
+
+//  Non-blocking connects to all of Spas, reporting each to pCallback (by
+//  index into Spas) as it completes.  Returns the number connected.
+UINT ConnectToSpas(const SpaAddressVector &Spas, ISpaConnectCallback *pCallback,
+				   const SpaConnectOptions & = SpaConnectOptions());
+
+
+//  Asynchronous discovery.  Callbacks are made on the discovery thread.
+class IDiscoveryCallback
+{
+public:
+	//  Each spa is reported once, as soon as its response arrives.  Return
+	//  FALSE to stop looking.
+	virtual BOOL OnSpaFound(const CSpaAddress &) = 0;
+
+	//  Always called, last.  fSuccess is FALSE if discovery couldn't run
+	//  (e.g. no network), not if it simply found nothing.
+	virtual void OnDiscoveryComplete(BOOL fSuccess) {};
+};
+
+
+struct DiscoveryOptions
+{
+	DiscoveryOptions();
+
+	//  Overall deadline.
+	DWORD m_dwTimeoutMs;
+
+	//  Extra broadcasts, for lossy Wi-Fi.
+	UINT m_cRetransmits;
+	DWORD m_dwRetransmitIntervalMs;
+
+	//  Finish as soon as all of these have been found (e.g. the spas we
+	//  already know about).  Same format as CSpaAddress::m_strMACAddress.
+	std::vector<string> m_StopWhenFound;
+
+	//  Send a directed broadcast on every IPv4 interface that's up, all at
+	//  once, rather than 255.255.255.255 (which only goes out of one of
+	//  them).  Falls back to 255.255.255.255 if there are no interfaces.
+	BOOL m_fAllInterfaces;
+};
+
+
+class CSpaDiscovery
+{
+public:
+	CSpaDiscovery();
+	~CSpaDiscovery();
+
+	BOOL Start(IDiscoveryCallback *, const DiscoveryOptions & = DiscoveryOptions());
+
+	//  Cancels, if still running, and waits for the thread to finish.
+	void Stop(void);
+
+	//  TRUE once discovery has completed.
+	BOOL Wait(DWORD dwTimeoutMs = INFINITE);
+
+private:
+	static unsigned int __stdcall DiscoveryThreadProc(void *);
+	unsigned int DiscoveryThreadProc(void);
+
+	BOOL OpenInterfaceSockets(void);
+	BOOL AddBroadcastSocket(const in_addr &LocalAddress, const in_addr &BroadcastAddress);
+	BOOL SendDiscoveryMessages(void);
+	BOOL ReceiveResponse(SOCKET, BOOL &fDone);
+	void CloseSockets(void);
+
+	IDiscoveryCallback *m_pCallback;
+	DiscoveryOptions m_Options;
+
+	std::vector<SOCKET> m_Sockets;
+	std::vector<sockaddr_in> m_BroadcastAddresses;	//  Parallel to m_Sockets
+
+	SpaAddressVector m_Found;
+
+	HANDLE m_hDiscoveryThread;
+	volatile BOOL m_fShutDown;
+
+	//  Disallowed operations.
+	const CSpaDiscovery & operator=(const CSpaDiscovery &) { return *this; };
+};
+
+
+//  Runs a CSpaDiscovery to completion.  Spas answering on more than one
+//  interface are only listed once.
+BOOL DiscoverSpas(SpaAddressVector &Spas, const DiscoveryOptions &Options);
@@ -0,0 +1,230 @@
+#include "stdafx.h"
+#include "Discovery.h"
+#include "DiscoveryCache.h"
+
+using std::mutex;
+using std::lock_guard;
+
+
+//  Only the IP address; the cache file doesn't keep the port, and a
+//  discovery reply's is just the one it was sent from.
+static BOOL
+SameAddress(
+	const sockaddr_in &First,
+	const sockaddr_in &Second)
+{
+	return (First.sin_addr.s_addr == Second.sin_addr.s_addr);
+}
+
+
+CDiscoveryCache::CDiscoveryCache(
+	const WCHAR *szFileName,
+	DWORD dwTTLSeconds)
+	: m_strFileName(szFileName), m_dwTTLSeconds(dwTTLSeconds), m_pCallback(NULL)
+{}
+
+CDiscoveryCache::~CDiscoveryCache()
+{
+	StopRevalidation();
+}
+
+
+//  One spa per line: MAC address, IP address, last seen (seconds since 1970).
+BOOL
+CDiscoveryCache::Load(void)
+{
+	FILE *fhIn;
+
+	if (_wfopen_s(&fhIn, m_strFileName.c_str(), L"r") != 0)
+	{
+		return FALSE;
+	}
+
+	lock_guard<mutex> lg(m_mutex);
+	char szLine[256];
+
+	m_Entries.clear();
+
+	while (fgets(szLine, sizeof(szLine), fhIn) != NULL)
+	{
+		char szMACAddress[32];
+		char szIpAddr[32];
+		__time64_t tLastSeen;
+
+		if (sscanf_s(szLine, "%31s %31s %lld", szMACAddress, (unsigned)sizeof(szMACAddress),
+					 szIpAddr, (unsigned)sizeof(szIpAddr), &tLastSeen) != 3)
+		{
+			continue;
+		}
+
+		sockaddr_in SpaAddress;
+
+		memset(&SpaAddress, 0, sizeof(SpaAddress));
+		SpaAddress.sin_family = AF_INET;
+
+		if (inet_pton(AF_INET, szIpAddr, &SpaAddress.sin_addr) != 1)
+		{
+			continue;
+		}
+
+		m_Entries.push_back(Entry(CSpaAddress(SpaAddress, szMACAddress), tLastSeen));
+	}
+
+	fclose(fhIn);
+
+	return TRUE;
+}
+
+
+BOOL
+CDiscoveryCache::Save(void) const
+{
+	FILE *fhOut;
+
+	if (_wfopen_s(&fhOut, m_strFileName.c_str(), L"w") != 0)
+	{
+		return FALSE;
+	}
+
+	lock_guard<mutex> lg(m_mutex);
+	__time64_t tNow = _time64(NULL);
+	BOOL fOK = TRUE;
+
+	for (auto pEntry = m_Entries.cbegin(); fOK && (pEntry != m_Entries.cend()); pEntry++)
+	{
+		if (tNow - pEntry->m_tLastSeen > m_dwTTLSeconds)
+		{
+			continue;
+		}
+
+		char szIpAddr[32];
+
+		inet_ntop(AF_INET, &pEntry->m_Address.m_SpaAddress.sin_addr, szIpAddr, sizeof(szIpAddr));
+
+		fOK = (fprintf(fhOut, "%s %s %lld\n", pEntry->m_Address.m_strMACAddress.c_str(), szIpAddr, pEntry->m_tLastSeen) > 0);
+	}
+
+	return (fclose(fhOut) == 0) && fOK;
+}
+
+
+void
+CDiscoveryCache::GetSpas(
+	SpaAddressVector &Spas) const
+{
+	lock_guard<mutex> lg(m_mutex);
+	__time64_t tNow = _time64(NULL);
+
+	Spas.clear();
+
+	for (auto pEntry = m_Entries.cbegin(); pEntry != m_Entries.cend(); pEntry++)
+	{
+		if (tNow - pEntry->m_tLastSeen <= m_dwTTLSeconds)
+		{
+			Spas.push_back(pEntry->m_Address);
+		}
+	}
+}
+
+
+void
+CDiscoveryCache::Update(
+	const CSpaAddress &Spa)
+{
+	UpdateEntry(Spa);
+}
+
+
+BOOL
+CDiscoveryCache::UpdateEntry(
+	const CSpaAddress &Spa)
+{
+	lock_guard<mutex> lg(m_mutex);
+	__time64_t tNow = _time64(NULL);
+
+	for (auto pEntry = m_Entries.begin(); pEntry != m_Entries.end(); pEntry++)
+	{
+		if (_stricmp(pEntry->m_Address.m_strMACAddress.c_str(), Spa.m_strMACAddress.c_str()) == 0)
+		{
+			BOOL fMoved = !SameAddress(pEntry->m_Address.m_SpaAddress, Spa.m_SpaAddress);
+
+			pEntry->m_Address.m_SpaAddress = Spa.m_SpaAddress;
+			pEntry->m_tLastSeen = tNow;
+
+			return fMoved;
+		}
+	}
+
+	m_Entries.push_back(Entry(Spa, tNow));
+
+	return TRUE;
+}
+
+
+UINT
+CDiscoveryCache::ConnectCachedSpas(
+	SpaAddressVector &Spas,
+	std::vector<SOCKET> &Sockets,
+	DWORD dwTimeoutMs)
+{
+	GetSpas(Spas);
+
+	UINT cConnected = ConnectToSpas(Spas, dwTimeoutMs, Sockets);
+
+	for (size_t i = 0; i < Spas.size(); i++)
+	{
+		if (Sockets[i] != INVALID_SOCKET)
+		{
+			Update(Spas[i]);
+		}
+	}
+
+	return cConnected;
+}
+
+
+BOOL
+CDiscoveryCache::StartRevalidation(
+	IDiscoveryCallback *pCallback,
+	const DiscoveryOptions &Options)
+{
+	m_pCallback = pCallback;
+
+	return m_Discovery.Start(this, Options);
+}
+
+
+void
+CDiscoveryCache::StopRevalidation(void)
+{
+	m_Discovery.Stop();
+}
+
+
+BOOL
+CDiscoveryCache::OnSpaFound(
+	const CSpaAddress &Spa)
+{
+	if (UpdateEntry(Spa) && (m_pCallback != NULL))
+	{
+		return m_pCallback->OnSpaFound(Spa);
+	}
+
+	return TRUE;
+}
+
+
+void
+CDiscoveryCache::OnDiscoveryComplete(
+	BOOL fSuccess)
+{
+	if (fSuccess)
+	{
+		Save();
+	}
+
+	if (m_pCallback != NULL)
+	{
+		m_pCallback->OnDiscoveryComplete(fSuccess);
+	}
+}
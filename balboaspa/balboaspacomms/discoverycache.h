@@ -0,0 +1,71 @@
+#pragma once
+
+//  Remembers where spas were last seen, so a restart can connect straight
+//  away instead of waiting for a discovery broadcast.  Typical use:
+//
+//    CDiscoveryCache Cache(szFile);
+//    Cache.Load();
+//    Cache.ConnectCachedSpas(Spas, Sockets);    //  One TCP handshake
+//    ...CSpaComms::StartMonitor(Sockets[i]) for each connected spa...
+//    Cache.StartRevalidation(pCallback);       //  Finds moved or new spas
+//
+//  Entries not seen for longer than the TTL are ignored, and dropped on the
+//  next save.
+
+const DWORD dwDefaultDiscoveryCacheTTL = 7 * 24 * 60 * 60;
+
+class CDiscoveryCache :
+	private IDiscoveryCallback
+{
+public:
+	CDiscoveryCache(const WCHAR *szFileName, DWORD dwTTLSeconds = dwDefaultDiscoveryCacheTTL);
+	~CDiscoveryCache();
+
+	BOOL Load(void);
+	BOOL Save(void) const;
+
+	//  Cached spas that are still within the TTL.
+	void GetSpas(SpaAddressVector &) const;
+	void Update(const CSpaAddress &);
+
+	//  Probes every cached spa at once; see ConnectToSpas().  Spas that
+	//  answer are marked as seen.
+	UINT ConnectCachedSpas(SpaAddressVector &Spas, std::vector<SOCKET> &Sockets, DWORD dwTimeoutMs = 500);
+
+	//  Broadcasts in the background, updating the cache and saving it when
+	//  done.  Spas that are new, or have moved, are passed on to pCallback
+	//  (if any).
+	BOOL StartRevalidation(IDiscoveryCallback *pCallback = NULL, const DiscoveryOptions & = DiscoveryOptions());
+	void StopRevalidation(void);
+
+private:
+	//  IDiscoveryCallback, for revalidation.
+	BOOL OnSpaFound(const CSpaAddress &);
+	void OnDiscoveryComplete(BOOL fSuccess);
+
+	//  Returns FALSE if the spa was already cached at the same address.
+	BOOL UpdateEntry(const CSpaAddress &);
+
+	struct Entry
+	{
+		Entry(const CSpaAddress &Address, __time64_t tLastSeen)
+			: m_Address(Address), m_tLastSeen(tLastSeen)
+		{};
+
+		CSpaAddress m_Address;
+		__time64_t m_tLastSeen;
+	};
+
+	std::wstring m_strFileName;
+	DWORD m_dwTTLSeconds;
+
+	//  Revalidation updates from the discovery thread.
+	mutable std::mutex m_mutex;
+	std::vector<Entry> m_Entries;
+
+	CSpaDiscovery m_Discovery;
+	IDiscoveryCallback *m_pCallback;
+
+	//  Disallowed operations.
+	const CDiscoveryCache & operator=(const CDiscoveryCache &) { return *this; };
+};
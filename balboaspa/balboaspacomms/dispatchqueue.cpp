@@ -0,0 +1,342 @@
+#include "stdafx.h"
+#include "MonitorCallback.h"
+#include "DispatchQueue.h"
+
+using std::mutex;
+using std::lock_guard;
+
+
+CDispatchQueue::CDispatchQueue(
+	IMonitorCallback *pCallback,
+	UINT cMaxQueued)
+	: m_pCallback(pCallback), m_cMaxQueued(cMaxQueued),
+	m_hDispatchThread(0), m_hWake(NULL), m_fShutDown(FALSE),
+	m_fRunning(FALSE), m_Status(), m_fStatusQueued(FALSE), m_fFatalError(FALSE),
+	m_DeliveringStatus()
+{
+	memset(&m_Stats, 0, sizeof(m_Stats));
+}
+
+CDispatchQueue::~CDispatchQueue()
+{
+	Stop();
+}
+
+
+BOOL
+CDispatchQueue::Start(void)
+{
+	if (m_hDispatchThread != 0)
+	{
+		return FALSE;
+	}
+
+	m_hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (m_hWake == NULL)
+	{
+		return FALSE;
+	}
+
+	m_fShutDown = FALSE;
+	m_fRunning = TRUE;
+
+	m_hDispatchThread = (HANDLE)_beginthreadex(NULL, 0, CDispatchQueue::DispatchThreadProc, this, 0, NULL);
+
+	if (m_hDispatchThread == 0)
+	{
+		m_fRunning = FALSE;
+		CloseHandle(m_hWake);
+		m_hWake = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CDispatchQueue::Stop(void)
+{
+	if (m_hDispatchThread == 0)
+	{
+		return;
+	}
+
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		m_fRunning = FALSE;
+	}
+
+	m_fShutDown = TRUE;
+	SetEvent(m_hWake);
+	WaitForSingleObject(m_hDispatchThread, INFINITE);
+	CloseHandle(m_hDispatchThread);
+	m_hDispatchThread = 0;
+
+	CloseHandle(m_hWake);
+	m_hWake = NULL;
+
+	//  Nothing can be added now.
+	m_Replies.Clear();
+	m_Others.Clear();
+	m_fStatusQueued = FALSE;
+	m_fFatalError = FALSE;
+}
+
+
+void
+CDispatchQueue::GetStats(
+	DispatchQueueStats &Stats) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	Stats = m_Stats;
+}
+
+
+BOOL
+CDispatchQueue::IsEmpty(void) const
+{
+	return (m_Replies.GetCount() == 0) && !m_fStatusQueued && (m_Others.GetCount() == 0) && !m_fFatalError;
+}
+
+
+//  Only wakes the dispatch thread if it might be waiting, i.e. there was
+//  nothing queued.
+template <class Message>
+void
+CDispatchQueue::QueueReply(
+	const Message &NewMessage,
+	void (IMonitorCallback::*pProcess)(const Message &))
+{
+	BOOL fWake = FALSE;
+
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		if (m_fRunning)
+		{
+			if (m_Replies.GetCount() < m_cMaxQueued)
+			{
+				fWake = IsEmpty();
+				m_Replies.Add(NewMessage);
+				m_Stats.m_cQueued++;
+			}
+			else
+			{
+				m_Stats.m_cDropped++;
+			}
+
+			if (fWake)
+			{
+				SetEvent(m_hWake);
+			}
+
+			return;
+		}
+	}
+
+	(m_pCallback->*pProcess)(NewMessage);
+}
+
+
+void
+CDispatchQueue::ProcessConfigResponse(
+	const ConfigResponseMessage &Message)
+{
+	QueueReply(Message, &IMonitorCallback::ProcessConfigResponse);
+}
+
+
+void
+CDispatchQueue::ProcessFilterConfigResponse(
+	const FilterConfigResponseMessage &Message)
+{
+	QueueReply(Message, &IMonitorCallback::ProcessFilterConfigResponse);
+}
+
+
+void
+CDispatchQueue::ProcessVersionInfoResponse(
+	const VersionInfoResponseMessage &Message)
+{
+	QueueReply(Message, &IMonitorCallback::ProcessVersionInfoResponse);
+}
+
+
+void
+CDispatchQueue::ProcessControlConfig2Response(
+	const ControlConfig2ResponseMessage &Message)
+{
+	QueueReply(Message, &IMonitorCallback::ProcessControlConfig2Response);
+}
+
+
+void
+CDispatchQueue::ProcessStatusMessage(
+	const StatusMessage &Status)
+{
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		if (m_fRunning)
+		{
+			BOOL fWake = IsEmpty();
+
+			if (m_fStatusQueued)
+			{
+				m_Stats.m_cStatusesCollapsed++;
+			}
+
+			//  Reuses the buffers of the one it replaces.
+			m_Status = Status;
+			m_fStatusQueued = TRUE;
+			m_Stats.m_cQueued++;
+
+			if (fWake)
+			{
+				SetEvent(m_hWake);
+			}
+
+			return;
+		}
+	}
+
+	m_pCallback->ProcessStatusMessage(Status);
+}
+
+
+void
+CDispatchQueue::ProcessUnknownMessageRaw(
+	const CByteArray &Message)
+{
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		if (m_fRunning)
+		{
+			if (m_Others.GetCount() < m_cMaxQueued)
+			{
+				BOOL fWake = IsEmpty();
+
+				m_Others.AddUnknown(Message);
+				m_Stats.m_cQueued++;
+
+				if (fWake)
+				{
+					SetEvent(m_hWake);
+				}
+			}
+			else
+			{
+				m_Stats.m_cDropped++;
+			}
+
+			return;
+		}
+	}
+
+	m_pCallback->ProcessUnknownMessageRaw(Message);
+}
+
+
+void
+CDispatchQueue::OnFatalError(void)
+{
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		if (m_fRunning)
+		{
+			BOOL fWake = IsEmpty();
+
+			m_fFatalError = TRUE;
+
+			if (fWake)
+			{
+				SetEvent(m_hWake);
+			}
+
+			return;
+		}
+	}
+
+	m_pCallback->OnFatalError();
+}
+
+
+unsigned int __stdcall
+CDispatchQueue::DispatchThreadProc(
+	void *pParam)
+{
+	return ((CDispatchQueue *)pParam)->DispatchThreadProc();
+}
+
+
+unsigned int
+CDispatchQueue::DispatchThreadProc(void)
+{
+	while (!m_fShutDown)
+	{
+		WaitForSingleObject(m_hWake, INFINITE);
+
+		for (;;)
+		{
+			BOOL fStatus;
+			BOOL fFatalError;
+
+			{
+				lock_guard<mutex> lg(m_mutex);
+
+				if (IsEmpty())
+				{
+					break;
+				}
+
+				//  The delivering batches were cleared after the last round.
+				std::swap(m_Replies, m_DeliveringReplies);
+				std::swap(m_Others, m_DeliveringOthers);
+
+				fStatus = m_fStatusQueued;
+				if (fStatus)
+				{
+					m_DeliveringStatus = m_Status;
+					m_fStatusQueued = FALSE;
+				}
+
+				fFatalError = m_fFatalError;
+				m_fFatalError = FALSE;
+			}
+
+			//  One at a time; the IMonitorCallback version of
+			//  ProcessMessageBatch() does that, whatever the callback's own
+			//  does.
+			if (!m_fShutDown && (m_DeliveringReplies.GetCount() != 0))
+			{
+				m_pCallback->IMonitorCallback::ProcessMessageBatch(m_DeliveringReplies.GetMessages(), m_DeliveringReplies.GetCount());
+			}
+
+			if (!m_fShutDown && fStatus)
+			{
+				m_pCallback->ProcessStatusMessage(m_DeliveringStatus);
+			}
+
+			if (!m_fShutDown && (m_DeliveringOthers.GetCount() != 0))
+			{
+				m_pCallback->IMonitorCallback::ProcessMessageBatch(m_DeliveringOthers.GetMessages(), m_DeliveringOthers.GetCount());
+			}
+
+			if (!m_fShutDown && fFatalError)
+			{
+				m_pCallback->OnFatalError();
+			}
+
+			m_DeliveringReplies.Clear();
+			m_DeliveringOthers.Clear();
+		}
+	}
+
+	return 0;
+}
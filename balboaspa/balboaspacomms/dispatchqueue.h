@@ -0,0 +1,92 @@
+#pragma once
+
+//  Keeps a slow IMonitorCallback from holding up the monitor.  The monitor
+//  thread only queues each message and goes straight back to reading, so
+//  the socket is always drained promptly; a thread of the queue's own makes
+//  the callbacks.  Each time round it takes, in this order:
+//
+//    - replies to requests (config, filter config, version info and control
+//      config 2), in the order they arrived; these are never collapsed
+//    - the latest status: a status that arrives while another is still
+//      waiting replaces it, so a consumer that falls behind skips to the
+//      freshest state rather than working through a backlog
+//    - anything else (unknown messages), in order
+//
+//  Replies and other messages are each bounded by cMaxQueued; past that,
+//  new ones are dropped and counted.  OnFatalError() is passed on after
+//  everything queued ahead of it.  Messages go to the callback one at a
+//  time.
+//
+//  Until Start(), and after Stop(), messages are passed straight through on
+//  the caller's thread.  See CSpaComms::SetQueuedDelivery().
+
+struct DispatchQueueStats
+{
+	UINT64 m_cQueued;
+	UINT64 m_cStatusesCollapsed;		//  Replaced by a newer status first
+	UINT64 m_cDropped;					//  Lane was full
+};
+
+
+class CDispatchQueue :
+	public IMonitorCallback
+{
+public:
+	CDispatchQueue(IMonitorCallback *, UINT cMaxQueued = 64);
+	~CDispatchQueue();
+
+	BOOL Start(void);
+
+	//  Anything still queued is dropped.  Once this returns, the callback
+	//  won't be called from the queue's thread again.
+	void Stop(void);
+
+	void GetStats(DispatchQueueStats &) const;
+
+	//  IMonitorCallback, from the monitor thread.
+	void ProcessStatusMessage(const StatusMessage &);
+	void ProcessConfigResponse(const ConfigResponseMessage &);
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &);
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &);
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &);
+	void ProcessUnknownMessageRaw(const CByteArray &);
+	void OnFatalError(void);
+
+	//  The callback is its owner's to dispose of.
+	void Dispose(void) {};
+
+private:
+	static unsigned int __stdcall DispatchThreadProc(void *);
+	unsigned int DispatchThreadProc(void);
+
+	template <class Message>
+	void QueueReply(const Message &, void (IMonitorCallback::*)(const Message &));
+
+	//  Caller holds m_mutex.
+	BOOL IsEmpty(void) const;
+
+	IMonitorCallback *m_pCallback;
+	UINT m_cMaxQueued;
+
+	HANDLE m_hDispatchThread;
+	HANDLE m_hWake;
+	volatile BOOL m_fShutDown;
+
+	mutable std::mutex m_mutex;
+	BOOL m_fRunning;
+	CMessageBatch m_Replies;
+	StatusMessage m_Status;
+	BOOL m_fStatusQueued;
+	CMessageBatch m_Others;
+	BOOL m_fFatalError;
+	DispatchQueueStats m_Stats;
+
+	//  Dispatch thread only.  Swapped with the lanes above, so once running
+	//  neither side allocates.
+	CMessageBatch m_DeliveringReplies;
+	StatusMessage m_DeliveringStatus;
+	CMessageBatch m_DeliveringOthers;
+
+	//  Disallowed operations.
+	const CDispatchQueue & operator=(const CDispatchQueue &) { return *this; };
+};
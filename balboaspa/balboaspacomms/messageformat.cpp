@@ -0,0 +1,145 @@
+#include "stdafx.h"
+#include "MessageFormat.h"
+
+
+CMessageFramer::CMessageFramer()
+	: m_pInput(NULL), m_cbInput(0), m_cbPartial(0)
+{}
+
+
+void
+CMessageFramer::AddData(
+	const BYTE *pData,
+	size_t cbData)
+{
+	_ASSERT(m_cbInput == 0);
+
+	m_pInput = pData;
+	m_cbInput = cbData;
+}
+
+
+//  A length byte too small for the overhead means we're not at the start of
+//  a message after all.
+static BOOL
+IsValidLength(
+	BYTE byLength)
+{
+	return byLength >= cMessageOverhead - 2;
+}
+
+
+BOOL
+CMessageFramer::GetNextMessage(
+	const BYTE *&pMessage,
+	size_t &cbMessage)
+{
+	// Locate beginning of message.  We expect it to be at the begining of the buffer,
+	// but let's make sure, shall we?  Nothing past the length byte is checked
+	// here; callers taking data from anywhere but the spa check the rest.
+	while (m_cbPartial == 0)
+	{
+		while ((m_cbInput != 0) && (*m_pInput != byMessageTerminator))
+		{
+			m_pInput++;
+			m_cbInput--;
+		}
+
+		if (m_cbInput < 2)
+		{
+			//  Keep a lone terminator for next time.
+			break;
+		}
+
+		if (!IsValidLength(m_pInput[1]))
+		{
+			m_pInput++;
+			m_cbInput--;
+			continue;
+		}
+
+		cbMessage = m_pInput[1] + 2;
+
+		if (m_cbInput < cbMessage)
+		{
+			break;
+		}
+
+		//  Complete message in the input; no need to copy it.
+		pMessage = m_pInput;
+
+		m_pInput += cbMessage;
+		m_cbInput -= cbMessage;
+
+		return TRUE;
+	}
+
+	//  Add to the start of a message from last time, until it's complete or
+	//  the input runs out.
+	while (m_cbInput != 0)
+	{
+		size_t cbWanted = (m_cbPartial < 2) ? 2 : (size_t)m_Partial[1] + 2;
+
+		if (m_cbPartial == cbWanted)
+		{
+			break;
+		}
+
+		size_t cbCopy = (std::min)(cbWanted - m_cbPartial, m_cbInput);
+
+		memcpy(m_Partial + m_cbPartial, m_pInput, cbCopy);
+		m_cbPartial += cbCopy;
+		m_pInput += cbCopy;
+		m_cbInput -= cbCopy;
+
+		if ((m_cbPartial == 2) && !IsValidLength(m_Partial[1]))
+		{
+			//  Start again from the length byte.
+			m_cbPartial = 0;
+			m_pInput--;
+			m_cbInput++;
+			return GetNextMessage(pMessage, cbMessage);
+		}
+	}
+
+	if ((m_cbPartial < 2) || (m_cbPartial < (size_t)m_Partial[1] + 2))
+	{
+		//  Buffer has one incomplete message.  Wait for more input.
+		return FALSE;
+	}
+
+	pMessage = m_Partial;
+	cbMessage = m_cbPartial;
+
+	//  Not overwritten until the next call.
+	m_cbPartial = 0;
+
+	return TRUE;
+}
+
+
+BOOL
+CMessageFramer::GetNextMessage(
+	CByteArray &Message)
+{
+	const BYTE *pMessage;
+	size_t cbMessage;
+
+	if (!GetNextMessage(pMessage, cbMessage))
+	{
+		return FALSE;
+	}
+
+	Message.assign(pMessage, pMessage + cbMessage);
+
+	return TRUE;
+}
+
+
+void
+CMessageFramer::Reset(void)
+{
+	m_pInput = NULL;
+	m_cbInput = 0;
+	m_cbPartial = 0;
+}
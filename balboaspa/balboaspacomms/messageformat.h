@@ -0,0 +1,71 @@
+#pragma once
+
+//  Framing constants and message IDs shared by the comms library and
+//  anything else that needs to build or pick apart raw spa messages.
+//  See Protocol.txt for the wire format.
+
+//Each message requires MessageTerminators, MessageLength, MessageId (3 bytes), CrcByte
+//  MT ML MI MI MI ... CB MT
+const UINT cMessageOverhead = 7;
+const BYTE byMessageTerminator = 0x7e;
+const UINT uiPayloadStartOffset = 5;
+
+enum SpaResponseMessageIDs
+{
+	msStatus = 0xffaf13,
+	msConfigResponse = 0x0abf94,
+	msFilterConfig = 0x0abf23,
+	msControlConfig = 0x0abf24,
+	msControlConfig2 = 0x0abf2e,
+	msSetTempRange = 0xffaf26
+};
+
+enum SpaCommandMessageID
+{
+	msConfigRequest = 0x0abf04,
+	msFilterConfigRequest = 0x0abf22,
+	msToggleItemRequest = 0x0abf11,
+	msSetTempRequest = 0x0abf20,
+	msSetTempScaleRequest = 0x0abf27,
+	msSetTimeRequest = 0x0abf21,
+	msSetWiFiSettingsRequest = 0x0abf92,
+	msControlConfigRequest = 0x0abf22,
+	msSetFilterConfigRequest = 0x0abf23,
+};
+
+
+void FillInMessageOverhead(CByteArray &, SpaCommandMessageID, UINT uiPayloadLength);
+void FillInMessageCRC(CByteArray &);
+
+
+//  Longest possible message: the length byte covers everything but the
+//  terminators.
+const UINT cbMaxMessage = 0xff + 2;
+
+
+//  Reassembles complete messages from a byte stream that may split them,
+//  or run several together, at arbitrary points.  Messages that arrive
+//  whole are returned in place; only one split across reads is copied, into
+//  a fixed buffer, so the framer never allocates and its size is fixed.
+class CMessageFramer
+{
+public:
+	CMessageFramer();
+
+	//  The data has to stay put until GetNextMessage() returns FALSE.
+	void AddData(const BYTE *, size_t);
+
+	//  The message is valid until the next call.
+	BOOL GetNextMessage(const BYTE *&pMessage, size_t &cbMessage);
+	BOOL GetNextMessage(CByteArray &);
+
+	void Reset(void);
+
+private:
+	const BYTE *m_pInput;
+	size_t m_cbInput;
+
+	//  Start of a message carried over between reads.
+	BYTE m_Partial[cbMaxMessage];
+	size_t m_cbPartial;
+};
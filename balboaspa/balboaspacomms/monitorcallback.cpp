@@ -1,3 +1,147 @@
 #include "stdafx.h"
 #include "MonitorCallback.h"
 
+
+
+void
+IMonitorCallback::ProcessMessageBatch(
+	const SpaMessage *pMessages,
+	size_t cMessages)
+{
+	for (size_t i = 0; i < cMessages; i++)
+	{
+		const SpaMessage &Message = pMessages[i];
+
+		switch (Message.m_Type)
+		{
+		case smtStatus:
+			ProcessStatusMessage(*Message.m_pStatus);
+			break;
+
+		case smtConfigResponse:
+			ProcessConfigResponse(*Message.m_pConfigResponse);
+			break;
+
+		case smtFilterConfigResponse:
+			ProcessFilterConfigResponse(*Message.m_pFilterConfigResponse);
+			break;
+
+		case smtVersionInfoResponse:
+			ProcessVersionInfoResponse(*Message.m_pVersionInfoResponse);
+			break;
+
+		case smtControlConfig2Response:
+			ProcessControlConfig2Response(*Message.m_pControlConfig2Response);
+			break;
+
+		default:
+			ProcessUnknownMessageRaw(*Message.m_pUnknown);
+		}
+	}
+}
+
+
+CMessageBatch::CMessageBatch()
+	: m_fPointersSet(FALSE)
+{
+	Clear();
+}
+
+
+void
+CMessageBatch::Clear(void)
+{
+	m_Messages.clear();
+	m_Indexes.clear();
+	m_fPointersSet = FALSE;
+
+	m_cStatus = 0;
+	m_cConfigResponses = 0;
+	m_cFilterConfigResponses = 0;
+	m_cVersionInfoResponses = 0;
+	m_cControlConfig2Responses = 0;
+	m_cUnknown = 0;
+}
+
+
+//  Assigning over a slot left from an earlier batch reuses its buffers.
+template <class Message>
+void
+CMessageBatch::AddTo(
+	std::vector<Message> &Messages,
+	size_t &cUsed,
+	const Message &NewMessage,
+	SpaMessageType Type)
+{
+	if (cUsed < Messages.size())
+	{
+		Messages[cUsed] = NewMessage;
+	}
+	else
+	{
+		Messages.push_back(NewMessage);
+	}
+
+	SpaMessage Entry;
+
+	Entry.m_Type = Type;
+	Entry.m_pUnknown = NULL;
+
+	m_Messages.push_back(Entry);
+	m_Indexes.push_back(cUsed++);
+	m_fPointersSet = FALSE;
+}
+
+
+void CMessageBatch::Add(const StatusMessage &Message) { AddTo(m_Status, m_cStatus, Message, smtStatus); }
+void CMessageBatch::Add(const ConfigResponseMessage &Message) { AddTo(m_ConfigResponses, m_cConfigResponses, Message, smtConfigResponse); }
+void CMessageBatch::Add(const FilterConfigResponseMessage &Message) { AddTo(m_FilterConfigResponses, m_cFilterConfigResponses, Message, smtFilterConfigResponse); }
+void CMessageBatch::Add(const VersionInfoResponseMessage &Message) { AddTo(m_VersionInfoResponses, m_cVersionInfoResponses, Message, smtVersionInfoResponse); }
+void CMessageBatch::Add(const ControlConfig2ResponseMessage &Message) { AddTo(m_ControlConfig2Responses, m_cControlConfig2Responses, Message, smtControlConfig2Response); }
+void CMessageBatch::AddUnknown(const CByteArray &Message) { AddTo(m_Unknown, m_cUnknown, Message, smtUnknown); }
+
+
+//  The per type vectors may have moved while the batch was being built, so
+//  the pointers are only filled in once it's complete.
+const SpaMessage *
+CMessageBatch::GetMessages(void)
+{
+	if (!m_fPointersSet)
+	{
+		for (size_t i = 0; i < m_Messages.size(); i++)
+		{
+			SpaMessage &Message = m_Messages[i];
+			size_t uiIndex = m_Indexes[i];
+
+			switch (Message.m_Type)
+			{
+			case smtStatus:
+				Message.m_pStatus = &m_Status[uiIndex];
+				break;
+
+			case smtConfigResponse:
+				Message.m_pConfigResponse = &m_ConfigResponses[uiIndex];
+				break;
+
+			case smtFilterConfigResponse:
+				Message.m_pFilterConfigResponse = &m_FilterConfigResponses[uiIndex];
+				break;
+
+			case smtVersionInfoResponse:
+				Message.m_pVersionInfoResponse = &m_VersionInfoResponses[uiIndex];
+				break;
+
+			case smtControlConfig2Response:
+				Message.m_pControlConfig2Response = &m_ControlConfig2Responses[uiIndex];
+				break;
+
+			default:
+				Message.m_pUnknown = &m_Unknown[uiIndex];
+			}
+		}
+
+		m_fPointersSet = TRUE;
+	}
+
+	return m_Messages.empty() ? NULL : &m_Messages[0];
+}
@@ -46,7 +46,9 @@ struct RawResponseMessage
 };
 
 
-struct StatusMessage : public RawResponseMessage
+//  Decoded contents only, so it can be copied around without allocating; see
+//  CSpaComms::GetLatestStatus().
+struct StatusInfo
 {
 	SpaTime m_Time;
 	BOOL m_f24Time;
@@ -67,6 +69,10 @@ struct StatusMessage : public RawResponseMessage
 	BOOL m_fLights;
 };
 
+struct StatusMessage : public RawResponseMessage, public StatusInfo
+{
+};
+
 
 struct ConfigResponseMessage : public RawResponseMessage
 {
@@ -79,7 +85,7 @@ struct ControlConfig2ResponseMessage : public RawResponseMessage
 };
 
 
-struct FilterConfigResponseMessage : public RawResponseMessage
+struct FilterConfigInfo
 {
 	SpaTime m_Filter1StartTime;
 	UINT m_uiFilter1Duration;
@@ -89,6 +95,10 @@ struct FilterConfigResponseMessage : public RawResponseMessage
 	UINT m_uiFilter2Duration;
 };
 
+struct FilterConfigResponseMessage : public RawResponseMessage, public FilterConfigInfo
+{
+};
+
 struct VersionInfoResponseMessage : public RawResponseMessage
 {
 	string m_strModelName;
@@ -102,6 +112,48 @@ struct SetTempRangeResponseMessage: public RawResponseMessage
 	// Unknown contents
 };
 
+//  One decoded message, tagged with its type, for batch delivery.
+enum SpaMessageType
+{
+	smtStatus,
+	smtConfigResponse,
+	smtFilterConfigResponse,
+	smtVersionInfoResponse,
+	smtControlConfig2Response,
+	smtUnknown
+};
+
+struct SpaMessage
+{
+	SpaMessageType m_Type;
+
+	union
+	{
+		const StatusMessage *m_pStatus;
+		const ConfigResponseMessage *m_pConfigResponse;
+		const FilterConfigResponseMessage *m_pFilterConfigResponse;
+		const VersionInfoResponseMessage *m_pVersionInfoResponse;
+		const ControlConfig2ResponseMessage *m_pControlConfig2Response;
+		const CByteArray *m_pUnknown;
+	};
+};
+
+
+//  Sets of message types, for subscriptions; see CSpaComms::SetSubscriptions().
+enum SpaMessageMask
+{
+	smmNone = 0,
+	smmStatus = 1 << smtStatus,
+	smmConfigResponse = 1 << smtConfigResponse,
+	smmFilterConfigResponse = 1 << smtFilterConfigResponse,
+	smmVersionInfoResponse = 1 << smtVersionInfoResponse,
+	smmControlConfig2Response = 1 << smtControlConfig2Response,
+	smmUnknown = 1 << smtUnknown,
+
+	smmAll = (1 << (smtUnknown + 1)) - 1
+};
+
+
 class IMonitorCallback
 {
 public:
@@ -113,9 +165,63 @@ public:
 	virtual void ProcessSetTempRangeResponse(const SetTempRangeResponseMessage &) {};
 	virtual void ProcessUnknownMessageRaw(const CByteArray &) {};
 
+	//  With CSpaComms::SetBatchDelivery(), everything decoded from one read
+	//  comes here in a single call, in order, instead of to the methods
+	//  above; e.g. to take a lock once per read rather than per message.
+	//  The messages are only valid for the duration of the call.  By default
+	//  they're passed on to the methods above one at a time.
+	virtual void ProcessMessageBatch(const SpaMessage *, size_t cMessages);
+
 	virtual void Dispose(void) = 0;
 	virtual void OnFatalError(void) {};
 
 private:
 };
 
+
+
+//  Collects messages into a batch, keeping its storage from one batch to the
+//  next so that a steady stream doesn't allocate.
+class CMessageBatch
+{
+public:
+	CMessageBatch();
+
+	void Add(const StatusMessage &);
+	void Add(const ConfigResponseMessage &);
+	void Add(const FilterConfigResponseMessage &);
+	void Add(const VersionInfoResponseMessage &);
+	void Add(const ControlConfig2ResponseMessage &);
+	void AddUnknown(const CByteArray &);
+
+	size_t GetCount(void) const { return m_Messages.size(); };
+
+	//  Valid until the next Add() or Clear().
+	const SpaMessage *GetMessages(void);
+
+	void Clear(void);
+
+private:
+	template <class Message>
+	void AddTo(std::vector<Message> &, size_t &cUsed, const Message &, SpaMessageType);
+
+	std::vector<SpaMessage> m_Messages;
+	std::vector<size_t> m_Indexes;				//  Into the per type vector, parallel to m_Messages
+	BOOL m_fPointersSet;
+
+	//  Only the first m_cX of each are in this batch; the rest are kept
+	//  for their allocations.
+	std::vector<StatusMessage> m_Status;
+	std::vector<ConfigResponseMessage> m_ConfigResponses;
+	std::vector<FilterConfigResponseMessage> m_FilterConfigResponses;
+	std::vector<VersionInfoResponseMessage> m_VersionInfoResponses;
+	std::vector<ControlConfig2ResponseMessage> m_ControlConfig2Responses;
+	std::vector<CByteArray> m_Unknown;
+
+	size_t m_cStatus;
+	size_t m_cConfigResponses;
+	size_t m_cFilterConfigResponses;
+	size_t m_cVersionInfoResponses;
+	size_t m_cControlConfig2Responses;
+	size_t m_cUnknown;
+};
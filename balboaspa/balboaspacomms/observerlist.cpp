@@ -0,0 +1,398 @@
+#include "stdafx.h"
+#include "MonitorCallback.h"
+#include "DispatchQueue.h"
+#include "ObserverList.h"
+
+using std::mutex;
+using std::lock_guard;
+
+
+struct CObserverList::Observer
+{
+	Observer(IMonitorCallback *pObserver, DWORD dwMessages)
+		: m_pObserver(pObserver), m_pTarget(pObserver), m_dwMessages(dwMessages)
+	{};
+
+	IMonitorCallback *m_pObserver;
+	IMonitorCallback *m_pTarget;			//  The observer, or its queue
+	DWORD m_dwMessages;
+
+	//  Stopped when the last list holding the observer goes.
+	std::unique_ptr<CDispatchQueue> m_pQueue;
+};
+
+
+//  The list this thread is delivering for, if any; see Publish().
+static thread_local const CObserverList *t_pDelivering = NULL;
+
+
+CObserverList::CObserverList(
+	IMonitorCallback *pPrimary)
+	: m_pPrimary(pPrimary), m_pObservers(NULL), m_uiDeliverySequence(0)
+{}
+
+CObserverList::~CObserverList()
+{
+	delete m_pObservers.load();
+}
+
+
+void
+CObserverList::SetPrimary(
+	IMonitorCallback *pPrimary)
+{
+	m_pPrimary = pPrimary;
+}
+
+
+BOOL
+CObserverList::Subscribe(
+	IMonitorCallback *pObserver,
+	DWORD dwMessages,
+	ObserverDelivery Delivery)
+{
+	_ASSERT(pObserver != NULL);
+
+	auto pObserverEntry = std::make_shared<Observer>(pObserver, dwMessages);
+
+	if (Delivery == odQueued)
+	{
+		pObserverEntry->m_pQueue = std::make_unique<CDispatchQueue>(pObserver);
+
+		if (!pObserverEntry->m_pQueue->Start())
+		{
+			return FALSE;
+		}
+
+		pObserverEntry->m_pTarget = pObserverEntry->m_pQueue.get();
+	}
+
+	ObserverVectorList Unused;
+	UINT uiSequence;
+
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		const ObserverVector *pCurrent = m_pObservers.load();
+		std::unique_ptr<ObserverVector> pNew = std::make_unique<ObserverVector>();
+
+		if (pCurrent != NULL)
+		{
+			for (const auto &pEntry : *pCurrent)
+			{
+				if (pEntry->m_pObserver == pObserver)
+				{
+					return FALSE;
+				}
+			}
+
+			pNew->reserve(pCurrent->size() + 1);
+			*pNew = *pCurrent;
+		}
+
+		pNew->push_back(pObserverEntry);
+		uiSequence = Publish(pNew.release(), Unused);
+	}
+
+	WaitForDelivery(uiSequence);
+
+	return TRUE;
+}
+
+
+BOOL
+CObserverList::Unsubscribe(
+	IMonitorCallback *pObserver)
+{
+	ObserverVectorList Unused;
+	UINT uiSequence;
+
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		const ObserverVector *pCurrent = m_pObservers.load();
+
+		if (pCurrent == NULL)
+		{
+			return FALSE;
+		}
+
+		auto itObserver = std::find_if(pCurrent->begin(), pCurrent->end(),
+			[pObserver](const std::shared_ptr<Observer> &pEntry) { return pEntry->m_pObserver == pObserver; });
+
+		if (itObserver == pCurrent->end())
+		{
+			return FALSE;
+		}
+
+		if (pCurrent->size() == 1)
+		{
+			uiSequence = Publish(NULL, Unused);
+		}
+		else
+		{
+			std::unique_ptr<ObserverVector> pNew = std::make_unique<ObserverVector>();
+
+			pNew->reserve(pCurrent->size() - 1);
+			pNew->insert(pNew->end(), pCurrent->begin(), itObserver);
+			pNew->insert(pNew->end(), itObserver + 1, pCurrent->end());
+			uiSequence = Publish(pNew.release(), Unused);
+		}
+	}
+
+	WaitForDelivery(uiSequence);
+
+	return TRUE;
+}
+
+
+UINT
+CObserverList::GetCount(void) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	const ObserverVector *pCurrent = m_pObservers.load();
+
+	return (pCurrent != NULL) ? (UINT)pCurrent->size() : 0;
+}
+
+
+//  Swaps in the new list.  The old one goes in Unused, along with anything
+//  retired earlier and the observers dropped, for the caller to free once
+//  it's let go of m_mutex and waited out any delivery that might still be
+//  using them; returns the sequence to pass to WaitForDelivery().  A
+//  delivery that started after the swap sees the new list, so only one
+//  already under way (the sequence is odd) matters.
+//
+//  The wait is done without m_mutex, as the delivery's callbacks may be
+//  after it (to subscribe, unsubscribe or count), and so is the freeing:
+//  stopping a queue waits for its thread, which may be too.
+//
+//  From inside a callback the delivery can't finish until this returns, so
+//  the old list is kept until the next change instead.
+UINT
+CObserverList::Publish(
+	ObserverVector *pObservers,
+	ObserverVectorList &Unused)
+{
+	std::unique_ptr<const ObserverVector> pOld(m_pObservers.exchange(pObservers));
+
+	if (t_pDelivering == this)
+	{
+		if (pOld)
+		{
+			m_Retired.push_back(std::move(pOld));
+		}
+
+		return 0;
+	}
+
+	//  Anything retired was swapped out during a delivery that's either
+	//  over or the one under way, so it's done with by the same wait.
+	Unused.swap(m_Retired);
+
+	if (pOld)
+	{
+		Unused.push_back(std::move(pOld));
+	}
+
+	return m_uiDeliverySequence.load();
+}
+
+
+//  Even means no delivery was under way.
+void
+CObserverList::WaitForDelivery(
+	UINT uiSequence) const
+{
+	if ((uiSequence & 1) != 0)
+	{
+		while (m_uiDeliverySequence.load() == uiSequence)
+		{
+			Sleep(0);
+		}
+	}
+}
+
+
+//  pOuter is for a delivery from inside another list's callbacks.
+const CObserverList::ObserverVector *
+CObserverList::BeginDelivery(
+	const CObserverList *&pOuter)
+{
+	//  The sequence has to go odd before the list is loaded, or a writer
+	//  could swap it out and free it in between.
+	m_uiDeliverySequence.fetch_add(1);
+	pOuter = t_pDelivering;
+	t_pDelivering = this;
+
+	return m_pObservers.load();
+}
+
+
+void
+CObserverList::EndDelivery(
+	const CObserverList *pOuter)
+{
+	t_pDelivering = pOuter;
+	m_uiDeliverySequence.fetch_add(1);
+}
+
+
+//  With no observers there's nothing for a writer to free, so the sequence
+//  is left alone.
+template <class Message>
+void
+CObserverList::Deliver(
+	SpaMessageType Type,
+	const Message &NewMessage,
+	void (IMonitorCallback::*pProcess)(const Message &))
+{
+	(m_pPrimary->*pProcess)(NewMessage);
+
+	if (m_pObservers.load(std::memory_order_relaxed) == NULL)
+	{
+		return;
+	}
+
+	const CObserverList *pOuter;
+	const ObserverVector *pObservers = BeginDelivery(pOuter);
+
+	if (pObservers != NULL)
+	{
+		DWORD dwType = 1 << Type;
+
+		for (const auto &pEntry : *pObservers)
+		{
+			if ((pEntry->m_dwMessages & dwType) != 0)
+			{
+				(pEntry->m_pTarget->*pProcess)(NewMessage);
+			}
+		}
+	}
+
+	EndDelivery(pOuter);
+}
+
+
+void
+CObserverList::ProcessStatusMessage(
+	const StatusMessage &Message)
+{
+	Deliver(smtStatus, Message, &IMonitorCallback::ProcessStatusMessage);
+}
+
+
+void
+CObserverList::ProcessConfigResponse(
+	const ConfigResponseMessage &Message)
+{
+	Deliver(smtConfigResponse, Message, &IMonitorCallback::ProcessConfigResponse);
+}
+
+
+void
+CObserverList::ProcessFilterConfigResponse(
+	const FilterConfigResponseMessage &Message)
+{
+	Deliver(smtFilterConfigResponse, Message, &IMonitorCallback::ProcessFilterConfigResponse);
+}
+
+
+void
+CObserverList::ProcessVersionInfoResponse(
+	const VersionInfoResponseMessage &Message)
+{
+	Deliver(smtVersionInfoResponse, Message, &IMonitorCallback::ProcessVersionInfoResponse);
+}
+
+
+void
+CObserverList::ProcessControlConfig2Response(
+	const ControlConfig2ResponseMessage &Message)
+{
+	Deliver(smtControlConfig2Response, Message, &IMonitorCallback::ProcessControlConfig2Response);
+}
+
+
+void
+CObserverList::ProcessUnknownMessageRaw(
+	const CByteArray &Message)
+{
+	Deliver(smtUnknown, Message, &IMonitorCallback::ProcessUnknownMessageRaw);
+}
+
+
+//  An observer that wants every type in the batch gets it as is; otherwise
+//  just the messages it wants, as batches of one, so that a batch isn't
+//  built per observer.
+void
+CObserverList::ProcessMessageBatch(
+	const SpaMessage *pMessages,
+	size_t cMessages)
+{
+	m_pPrimary->ProcessMessageBatch(pMessages, cMessages);
+
+	if (m_pObservers.load(std::memory_order_relaxed) == NULL)
+	{
+		return;
+	}
+
+	const CObserverList *pOuter;
+	const ObserverVector *pObservers = BeginDelivery(pOuter);
+
+	if (pObservers != NULL)
+	{
+		DWORD dwTypes = 0;
+
+		for (size_t i = 0; i < cMessages; i++)
+		{
+			dwTypes |= 1 << pMessages[i].m_Type;
+		}
+
+		for (const auto &pEntry : *pObservers)
+		{
+			if ((pEntry->m_dwMessages & dwTypes) == dwTypes)
+			{
+				pEntry->m_pTarget->ProcessMessageBatch(pMessages, cMessages);
+			}
+			else if ((pEntry->m_dwMessages & dwTypes) != 0)
+			{
+				for (size_t i = 0; i < cMessages; i++)
+				{
+					if ((pEntry->m_dwMessages & (1 << pMessages[i].m_Type)) != 0)
+					{
+						pEntry->m_pTarget->ProcessMessageBatch(pMessages + i, 1);
+					}
+				}
+			}
+		}
+	}
+
+	EndDelivery(pOuter);
+}
+
+
+void
+CObserverList::OnFatalError(void)
+{
+	m_pPrimary->OnFatalError();
+
+	if (m_pObservers.load(std::memory_order_relaxed) == NULL)
+	{
+		return;
+	}
+
+	const CObserverList *pOuter;
+	const ObserverVector *pObservers = BeginDelivery(pOuter);
+
+	if (pObservers != NULL)
+	{
+		for (const auto &pEntry : *pObservers)
+		{
+			pEntry->m_pTarget->OnFatalError();
+		}
+	}
+
+	EndDelivery(pOuter);
+}
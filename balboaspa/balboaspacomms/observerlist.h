@@ -0,0 +1,92 @@
+#pragma once
+
+//  Passes each message on to a primary IMonitorCallback, and then to any
+//  number of observers that come and go while the spa is being monitored;
+//  e.g. a logger, a metrics exporter and a UI all watching the same spa.
+//  See CSpaComms::Subscribe().
+//
+//  The list of observers is copy on write.  Subscribe() and Unsubscribe()
+//  build a new list and swap it in, then wait for any delivery still using
+//  the old one to finish before freeing it; delivery just follows the
+//  current list, without taking a lock or allocating.  With no observers,
+//  delivery to the primary costs one extra load.
+//
+//  Deliveries to one list mustn't overlap, i.e. it's fed by one thread at a
+//  time, as with a CSpaComms.
+
+enum ObserverDelivery
+{
+	odDirect,				//  On the thread feeding the list, as with the primary
+	odQueued				//  Through a CDispatchQueue of the observer's own
+};
+
+
+class CObserverList :
+	public IMonitorCallback
+{
+public:
+	CObserverList(IMonitorCallback *pPrimary);
+	~CObserverList();
+
+	//  Not while messages are being delivered.
+	void SetPrimary(IMonitorCallback *);
+
+	//  The observer gets the SpaMessageMask types in dwMessages, and
+	//  OnFatalError(), and stays the caller's to dispose of.  FALSE if it's
+	//  already subscribed, or its queue couldn't be started.
+	BOOL Subscribe(IMonitorCallback *, DWORD dwMessages = smmAll, ObserverDelivery = odDirect);
+
+	//  Once this returns, the observer won't be called again; except that
+	//  from inside a callback, the message being delivered may still reach
+	//  it.  A queued observer can't unsubscribe itself from its own
+	//  callbacks.
+	BOOL Unsubscribe(IMonitorCallback *);
+
+	UINT GetCount(void) const;
+
+	//  IMonitorCallback
+	void ProcessStatusMessage(const StatusMessage &);
+	void ProcessConfigResponse(const ConfigResponseMessage &);
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &);
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &);
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &);
+	void ProcessUnknownMessageRaw(const CByteArray &);
+	void ProcessMessageBatch(const SpaMessage *, size_t cMessages);
+	void OnFatalError(void);
+
+	//  The primary is its owner's to dispose of.
+	void Dispose(void) {};
+
+private:
+	struct Observer;
+	typedef std::vector<std::shared_ptr<Observer>> ObserverVector;
+	typedef std::vector<std::unique_ptr<const ObserverVector>> ObserverVectorList;
+
+	template <class Message>
+	void Deliver(SpaMessageType, const Message &, void (IMonitorCallback::*)(const Message &));
+
+	//  Bracket every use of m_pObservers by delivery.
+	const ObserverVector *BeginDelivery(const CObserverList *&pOuter);
+	void EndDelivery(const CObserverList *pOuter);
+
+	//  Caller holds m_mutex.  Takes ownership of pObservers, NULL for none.
+	UINT Publish(ObserverVector *pObservers, ObserverVectorList &Unused);
+
+	//  Caller doesn't hold m_mutex, and frees Unused after.
+	void WaitForDelivery(UINT uiSequence) const;
+
+	IMonitorCallback *m_pPrimary;
+
+	std::atomic<const ObserverVector *> m_pObservers;
+
+	//  Odd while a delivery is using m_pObservers.
+	std::atomic<UINT> m_uiDeliverySequence;
+
+	//  Writers only.  Lists swapped out from inside a callback, which can't
+	//  wait for the delivery to finish; freed by the next change.
+	mutable std::mutex m_mutex;
+	ObserverVectorList m_Retired;
+
+	//  Disallowed operations.
+	const CObserverList & operator=(const CObserverList &) { return *this; };
+};
@@ -0,0 +1,317 @@
+#include "stdafx.h"
+#include "Discovery.h"
+#include "PassiveDiscovery.h"
+
+#include <iphlpapi.h>
+#pragma comment(lib, "Iphlpapi.lib")
+
+
+const BYTE byBalboaOUI[3] = { 0x00, 0x15, 0x27 };
+
+//  Same format as the discovery response.
+const char *szBalboaMACPrefix = "00-15-27-";
+const size_t cchMACAddress = 17;
+
+//  Lease file fields are separated by white space or these.
+const char *szSeparators = " \t\r\n;,{}()[]\"";
+
+
+PassiveDiscoveryOptions::PassiveDiscoveryOptions()
+	: m_fNeighbourTable(TRUE), m_dwConnectTimeoutMs(500)
+{}
+
+
+static void
+FormatMACAddress(
+	const BYTE *pAddress,
+	string &strMACAddress)
+{
+	char szMACAddress[cchMACAddress + 1];
+
+	sprintf_s(szMACAddress, "%02X-%02X-%02X-%02X-%02X-%02X",
+			  pAddress[0], pAddress[1], pAddress[2], pAddress[3], pAddress[4], pAddress[5]);
+
+	strMACAddress = szMACAddress;
+}
+
+
+static int
+HexDigit(
+	char ch)
+{
+	if ((ch >= '0') && (ch <= '9'))
+	{
+		return ch - '0';
+	}
+
+	if ((ch >= 'a') && (ch <= 'f'))
+	{
+		return ch - 'a' + 10;
+	}
+
+	if ((ch >= 'A') && (ch <= 'F'))
+	{
+		return ch - 'A' + 10;
+	}
+
+	return -1;
+}
+
+
+//  "00:15:27:AB:CD:EF" or "00-15-27-ab-cd-ef".
+static BOOL
+ParseMACAddress(
+	const char *pToken,
+	size_t cchToken,
+	BYTE *pAddress)
+{
+	if (cchToken != cchMACAddress)
+	{
+		return FALSE;
+	}
+
+	char chSeparator = pToken[2];
+
+	if ((chSeparator != ':') && (chSeparator != '-'))
+	{
+		return FALSE;
+	}
+
+	for (UINT i = 0; i < 6; i++)
+	{
+		const char *pByte = &pToken[i * 3];
+		int iHigh = HexDigit(pByte[0]);
+		int iLow = HexDigit(pByte[1]);
+
+		if ((iHigh < 0) || (iLow < 0) || ((i < 5) && (pByte[2] != chSeparator)))
+		{
+			return FALSE;
+		}
+
+		pAddress[i] = (BYTE)((iHigh << 4) | iLow);
+	}
+
+	return TRUE;
+}
+
+
+static BOOL
+ParseIPAddress(
+	const char *pToken,
+	size_t cchToken,
+	in_addr &Address)
+{
+	char szToken[INET_ADDRSTRLEN];
+
+	if (cchToken >= sizeof(szToken))
+	{
+		return FALSE;
+	}
+
+	memcpy(szToken, pToken, cchToken);
+	szToken[cchToken] = '\0';
+
+	return (inet_pton(AF_INET, szToken, &Address) == 1);
+}
+
+
+//  Adds the spa, or updates its address if fReplace.
+static void
+AddCandidate(
+	SpaAddressVector &Candidates,
+	const in_addr &Address,
+	const string &strMACAddress,
+	BOOL fReplace)
+{
+	sockaddr_in SpaAddress;
+
+	memset(&SpaAddress, 0, sizeof(SpaAddress));
+	SpaAddress.sin_family = AF_INET;
+	SpaAddress.sin_addr = Address;
+
+	for (auto pSpa = Candidates.begin(); pSpa != Candidates.end(); pSpa++)
+	{
+		if (_stricmp(pSpa->m_strMACAddress.c_str(), strMACAddress.c_str()) == 0)
+		{
+			if (fReplace)
+			{
+				pSpa->m_SpaAddress = SpaAddress;
+			}
+
+			return;
+		}
+	}
+
+	Candidates.push_back(CSpaAddress(SpaAddress, strMACAddress));
+}
+
+
+static BOOL
+ReadNeighbourTable(
+	SpaAddressVector &Candidates)
+{
+	MIB_IPNET_TABLE2 *pTable;
+	DWORD dwResult = GetIpNetTable2(AF_INET, &pTable);
+
+	if (dwResult != NO_ERROR)
+	{
+		_RPTWN(_CRT_WARN, L"GetIpNetTable2 failed with error: %lu\n", dwResult);
+		return FALSE;
+	}
+
+	for (ULONG i = 0; i < pTable->NumEntries; i++)
+	{
+		const MIB_IPNET_ROW2 &Row = pTable->Table[i];
+
+		if ((Row.PhysicalAddressLength != 6) ||
+			(Row.State == NlnsUnreachable) || (Row.State == NlnsIncomplete) ||
+			(memcmp(Row.PhysicalAddress, byBalboaOUI, sizeof(byBalboaOUI)) != 0))
+		{
+			continue;
+		}
+
+		string strMACAddress;
+
+		FormatMACAddress(Row.PhysicalAddress, strMACAddress);
+		AddCandidate(Candidates, Row.Address.Ipv4.sin_addr, strMACAddress, FALSE);
+	}
+
+	FreeMibTable(pTable);
+
+	return TRUE;
+}
+
+
+//  Line based, so it copes with most formats: a Balboa MAC address is paired
+//  with an IP address on the same line or, failing that, the last one
+//  before it (ISC dhcpd puts them on separate lines of a "lease" block).
+//  Later entries win, as lease files are appended to.
+static BOOL
+ReadLeaseFile(
+	const WCHAR *szFileName,
+	SpaAddressVector &Candidates)
+{
+	FILE *fhIn;
+
+	if (_wfopen_s(&fhIn, szFileName, L"r") != 0)
+	{
+		_RPTWN(_CRT_WARN, L"Unable to open %s\n", szFileName);
+		return FALSE;
+	}
+
+	char szLine[1024];
+	in_addr LastAddress;
+	BOOL fHaveAddress = FALSE;
+
+	while (fgets(szLine, sizeof(szLine), fhIn) != NULL)
+	{
+		in_addr LineAddress;
+		BOOL fLineAddress = FALSE;
+		std::vector<string> MACAddresses;
+
+		for (const char *pToken = szLine; *pToken != '\0';)
+		{
+			pToken += strspn(pToken, szSeparators);
+
+			size_t cchToken = strcspn(pToken, szSeparators);
+			BYTE MACAddress[6];
+
+			if (cchToken == 0)
+			{
+				break;
+			}
+
+			if (!fLineAddress && ParseIPAddress(pToken, cchToken, LineAddress))
+			{
+				fLineAddress = TRUE;
+			}
+			else if (ParseMACAddress(pToken, cchToken, MACAddress) &&
+					 (memcmp(MACAddress, byBalboaOUI, sizeof(byBalboaOUI)) == 0))
+			{
+				string strMACAddress;
+
+				FormatMACAddress(MACAddress, strMACAddress);
+				MACAddresses.push_back(strMACAddress);
+			}
+
+			pToken += cchToken;
+		}
+
+		if (fLineAddress)
+		{
+			LastAddress = LineAddress;
+			fHaveAddress = TRUE;
+		}
+
+		for (auto pMAC = MACAddresses.cbegin(); fHaveAddress && (pMAC != MACAddresses.cend()); pMAC++)
+		{
+			AddCandidate(Candidates, LastAddress, *pMAC, TRUE);
+		}
+	}
+
+	fclose(fhIn);
+
+	return TRUE;
+}
+
+
+BOOL
+FindSpaCandidates(
+	const PassiveDiscoveryOptions &Options,
+	SpaAddressVector &Candidates)
+{
+	BOOL fRead = FALSE;
+
+	Candidates.clear();
+
+	if (Options.m_fNeighbourTable)
+	{
+		fRead |= ReadNeighbourTable(Candidates);
+	}
+
+	//  Lease entries can't displace what's in the neighbour table, which is
+	//  more current.
+	SpaAddressVector Leases;
+
+	for (auto pFile = Options.m_LeaseFiles.cbegin(); pFile != Options.m_LeaseFiles.cend(); pFile++)
+	{
+		fRead |= ReadLeaseFile(pFile->c_str(), Leases);
+	}
+
+	for (auto pSpa = Leases.cbegin(); pSpa != Leases.cend(); pSpa++)
+	{
+		AddCandidate(Candidates, pSpa->m_SpaAddress.sin_addr, pSpa->m_strMACAddress, FALSE);
+	}
+
+	return fRead;
+}
+
+
+UINT
+FindSpasPassively(
+	SpaAddressVector &Spas,
+	std::vector<SOCKET> &Sockets,
+	const PassiveDiscoveryOptions &Options)
+{
+	Sockets.clear();
+
+	if (!FindSpaCandidates(Options, Spas) || Spas.empty())
+	{
+		Spas.clear();
+		return 0;
+	}
+
+	UINT cConnected = ConnectToSpas(Spas, Options.m_dwConnectTimeoutMs, Sockets);
+
+	//  Stale entries, or not a spa after all.
+	for (size_t i = Spas.size(); i-- > 0;)
+	{
+		if (Sockets[i] == INVALID_SOCKET)
+		{
+			Spas.erase(Spas.begin() + i);
+			Sockets.erase(Sockets.begin() + i);
+		}
+	}
+
+	return cConnected;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+//  Zero traffic discovery.  Balboa modules all have MAC addresses starting
+//  00-15-27, so any such address in the neighbour (ARP) table or in a DHCP
+//  lease file is probably a spa; each candidate is then checked by
+//  connecting to its control port.  Gives results straight away, even where
+//  broadcasts are filtered, and adds no broadcast load.  It only finds spas
+//  this machine (or the DHCP server) has talked to recently, though, so
+//  CSpaDiscovery is still needed to be sure of finding them all.
+
+struct PassiveDiscoveryOptions
+{
+	PassiveDiscoveryOptions();
+
+	//  Read this machine's IPv4 neighbour table.
+	BOOL m_fNeighbourTable;
+
+	//  Text files listing IP and MAC address pairs: dnsmasq or ISC dhcpd
+	//  leases, or ARP tables ("arp -a", /proc/net/arp) copied from a router.
+	std::vector<std::wstring> m_LeaseFiles;
+
+	//  For the connect check; see ConnectToSpas().
+	DWORD m_dwConnectTimeoutMs;
+};
+
+
+//  Spas listed in the tables, unchecked.  Each MAC address appears once; the
+//  neighbour table is preferred, then the last entry in the lease files.
+//  Fails only if none of the tables could be read.
+BOOL FindSpaCandidates(const PassiveDiscoveryOptions &, SpaAddressVector &Candidates);
+
+//  Candidates that accept a connection.  Sockets[i] is connected to Spas[i],
+//  ready for CSpaComms::StartMonitor(SOCKET); the caller closes any it
+//  doesn't use.  Returns the number of spas found.
+UINT FindSpasPassively(SpaAddressVector &Spas, std::vector<SOCKET> &Sockets, const PassiveDiscoveryOptions & = PassiveDiscoveryOptions());
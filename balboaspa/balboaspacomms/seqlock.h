@@ -0,0 +1,68 @@
+#pragma once
+
+//  Single writer, many reader snapshot of a plain (trivially copyable)
+//  struct.  The writer never waits for readers; a reader that overlaps a
+//  write just copies again.  Neither side allocates or takes a lock.
+//
+//  The sequence is odd while a write is in progress, and goes up by two for
+//  each completed write, so zero means "never written".
+
+template <typename T>
+class CSeqLock
+{
+	static_assert(std::is_trivially_copyable<T>::value, "CSeqLock needs a plain struct");
+
+public:
+	CSeqLock() : m_uiSequence(0)
+	{
+		memset(&m_Value, 0, sizeof(m_Value));
+	};
+
+	//  Writer thread only.
+	void Write(const T &Value)
+	{
+		UINT uiSequence = m_uiSequence.load(std::memory_order_relaxed);
+
+		m_uiSequence.store(uiSequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		memcpy(&m_Value, &Value, sizeof(m_Value));
+
+		m_uiSequence.store(uiSequence + 2, std::memory_order_release);
+	};
+
+	//  Returns the sequence of the copied value.
+	UINT Read(T &Value) const
+	{
+		for (;;)
+		{
+			UINT uiBefore = m_uiSequence.load(std::memory_order_acquire);
+
+			if ((uiBefore & 1) == 0)
+			{
+				memcpy(&Value, &m_Value, sizeof(m_Value));
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if (m_uiSequence.load(std::memory_order_relaxed) == uiBefore)
+				{
+					return uiBefore;
+				}
+			}
+
+			YieldProcessor();
+		}
+	};
+
+	UINT GetSequence(void) const
+	{
+		return m_uiSequence.load(std::memory_order_acquire);
+	};
+
+private:
+	std::atomic<UINT> m_uiSequence;
+	T m_Value;
+
+	//  Disallowed operations.
+	CSeqLock(const CSeqLock &);
+	const CSeqLock & operator=(const CSeqLock &) { return *this; };
+};
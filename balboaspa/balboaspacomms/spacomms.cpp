@@ -2,7 +2,15 @@
 #include "stdafx.h"
 #include "Discovery.h"
 #include "MonitorCallback.h"
+#include "ObserverList.h"
 #include "SpaComms.h"
+#include "CommandLatency.h"
+#include "CompletionPort.h"
+#include "DispatchQueue.h"
+#include "MessageFormat.h"
+#include "SpaMonitor.h"
+#include "SeqLock.h"
+#include "StateSegment.h"
 #include "Debug.h"
 
 typedef uint8_t crc;
@@ -12,21 +20,75 @@ typedef uint8_t crc;
 
 const u_short usConnectionPort = 4257;
 
-struct CSpaComms::sPrivateData
+//  Also the handler for m_Monitor: keeps the latest state up to date, then
+//  passes each message on to the IMonitorCallback and any observers.  And, when monitoring
+//  through a completion port, the port's client.
+struct CSpaComms::sPrivateData :
+	public CMonitorCallbackHandler,
+	public ISpaPortClient
 {
-	sPrivateData(SOCKET s);
+	sPrivateData(SOCKET s, IMonitorCallback *, BOOL fCoalesce);
 	SOCKET m_SpaSocket;
+	CSpaMonitor<sPrivateData> m_Monitor;
+
+	CSpaCompletionPort *m_pPort;
+	CSpaCompletionPort::Connection *m_pPortConnection;
+
+	//  By the monitor thread, and senders; see GetSystemCallCount().
+	std::atomic<UINT64> m_cSystemCalls;
+
+	void OnSpaData(const BYTE *pData, size_t cbData) { m_Monitor.ProcessIncomingData(pData, cbData); };
+	void OnSpaFailed(void) { m_pCallback->OnFatalError(); };
+
+	//  m_pCallback.  The primary is the IMonitorCallback, or with
+	//  SetQueuedDelivery() the queue, which passes on to it.  The queue runs
+	//  while monitoring.
+	CObserverList m_Observers;
+	std::unique_ptr<CDispatchQueue> m_pQueue;
+
+	void SetQueuedDelivery(IMonitorCallback *, BOOL fQueued);
+	BOOL StartQueue(void) { return !m_pQueue || m_pQueue->Start(); };
+	void StopQueue(void) { if (m_pQueue) m_pQueue->Stop(); };
+
+	//  Written by the monitor thread, read by anyone; see GetLatestStatus().
+	CSeqLock<StatusInfo> m_LatestStatus;
+	CSeqLock<FilterConfigInfo> m_LatestFilterConfig;
+	std::atomic<UINT> m_uiStateVersion;
+
+	CSpaStateSegment *m_pStateSegment;
+	UINT m_uiStateSlot;
+
+	//  Told of commands just before they're sent; see AttachLatencyTracker().
+	CCommandLatency *m_pLatency;
+
+	//  What the callback asked for; see UpdateSubscriptions().
+	DWORD m_dwDecoded;
+	DWORD m_dwRaw;
+
+	void UpdateSubscriptions(void);
+
+	void OnStatusChanged(const StatusMessage &);
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &);
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &);
 };
 
 
+//  What's kept per spa is sPrivateData, in one block, and the message
+//  buffers its monitor allocates for the first message of each type
+//  (cbMonitorMessageBuffers).  Nothing else is allocated on the data path,
+//  so a fleet's memory is this times the number of spas.  The exceptions
+//  are a batch, with SetBatchDelivery(), the queue with SetQueuedDelivery(),
+//  and the list of observers with Subscribe().
+const size_t cbMaxConnectionState = 2048;
+
+
 CSpaComms::CSpaComms(
 	const CSpaAddress &SpaAddress,
 	IMonitorCallback *pCallback,
 	BOOL fCoalesce)
 	: m_SpaAddress(SpaAddress), m_hMonitorThread(0), m_fShutDown(FALSE),
-	m_fCoalesce(fCoalesce),
-	m_PreviousStatusMessage(64), m_pCallback(pCallback),
-	m_pData(std::make_unique<CSpaComms::sPrivateData>(INVALID_SOCKET))
+	m_pCallback(pCallback),
+	m_pData(std::make_unique<CSpaComms::sPrivateData>(INVALID_SOCKET, pCallback, fCoalesce))
 {
 	F_CRC_InicializaTabla();
 }
@@ -45,16 +107,16 @@ CSpaComms::~CSpaComms()
 
 BOOL CSpaComms::StartMonitor(void)
 {
-	if (m_hMonitorThread != 0)
+	if (IsMonitoring())
 	{
 		//  Already running
 		return FALSE;
 	}
 
-	m_pData->m_SpaSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	SOCKET SpaSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	SOCKET iResult = INVALID_SOCKET;
 
-	if (m_pData->m_SpaSocket == INVALID_SOCKET)
+	if (SpaSocket == INVALID_SOCKET)
 	{
 		//  We don't really expect to hit this case.
 		return FALSE;
@@ -63,34 +125,116 @@ BOOL CSpaComms::StartMonitor(void)
 	sockaddr_in SpaAddressPort = m_SpaAddress.m_SpaAddress;
 	SpaAddressPort.sin_port = htons(usConnectionPort);
 
-	iResult = connect(m_pData->m_SpaSocket, (const sockaddr *)&SpaAddressPort, sizeof(SpaAddressPort));
+	iResult = connect(SpaSocket, (const sockaddr *)&SpaAddressPort, sizeof(SpaAddressPort));
 
 	if (iResult == INVALID_SOCKET)
 	{
 		//  Unable to connect to Spa - perhaps already in use by another app?
 		int iError = WSAGetLastError();
-		closesocket(m_pData->m_SpaSocket);
-		m_pData->m_SpaSocket = INVALID_SOCKET;
+		closesocket(SpaSocket);
 
 		return FALSE;
 	}
+
+	if (!StartMonitor(SpaSocket))
+	{
+		closesocket(SpaSocket);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+BOOL CSpaComms::StartMonitor(SOCKET ConnectedSocket)
+{
+	if (IsMonitoring() || (ConnectedSocket == INVALID_SOCKET))
+	{
+		return FALSE;
+	}
+
+	if (!m_pData->StartQueue())
+	{
+		return FALSE;
+	}
+
+	m_pData->m_Monitor.Reset();
+	m_pData->m_SpaSocket = ConnectedSocket;
+
 	m_hMonitorThread = (HANDLE) _beginthreadex(NULL, 0, CSpaComms::MonitorThreadProc, this, 0, NULL);
 
-	return (m_hMonitorThread != 0);
+	if (m_hMonitorThread == 0)
+	{
+		//  Still the caller's.
+		m_pData->m_SpaSocket = INVALID_SOCKET;
+		m_pData->StopQueue();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaComms::StartMonitor(
+	SOCKET ConnectedSocket,
+	CSpaCompletionPort *pPort)
+{
+	if (IsMonitoring() || (ConnectedSocket == INVALID_SOCKET) || (pPort == NULL))
+	{
+		return FALSE;
+	}
+
+	if (!m_pData->StartQueue())
+	{
+		return FALSE;
+	}
+
+	m_pData->m_Monitor.Reset();
+	m_pData->m_SpaSocket = ConnectedSocket;
+	m_pData->m_pPort = pPort;
+	m_pData->m_pPortConnection = pPort->Add(ConnectedSocket, m_pData.get());
+
+	if (m_pData->m_pPortConnection == NULL)
+	{
+		m_pData->m_SpaSocket = INVALID_SOCKET;
+		m_pData->m_pPort = NULL;
+		m_pData->StopQueue();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaComms::IsMonitoring(void) const
+{
+	return (m_hMonitorThread != 0) || (m_pData->m_pPortConnection != NULL);
 }
 
 
 void CSpaComms::EndMonitor()
 {
-	m_fShutDown = TRUE;
+	if (m_pData->m_pPortConnection != NULL)
+	{
+		m_pData->m_pPort->Remove(m_pData->m_pPortConnection);
+		m_pData->m_pPortConnection = NULL;
+		m_pData->m_pPort = NULL;
+	}
+
 	if (m_hMonitorThread != 0)
 	{
+		m_fShutDown = TRUE;
 		WaitForSingleObject(m_hMonitorThread, INFINITE);
 		CloseHandle(m_hMonitorThread);
 		m_hMonitorThread = 0;
 		m_fShutDown = FALSE;
 	}
 
+	//  After the monitor, which feeds it.
+	m_pData->StopQueue();
+
 	if (m_pData->m_SpaSocket != INVALID_SOCKET)
 	{
 		closesocket(m_pData->m_SpaSocket);
@@ -106,11 +250,6 @@ CSpaComms::MonitorThreadProc(
 }
 
 
-//Each message requires MessageTerminators, MessageLength, MessageId (3 bytes), CrcByte
-//  MT ML MI MI MI ... CB MT
-const UINT cMessageOverhead = 7;
-const BYTE byMessageTerminator = 0x7e;
-
 #ifdef _DEBUG
 //  Force a small size to exercize buffer stitching code
 const size_t uiRecvBufferSize = 15;
@@ -130,8 +269,7 @@ CSpaComms::MonitorThreadProc()
 	tvTimeout.tv_sec = 1;
 	tvTimeout.tv_usec = 0;
 
-	CByteArray LeftOvers;
-	LeftOvers.reserve(1024);
+	BYTE RecvBuffer[uiRecvBufferSize];
 
 	while (!m_fShutDown)
 	{
@@ -140,81 +278,33 @@ CSpaComms::MonitorThreadProc()
 		FD_ZERO(&fsIncoming);
 		FD_SET(m_pData->m_SpaSocket, &fsIncoming);
 
-		CByteArray RecvBuffer(uiRecvBufferSize);
-
 		int iResult = select(0, &fsIncoming, NULL, NULL, &tvTimeout);
 
+		m_pData->m_cSystemCalls.fetch_add(1, std::memory_order_relaxed);
+
 		if (iResult == SOCKET_ERROR)
 		{
 			int iError = WSAGetLastError();
-			m_pCallback->OnFatalError();
+			m_pData->OnSpaFailed();
 			return 0;
 		}
 
 		if (iResult > 0)
 		{
 			uiTimeouts = 0;
-			RecvBuffer.resize(uiRecvBufferSize);
 
-			iResult = recv(m_pData->m_SpaSocket, (char *)&*RecvBuffer.begin(), (int)RecvBuffer.size(), 0);
+			iResult = recv(m_pData->m_SpaSocket, (char *)RecvBuffer, sizeof(RecvBuffer), 0);
+			m_pData->m_cSystemCalls.fetch_add(1, std::memory_order_relaxed);
 
 			if (iResult == SOCKET_ERROR)
 			{
 				int iError = WSAGetLastError();
-				m_pCallback->OnFatalError();
+				m_pData->OnSpaFailed();
 				return 0;
 			}
 			else
 			{
-				RecvBuffer.resize(iResult);
-
-				//  Add our current input to whatever was leftover from last-time.
-				LeftOvers.insert(LeftOvers.end(), RecvBuffer.begin(), RecvBuffer.end());
-
-				auto pByte = LeftOvers.cbegin();
-
-				// Locate beginning of message.  We expect it to be at the begining of the buffer,
-				// but let's make sure, shall we?
-				_ASSERT(*pByte == byMessageTerminator);
-
-				while (pByte != LeftOvers.cend() && *pByte != byMessageTerminator)
-				{
-					pByte++;
-				}
-
-				if (pByte != LeftOvers.cbegin())
-				{
-					LeftOvers.erase(LeftOvers.cbegin(), pByte);
-				}
-
-				//  May have multiple messages now in the buffer.
-				while (LeftOvers.size() >= cMessageOverhead)
-				{
-					pByte = LeftOvers.cbegin();
-					pByte++;
-
-					//  Get size of payload
-					BYTE bySize = *pByte;
-
-					if (LeftOvers.cend() - pByte > bySize)
-					{
-						//  Skip over the payload.
-						pByte += bySize;
-
-						_ASSERT(*pByte == byMessageTerminator);
-
-						//  Extract complete message, remove from 'LeftOvers', process.
-						CByteArray Message(LeftOvers.cbegin(), pByte + 1);
-
-						LeftOvers.erase(LeftOvers.cbegin(), pByte + 1);
-						ProcessMessage(Message);
-					}
-					else
-					{
-						//  Buffer has one incomplete message.  Wait for more input.
-						break;
-					}
-				}
+				ProcessIncomingData(RecvBuffer, iResult);
 			}
 		}
 		else
@@ -224,7 +314,7 @@ CSpaComms::MonitorThreadProc()
 			
 			if (uiTimeouts >= 5)
 			{
-				m_pCallback->OnFatalError();
+				m_pData->OnSpaFailed();
 				return 0;
 			}
 		}
@@ -234,186 +324,74 @@ CSpaComms::MonitorThreadProc()
 }
 
 
-enum SpaResponseMessageIDs
-{
-	msStatus = 0xffaf13,
-	msConfigResponse = 0x0abf94,
-	msFilterConfig = 0x0abf23,
-	msControlConfig = 0x0abf24,
-	msControlConfig2 = 0x0abf2e,
-	msSetTempRange = 0xffaf26
-};
-
-const UINT uiPayloadStartOffset = 5;
-
-void
-CSpaComms::ProcessMessage(
-	const CByteArray &Message)
+BOOL
+CSpaComms::ReplayIncomingData(
+	const BYTE *pData,
+	size_t cbData)
 {
-	_ASSERT(Message[0] == byMessageTerminator);
-	_ASSERT(Message[Message.size() - 1] == byMessageTerminator);
-
-	UINT uiSize = Message[1];
-
-	//  Message should be the payload + 2 terminators
-	_ASSERT(uiSize == Message.size() - 2);
-
-	//  CRC is appended, so don't include that byte when re-calculating.
-	crc MessageCRC = F_CRC_CalculaCheckSum(&Message[1], uiSize - 1);
-
-	//  Sometimes fails?
-	_ASSERT(MessageCRC == Message[Message.size() - 2]);
-
-	UINT uiMessageID = (Message[2] << 16) + (Message[3] << 8) + Message[4];
-
-	switch (uiMessageID)
+	if (IsMonitoring())
 	{
+		//  Would interleave with live data from the spa.
+		return FALSE;
+	}
 
-	case msConfigResponse:
-		if (Message.size() == 32)
-		{
-			ConfigResponseMessage ConfigResponseMessage;
-
-			ConfigResponseMessage.m_RawMessage = Message;
-
-			char szMacAddress[64];
-
-			sprintf_s(szMacAddress, "%02X-%02X-%02X-%02X-%02X-%02X",
-					  Message[uiPayloadStartOffset + 3], Message[uiPayloadStartOffset + 4],
-					  Message[uiPayloadStartOffset + 5], Message[uiPayloadStartOffset + 6],
-					  Message[uiPayloadStartOffset + 7], Message[uiPayloadStartOffset + 8]);
-
-			ConfigResponseMessage.m_strMACAddress = szMacAddress;
-			m_pCallback->ProcessConfigResponse(ConfigResponseMessage);
-		}
-		else
-		{
-			m_pCallback->ProcessUnknownMessageRaw(Message);
-		}
-
-		break;
-
-	case msFilterConfig:
-		if (Message.size() == 15)
-		{
-			FilterConfigResponseMessage FilterConfigResponse;
-
-			FilterConfigResponse.m_RawMessage = Message;
-
-			FilterConfigResponse.m_Filter1StartTime.m_Hour = Message[uiPayloadStartOffset + 0];
-			FilterConfigResponse.m_Filter1StartTime.m_Minute = Message[uiPayloadStartOffset + 1];
-			FilterConfigResponse.m_uiFilter1Duration =
-				Message[uiPayloadStartOffset + 2] * 60 + Message[uiPayloadStartOffset + 3];
-
-			FilterConfigResponse.m_fFilter2Enabled = (Message[uiPayloadStartOffset + 4] & 0x80) != 0;
-			FilterConfigResponse.m_Filter2StartTime.m_Hour = Message[uiPayloadStartOffset + 4] & 0x7f;
-			FilterConfigResponse.m_Filter2StartTime.m_Minute = Message[uiPayloadStartOffset + 5];
-			FilterConfigResponse.m_uiFilter2Duration =
-				Message[uiPayloadStartOffset + 6] * 60 + Message[uiPayloadStartOffset + 7];
-
-			m_pCallback->ProcessFilterConfigResponse(FilterConfigResponse);
-		}
-		else
-		{
-			m_pCallback->ProcessUnknownMessageRaw(Message);
-		}
-
-		break;
-
-	case msControlConfig:
-		if (Message.size() == 28)
-		{
-			VersionInfoResponseMessage VersionInfoResponse;
-
-			VersionInfoResponse.m_RawMessage = Message;
-
-			VersionInfoResponse.m_strModelName = string((const char *)&Message[uiPayloadStartOffset + 4], 8);
-			VersionInfoResponse.m_strModelName.erase(VersionInfoResponse.m_strModelName.find_last_not_of(" ") + 1);
-			VersionInfoResponse.SoftwareID[0] = Message[uiPayloadStartOffset + 0];
-			VersionInfoResponse.SoftwareID[1] = Message[uiPayloadStartOffset + 1];
-			VersionInfoResponse.SoftwareID[2] = Message[uiPayloadStartOffset + 2];
-			VersionInfoResponse.CurrentSetup = Message[uiPayloadStartOffset + 12];
-			VersionInfoResponse.ConfigurationSignature =
-				(Message[uiPayloadStartOffset + 13] << 24) +
-				(Message[uiPayloadStartOffset + 14] << 16) +
-				(Message[uiPayloadStartOffset + 15] << 8) +
-				(Message[uiPayloadStartOffset + 16]);
-
-			m_pCallback->ProcessVersionInfoResponse(VersionInfoResponse);
-		}
-		else
-		{
-			m_pCallback->ProcessUnknownMessageRaw(Message);
-		}
-
-		break;
-
-	case msControlConfig2:
-		if (Message.size() == 13)
-		{
-			ControlConfig2ResponseMessage ControlConfig2ResponseMessage;
-
-			ControlConfig2ResponseMessage.m_RawMessage = Message;
-
-			m_pCallback->ProcessControlConfig2Response(ControlConfig2ResponseMessage);
-		}
-		else
-		{
-			m_pCallback->ProcessUnknownMessageRaw(Message);
-		}
-		break;
-
-	//case msSetTempRange:
-	//	//  Unknown contents
-	//	break;
+	ProcessIncomingData(pData, cbData);
 
+	return TRUE;
+}
 
-	case msStatus:
-		if (Message.size() == 31)
-		{
-			if (!m_fCoalesce || (Message != m_PreviousStatusMessage))
-			{
-				if (m_fCoalesce)
-				{
-					m_PreviousStatusMessage = Message;
-				}
 
-				StatusMessage StatusMessage;
+void
+CSpaComms::ProcessIncomingData(
+	const BYTE *pData,
+	size_t cbData)
+{
+	m_pData->m_Monitor.ProcessIncomingData(pData, cbData);
+}
 
-				StatusMessage.m_RawMessage = Message;
 
-				StatusMessage.m_Time.m_Hour = Message[8];
-				StatusMessage.m_Time.m_Minute = Message[9];
-				StatusMessage.m_f24Time = ((Message[14] & 0x02) != 0);
+//  Only bump the version when something actually changed, so pollers can
+//  skip the copy.
+void
+CSpaComms::sPrivateData::OnStatusChanged(
+	const StatusMessage &Status)
+{
+	m_LatestStatus.Write(Status);
+	m_uiStateVersion.fetch_add(1, std::memory_order_release);
 
-				StatusMessage.m_CurrentTemp = Message[7];
-				StatusMessage.m_SetPointTemp = Message[25];
-				StatusMessage.m_TempScale = (Message[14] & 0x01) ? tsCelsiusX2 : tsFahrenheight;
+	if (m_pStateSegment != NULL)
+	{
+		m_pStateSegment->PublishStatus(m_uiStateSlot, Status);
+	}
+}
 
-				StatusMessage.m_HeatRange = (Message[15] & 0x04) ? hrHigh : hrLow;
-				StatusMessage.m_HeatingMode = static_cast<HeatingMode>(Message[10] & 0x03);
 
-				StatusMessage.m_Pump1Status = static_cast<PumpStatus>(Message[16] & 0x03);
-				StatusMessage.m_Pump2Status = static_cast<PumpStatus>((Message[16] >> 2) & 0x03);
+void
+CSpaComms::sPrivateData::ProcessFilterConfigResponse(
+	const FilterConfigResponseMessage &FilterConfigResponse)
+{
+	m_LatestFilterConfig.Write(FilterConfigResponse);
+	m_uiStateVersion.fetch_add(1, std::memory_order_release);
 
-				StatusMessage.m_fPriming = ((Message[6] & 0x01) != 0);
-				StatusMessage.m_fHeating = ((Message[15] & 0x30) != 0);
-				StatusMessage.m_fCircPumpRunning = ((Message[18] & 0x02) != 0);
-				StatusMessage.m_fLights = ((Message[19] & 0x03) != 0);
+	if (m_pStateSegment != NULL)
+	{
+		m_pStateSegment->PublishFilterConfig(m_uiStateSlot, FilterConfigResponse);
+	}
 
-				m_pCallback->ProcessStatusMessage(StatusMessage);
-			}
-		}
-		else
-		{
-			m_pCallback->ProcessUnknownMessageRaw(Message);
-		}
+	CMonitorCallbackHandler::ProcessFilterConfigResponse(FilterConfigResponse);
+}
 
-		break;
 
-	default:
-		m_pCallback->ProcessUnknownMessageRaw(Message);
+void
+CSpaComms::sPrivateData::ProcessVersionInfoResponse(
+	const VersionInfoResponseMessage &VersionInfoResponse)
+{
+	if (m_pStateSegment != NULL)
+	{
+		m_pStateSegment->PublishVersionInfo(m_uiStateSlot, VersionInfoResponse);
 	}
+
+	CMonitorCallbackHandler::ProcessVersionInfoResponse(VersionInfoResponse);
 }
 
 
@@ -425,27 +403,36 @@ CSpaComms::SendSpaMessage(
 	_ASSERT(Message[Message.size() - 1] == byMessageTerminator);
 	_ASSERT(Message[1] == Message.size() - 2);
 
+	if (m_pData->m_pPortConnection != NULL)
+	{
+		return m_pData->m_pPort->Send(m_pData->m_pPortConnection, Message);
+	}
+
 	int iResult = 0;
 
+	m_pData->m_cSystemCalls.fetch_add(1, std::memory_order_relaxed);
 	iResult = send(m_pData->m_SpaSocket, (const char *)&Message[0], (int)Message.size(), 0);
 
 	return (iResult == Message.size());
 }
 
 
-enum SpaCommandMessageID
+BOOL
+CSpaComms::SendRawMessage(
+	const CByteArray &Message)
 {
-	msConfigRequest = 0x0abf04,
-	msFilterConfigRequest = 0x0abf22,
-	msToggleItemRequest = 0x0abf11,
-	msSetTempRequest = 0x0abf20,
-	msSetTempScaleRequest = 0x0abf27,
-	msSetTimeRequest = 0x0abf21,
-	msSetWiFiSettingsRequest = 0x0abf92,
-	msControlConfigRequest = 0x0abf22,
-	msSetFilterConfigRequest = 0x0abf23,
-};
+	//  Comes from outside the library, so check the framing rather than
+	//  just asserting it.
+	if ((Message.size() < cMessageOverhead) ||
+		(Message[0] != byMessageTerminator) ||
+		(Message[Message.size() - 1] != byMessageTerminator) ||
+		(Message[1] != Message.size() - 2))
+	{
+		return FALSE;
+	}
 
+	return SendSpaMessage(Message);
+}
 
 
 void
@@ -513,6 +500,11 @@ CSpaComms::SendToggleRequest(
 	ToggleSpaItemRequestMessage[uiPayloadStartOffset] = tsi;
 	FillInMessageCRC(ToggleSpaItemRequestMessage);
 
+	if (m_pData->m_pLatency != NULL)
+	{
+		m_pData->m_pLatency->OnToggleRequest(tsi);
+	}
+
 	return SendSpaMessage(ToggleSpaItemRequestMessage);
 }
 
@@ -549,6 +541,10 @@ BOOL CSpaComms::SendSetTempRequest(
 	SetTempRequestMessage[uiPayloadStartOffset] = uiTemp;
 	FillInMessageCRC(SetTempRequestMessage);
 
+	if (m_pData->m_pLatency != NULL)
+	{
+		m_pData->m_pLatency->OnSetTempRequest(uiTemp, ts);
+	}
 
 	return SendSetTempScaleRequest(ts) && SendSpaMessage(SetTempRequestMessage);
 }
@@ -570,7 +566,7 @@ BOOL CSpaComms::SendSetTempScaleRequest(
 }
 
 BOOL CSpaComms::SendSetFilterConfigRequest(
-	const FilterConfigResponseMessage &FilterConfig)
+	const FilterConfigInfo &FilterConfig)
 {
 	CByteArray SetFilterConfigRequestMessage;
 
@@ -586,13 +582,233 @@ BOOL CSpaComms::SendSetFilterConfigRequest(
 	SetFilterConfigRequestMessage[uiPayloadStartOffset + 7] = FilterConfig.m_uiFilter2Duration % 60;
 
 	SetFilterConfigRequestMessage[uiPayloadStartOffset + 4] |= FilterConfig.m_fFilter2Enabled ? 0x80 : 0x00;
+	FillInMessageCRC(SetFilterConfigRequestMessage);
 
+	if (m_pData->m_pLatency != NULL)
+	{
+		m_pData->m_pLatency->OnSetFilterConfigRequest(FilterConfig);
+	}
 
+	return SendSpaMessage(SetFilterConfigRequestMessage);
+}
 
+BOOL
+CSpaComms::GetLatestStatus(
+	StatusInfo &Status) const
+{
+	//  Sequence is still zero if no status has arrived yet.
+	return (m_pData->m_LatestStatus.Read(Status) != 0);
+}
 
-	return SendSpaMessage(SetFilterConfigRequestMessage);
+
+BOOL
+CSpaComms::GetLatestFilterConfig(
+	FilterConfigInfo &FilterConfig) const
+{
+	return (m_pData->m_LatestFilterConfig.Read(FilterConfig) != 0);
+}
+
+
+UINT
+CSpaComms::GetStateVersion(void) const
+{
+	return m_pData->m_uiStateVersion.load(std::memory_order_acquire);
 }
 
-CSpaComms::sPrivateData::sPrivateData(SOCKET s)
-	: m_SpaSocket(s)
+
+BOOL
+CSpaComms::AttachStateSegment(
+	CSpaStateSegment *pSegment,
+	UINT uiSlot)
+{
+	if (IsMonitoring())
+	{
+		//  Monitor thread is the writer; can't swap it out from under it.
+		return FALSE;
+	}
+
+	if ((pSegment != NULL) && (uiSlot >= pSegment->GetSlotCount()))
+	{
+		return FALSE;
+	}
+
+	m_pData->m_pStateSegment = pSegment;
+	m_pData->m_uiStateSlot = uiSlot;
+	m_pData->UpdateSubscriptions();
+
+	if (pSegment != NULL)
+	{
+		pSegment->SetMACAddress(uiSlot, m_SpaAddress.m_strMACAddress);
+	}
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaComms::SetBatchDelivery(
+	BOOL fBatch)
+{
+	if (IsMonitoring())
+	{
+		return FALSE;
+	}
+
+	m_pData->SetBatchDelivery(fBatch);
+
+	return TRUE;
+}
+
+
+size_t
+CSpaComms::GetConnectionStateSize(void)
+{
+	static_assert(sizeof(sPrivateData) + cbMonitorMessageBuffers <= cbMaxConnectionState, "Per spa state is over budget");
+
+	return sizeof(sPrivateData) + cbMonitorMessageBuffers;
+}
+
+
+BOOL
+CSpaComms::SetQueuedDelivery(
+	BOOL fQueued)
+{
+	if (IsMonitoring())
+	{
+		return FALSE;
+	}
+
+	m_pData->SetQueuedDelivery(m_pCallback, fQueued);
+
+	return TRUE;
+}
+
+
+void
+CSpaComms::sPrivateData::SetQueuedDelivery(
+	IMonitorCallback *pCallback,
+	BOOL fQueued)
+{
+	if (fQueued && !m_pQueue)
+	{
+		m_pQueue = std::make_unique<CDispatchQueue>(pCallback);
+		m_Observers.SetPrimary(m_pQueue.get());
+	}
+	else if (!fQueued && m_pQueue)
+	{
+		m_Observers.SetPrimary(pCallback);
+		m_pQueue.reset();
+	}
+}
+
+
+BOOL
+CSpaComms::Subscribe(
+	IMonitorCallback *pObserver,
+	DWORD dwMessages,
+	ObserverDelivery Delivery)
+{
+	return m_pData->m_Observers.Subscribe(pObserver, dwMessages, Delivery);
+}
+
+
+BOOL
+CSpaComms::Unsubscribe(
+	IMonitorCallback *pObserver)
+{
+	return m_pData->m_Observers.Unsubscribe(pObserver);
+}
+
+
+//  The tracker sees the messages directly, so it isn't held up by a queue.
+BOOL
+CSpaComms::AttachLatencyTracker(
+	CCommandLatency *pTracker)
+{
+	if (m_pData->m_pLatency != NULL)
+	{
+		m_pData->m_Observers.Unsubscribe(m_pData->m_pLatency);
+		m_pData->m_pLatency = NULL;
+	}
+
+	if (pTracker != NULL)
+	{
+		if (!m_pData->m_Observers.Subscribe(pTracker, smmStatus | smmFilterConfigResponse))
+		{
+			return FALSE;
+		}
+
+		m_pData->m_pLatency = pTracker;
+	}
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaComms::GetDispatchStats(
+	DispatchQueueStats &Stats) const
+{
+	if (!m_pData->m_pQueue)
+	{
+		return FALSE;
+	}
+
+	m_pData->m_pQueue->GetStats(Stats);
+
+	return TRUE;
+}
+
+
+UINT64
+CSpaComms::GetSystemCallCount(void) const
+{
+	return m_pData->m_cSystemCalls.load(std::memory_order_relaxed);
+}
+
+
+BOOL
+CSpaComms::SetSubscriptions(
+	DWORD dwDecoded,
+	DWORD dwRaw)
+{
+	if (IsMonitoring())
+	{
+		return FALSE;
+	}
+
+	m_pData->m_dwDecoded = dwDecoded;
+	m_pData->m_dwRaw = dwRaw;
+	m_pData->UpdateSubscriptions();
+
+	return TRUE;
+}
+
+
+//  The latest status and filter config are always decoded, and the version
+//  info too if there's a state segment to publish it to, but they only go
+//  on to the callback if it subscribed to them.
+void
+CSpaComms::sPrivateData::UpdateSubscriptions(void)
+{
+	DWORD dwInternal = smmStatus | smmFilterConfigResponse;
+
+	if (m_pStateSegment != NULL)
+	{
+		dwInternal |= smmVersionInfoResponse;
+	}
+
+	m_Monitor.SetSubscriptions(m_dwDecoded | dwInternal, m_dwRaw);
+	CMonitorCallbackHandler::SetSubscriptions(m_dwDecoded | m_dwRaw);
+}
+
+
+CSpaComms::sPrivateData::sPrivateData(
+	SOCKET s,
+	IMonitorCallback *pCallback,
+	BOOL fCoalesce)
+	: CMonitorCallbackHandler(&m_Observers), m_SpaSocket(s), m_Monitor(*this, fCoalesce),
+	m_pPort(NULL), m_pPortConnection(NULL), m_cSystemCalls(0), m_Observers(pCallback),
+	m_uiStateVersion(0), m_pStateSegment(NULL), m_uiStateSlot(0), m_pLatency(NULL),
+	m_dwDecoded(smmAll), m_dwRaw(smmAll)
 {}
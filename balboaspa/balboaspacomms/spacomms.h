@@ -1,5 +1,9 @@
 #pragma once
 
+class CSpaStateSegment;
+class CSpaCompletionPort;
+class CCommandLatency;
+struct DispatchQueueStats;
 
 class CSpaComms
 {
@@ -8,8 +12,18 @@ public:
 			  BOOL fCoalesce = TRUE);
 	~CSpaComms();
 	BOOL StartMonitor(void);
+
+	//  Monitor an already connected (blocking) socket, e.g. one from
+	//  ConnectToSpas().  Takes ownership of it, if successful.
+	BOOL StartMonitor(SOCKET);
+
+	//  The same, but through a completion port shared with other spas
+	//  rather than a thread of this one's own; for large fleets.
+	BOOL StartMonitor(SOCKET, CSpaCompletionPort *);
 	void EndMonitor(void);
 
+	const CSpaAddress &GetSpaAddress(void) const { return m_SpaAddress; };
+
 	enum ToggleSpaItem
 	{
 		tsiPump1 = 0x04,
@@ -26,7 +40,72 @@ public:
 	BOOL SendControlConfig2Request(void);
 	BOOL SendSetTempRequest(UINT, TempScale);
 	BOOL SendSetTempScaleRequest(TempScale);
-	BOOL SendSetFilterConfigRequest(const FilterConfigResponseMessage &);
+	BOOL SendSetFilterConfigRequest(const FilterConfigInfo &);
+
+	//  Pass through an already built message, e.g. one relayed from another
+	//  client.  Framing is checked, the CRC is not.
+	BOOL SendRawMessage(const CByteArray &);
+
+	//  Most recent state, for consumers that poll rather than handle every
+	//  callback.  Safe from any thread; never blocks the monitor thread and
+	//  never allocates.  FALSE if nothing has been received yet.
+	BOOL GetLatestStatus(StatusInfo &) const;
+	BOOL GetLatestFilterConfig(FilterConfigInfo &) const;
+
+	//  Changes whenever either of the above does.  Compare against the value
+	//  from the last poll to skip the copy when nothing is new.
+	UINT GetStateVersion(void) const;
+
+	//  Also publish decoded state into 'uiSlot' of a shared memory segment.
+	//  Set before StartMonitor(); NULL to stop.
+	BOOL AttachStateSegment(CSpaStateSegment *, UINT uiSlot);
+
+	//  Deliver everything decoded from one read with a single
+	//  IMonitorCallback::ProcessMessageBatch() call, instead of a call per
+	//  message.  Only allowed while not monitoring.
+	BOOL SetBatchDelivery(BOOL fBatch);
+
+	//  Make the callbacks from a thread of their own, through a
+	//  CDispatchQueue, so that a slow callback doesn't stop the spa being
+	//  read: replies first, then only the latest status.  Only allowed while
+	//  not monitoring.
+	BOOL SetQueuedDelivery(BOOL fQueued);
+	BOOL GetDispatchStats(DispatchQueueStats &) const;
+
+	//  More callbacks alongside the one given to the constructor, e.g. a
+	//  logger, a metrics exporter and a UI, each getting the SpaMessageMask
+	//  types in dwMessages; see CObserverList.  Allowed at any time, from any
+	//  thread.  Observers only get what SetSubscriptions() has decoded, and
+	//  stay the caller's to dispose of.
+	BOOL Subscribe(IMonitorCallback *, DWORD dwMessages = smmAll, ObserverDelivery = odDirect);
+	BOOL Unsubscribe(IMonitorCallback *);
+
+	//  Time toggle, set temp and set filter config requests until the spa
+	//  shows their effect; the tracker is subscribed for the messages it
+	//  needs.  NULL to stop.  Not while commands are being sent.
+	BOOL AttachLatencyTracker(CCommandLatency *);
+
+	//  Decode, and pass to the callback, only the SpaMessageMask types in
+	//  dwDecoded or dwRaw; see CSpaMonitor::SetSubscriptions().  E.g.
+	//  SetSubscriptions(smmStatus, smmNone) for a consumer that only uses the
+	//  decoded status.  The latest state above, and any state segment, are
+	//  kept up to date regardless.  Only allowed while not monitoring.
+	BOOL SetSubscriptions(DWORD dwDecoded, DWORD dwRaw);
+
+	//  select(), recv() and send() calls made by the threaded monitor so far,
+	//  for comparison with CSpaCompletionPort::GetSystemCallCount().
+	UINT64 GetSystemCallCount(void) const;
+
+	//  Bytes kept for each spa while monitoring: a block allocated with the
+	//  CSpaComms, and a buffer for each type of message, allocated when the
+	//  first arrives.  The same however long it runs.  Not counting the
+	//  address, the heap's own overhead, or a completion port's per
+	//  connection state.
+	static size_t GetConnectionStateSize(void);
+
+	//  Feed previously captured bytes through the decoder as if they had
+	//  just been read from the spa.  Only allowed while not monitoring.
+	BOOL ReplayIncomingData(const BYTE *, size_t);
 	
 private:
 
@@ -37,15 +116,14 @@ private:
 	static  unsigned int __stdcall MonitorThreadProc(void *);
 	unsigned int MonitorThreadProc(void);
 
-	void ProcessMessage(const CByteArray &);
+	BOOL IsMonitoring(void) const;
+	void ProcessIncomingData(const BYTE *, size_t);
 	BOOL SendSpaMessage(const CByteArray &);
 
 	CSpaAddress m_SpaAddress;
 	HANDLE m_hMonitorThread;
 	BOOL m_fShutDown;
 	//SOCKET m_SpaSocket;
-	BOOL m_fCoalesce;
-	CByteArray m_PreviousStatusMessage;
 
 	IMonitorCallback *m_pCallback;
 
@@ -0,0 +1,659 @@
+#include "stdafx.h"
+#include "Discovery.h"
+#include "MonitorCallback.h"
+#include "ObserverList.h"
+#include "SpaComms.h"
+#include "CompletionPort.h"
+#include "SpaFleet.h"
+
+using std::mutex;
+using std::lock_guard;
+
+const UINT cMaxShards = 256;
+const size_t cbCacheLine = 64;
+
+
+//  Written by the shard's thread, except when a spa is added, removed or
+//  moved, which happens with the spa's monitoring stopped.  Each shard's
+//  counters sit on their own cache lines: new doesn't honour alignas beyond
+//  the default under C++14, so they're padded on both sides instead, which
+//  works wherever the shard is allocated.
+struct CSpaFleet::Shard
+{
+	Shard()
+		: m_cSpas(0), m_cConnected(0), m_cStatuses(0), m_cFailures(0),
+		m_cHeating(0), m_cPumpsRunning(0), m_cLightsOn(0)
+	{};
+
+	CSpaCompletionPort m_Port;
+
+	BYTE m_PaddingBefore[cbCacheLine];
+	std::atomic<UINT> m_cSpas;
+	std::atomic<UINT> m_cConnected;
+	std::atomic<UINT64> m_cStatuses;
+	std::atomic<UINT64> m_cFailures;
+	std::atomic<UINT> m_cHeating;
+	std::atomic<UINT> m_cPumpsRunning;
+	std::atomic<UINT> m_cLightsOn;
+	BYTE m_PaddingAfter[cbCacheLine];
+};
+
+
+//  One spa: its CSpaComms, and the callback that keeps its shard's figures
+//  up to date before passing messages on.
+class CSpaFleet::CSession :
+	public IMonitorCallback
+{
+public:
+	CSession(const CSpaAddress &, IMonitorCallback *);
+	~CSession();
+
+	const string &GetMACAddress(void) const { return m_Address.m_strMACAddress; };
+	const CSpaAddress &GetAddress(void) const { return m_Address; };
+
+	//  Spa must not be monitored for any of these.
+	BOOL IsMonitoring(void) const { return m_fMonitoring; };
+	void SetShard(Shard *);
+	BOOL IsOnShard(const Shard *pShard) const { return m_pShard == pShard; };
+	BOOL Start(SOCKET);
+	void Stop(void);
+
+	BOOL IsStreaming(void) const { return m_fMonitoring && !m_fFailed; };
+	BOOL GetLatestStatus(StatusInfo &Status) const { return m_pSpa->GetLatestStatus(Status); };
+
+private:
+	void ProcessStatusMessage(const StatusMessage &);
+	void ProcessConfigResponse(const ConfigResponseMessage &Message) { Forward(&IMonitorCallback::ProcessConfigResponse, Message); };
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &Message) { Forward(&IMonitorCallback::ProcessFilterConfigResponse, Message); };
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &Message) { Forward(&IMonitorCallback::ProcessVersionInfoResponse, Message); };
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &Message) { Forward(&IMonitorCallback::ProcessControlConfig2Response, Message); };
+	void ProcessSetTempRangeResponse(const SetTempRangeResponseMessage &Message) { Forward(&IMonitorCallback::ProcessSetTempRangeResponse, Message); };
+	void ProcessUnknownMessageRaw(const CByteArray &Message) { Forward(&IMonitorCallback::ProcessUnknownMessageRaw, Message); };
+
+	//  CSpaComms disposes of us; we dispose of ours in the destructor.
+	void Dispose(void) {};
+	void OnFatalError(void);
+
+	template <class Message>
+	void Forward(void (IMonitorCallback::*pProcess)(const Message &), const Message &NewMessage)
+	{
+		if (m_pCallback != NULL)
+		{
+			(m_pCallback->*pProcess)(NewMessage);
+		}
+	};
+
+	//  Adds (or with -1, takes away) the last status from the shard's totals.
+	void CountStatus(int iSign);
+
+	CSpaAddress m_Address;
+	IMonitorCallback *m_pCallback;
+	std::unique_ptr<CSpaComms> m_pSpa;
+	Shard *m_pShard;
+
+	BOOL m_fMonitoring;
+	std::atomic<BOOL> m_fFailed;
+
+	//  Shard thread only, while monitoring.
+	StatusInfo m_LastStatus;
+	BOOL m_fHaveStatus;
+
+	//  Disallowed operations.
+	const CSession & operator=(const CSession &) { return *this; };
+};
+
+
+CSpaFleet::CSession::CSession(
+	const CSpaAddress &Address,
+	IMonitorCallback *pCallback)
+	: m_Address(Address), m_pCallback(pCallback), m_pShard(NULL),
+	m_fMonitoring(FALSE), m_fFailed(FALSE), m_fHaveStatus(FALSE)
+{
+	//  No coalescing; the figures count every status.
+	m_pSpa = std::make_unique<CSpaComms>(Address, this, FALSE);
+}
+
+CSpaFleet::CSession::~CSession()
+{
+	Stop();
+	SetShard(NULL);
+
+	m_pSpa.reset();
+
+	if (m_pCallback != NULL)
+	{
+		m_pCallback->Dispose();
+	}
+}
+
+
+void
+CSpaFleet::CSession::SetShard(
+	Shard *pShard)
+{
+	_ASSERT(!m_fMonitoring);
+
+	if (m_pShard != NULL)
+	{
+		m_pShard->m_cSpas--;
+	}
+
+	m_pShard = pShard;
+
+	if (m_pShard != NULL)
+	{
+		m_pShard->m_cSpas++;
+	}
+}
+
+
+BOOL
+CSpaFleet::CSession::Start(
+	SOCKET SpaSocket)
+{
+	_ASSERT(!m_fMonitoring && (m_pShard != NULL));
+
+	m_fFailed = FALSE;
+	m_fHaveStatus = FALSE;
+
+	//  Counted first, as the shard thread may fail it straight away.
+	m_pShard->m_cConnected++;
+
+	if (!m_pSpa->StartMonitor(SpaSocket, &m_pShard->m_Port))
+	{
+		m_pShard->m_cConnected--;
+		return FALSE;
+	}
+
+	m_fMonitoring = TRUE;
+
+	return TRUE;
+}
+
+
+void
+CSpaFleet::CSession::Stop(void)
+{
+	if (!m_fMonitoring)
+	{
+		return;
+	}
+
+	m_pSpa->EndMonitor();
+	m_fMonitoring = FALSE;
+
+	//  Nothing else is touching these now.
+	if (!m_fFailed.exchange(TRUE))
+	{
+		m_pShard->m_cConnected--;
+	}
+
+	CountStatus(-1);
+	m_fHaveStatus = FALSE;
+}
+
+
+void
+CSpaFleet::CSession::CountStatus(
+	int iSign)
+{
+	if (!m_fHaveStatus)
+	{
+		return;
+	}
+
+	if (m_LastStatus.m_fHeating)
+	{
+		m_pShard->m_cHeating += iSign;
+	}
+
+	if ((m_LastStatus.m_Pump1Status != psOff) || (m_LastStatus.m_Pump2Status != psOff))
+	{
+		m_pShard->m_cPumpsRunning += iSign;
+	}
+
+	if (m_LastStatus.m_fLights)
+	{
+		m_pShard->m_cLightsOn += iSign;
+	}
+}
+
+
+void
+CSpaFleet::CSession::ProcessStatusMessage(
+	const StatusMessage &Status)
+{
+	if (!m_fFailed)
+	{
+		CountStatus(-1);
+
+		m_LastStatus = Status;
+		m_fHaveStatus = TRUE;
+
+		CountStatus(1);
+	}
+
+	m_pShard->m_cStatuses.fetch_add(1, std::memory_order_relaxed);
+
+	Forward(&IMonitorCallback::ProcessStatusMessage, Status);
+}
+
+
+void
+CSpaFleet::CSession::OnFatalError(void)
+{
+	if (!m_fFailed.exchange(TRUE))
+	{
+		m_pShard->m_cConnected--;
+		m_pShard->m_cFailures++;
+
+		CountStatus(-1);
+		m_fHaveStatus = FALSE;
+	}
+
+	if (m_pCallback != NULL)
+	{
+		m_pCallback->OnFatalError();
+	}
+}
+
+
+CSpaFleet::CSpaFleet()
+{}
+
+CSpaFleet::~CSpaFleet()
+{
+	Stop();
+}
+
+
+//  Jump consistent hash (Lamping and Veach) of the MAC address, ignoring
+//  case: adding the N'th shard moves only the spas that belong on it.
+UINT
+CSpaFleet::GetShardIndex(
+	const string &strMACAddress,
+	UINT cShards)
+{
+	UINT64 uiKey = HashMACAddress(strMACAddress);
+	INT64 iBucket = -1;
+	INT64 iNext = 0;
+
+	while (iNext < (INT64)cShards)
+	{
+		iBucket = iNext;
+		uiKey = uiKey * 2862933555777941757ULL + 1;
+		iNext = (INT64)((iBucket + 1) * ((double)(1LL << 31) / (double)((uiKey >> 33) + 1)));
+	}
+
+	return (UINT)iBucket;
+}
+
+
+bool
+CSpaFleet::SessionLess(
+	const std::unique_ptr<CSpaFleet::CSession> &pSession,
+	const string &strMACAddress)
+{
+	return _stricmp(pSession->GetMACAddress().c_str(), strMACAddress.c_str()) < 0;
+}
+
+
+CSpaFleet::SessionVector::iterator
+CSpaFleet::FindSession(
+	const string &strMACAddress)
+{
+	auto pSession = std::lower_bound(m_Sessions.begin(), m_Sessions.end(), strMACAddress, SessionLess);
+
+	if ((pSession != m_Sessions.end()) &&
+		(_stricmp((*pSession)->GetMACAddress().c_str(), strMACAddress.c_str()) == 0))
+	{
+		return pSession;
+	}
+
+	return m_Sessions.end();
+}
+
+
+BOOL
+CSpaFleet::Start(
+	UINT cShards)
+{
+	if (cShards == 0)
+	{
+		SYSTEM_INFO SystemInfo;
+
+		GetSystemInfo(&SystemInfo);
+		cShards = SystemInfo.dwNumberOfProcessors;
+	}
+
+	lock_guard<mutex> lg(m_mutex);
+
+	if (!m_Shards.empty())
+	{
+		return FALSE;
+	}
+
+	if (!AddShards((std::min)(cShards, cMaxShards)))
+	{
+		m_Shards.clear();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CSpaFleet::Stop(void)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	//  Sessions first; they're still on the shards' ports.
+	m_Sessions.clear();
+	m_Shards.clear();
+}
+
+
+BOOL
+CSpaFleet::AddShards(
+	UINT cShards)
+{
+	while (m_Shards.size() < cShards)
+	{
+		auto pShard = std::make_unique<Shard>();
+
+		if (!pShard->m_Port.Start())
+		{
+			return FALSE;
+		}
+
+		m_Shards.push_back(std::move(pShard));
+	}
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaFleet::AddSpa(
+	const CSpaAddress &Spa,
+	IMonitorCallback *pCallback)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	if (m_Shards.empty() || (FindSession(Spa.m_strMACAddress) != m_Sessions.end()))
+	{
+		return FALSE;
+	}
+
+	std::vector<CSession *> NewSessions(1, InsertSession(Spa, pCallback));
+
+	ConnectSessions(NewSessions);
+
+	return TRUE;
+}
+
+
+UINT
+CSpaFleet::AddSpas(
+	const SpaAddressVector &Spas,
+	const std::vector<IMonitorCallback *> &Callbacks)
+{
+	_ASSERT(Callbacks.empty() || (Callbacks.size() == Spas.size()));
+
+	lock_guard<mutex> lg(m_mutex);
+
+	if (m_Shards.empty())
+	{
+		return 0;
+	}
+
+	std::vector<CSession *> NewSessions;
+
+	for (size_t i = 0; i < Spas.size(); i++)
+	{
+		if (FindSession(Spas[i].m_strMACAddress) == m_Sessions.end())
+		{
+			NewSessions.push_back(InsertSession(Spas[i], Callbacks.empty() ? NULL : Callbacks[i]));
+		}
+	}
+
+	return ConnectSessions(NewSessions);
+}
+
+
+CSpaFleet::CSession *
+CSpaFleet::InsertSession(
+	const CSpaAddress &Spa,
+	IMonitorCallback *pCallback)
+{
+	auto pSession = m_Sessions.insert(
+		std::lower_bound(m_Sessions.begin(), m_Sessions.end(), Spa.m_strMACAddress, SessionLess),
+		std::make_unique<CSession>(Spa, pCallback));
+
+	(*pSession)->SetShard(m_Shards[GetShardIndex(Spa.m_strMACAddress, (UINT)m_Shards.size())].get());
+
+	return pSession->get();
+}
+
+
+BOOL
+CSpaFleet::RemoveSpa(
+	const string &strMACAddress)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	auto pSession = FindSession(strMACAddress);
+
+	if (pSession == m_Sessions.end())
+	{
+		return FALSE;
+	}
+
+	m_Sessions.erase(pSession);
+
+	return TRUE;
+}
+
+
+UINT
+CSpaFleet::ReconnectSpas(void)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	std::vector<CSession *> Lost;
+
+	for (auto pSession = m_Sessions.cbegin(); pSession != m_Sessions.cend(); pSession++)
+	{
+		if (!(*pSession)->IsStreaming())
+		{
+			(*pSession)->Stop();
+			Lost.push_back(pSession->get());
+		}
+	}
+
+	return ConnectSessions(Lost);
+}
+
+
+//  A socket can't be moved from one completion port to another, so a spa
+//  that changes shard is disconnected and connected again on the new one.
+BOOL
+CSpaFleet::SetShardCount(
+	UINT cShards)
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	if (m_Shards.empty() || (cShards == 0))
+	{
+		return FALSE;
+	}
+
+	cShards = (std::min)(cShards, cMaxShards);
+
+	const size_t cOldShards = m_Shards.size();
+
+	if (!AddShards(cShards))
+	{
+		//  Any that did start are still empty.
+		m_Shards.resize(cOldShards);
+		return FALSE;
+	}
+
+	std::vector<CSession *> Moved;
+
+	for (auto pSession = m_Sessions.cbegin(); pSession != m_Sessions.cend(); pSession++)
+	{
+		Shard *pShard = m_Shards[GetShardIndex((*pSession)->GetMACAddress(), cShards)].get();
+
+		if (!(*pSession)->IsOnShard(pShard))
+		{
+			(*pSession)->Stop();
+			(*pSession)->SetShard(pShard);
+			Moved.push_back(pSession->get());
+		}
+	}
+
+	//  Nothing is left on these.
+	m_Shards.resize(cShards);
+
+	ConnectSessions(Moved);
+
+	return TRUE;
+}
+
+
+UINT
+CSpaFleet::ConnectSessions(
+	const std::vector<CSession *> &Sessions)
+{
+	if (Sessions.empty())
+	{
+		return 0;
+	}
+
+	SpaAddressVector Spas;
+
+	Spas.reserve(Sessions.size());
+
+	for (auto pSession = Sessions.cbegin(); pSession != Sessions.cend(); pSession++)
+	{
+		Spas.push_back((*pSession)->GetAddress());
+	}
+
+	m_Connecting = Sessions;
+	ConnectToSpas(Spas, this);
+	m_Connecting.clear();
+
+	UINT cStreaming = 0;
+
+	for (auto pSession = Sessions.cbegin(); pSession != Sessions.cend(); pSession++)
+	{
+		if ((*pSession)->IsStreaming())
+		{
+			cStreaming++;
+		}
+	}
+
+	return cStreaming;
+}
+
+
+BOOL
+CSpaFleet::OnSpaConnected(
+	size_t uiSpa,
+	SOCKET SpaSocket)
+{
+	_ASSERT(uiSpa < m_Connecting.size());
+
+	return m_Connecting[uiSpa]->Start(SpaSocket);
+}
+
+
+UINT
+CSpaFleet::GetShardCount(void) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	return (UINT)m_Shards.size();
+}
+
+
+UINT
+CSpaFleet::GetSpaCount(void) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	return (UINT)m_Sessions.size();
+}
+
+
+BOOL
+CSpaFleet::GetShardMetrics(
+	UINT uiShard,
+	FleetShardMetrics &Metrics) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	if (uiShard >= m_Shards.size())
+	{
+		return FALSE;
+	}
+
+	const Shard &ThisShard = *m_Shards[uiShard];
+
+	Metrics.m_cSpas = ThisShard.m_cSpas;
+	Metrics.m_cConnected = ThisShard.m_cConnected;
+	Metrics.m_cStatuses = ThisShard.m_cStatuses;
+	Metrics.m_cFailures = ThisShard.m_cFailures;
+	Metrics.m_cHeating = ThisShard.m_cHeating;
+	Metrics.m_cPumpsRunning = ThisShard.m_cPumpsRunning;
+	Metrics.m_cLightsOn = ThisShard.m_cLightsOn;
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaFleet::GetSpaShard(
+	const string &strMACAddress,
+	UINT &uiShard) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	auto pSession = const_cast<CSpaFleet *>(this)->FindSession(strMACAddress);
+
+	if (pSession == m_Sessions.end())
+	{
+		return FALSE;
+	}
+
+	for (UINT i = 0; i < m_Shards.size(); i++)
+	{
+		if ((*pSession)->IsOnShard(m_Shards[i].get()))
+		{
+			uiShard = i;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+BOOL
+CSpaFleet::GetLatestStatus(
+	const string &strMACAddress,
+	StatusInfo &Status) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	auto pSession = const_cast<CSpaFleet *>(this)->FindSession(strMACAddress);
+
+	if (pSession == m_Sessions.end())
+	{
+		return FALSE;
+	}
+
+	return (*pSession)->GetLatestStatus(Status);
+}
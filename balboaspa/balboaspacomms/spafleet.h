@@ -0,0 +1,100 @@
+#pragma once
+
+//  Monitors thousands of spas on a fixed number of threads.  Spas are keyed
+//  by MAC address and spread over shards, each a CSpaCompletionPort with a
+//  thread of its own; a spa's connection, decoder, state and callbacks all
+//  live on its shard's thread, so the data path takes no locks.
+//
+//  Spas are assigned to shards by a consistent hash of the MAC address, so
+//  changing the shard count with SetShardCount() only moves the spas that
+//  have to move (about 1 in N when adding the N'th shard).  A moved spa is
+//  reconnected through its new shard, keeping its latest state.
+//
+//  Adding, removing and rebalancing are serialized, and may be done from any
+//  thread other than a shard's.
+
+struct FleetShardMetrics
+{
+	UINT m_cSpas;
+	UINT m_cConnected;					//  Streaming, as far as is known
+
+	//  Since the shard was created.
+	UINT64 m_cStatuses;
+	UINT64 m_cFailures;
+
+	//  Spas whose latest status shows them heating, etc.  Failed spas aren't
+	//  counted.
+	UINT m_cHeating;
+	UINT m_cPumpsRunning;				//  Either pump
+	UINT m_cLightsOn;
+};
+
+
+class CSpaFleet :
+	private ISpaConnectCallback
+{
+public:
+	CSpaFleet();
+	~CSpaFleet();
+
+	//  cShards of 0 is one per processor.
+	BOOL Start(UINT cShards = 0);
+
+	//  Removes every spa.
+	void Stop(void);
+
+	//  Connects to the spa and starts monitoring it.  pCallback, if any, gets
+	//  the spa's messages on its shard's thread, and is disposed of when the
+	//  spa is removed.  A spa that doesn't answer is kept, to be retried by
+	//  ReconnectSpas().  FALSE if the MAC address is already in the fleet.
+	BOOL AddSpa(const CSpaAddress &, IMonitorCallback *pCallback = NULL);
+
+	//  The same for many spas at once, connecting in parallel.  Callbacks is
+	//  either empty or parallel to Spas; those for spas already in the fleet
+	//  are left with the caller.  Returns the number of new spas streaming.
+	UINT AddSpas(const SpaAddressVector &Spas, const std::vector<IMonitorCallback *> &Callbacks = std::vector<IMonitorCallback *>());
+
+	BOOL RemoveSpa(const string &strMACAddress);
+
+	//  Retries spas that failed or never connected.  Returns the number that
+	//  did.
+	UINT ReconnectSpas(void);
+
+	//  Adds or removes shards, moving spas as needed.
+	BOOL SetShardCount(UINT cShards);
+
+	UINT GetShardCount(void) const;
+	UINT GetSpaCount(void) const;
+	BOOL GetShardMetrics(UINT uiShard, FleetShardMetrics &) const;
+
+	//  The shard the spa is on; FALSE if it isn't in the fleet.
+	BOOL GetSpaShard(const string &strMACAddress, UINT &uiShard) const;
+	BOOL GetLatestStatus(const string &strMACAddress, StatusInfo &) const;
+
+private:
+	class CSession;
+	struct Shard;
+
+	typedef std::vector<std::unique_ptr<CSession>> SessionVector;
+
+	static UINT GetShardIndex(const string &strMACAddress, UINT cShards);
+	static bool SessionLess(const std::unique_ptr<CSession> &, const string &strMACAddress);
+
+	//  ISpaConnectCallback, for ConnectSessions().
+	BOOL OnSpaConnected(size_t uiSpa, SOCKET);
+
+	//  Callers hold m_mutex for all of these.
+	UINT ConnectSessions(const std::vector<CSession *> &);
+	BOOL AddShards(UINT cShards);
+	SessionVector::iterator FindSession(const string &strMACAddress);
+	CSession *InsertSession(const CSpaAddress &, IMonitorCallback *);
+
+	std::vector<std::unique_ptr<Shard>> m_Shards;
+	SessionVector m_Sessions;								//  Sorted by MAC address
+	std::vector<CSession *> m_Connecting;					//  Only during ConnectSessions()
+
+	mutable std::mutex m_mutex;
+
+	//  Disallowed operations.
+	const CSpaFleet & operator=(const CSpaFleet &) { return *this; };
+};
@@ -0,0 +1,499 @@
+#pragma once
+
+#include <type_traits>
+
+#include "MessageFormat.h"
+#include "crc.h"
+
+//  Decodes the spa's byte stream and passes each message to a handler, the
+//  same as CSpaComms does with an IMonitorCallback, but with the handler's
+//  type fixed at compile time.  There are no virtual calls, so the handler
+//  can be inlined into the decode loop:
+//
+//    class CStatusExporter : public CMonitorHandler
+//    {
+//    public:
+//        void ProcessStatusMessage(const StatusMessage &);
+//    };
+//
+//    CStatusExporter Exporter;
+//    CSpaMonitor<CStatusExporter> Monitor(Exporter);
+//    ...Monitor.ProcessIncomingData(pData, cbData) after each recv()...
+//
+//  A handler declares only the CMonitorHandler methods it wants, with the
+//  same signatures.  Messages no method is declared for aren't decoded at
+//  all, so an empty handler costs nothing beyond the framing.  Where that
+//  has to be decided at run time, SetSubscriptions() does the same.
+//
+//  Owns no socket or thread; feed it from one thread at a time.  CSpaComms
+//  is built on it.
+
+
+class CMonitorHandler
+{
+public:
+	//  Each time the status differs from the one before, whether or not
+	//  coalescing is on; before ProcessStatusMessage().
+	void OnStatusChanged(const StatusMessage &) {};
+
+	void ProcessStatusMessage(const StatusMessage &) {};
+	void ProcessConfigResponse(const ConfigResponseMessage &) {};
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &) {};
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &) {};
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &) {};
+	void ProcessUnknownMessageRaw(const CByteArray &) {};
+
+	//  After the messages from each ProcessIncomingData() call; see
+	//  CMessageBatch.
+	void OnBatchComplete(void) {};
+};
+
+
+//  TRUE if Handler declares Method itself, rather than inheriting the empty
+//  one from CMonitorHandler.  A compile time constant.
+#define HANDLER_IMPLEMENTS(Handler, Method) \
+	(!std::is_same<decltype(&Handler::Method), decltype(&CMonitorHandler::Method)>::value)
+
+
+//  Passes everything on to an IMonitorCallback, for code written against the
+//  virtual interface; either a message at a time, or with SetBatchDelivery()
+//  as one ProcessMessageBatch() call per read.  SetSubscriptions() limits
+//  which types are passed on, for when the monitor decodes more than the
+//  callback wants.
+class CMonitorCallbackHandler :
+	public CMonitorHandler
+{
+public:
+	CMonitorCallbackHandler(IMonitorCallback *pCallback) : m_pCallback(pCallback), m_fBatch(FALSE), m_dwSubscriptions(smmAll) {};
+
+	void SetBatchDelivery(BOOL fBatch) { m_fBatch = fBatch; m_Batch.Clear(); };
+	void SetSubscriptions(DWORD dwSubscriptions) { m_dwSubscriptions = dwSubscriptions; };
+
+	void ProcessStatusMessage(const StatusMessage &Message) { Deliver(smtStatus, Message, &IMonitorCallback::ProcessStatusMessage); };
+	void ProcessConfigResponse(const ConfigResponseMessage &Message) { Deliver(smtConfigResponse, Message, &IMonitorCallback::ProcessConfigResponse); };
+	void ProcessFilterConfigResponse(const FilterConfigResponseMessage &Message) { Deliver(smtFilterConfigResponse, Message, &IMonitorCallback::ProcessFilterConfigResponse); };
+	void ProcessVersionInfoResponse(const VersionInfoResponseMessage &Message) { Deliver(smtVersionInfoResponse, Message, &IMonitorCallback::ProcessVersionInfoResponse); };
+	void ProcessControlConfig2Response(const ControlConfig2ResponseMessage &Message) { Deliver(smtControlConfig2Response, Message, &IMonitorCallback::ProcessControlConfig2Response); };
+
+	void ProcessUnknownMessageRaw(const CByteArray &Message)
+	{
+		if ((m_dwSubscriptions & smmUnknown) == 0)
+		{
+			return;
+		}
+
+		if (m_fBatch)
+		{
+			m_Batch.AddUnknown(Message);
+		}
+		else
+		{
+			m_pCallback->ProcessUnknownMessageRaw(Message);
+		}
+	};
+
+	void OnBatchComplete(void)
+	{
+		if (m_fBatch && (m_Batch.GetCount() != 0))
+		{
+			m_pCallback->ProcessMessageBatch(m_Batch.GetMessages(), m_Batch.GetCount());
+			m_Batch.Clear();
+		}
+	};
+
+protected:
+	IMonitorCallback *m_pCallback;
+
+private:
+	template <class Message>
+	void Deliver(SpaMessageType Type, const Message &NewMessage, void (IMonitorCallback::*pProcess)(const Message &))
+	{
+		if ((m_dwSubscriptions & (1 << Type)) == 0)
+		{
+			return;
+		}
+
+		if (m_fBatch)
+		{
+			m_Batch.Add(NewMessage);
+		}
+		else
+		{
+			(m_pCallback->*pProcess)(NewMessage);
+		}
+	};
+
+	BOOL m_fBatch;
+	CMessageBatch m_Batch;
+	DWORD m_dwSubscriptions;
+};
+
+
+const UINT cbStatusMessage = 31;
+const UINT cbConfigResponseMessage = 32;
+const UINT cbFilterConfigMessage = 15;
+const UINT cbVersionInfoMessage = 28;
+const UINT cbControlConfig2Message = 13;
+
+//  What the buffers behind a CSpaMonitor's messages grow to on the heap,
+//  once each type has arrived: a copy of each known type's frame, the
+//  config response's MAC address (too long for a string to hold in
+//  itself; the model name isn't), and the longest unknown message.  Each is
+//  allocated for the first message that needs it, and reused after.  Not
+//  counting the heap's own overhead.
+const size_t cbMonitorMessageBuffers =
+	cbStatusMessage + cbConfigResponseMessage + cbFilterConfigMessage + cbVersionInfoMessage +
+	cbControlConfig2Message + sizeof("00-15-27-00-00-00") + cbMaxMessage;
+
+
+template <class Handler>
+class CSpaMonitor
+{
+public:
+	//  With fCoalesce, a status identical to the previous one isn't passed on.
+	CSpaMonitor(Handler &, BOOL fCoalesce = TRUE);
+
+	//  Raw bytes from the spa, split anywhere.
+	void ProcessIncomingData(const BYTE *, size_t);
+
+	//  One complete frame.
+	void ProcessMessage(const CByteArray &);
+	void ProcessMessage(const BYTE *, size_t);
+
+	//  Forget partial messages and the previous status, e.g. on reconnecting.
+	void Reset(void);
+
+	//  SpaMessageMask sets of the types to decode, and of those to copy the
+	//  frame into m_RawMessage for.  Types in neither are dropped as soon as
+	//  their ID is read; types only in dwRaw get just m_RawMessage (and no
+	//  OnStatusChanged()).  Defaults to smmAll for both.
+	void SetSubscriptions(DWORD dwDecoded, DWORD dwRaw);
+
+private:
+	BOOL IsSubscribed(SpaMessageType Type) const { return ((m_dwDecoded | m_dwRaw) & (1 << Type)) != 0; };
+	BOOL WantsDecoded(SpaMessageType Type) const { return (m_dwDecoded & (1 << Type)) != 0; };
+	BOOL WantsRaw(SpaMessageType Type) const { return (m_dwRaw & (1 << Type)) != 0; };
+
+	void ProcessUnknownMessage(const BYTE *, size_t);
+
+	Handler &m_Handler;
+	CMessageFramer m_Framer;
+
+	//  Messages are decoded into these, one after another, rather than into
+	//  new ones each time, so that their buffers (the raw frame, the MAC
+	//  address, etc.) are allocated for the first message of each type and
+	//  reused from then on; see cbMonitorMessageBuffers.  A steady stream of
+	//  statuses doesn't touch the heap.  m_Message is for unknown ones.
+	StatusMessage m_StatusMessage;
+	ConfigResponseMessage m_ConfigResponse;
+	FilterConfigResponseMessage m_FilterConfigResponse;
+	VersionInfoResponseMessage m_VersionInfoResponse;
+	ControlConfig2ResponseMessage m_ControlConfig2Response;
+	CByteArray m_Message;
+
+	void SetRawMessage(RawResponseMessage &, SpaMessageType, const BYTE *, size_t);
+
+	BOOL m_fCoalesce;
+	BYTE m_PreviousStatusMessage[cbStatusMessage];
+
+	DWORD m_dwDecoded;
+	DWORD m_dwRaw;
+
+	//  Disallowed operations.
+	const CSpaMonitor & operator=(const CSpaMonitor &) { return *this; };
+};
+
+
+template <class Handler>
+CSpaMonitor<Handler>::CSpaMonitor(
+	Handler &MessageHandler,
+	BOOL fCoalesce)
+	: m_Handler(MessageHandler),
+	m_StatusMessage(), m_ConfigResponse(), m_FilterConfigResponse(), m_VersionInfoResponse(), m_ControlConfig2Response(),
+	m_fCoalesce(fCoalesce), m_dwDecoded(smmAll), m_dwRaw(smmAll)
+{
+	F_CRC_InicializaTabla();
+	memset(m_PreviousStatusMessage, 0, sizeof(m_PreviousStatusMessage));
+}
+
+
+template <class Handler>
+void
+CSpaMonitor<Handler>::Reset(void)
+{
+	m_Framer.Reset();
+	memset(m_PreviousStatusMessage, 0, sizeof(m_PreviousStatusMessage));
+}
+
+
+//  Without the status subscription the previous status isn't kept, so
+//  forget it.
+template <class Handler>
+void
+CSpaMonitor<Handler>::SetSubscriptions(
+	DWORD dwDecoded,
+	DWORD dwRaw)
+{
+	m_dwDecoded = dwDecoded;
+	m_dwRaw = dwRaw;
+	memset(m_PreviousStatusMessage, 0, sizeof(m_PreviousStatusMessage));
+}
+
+
+template <class Handler>
+void
+CSpaMonitor<Handler>::ProcessUnknownMessage(
+	const BYTE *pMessage,
+	size_t cbMessage)
+{
+	if (HANDLER_IMPLEMENTS(Handler, ProcessUnknownMessageRaw) && IsSubscribed(smtUnknown))
+	{
+		m_Message.assign(pMessage, pMessage + cbMessage);
+		m_Handler.ProcessUnknownMessageRaw(m_Message);
+	}
+}
+
+
+//  Clearing keeps the buffer for next time.
+template <class Handler>
+void
+CSpaMonitor<Handler>::SetRawMessage(
+	RawResponseMessage &Message,
+	SpaMessageType Type,
+	const BYTE *pMessage,
+	size_t cbMessage)
+{
+	if (WantsRaw(Type))
+	{
+		Message.m_RawMessage.assign(pMessage, pMessage + cbMessage);
+	}
+	else
+	{
+		Message.m_RawMessage.clear();
+	}
+}
+
+
+template <class Handler>
+void
+CSpaMonitor<Handler>::ProcessIncomingData(
+	const BYTE *pData,
+	size_t cbData)
+{
+	const BYTE *pMessage;
+	size_t cbMessage;
+
+	m_Framer.AddData(pData, cbData);
+
+	//  May have multiple messages now in the buffer.
+	while (m_Framer.GetNextMessage(pMessage, cbMessage))
+	{
+		ProcessMessage(pMessage, cbMessage);
+	}
+
+	if (HANDLER_IMPLEMENTS(Handler, OnBatchComplete))
+	{
+		m_Handler.OnBatchComplete();
+	}
+}
+
+
+template <class Handler>
+void
+CSpaMonitor<Handler>::ProcessMessage(
+	const CByteArray &Message)
+{
+	ProcessMessage(&Message[0], Message.size());
+}
+
+
+template <class Handler>
+void
+CSpaMonitor<Handler>::ProcessMessage(
+	const BYTE *pMessage,
+	size_t cbMessage)
+{
+	_ASSERT(pMessage[0] == byMessageTerminator);
+	_ASSERT(pMessage[cbMessage - 1] == byMessageTerminator);
+
+	UINT uiSize = pMessage[1];
+
+	//  Message should be the payload + 2 terminators
+	_ASSERT(uiSize == cbMessage - 2);
+
+	//  CRC is appended, so don't include that byte when re-calculating.
+	_ASSERT(F_CRC_CalculaCheckSum(pMessage + 1, (uint16_t)(uiSize - 1)) == pMessage[cbMessage - 2]);
+	UNREFERENCED_PARAMETER(uiSize);
+
+	UINT uiMessageID = (pMessage[2] << 16) + (pMessage[3] << 8) + pMessage[4];
+
+	switch (uiMessageID)
+	{
+
+	case msConfigResponse:
+		if (cbMessage != cbConfigResponseMessage)
+		{
+			ProcessUnknownMessage(pMessage, cbMessage);
+		}
+		else if (HANDLER_IMPLEMENTS(Handler, ProcessConfigResponse) && IsSubscribed(smtConfigResponse))
+		{
+			ConfigResponseMessage &ConfigResponseMessage = m_ConfigResponse;
+
+			SetRawMessage(ConfigResponseMessage, smtConfigResponse, pMessage, cbMessage);
+			ConfigResponseMessage.m_strMACAddress.clear();
+
+			if (WantsDecoded(smtConfigResponse))
+			{
+				char szMacAddress[64];
+
+				sprintf_s(szMacAddress, "%02X-%02X-%02X-%02X-%02X-%02X",
+						  pMessage[uiPayloadStartOffset + 3], pMessage[uiPayloadStartOffset + 4],
+						  pMessage[uiPayloadStartOffset + 5], pMessage[uiPayloadStartOffset + 6],
+						  pMessage[uiPayloadStartOffset + 7], pMessage[uiPayloadStartOffset + 8]);
+
+				ConfigResponseMessage.m_strMACAddress = szMacAddress;
+			}
+
+			m_Handler.ProcessConfigResponse(ConfigResponseMessage);
+		}
+		break;
+
+	case msFilterConfig:
+		if (cbMessage != cbFilterConfigMessage)
+		{
+			ProcessUnknownMessage(pMessage, cbMessage);
+		}
+		else if (HANDLER_IMPLEMENTS(Handler, ProcessFilterConfigResponse) && IsSubscribed(smtFilterConfigResponse))
+		{
+			FilterConfigResponseMessage &FilterConfigResponse = m_FilterConfigResponse;
+
+			SetRawMessage(FilterConfigResponse, smtFilterConfigResponse, pMessage, cbMessage);
+
+			if (WantsDecoded(smtFilterConfigResponse))
+			{
+				FilterConfigResponse.m_Filter1StartTime.m_Hour = pMessage[uiPayloadStartOffset + 0];
+				FilterConfigResponse.m_Filter1StartTime.m_Minute = pMessage[uiPayloadStartOffset + 1];
+				FilterConfigResponse.m_uiFilter1Duration =
+					pMessage[uiPayloadStartOffset + 2] * 60 + pMessage[uiPayloadStartOffset + 3];
+
+				FilterConfigResponse.m_fFilter2Enabled = (pMessage[uiPayloadStartOffset + 4] & 0x80) != 0;
+				FilterConfigResponse.m_Filter2StartTime.m_Hour = pMessage[uiPayloadStartOffset + 4] & 0x7f;
+				FilterConfigResponse.m_Filter2StartTime.m_Minute = pMessage[uiPayloadStartOffset + 5];
+				FilterConfigResponse.m_uiFilter2Duration =
+					pMessage[uiPayloadStartOffset + 6] * 60 + pMessage[uiPayloadStartOffset + 7];
+			}
+
+			m_Handler.ProcessFilterConfigResponse(FilterConfigResponse);
+		}
+		break;
+
+	case msControlConfig:
+		if (cbMessage != cbVersionInfoMessage)
+		{
+			ProcessUnknownMessage(pMessage, cbMessage);
+		}
+		else if (HANDLER_IMPLEMENTS(Handler, ProcessVersionInfoResponse) && IsSubscribed(smtVersionInfoResponse))
+		{
+			VersionInfoResponseMessage &VersionInfoResponse = m_VersionInfoResponse;
+
+			SetRawMessage(VersionInfoResponse, smtVersionInfoResponse, pMessage, cbMessage);
+			VersionInfoResponse.m_strModelName.clear();
+
+			if (WantsDecoded(smtVersionInfoResponse))
+			{
+				VersionInfoResponse.m_strModelName.assign((const char *)&pMessage[uiPayloadStartOffset + 4], 8);
+				VersionInfoResponse.m_strModelName.erase(VersionInfoResponse.m_strModelName.find_last_not_of(" ") + 1);
+				VersionInfoResponse.SoftwareID[0] = pMessage[uiPayloadStartOffset + 0];
+				VersionInfoResponse.SoftwareID[1] = pMessage[uiPayloadStartOffset + 1];
+				VersionInfoResponse.SoftwareID[2] = pMessage[uiPayloadStartOffset + 2];
+				VersionInfoResponse.CurrentSetup = pMessage[uiPayloadStartOffset + 12];
+				VersionInfoResponse.ConfigurationSignature =
+					(pMessage[uiPayloadStartOffset + 13] << 24) +
+					(pMessage[uiPayloadStartOffset + 14] << 16) +
+					(pMessage[uiPayloadStartOffset + 15] << 8) +
+					(pMessage[uiPayloadStartOffset + 16]);
+			}
+
+			m_Handler.ProcessVersionInfoResponse(VersionInfoResponse);
+		}
+		break;
+
+	case msControlConfig2:
+		if (cbMessage != cbControlConfig2Message)
+		{
+			ProcessUnknownMessage(pMessage, cbMessage);
+		}
+		else if (HANDLER_IMPLEMENTS(Handler, ProcessControlConfig2Response) && IsSubscribed(smtControlConfig2Response))
+		{
+			ControlConfig2ResponseMessage &ControlConfig2ResponseMessage = m_ControlConfig2Response;
+
+			//  Nothing to decode yet.
+			ControlConfig2ResponseMessage.m_RawMessage.assign(pMessage, pMessage + cbMessage);
+
+			m_Handler.ProcessControlConfig2Response(ControlConfig2ResponseMessage);
+		}
+		break;
+
+	//case msSetTempRange:
+	//	//  Unknown contents
+	//	break;
+
+
+	case msStatus:
+		if (cbMessage != cbStatusMessage)
+		{
+			ProcessUnknownMessage(pMessage, cbMessage);
+		}
+		else if ((HANDLER_IMPLEMENTS(Handler, OnStatusChanged) || HANDLER_IMPLEMENTS(Handler, ProcessStatusMessage)) &&
+				 IsSubscribed(smtStatus))
+		{
+			BOOL fChanged = (memcmp(pMessage, m_PreviousStatusMessage, cbStatusMessage) != 0);
+
+			if (fChanged)
+			{
+				memcpy(m_PreviousStatusMessage, pMessage, cbStatusMessage);
+			}
+
+			if (!m_fCoalesce || fChanged)
+			{
+				StatusMessage &StatusMessage = m_StatusMessage;
+				BOOL fDecoded = WantsDecoded(smtStatus);
+
+				SetRawMessage(StatusMessage, smtStatus, pMessage, cbMessage);
+
+				if (fDecoded)
+				{
+					StatusMessage.m_Time.m_Hour = pMessage[8];
+					StatusMessage.m_Time.m_Minute = pMessage[9];
+					StatusMessage.m_f24Time = ((pMessage[14] & 0x02) != 0);
+
+					StatusMessage.m_CurrentTemp = pMessage[7];
+					StatusMessage.m_SetPointTemp = pMessage[25];
+					StatusMessage.m_TempScale = (pMessage[14] & 0x01) ? tsCelsiusX2 : tsFahrenheight;
+
+					StatusMessage.m_HeatRange = (pMessage[15] & 0x04) ? hrHigh : hrLow;
+					StatusMessage.m_HeatingMode = static_cast<HeatingMode>(pMessage[10] & 0x03);
+
+					StatusMessage.m_Pump1Status = static_cast<PumpStatus>(pMessage[16] & 0x03);
+					StatusMessage.m_Pump2Status = static_cast<PumpStatus>((pMessage[16] >> 2) & 0x03);
+
+					StatusMessage.m_fPriming = ((pMessage[6] & 0x01) != 0);
+					StatusMessage.m_fHeating = ((pMessage[15] & 0x30) != 0);
+					StatusMessage.m_fCircPumpRunning = ((pMessage[18] & 0x02) != 0);
+					StatusMessage.m_fLights = ((pMessage[19] & 0x03) != 0);
+				}
+
+				if (fChanged && fDecoded)
+				{
+					m_Handler.OnStatusChanged(StatusMessage);
+				}
+
+				m_Handler.ProcessStatusMessage(StatusMessage);
+			}
+		}
+		break;
+
+	default:
+		ProcessUnknownMessage(pMessage, cbMessage);
+	}
+}
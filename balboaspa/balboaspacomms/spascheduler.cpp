@@ -0,0 +1,492 @@
+#include "stdafx.h"
+#include "Discovery.h"
+#include "MonitorCallback.h"
+#include "ObserverList.h"
+#include "SpaComms.h"
+#include "SpaScheduler.h"
+
+using std::mutex;
+using std::lock_guard;
+
+
+const UINT cWheelLevels = 4;
+const UINT cWheelBits = 6;
+const UINT cWheelSlots = 1 << cWheelBits;
+
+//  Ticks the whole wheel covers; anything further out waits in the top
+//  level's furthest slot, and is put back in when that slot is reached.
+const ULONGLONG ullWheelSpanTicks = 1ULL << (cWheelLevels * cWheelBits);
+
+const UINT cNoEntry = UINT_MAX;
+
+
+CSpaScheduler::CSpaScheduler(
+	DWORD dwSpreadMs,
+	SchedulerClock pClock)
+	: m_dwSpreadMs(dwSpreadMs), m_pClock(pClock), m_hSchedulerThread(0), m_hWake(NULL), m_fShutDown(FALSE),
+	m_Slots(cWheelLevels * cWheelSlots, cNoEntry),
+	m_ullCurrentTick(pClock() / dwSchedulerTickMs), m_cPending(0), m_cRun(0), m_cFailed(0)
+{}
+
+CSpaScheduler::~CSpaScheduler()
+{
+	Stop();
+}
+
+
+BOOL
+CSpaScheduler::Start(void)
+{
+	if (m_hSchedulerThread != 0)
+	{
+		return FALSE;
+	}
+
+	m_hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (m_hWake == NULL)
+	{
+		return FALSE;
+	}
+
+	m_fShutDown = FALSE;
+	m_hSchedulerThread = (HANDLE)_beginthreadex(NULL, 0, CSpaScheduler::SchedulerThreadProc, this, 0, NULL);
+
+	if (m_hSchedulerThread == 0)
+	{
+		CloseHandle(m_hWake);
+		m_hWake = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+void
+CSpaScheduler::Stop(void)
+{
+	if (m_hSchedulerThread == 0)
+	{
+		return;
+	}
+
+	m_fShutDown = TRUE;
+	SetEvent(m_hWake);
+	WaitForSingleObject(m_hSchedulerThread, INFINITE);
+	CloseHandle(m_hSchedulerThread);
+	m_hSchedulerThread = 0;
+
+	lock_guard<mutex> lg(m_mutex);
+
+	CloseHandle(m_hWake);
+	m_hWake = NULL;
+}
+
+
+//  The MAC address's hash, as for CSpaFleet's shards.
+DWORD
+CSpaScheduler::GetSpreadOffsetMs(
+	const string &strMACAddress,
+	DWORD dwSpreadMs)
+{
+	if (dwSpreadMs == 0)
+	{
+		return 0;
+	}
+
+	return (DWORD)(HashMACAddress(strMACAddress) % dwSpreadMs);
+}
+
+
+ScheduleHandle
+CSpaScheduler::Schedule(
+	CSpaComms *pSpa,
+	ULONGLONG ullDelayMs,
+	const ScheduledAction &Action,
+	DWORD dwRepeatMs)
+{
+	if (pSpa == NULL)
+	{
+		return 0;
+	}
+
+	ULONGLONG ullDelayTicks =
+		(ullDelayMs + GetSpreadOffsetMs(pSpa->GetSpaAddress().m_strMACAddress, m_dwSpreadMs) + dwSchedulerTickMs - 1) / dwSchedulerTickMs;
+
+	lock_guard<mutex> lg(m_mutex);
+
+	ULONGLONG ullNowTick = m_pClock() / dwSchedulerTickMs;
+
+	//  With nothing pending the thread doesn't tick, so catch up here.
+	if ((m_cPending == 0) && (ullNowTick > m_ullCurrentTick))
+	{
+		m_ullCurrentTick = ullNowTick;
+	}
+
+	UINT uiEntry;
+
+	if (!m_FreeEntries.empty())
+	{
+		uiEntry = m_FreeEntries.back();
+		m_FreeEntries.pop_back();
+	}
+	else
+	{
+		Entry NewEntry;
+
+		memset(&NewEntry, 0, sizeof(NewEntry));
+		NewEntry.m_uiGeneration = 1;
+
+		uiEntry = (UINT)m_Entries.size();
+		m_Entries.push_back(NewEntry);
+	}
+
+	Entry &ScheduledEntry = m_Entries[uiEntry];
+
+	ScheduledEntry.m_pSpa = pSpa;
+	ScheduledEntry.m_Action = Action;
+	ScheduledEntry.m_ullDueTick = ullNowTick + ullDelayTicks;
+	ScheduledEntry.m_ullRepeatTicks = (dwRepeatMs != 0) ? (std::max)(1ULL, (ULONGLONG)(dwRepeatMs + dwSchedulerTickMs / 2) / dwSchedulerTickMs) : 0;
+	ScheduledEntry.m_fInUse = TRUE;
+
+	InsertEntry(uiEntry, m_ullCurrentTick + 1);
+
+	if ((++m_cPending == 1) && (m_hWake != NULL))
+	{
+		SetEvent(m_hWake);
+	}
+
+	return ((ScheduleHandle)ScheduledEntry.m_uiGeneration << 32) | uiEntry;
+}
+
+
+BOOL
+CSpaScheduler::Cancel(
+	ScheduleHandle hSchedule)
+{
+	UINT uiEntry = (UINT)hSchedule;
+	UINT uiGeneration = (UINT)(hSchedule >> 32);
+
+	lock_guard<mutex> lg(m_mutex);
+
+	if ((uiEntry >= m_Entries.size()) || !m_Entries[uiEntry].m_fInUse ||
+		(m_Entries[uiEntry].m_uiGeneration != uiGeneration))
+	{
+		return FALSE;
+	}
+
+	UnlinkEntry(uiEntry);
+	FreeEntry(uiEntry);
+
+	return TRUE;
+}
+
+
+//  Not O(1), but only needed when a spa goes.
+UINT
+CSpaScheduler::CancelSpa(
+	CSpaComms *pSpa)
+{
+	lock_guard<mutex> lgRun(m_RunMutex);
+	lock_guard<mutex> lg(m_mutex);
+	UINT cCancelled = 0;
+
+	for (UINT i = 0; i < m_Entries.size(); i++)
+	{
+		if (m_Entries[i].m_fInUse && (m_Entries[i].m_pSpa == pSpa))
+		{
+			UnlinkEntry(i);
+			FreeEntry(i);
+			cCancelled++;
+		}
+	}
+
+	return cCancelled;
+}
+
+
+void
+CSpaScheduler::GetStats(
+	SpaSchedulerStats &Stats) const
+{
+	lock_guard<mutex> lg(m_mutex);
+
+	Stats.m_cPending = m_cPending;
+	Stats.m_cRun = m_cRun;
+	Stats.m_cFailed = m_cFailed;
+}
+
+
+//  Level n holds entries due within 64^(n+1) ticks of ullBaseTick, the
+//  first tick not yet expired, in the slot for bits 6n to 6n+5 of the due
+//  tick.  Anything already due goes in ullBaseTick's slot.
+void
+CSpaScheduler::InsertEntry(
+	UINT uiEntry,
+	ULONGLONG ullBaseTick)
+{
+	Entry &NewEntry = m_Entries[uiEntry];
+	ULONGLONG ullDueTick = (std::max)(NewEntry.m_ullDueTick, ullBaseTick);
+	ULONGLONG ullDelta = ullDueTick - ullBaseTick;
+	UINT uiLevel = 0;
+
+	if (ullDelta >= ullWheelSpanTicks)
+	{
+		ullDueTick = ullBaseTick + ullWheelSpanTicks - 1;
+		ullDelta = ullWheelSpanTicks - 1;
+	}
+
+	while (ullDelta >= (1ULL << ((uiLevel + 1) * cWheelBits)))
+	{
+		uiLevel++;
+	}
+
+	UINT uiSlot = uiLevel * cWheelSlots + (UINT)((ullDueTick >> (uiLevel * cWheelBits)) & (cWheelSlots - 1));
+	UINT uiHead = m_Slots[uiSlot];
+
+	NewEntry.m_uiSlot = uiSlot;
+	NewEntry.m_uiPrev = cNoEntry;
+	NewEntry.m_uiNext = uiHead;
+
+	if (uiHead != cNoEntry)
+	{
+		m_Entries[uiHead].m_uiPrev = uiEntry;
+	}
+
+	m_Slots[uiSlot] = uiEntry;
+}
+
+
+void
+CSpaScheduler::UnlinkEntry(
+	UINT uiEntry)
+{
+	Entry &OldEntry = m_Entries[uiEntry];
+
+	if (OldEntry.m_uiPrev != cNoEntry)
+	{
+		m_Entries[OldEntry.m_uiPrev].m_uiNext = OldEntry.m_uiNext;
+	}
+	else
+	{
+		m_Slots[OldEntry.m_uiSlot] = OldEntry.m_uiNext;
+	}
+
+	if (OldEntry.m_uiNext != cNoEntry)
+	{
+		m_Entries[OldEntry.m_uiNext].m_uiPrev = OldEntry.m_uiPrev;
+	}
+
+	OldEntry.m_uiNext = cNoEntry;
+	OldEntry.m_uiPrev = cNoEntry;
+}
+
+
+void
+CSpaScheduler::FreeEntry(
+	UINT uiEntry)
+{
+	Entry &OldEntry = m_Entries[uiEntry];
+
+	OldEntry.m_fInUse = FALSE;
+
+	if (++OldEntry.m_uiGeneration == 0)
+	{
+		OldEntry.m_uiGeneration = 1;
+	}
+
+	m_FreeEntries.push_back(uiEntry);
+	m_cPending--;
+}
+
+
+//  Moves a slot's entries down to where they now belong, as the current
+//  tick is about to be expired.
+void
+CSpaScheduler::CascadeSlot(
+	UINT uiLevel,
+	UINT uiSlot)
+{
+	UINT uiEntry = m_Slots[uiLevel * cWheelSlots + uiSlot];
+
+	m_Slots[uiLevel * cWheelSlots + uiSlot] = cNoEntry;
+
+	while (uiEntry != cNoEntry)
+	{
+		UINT uiNext = m_Entries[uiEntry].m_uiNext;
+
+		InsertEntry(uiEntry, m_ullCurrentTick);
+		uiEntry = uiNext;
+	}
+}
+
+
+//  Collects the entries due at the next tick in Due, putting repeating ones
+//  back for their next time.
+void
+CSpaScheduler::AdvanceTick(
+	std::vector<ScheduledRun> &Due)
+{
+	m_ullCurrentTick++;
+
+	UINT uiIndex = (UINT)(m_ullCurrentTick & (cWheelSlots - 1));
+
+	//  Each time a level wraps, the next level's slot for the coming span
+	//  is spread out over the levels below.
+	if (uiIndex == 0)
+	{
+		for (UINT uiLevel = 1; uiLevel < cWheelLevels; uiLevel++)
+		{
+			UINT uiSlot = (UINT)((m_ullCurrentTick >> (uiLevel * cWheelBits)) & (cWheelSlots - 1));
+
+			CascadeSlot(uiLevel, uiSlot);
+
+			if (uiSlot != 0)
+			{
+				break;
+			}
+		}
+	}
+
+	UINT uiEntry = m_Slots[uiIndex];
+
+	while (uiEntry != cNoEntry)
+	{
+		Entry &DueEntry = m_Entries[uiEntry];
+		UINT uiNext = DueEntry.m_uiNext;
+
+		UnlinkEntry(uiEntry);
+
+		if (DueEntry.m_ullDueTick > m_ullCurrentTick)
+		{
+			//  Was further out than the wheel goes.
+			InsertEntry(uiEntry, m_ullCurrentTick + 1);
+		}
+		else
+		{
+			ScheduledRun Run;
+
+			Run.m_pSpa = DueEntry.m_pSpa;
+			Run.m_Action = DueEntry.m_Action;
+			Run.m_ullTick = m_ullCurrentTick;
+			Due.push_back(Run);
+
+			if (DueEntry.m_ullRepeatTicks != 0)
+			{
+				DueEntry.m_ullDueTick += DueEntry.m_ullRepeatTicks;
+				InsertEntry(uiEntry, m_ullCurrentTick + 1);
+			}
+			else
+			{
+				FreeEntry(uiEntry);
+			}
+		}
+
+		uiEntry = uiNext;
+	}
+}
+
+
+BOOL
+CSpaScheduler::RunAction(
+	const ScheduledRun &Run)
+{
+	const ScheduledAction &Action = Run.m_Action;
+
+	switch (Action.m_Type)
+	{
+	case satSetTemp:
+		return Run.m_pSpa->SendSetTempRequest(Action.m_uiTemp, Action.m_TempScale);
+
+	case satToggle:
+		return Run.m_pSpa->SendToggleRequest(Action.m_ToggleItem);
+
+	case satSetFilterConfig:
+		return Run.m_pSpa->SendSetFilterConfigRequest(Action.m_FilterConfig);
+
+	default:
+		_ASSERT(FALSE);
+		return FALSE;
+	}
+}
+
+
+//  Ticks missed (the thread was held up, or the machine slept) are caught
+//  up one at a time, so nothing is skipped.
+UINT
+CSpaScheduler::RunDue(
+	std::vector<ScheduledRun> *pRun)
+{
+	lock_guard<mutex> lgRun(m_RunMutex);
+	ULONGLONG ullNowTick = m_pClock() / dwSchedulerTickMs;
+
+	m_Due.clear();
+
+	{
+		lock_guard<mutex> lg(m_mutex);
+
+		while ((m_cPending != 0) && (m_ullCurrentTick < ullNowTick))
+		{
+			AdvanceTick(m_Due);
+		}
+	}
+
+	UINT64 cFailed = 0;
+
+	for (auto pDue = m_Due.cbegin(); pDue != m_Due.cend(); pDue++)
+	{
+		if (!RunAction(*pDue))
+		{
+			cFailed++;
+		}
+	}
+
+	if (pRun != NULL)
+	{
+		pRun->insert(pRun->end(), m_Due.cbegin(), m_Due.cend());
+	}
+
+	lock_guard<mutex> lg(m_mutex);
+
+	m_cRun += m_Due.size();
+	m_cFailed += cFailed;
+
+	return (UINT)m_Due.size();
+}
+
+
+unsigned int __stdcall
+CSpaScheduler::SchedulerThreadProc(
+	void *pParam)
+{
+	return ((CSpaScheduler *)pParam)->SchedulerThreadProc();
+}
+
+
+//  Ticks only while something is pending.
+unsigned int
+CSpaScheduler::SchedulerThreadProc(void)
+{
+	while (!m_fShutDown)
+	{
+		DWORD dwWait;
+
+		{
+			lock_guard<mutex> lg(m_mutex);
+
+			dwWait = (m_cPending != 0) ? dwSchedulerTickMs : INFINITE;
+		}
+
+		WaitForSingleObject(m_hWake, dwWait);
+
+		if (m_fShutDown)
+		{
+			break;
+		}
+
+		RunDue(NULL);
+	}
+
+	return 0;
+}
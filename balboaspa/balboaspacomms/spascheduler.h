@@ -0,0 +1,155 @@
+#pragma once
+
+//  Runs timed commands (set temp, toggles, filter config) across many spas
+//  over their existing connections, e.g. lowering every spa's set point at
+//  11pm, rather than connecting to each spa for each action.
+//
+//  Pending actions live in a hierarchical timer wheel: four levels of 64
+//  slots, of dwSchedulerTickMs, 64 ticks, 64^2 and 64^3 ticks each, so
+//  about 75 hours ahead before an action has to be carried over.  Adding
+//  and cancelling an action are O(1); each tick only looks at the actions
+//  due then, and once every 64 ticks moves one slot's actions down a level.
+//
+//  So that a fleet isn't all commanded in the same instant, each spa's
+//  actions are put back by an offset within dwSpreadMs taken from its MAC
+//  address.  The same spa always gets the same offset, and the offsets
+//  are uniform at random over the window, so a fleet is spread out on
+//  average, though two spas may still land close together.
+//
+//  Actions are run on the scheduler's thread.  Schedule() and Cancel() may
+//  be called from any thread.  Time comes from GetTickCount64(), or a clock
+//  given to the constructor.
+
+//  Resolution of the scheduler, about that of GetTickCount64().
+const DWORD dwSchedulerTickMs = 16;
+
+enum ScheduledActionType
+{
+	satSetTemp,
+	satToggle,
+	satSetFilterConfig
+};
+
+struct ScheduledAction
+{
+	ScheduledActionType m_Type;
+
+	UINT m_uiTemp;								//  satSetTemp
+	TempScale m_TempScale;
+	CSpaComms::ToggleSpaItem m_ToggleItem;		//  satToggle
+	FilterConfigInfo m_FilterConfig;			//  satSetFilterConfig
+};
+
+//  0 is never a valid handle.
+typedef UINT64 ScheduleHandle;
+
+//  Milliseconds, as from GetTickCount64().
+typedef ULONGLONG (WINAPI *SchedulerClock)(void);
+
+//  An action as it's run; see RunDue().
+struct ScheduledRun
+{
+	CSpaComms *m_pSpa;
+	ScheduledAction m_Action;
+	ULONGLONG m_ullTick;						//  The tick it was run for
+};
+
+struct SpaSchedulerStats
+{
+	UINT m_cPending;
+	UINT64 m_cRun;
+	UINT64 m_cFailed;						//  Of those run, couldn't be sent
+};
+
+
+class CSpaScheduler
+{
+public:
+	CSpaScheduler(DWORD dwSpreadMs = 5000, SchedulerClock = GetTickCount64);
+	~CSpaScheduler();
+
+	BOOL Start(void);
+
+	//  Pending actions are kept, to run if started again.
+	void Stop(void);
+
+	//  Runs the action on pSpa in ullDelayMs (plus the spa's spread offset),
+	//  and then, if dwRepeatMs isn't 0, every dwRepeatMs after that; for a
+	//  time of day, pass the time until then, and a day to repeat.  Returns
+	//  0 on failure.
+	ScheduleHandle Schedule(CSpaComms *pSpa, ULONGLONG ullDelayMs, const ScheduledAction &, DWORD dwRepeatMs = 0);
+
+	//  FALSE if the action has already run (and doesn't repeat), or been
+	//  cancelled.  An action already being run still finishes.
+	BOOL Cancel(ScheduleHandle);
+
+	//  Cancels all of the spa's actions, waiting for any being run; call this
+	//  before destroying a spa with actions scheduled.  Returns the number
+	//  cancelled.
+	UINT CancelSpa(CSpaComms *pSpa);
+
+	void GetStats(SpaSchedulerStats &) const;
+
+	//  What the thread does each tick: runs everything that's come due by
+	//  the clock, a tick at a time, catching up any ticks missed.  Only
+	//  needed to drive the scheduler by hand while it isn't started, e.g.
+	//  with a clock of the caller's.  Each action run is added to pRun, if
+	//  given.  Returns the number run.
+	UINT RunDue(std::vector<ScheduledRun> *pRun = NULL);
+
+	//  The spread offset for the spa with this MAC address.
+	static DWORD GetSpreadOffsetMs(const string &strMACAddress, DWORD dwSpreadMs);
+
+private:
+	//  In m_Entries, linked into one of m_Slots' lists while pending.
+	struct Entry
+	{
+		CSpaComms *m_pSpa;
+		ScheduledAction m_Action;
+		ULONGLONG m_ullDueTick;
+		ULONGLONG m_ullRepeatTicks;
+
+		UINT m_uiGeneration;					//  Changed as it's freed, for Cancel()
+		BOOL m_fInUse;
+		UINT m_uiSlot;
+		UINT m_uiNext;
+		UINT m_uiPrev;
+	};
+
+	static unsigned int __stdcall SchedulerThreadProc(void *);
+	unsigned int SchedulerThreadProc(void);
+
+	//  Caller holds m_mutex for all of these.
+	void InsertEntry(UINT uiEntry, ULONGLONG ullBaseTick);
+	void UnlinkEntry(UINT uiEntry);
+	void FreeEntry(UINT uiEntry);
+	void CascadeSlot(UINT uiLevel, UINT uiSlot);
+	void AdvanceTick(std::vector<ScheduledRun> &Due);
+
+	//  FALSE if the command couldn't be sent.
+	static BOOL RunAction(const ScheduledRun &);
+
+	DWORD m_dwSpreadMs;
+	SchedulerClock m_pClock;
+
+	HANDLE m_hSchedulerThread;
+	HANDLE m_hWake;
+	volatile BOOL m_fShutDown;
+
+	//  Held while the thread runs actions, so CancelSpa() can wait them out.
+	//  Taken before m_mutex.
+	std::mutex m_RunMutex;
+	std::vector<ScheduledRun> m_Due;			//  Under m_RunMutex
+
+	mutable std::mutex m_mutex;
+	std::vector<Entry> m_Entries;
+	std::vector<UINT> m_FreeEntries;
+	std::vector<UINT> m_Slots;					//  Heads of each level's lists
+	ULONGLONG m_ullCurrentTick;				//  The last tick expired
+	UINT m_cPending;
+	UINT64 m_cRun;
+	UINT64 m_cFailed;
+
+	//  Disallowed operations.
+	const CSpaScheduler & operator=(const CSpaScheduler &) { return *this; };
+};
@@ -0,0 +1,352 @@
+#include "stdafx.h"
+#include "MonitorCallback.h"
+#include "StateSegment.h"
+
+
+//  A reader gives up after this many attempts at a consistent copy.
+const UINT cMaxReadAttempts = 1000;
+
+
+CSpaStateSegment::CSpaStateSegment()
+	: m_hMapping(NULL), m_pHeader(NULL), m_pSlots(NULL), m_cSlots(0), m_fWritable(FALSE)
+{}
+
+CSpaStateSegment::~CSpaStateSegment()
+{
+	Close();
+}
+
+
+BOOL
+CSpaStateSegment::Create(
+	UINT uiSlots,
+	const WCHAR *szName)
+{
+	if ((m_pHeader != NULL) || (uiSlots == 0))
+	{
+		return FALSE;
+	}
+
+	ULONGLONG cbSegment = sizeof(StateSegmentHeader) + (ULONGLONG)uiSlots * sizeof(StateSegmentSlot);
+
+	if (cbSegment > MAXDWORD)
+	{
+		return FALSE;
+	}
+
+	m_hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)cbSegment, szName);
+
+	if (m_hMapping == NULL)
+	{
+		return FALSE;
+	}
+
+	BOOL fExisting = (GetLastError() == ERROR_ALREADY_EXISTS);
+
+	m_pHeader = (StateSegmentHeader *)MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+	if (m_pHeader == NULL)
+	{
+		Close();
+		return FALSE;
+	}
+
+	m_pSlots = (StateSegmentSlot *)(m_pHeader + 1);
+	m_fWritable = TRUE;
+
+	if (fExisting)
+	{
+		//  Left over from (or shared with) another writer; has to agree with
+		//  us about the layout.
+		if ((m_pHeader->m_dwMagic != dwStateSegmentMagic) ||
+			(m_pHeader->m_dwVersion != dwStateSegmentVersion) ||
+			(m_pHeader->m_cbHeader != sizeof(StateSegmentHeader)) ||
+			(m_pHeader->m_cbSlot != sizeof(StateSegmentSlot)))
+		{
+			Close();
+			return FALSE;
+		}
+
+		UINT cSlots = m_pHeader->m_cSlots;
+
+		if ((cSlots < uiSlots) || !FitsInView(cSlots))
+		{
+			Close();
+			return FALSE;
+		}
+
+		m_cSlots = cSlots;
+	}
+	else
+	{
+		//  New sections are zero filled, so every slot starts out as never
+		//  written.  Magic goes in last; readers won't trust the header
+		//  until it's there.
+		m_pHeader->m_dwVersion = dwStateSegmentVersion;
+		m_pHeader->m_cbHeader = sizeof(StateSegmentHeader);
+		m_pHeader->m_cbSlot = sizeof(StateSegmentSlot);
+		m_pHeader->m_cSlots = uiSlots;
+		MemoryBarrier();
+		m_pHeader->m_dwMagic = dwStateSegmentMagic;
+
+		m_cSlots = uiSlots;
+	}
+
+	return TRUE;
+}
+
+
+BOOL
+CSpaStateSegment::Open(
+	const WCHAR *szName)
+{
+	if (m_pHeader != NULL)
+	{
+		return FALSE;
+	}
+
+	m_hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, szName);
+
+	if (m_hMapping == NULL)
+	{
+		return FALSE;
+	}
+
+	m_pHeader = (StateSegmentHeader *)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+
+	if ((m_pHeader == NULL) ||
+		(m_pHeader->m_dwMagic != dwStateSegmentMagic) ||
+		(m_pHeader->m_dwVersion != dwStateSegmentVersion) ||
+		(m_pHeader->m_cbHeader != sizeof(StateSegmentHeader)) ||
+		(m_pHeader->m_cbSlot != sizeof(StateSegmentSlot)))
+	{
+		Close();
+		return FALSE;
+	}
+
+	//  Read once; the header is the writer's to change after this.
+	UINT cSlots = m_pHeader->m_cSlots;
+
+	if (!FitsInView(cSlots))
+	{
+		Close();
+		return FALSE;
+	}
+
+	m_pSlots = (StateSegmentSlot *)(m_pHeader + 1);
+	m_cSlots = cSlots;
+
+	return TRUE;
+}
+
+
+void
+CSpaStateSegment::Close(void)
+{
+	if (m_pHeader != NULL)
+	{
+		UnmapViewOfFile(m_pHeader);
+		m_pHeader = NULL;
+		m_pSlots = NULL;
+		m_cSlots = 0;
+	}
+
+	if (m_hMapping != NULL)
+	{
+		CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+
+	m_fWritable = FALSE;
+}
+
+
+UINT
+CSpaStateSegment::GetSlotCount(void) const
+{
+	return m_cSlots;
+}
+
+
+//  A header claiming more slots than the section holds (a writer with a
+//  different idea of the layout, or a squatter on the name) would have us
+//  read past the end of the view.  The view is the whole section, rounded
+//  up to a page.
+BOOL
+CSpaStateSegment::FitsInView(
+	UINT cSlots) const
+{
+	MEMORY_BASIC_INFORMATION mbi;
+
+	if (VirtualQuery(m_pHeader, &mbi, sizeof(mbi)) != sizeof(mbi))
+	{
+		return FALSE;
+	}
+
+	ULONGLONG cbNeeded = sizeof(StateSegmentHeader) + (ULONGLONG)cSlots * sizeof(StateSegmentSlot);
+
+	return cbNeeded <= mbi.RegionSize;
+}
+
+
+StateSegmentSlot *
+CSpaStateSegment::BeginWrite(
+	UINT uiSlot)
+{
+	if (!m_fWritable || (uiSlot >= m_cSlots))
+	{
+		return NULL;
+	}
+
+	StateSegmentSlot *pSlot = &m_pSlots[uiSlot];
+
+	//  Odd; full barrier, so none of the writes below move ahead of it.
+	InterlockedIncrement((volatile LONG *)&pSlot->m_lSequence);
+
+	return pSlot;
+}
+
+
+void
+CSpaStateSegment::EndWrite(
+	StateSegmentSlot *pSlot,
+	DWORD dwFlags)
+{
+	FILETIME ftNow;
+
+	GetSystemTimeAsFileTime(&ftNow);
+
+	pSlot->m_ullUpdateTime = ((ULONGLONG)ftNow.dwHighDateTime << 32) | ftNow.dwLowDateTime;
+	pSlot->m_dwFlags |= dwFlags;
+
+	//  Even again.
+	InterlockedIncrement((volatile LONG *)&pSlot->m_lSequence);
+}
+
+
+void
+CSpaStateSegment::SetMACAddress(
+	UINT uiSlot,
+	const string &strMACAddress)
+{
+	StateSegmentSlot *pSlot = BeginWrite(uiSlot);
+
+	if (pSlot != NULL)
+	{
+		memset(pSlot->m_szMACAddress, 0, sizeof(pSlot->m_szMACAddress));
+		strncpy_s(pSlot->m_szMACAddress, strMACAddress.c_str(), _TRUNCATE);
+
+		EndWrite(pSlot, 0);
+	}
+}
+
+
+void
+CSpaStateSegment::PublishStatus(
+	UINT uiSlot,
+	const StatusInfo &Status)
+{
+	StateSegmentSlot *pSlot = BeginWrite(uiSlot);
+
+	if (pSlot != NULL)
+	{
+		pSlot->m_Hour = Status.m_Time.m_Hour;
+		pSlot->m_Minute = Status.m_Time.m_Minute;
+		pSlot->m_f24Time = Status.m_f24Time ? 1 : 0;
+		pSlot->m_CurrentTemp = Status.m_CurrentTemp;
+		pSlot->m_SetPointTemp = Status.m_SetPointTemp;
+		pSlot->m_TempScale = (BYTE)Status.m_TempScale;
+		pSlot->m_HeatRange = (BYTE)Status.m_HeatRange;
+		pSlot->m_HeatingMode = (BYTE)Status.m_HeatingMode;
+		pSlot->m_Pump1Status = (BYTE)Status.m_Pump1Status;
+		pSlot->m_Pump2Status = (BYTE)Status.m_Pump2Status;
+		pSlot->m_fPriming = Status.m_fPriming ? 1 : 0;
+		pSlot->m_fHeating = Status.m_fHeating ? 1 : 0;
+		pSlot->m_fCircPumpRunning = Status.m_fCircPumpRunning ? 1 : 0;
+		pSlot->m_fLights = Status.m_fLights ? 1 : 0;
+
+		EndWrite(pSlot, ssfStatus);
+	}
+}
+
+
+void
+CSpaStateSegment::PublishFilterConfig(
+	UINT uiSlot,
+	const FilterConfigInfo &FilterConfig)
+{
+	StateSegmentSlot *pSlot = BeginWrite(uiSlot);
+
+	if (pSlot != NULL)
+	{
+		pSlot->m_Filter1Hour = FilterConfig.m_Filter1StartTime.m_Hour;
+		pSlot->m_Filter1Minute = FilterConfig.m_Filter1StartTime.m_Minute;
+		pSlot->m_wFilter1Duration = (WORD)FilterConfig.m_uiFilter1Duration;
+		pSlot->m_fFilter2Enabled = FilterConfig.m_fFilter2Enabled ? 1 : 0;
+		pSlot->m_Filter2Hour = FilterConfig.m_Filter2StartTime.m_Hour;
+		pSlot->m_Filter2Minute = FilterConfig.m_Filter2StartTime.m_Minute;
+		pSlot->m_wFilter2Duration = (WORD)FilterConfig.m_uiFilter2Duration;
+
+		EndWrite(pSlot, ssfFilterConfig);
+	}
+}
+
+
+void
+CSpaStateSegment::PublishVersionInfo(
+	UINT uiSlot,
+	const VersionInfoResponseMessage &VersionInfo)
+{
+	StateSegmentSlot *pSlot = BeginWrite(uiSlot);
+
+	if (pSlot != NULL)
+	{
+		pSlot->m_SoftwareID[0] = VersionInfo.SoftwareID[0];
+		pSlot->m_SoftwareID[1] = VersionInfo.SoftwareID[1];
+		pSlot->m_SoftwareID[2] = VersionInfo.SoftwareID[2];
+		pSlot->m_CurrentSetup = VersionInfo.CurrentSetup;
+		pSlot->m_dwConfigurationSignature = VersionInfo.ConfigurationSignature;
+
+		memset(pSlot->m_szModelName, 0, sizeof(pSlot->m_szModelName));
+		strncpy_s(pSlot->m_szModelName, VersionInfo.m_strModelName.c_str(), _TRUNCATE);
+
+		EndWrite(pSlot, ssfVersionInfo);
+	}
+}
+
+
+BOOL
+CSpaStateSegment::ReadSlot(
+	UINT uiSlot,
+	StateSegmentSlot &Slot) const
+{
+	if (uiSlot >= m_cSlots)
+	{
+		return FALSE;
+	}
+
+	const StateSegmentSlot *pSlot = &m_pSlots[uiSlot];
+	const volatile LONG *plSequence = (const volatile LONG *)&pSlot->m_lSequence;
+
+	for (UINT uiAttempt = 0; uiAttempt < cMaxReadAttempts; uiAttempt++)
+	{
+		LONG lBefore = *plSequence;
+
+		MemoryBarrier();
+
+		if ((lBefore & 1) == 0)
+		{
+			memcpy(&Slot, pSlot, sizeof(Slot));
+			MemoryBarrier();
+
+			if (*plSequence == lBefore)
+			{
+				return TRUE;
+			}
+		}
+
+		YieldProcessor();
+	}
+
+	return FALSE;
+}
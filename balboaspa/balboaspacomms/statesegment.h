@@ -0,0 +1,132 @@
+#pragma once
+
+//  Latest decoded state of each spa, published into a named shared memory
+//  section so other processes on the machine (exporters, UIs, rule engines)
+//  can read it without connecting to the spa or a broker.
+//
+//  The layout is fixed and versioned; see StateSegment.txt for the byte
+//  offsets, for readers not written in C++.
+
+const WCHAR * const szDefaultStateSegmentName = L"Local\\BalboaSpaState";
+
+const DWORD dwStateSegmentMagic = 0x41505342;	//  "BSPA"
+const DWORD dwStateSegmentVersion = 1;
+
+//  Slot flags, set once that part of the slot has been filled in.
+enum StateSegmentFlags
+{
+	ssfStatus = 0x01,
+	ssfFilterConfig = 0x02,
+	ssfVersionInfo = 0x04
+};
+
+
+//  All fields little endian, naturally aligned; no compiler packing needed.
+struct StateSegmentHeader
+{
+	DWORD m_dwMagic;
+	DWORD m_dwVersion;
+	DWORD m_cbHeader;
+	DWORD m_cbSlot;
+	DWORD m_cSlots;
+
+	BYTE m_Reserved[44];
+};
+
+
+//  One per spa, two cache lines.  The sequence is odd while the slot is
+//  being written, and zero if it never has been.
+struct StateSegmentSlot
+{
+	LONG m_lSequence;
+	DWORD m_dwFlags;
+	ULONGLONG m_ullUpdateTime;		//  FILETIME, UTC
+	char m_szMACAddress[20];
+	BYTE m_Reserved1[12];
+
+	//  StatusInfo, one byte per field.
+	BYTE m_Hour;
+	BYTE m_Minute;
+	BYTE m_f24Time;
+	BYTE m_CurrentTemp;
+	BYTE m_SetPointTemp;
+	BYTE m_TempScale;
+	BYTE m_HeatRange;
+	BYTE m_HeatingMode;
+	BYTE m_Pump1Status;
+	BYTE m_Pump2Status;
+	BYTE m_fPriming;
+	BYTE m_fHeating;
+	BYTE m_fCircPumpRunning;
+	BYTE m_fLights;
+	BYTE m_Reserved2[2];
+
+	//  FilterConfigInfo, durations in minutes.
+	BYTE m_Filter1Hour;
+	BYTE m_Filter1Minute;
+	WORD m_wFilter1Duration;
+	BYTE m_fFilter2Enabled;
+	BYTE m_Filter2Hour;
+	BYTE m_Filter2Minute;
+	BYTE m_Reserved3;
+	WORD m_wFilter2Duration;
+	BYTE m_Reserved4[6];
+
+	//  VersionInfoResponseMessage
+	BYTE m_SoftwareID[3];
+	BYTE m_CurrentSetup;
+	DWORD m_dwConfigurationSignature;
+	char m_szModelName[12];
+	BYTE m_Reserved5[28];
+};
+
+static_assert(sizeof(StateSegmentHeader) == 64, "State segment layout changed");
+static_assert(sizeof(StateSegmentSlot) == 128, "State segment layout changed");
+static_assert(offsetof(StateSegmentSlot, m_Hour) == 48, "State segment layout changed");
+static_assert(offsetof(StateSegmentSlot, m_Filter1Hour) == 64, "State segment layout changed");
+static_assert(offsetof(StateSegmentSlot, m_SoftwareID) == 80, "State segment layout changed");
+
+
+class CSpaStateSegment
+{
+public:
+	CSpaStateSegment();
+	~CSpaStateSegment();
+
+	//  Writer side.  Creates the section, or opens an existing one with a
+	//  matching layout and at least uiSlots slots.
+	BOOL Create(UINT uiSlots, const WCHAR *szName = szDefaultStateSegmentName);
+
+	//  Reader side, read only.  Fails unless the header's slots all lie
+	//  within the section.
+	BOOL Open(const WCHAR *szName = szDefaultStateSegmentName);
+
+	void Close(void);
+
+	UINT GetSlotCount(void) const;
+
+	//  Each slot must only be written by one thread at a time.
+	void SetMACAddress(UINT uiSlot, const string &);
+	void PublishStatus(UINT uiSlot, const StatusInfo &);
+	void PublishFilterConfig(UINT uiSlot, const FilterConfigInfo &);
+	void PublishVersionInfo(UINT uiSlot, const VersionInfoResponseMessage &);
+
+	//  Consistent copy of a slot.  FALSE if out of range, or if the writer
+	//  kept it busy (or died part way through an update).
+	BOOL ReadSlot(UINT uiSlot, StateSegmentSlot &) const;
+
+private:
+	BOOL FitsInView(UINT cSlots) const;
+
+	StateSegmentSlot *BeginWrite(UINT uiSlot);
+	void EndWrite(StateSegmentSlot *, DWORD dwFlags);
+
+	HANDLE m_hMapping;
+	StateSegmentHeader *m_pHeader;
+	StateSegmentSlot *m_pSlots;
+	UINT m_cSlots;						//  As checked when mapped; the header's may change
+	BOOL m_fWritable;
+
+	//  Disallowed operations.
+	const CSpaStateSegment & operator=(const CSpaStateSegment &) { return *this; };
+};
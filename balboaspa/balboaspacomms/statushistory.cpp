@@ -0,0 +1,597 @@
+#include "stdafx.h"
+#include "MonitorCallback.h"
+#include "StatusHistory.h"
+
+
+const DWORD dwHistoryFileMagic = 0x53485342;	//  "BSHS"
+const DWORD dwHistoryFileVersion = 1;
+
+enum HistoryColumn
+{
+	hcTime,			//  Seconds since the previous record
+	hcSpaClock,		//  Spa's own time, minutes since midnight
+	hcCurrentTemp,
+	hcSetPointTemp,
+	hcFlags,		//  Everything else, see PackFlags()
+	hcColumnCount
+};
+
+
+//  Values are stored as LEB128 varints; most fit in a byte.
+static void
+AppendVarint(
+	CByteArray &Buffer,
+	UINT uiValue)
+{
+	while (uiValue >= 0x80)
+	{
+		Buffer.push_back((BYTE)(uiValue | 0x80));
+		uiValue >>= 7;
+	}
+	Buffer.push_back((BYTE)uiValue);
+}
+
+static UINT
+ReadVarint(
+	const BYTE *&pData)
+{
+	UINT uiValue = 0;
+	UINT uiShift = 0;
+
+	while (*pData & 0x80)
+	{
+		uiValue |= (*pData++ & 0x7f) << uiShift;
+		uiShift += 7;
+	}
+	uiValue |= *pData++ << uiShift;
+
+	return uiValue;
+}
+
+//  Checks a column read from disk decodes to exactly cValues values, without
+//  running off the end.
+static BOOL
+ValidateColumn(
+	const CByteArray &Encoded,
+	UINT cValues)
+{
+	size_t cVarints = 0;
+	UINT cDecoded = 0;
+	UINT uiRunLength = 0;
+	UINT uiShift = 0;
+
+	for (auto pByte = Encoded.cbegin(); pByte != Encoded.cend(); pByte++)
+	{
+		if (uiShift > 28)
+		{
+			return FALSE;
+		}
+
+		uiRunLength |= (*pByte & 0x7f) << uiShift;
+		uiShift += 7;
+
+		if ((*pByte & 0x80) == 0)
+		{
+			//  Even varints are run lengths, odd ones values.
+			if ((cVarints++ & 1) == 0)
+			{
+				if ((uiRunLength == 0) || (uiRunLength > cValues - cDecoded))
+				{
+					return FALSE;
+				}
+				cDecoded += uiRunLength;
+			}
+			uiRunLength = 0;
+			uiShift = 0;
+		}
+	}
+
+	return (uiShift == 0) && ((cVarints & 1) == 0) && (cDecoded == cValues);
+}
+
+static size_t
+VarintSize(
+	UINT uiValue)
+{
+	size_t cbSize = 1;
+
+	while (uiValue >= 0x80)
+	{
+		uiValue >>= 7;
+		cbSize++;
+	}
+
+	return cbSize;
+}
+
+
+//  Flags word:
+//    bit  0     24 hour time
+//    bit  1     Temp scale
+//    bit  2     Heat range
+//    bits 3-4   Heating mode
+//    bits 5-6   Pump 1
+//    bits 7-8   Pump 2
+//    bit  9     Priming
+//    bit  10    Heating
+//    bit  11    Circulation pump
+//    bit  12    Lights
+static UINT
+PackFlags(
+	const StatusInfo &Status)
+{
+	return
+		(Status.m_f24Time ? 0x0001 : 0) |
+		(((UINT)Status.m_TempScale & 0x01) << 1) |
+		(((UINT)Status.m_HeatRange & 0x01) << 2) |
+		(((UINT)Status.m_HeatingMode & 0x03) << 3) |
+		(((UINT)Status.m_Pump1Status & 0x03) << 5) |
+		(((UINT)Status.m_Pump2Status & 0x03) << 7) |
+		(Status.m_fPriming ? 0x0200 : 0) |
+		(Status.m_fHeating ? 0x0400 : 0) |
+		(Status.m_fCircPumpRunning ? 0x0800 : 0) |
+		(Status.m_fLights ? 0x1000 : 0);
+}
+
+static void
+UnpackFlags(
+	UINT uiFlags,
+	StatusInfo &Status)
+{
+	Status.m_f24Time = (uiFlags & 0x0001) != 0;
+	Status.m_TempScale = static_cast<TempScale>((uiFlags >> 1) & 0x01);
+	Status.m_HeatRange = static_cast<HeatingRange>((uiFlags >> 2) & 0x01);
+	Status.m_HeatingMode = static_cast<HeatingMode>((uiFlags >> 3) & 0x03);
+	Status.m_Pump1Status = static_cast<PumpStatus>((uiFlags >> 5) & 0x03);
+	Status.m_Pump2Status = static_cast<PumpStatus>((uiFlags >> 7) & 0x03);
+	Status.m_fPriming = (uiFlags & 0x0200) != 0;
+	Status.m_fHeating = (uiFlags & 0x0400) != 0;
+	Status.m_fCircPumpRunning = (uiFlags & 0x0800) != 0;
+	Status.m_fLights = (uiFlags & 0x1000) != 0;
+}
+
+
+//  Sequence of (run length, value) pairs.  The run still being added to is
+//  kept to one side until the value changes.
+struct CStatusHistory::Column
+{
+	Column() : m_uiRunValue(0), m_uiRunLength(0) {};
+
+	void Add(UINT uiValue)
+	{
+		if ((m_uiRunLength != 0) && (uiValue != m_uiRunValue))
+		{
+			FlushRun();
+		}
+		m_uiRunValue = uiValue;
+		m_uiRunLength++;
+	};
+
+	void FlushRun(void)
+	{
+		if (m_uiRunLength != 0)
+		{
+			AppendVarint(m_Encoded, m_uiRunLength);
+			AppendVarint(m_Encoded, m_uiRunValue);
+			m_uiRunLength = 0;
+		}
+	};
+
+	size_t GetEncodedSize(void) const
+	{
+		return m_Encoded.size() +
+			((m_uiRunLength != 0) ? VarintSize(m_uiRunLength) + VarintSize(m_uiRunValue) : 0);
+	};
+
+	CByteArray m_Encoded;
+	UINT m_uiRunValue;
+	UINT m_uiRunLength;
+};
+
+
+struct CStatusHistory::Block
+{
+	Block(LONGLONG llFirstTime)
+		: m_llFirstTime(llFirstTime), m_llLastTime(llFirstTime), m_cRecords(0),
+		m_fSealed(FALSE)
+	{};
+
+	//  No more appends; trim it down to size.
+	void Seal(void)
+	{
+		for (UINT i = 0; i < hcColumnCount; i++)
+		{
+			m_Columns[i].FlushRun();
+			m_Columns[i].m_Encoded.shrink_to_fit();
+		}
+		m_fSealed = TRUE;
+	};
+
+	LONGLONG m_llFirstTime;
+	LONGLONG m_llLastTime;
+	UINT m_cRecords;
+	BOOL m_fSealed;
+
+	Column m_Columns[hcColumnCount];
+};
+
+
+//  Reads a column back one value at a time.
+class CColumnCursor
+{
+public:
+	CColumnCursor()
+		: m_pData(NULL), m_pEnd(NULL), m_uiValue(0), m_uiRemaining(0),
+		m_uiPendingValue(0), m_uiPendingLength(0)
+	{};
+
+	void Init(const CByteArray &Encoded, UINT uiPendingValue, UINT uiPendingLength)
+	{
+		m_pData = Encoded.empty() ? NULL : &Encoded[0];
+		m_pEnd = m_pData + Encoded.size();
+		m_uiRemaining = 0;
+		m_uiPendingValue = uiPendingValue;
+		m_uiPendingLength = uiPendingLength;
+	};
+
+	UINT Next(void)
+	{
+		if (m_uiRemaining == 0)
+		{
+			NextRun();
+		}
+		m_uiRemaining--;
+
+		return m_uiValue;
+	};
+
+	//  Whole runs at a time, where possible.
+	void Skip(UINT uiCount)
+	{
+		while (uiCount > 0)
+		{
+			if (m_uiRemaining == 0)
+			{
+				NextRun();
+			}
+
+			UINT uiStep = (std::min)(uiCount, m_uiRemaining);
+
+			m_uiRemaining -= uiStep;
+			uiCount -= uiStep;
+		}
+	};
+
+private:
+	void NextRun(void)
+	{
+		if (m_pData < m_pEnd)
+		{
+			m_uiRemaining = ReadVarint(m_pData);
+			m_uiValue = ReadVarint(m_pData);
+		}
+		else
+		{
+			//  Block's still open; this is the run being built.
+			_ASSERT(m_uiPendingLength != 0);
+			m_uiRemaining = m_uiPendingLength;
+			m_uiValue = m_uiPendingValue;
+			m_uiPendingLength = 0;
+		}
+	};
+
+	const BYTE *m_pData;
+	const BYTE *m_pEnd;
+	UINT m_uiValue;
+	UINT m_uiRemaining;
+	UINT m_uiPendingValue;
+	UINT m_uiPendingLength;
+};
+
+
+CStatusHistory::CStatusHistory()
+	: m_llLastTime(0), m_cRecords(0)
+{}
+
+CStatusHistory::~CStatusHistory()
+{}
+
+
+CStatusHistory::Block &
+CStatusHistory::GetAppendBlock(
+	LONGLONG llTime)
+{
+	if (!m_Blocks.empty())
+	{
+		Block &LastBlock = *m_Blocks.back();
+
+		if (!LastBlock.m_fSealed)
+		{
+			if ((LastBlock.m_cRecords < cStatusHistoryBlockSize) &&
+				(llTime - LastBlock.m_llLastTime <= UINT_MAX))
+			{
+				return LastBlock;
+			}
+
+			LastBlock.Seal();
+		}
+	}
+
+	m_Blocks.push_back(std::make_unique<Block>(llTime));
+
+	return *m_Blocks.back();
+}
+
+
+BOOL
+CStatusHistory::Append(
+	LONGLONG llTime,
+	const StatusInfo &Status)
+{
+	if ((m_cRecords != 0) && (llTime < m_llLastTime))
+	{
+		return FALSE;
+	}
+
+	Block &Block = GetAppendBlock(llTime);
+
+	Block.m_Columns[hcTime].Add((UINT)(llTime - Block.m_llLastTime));
+	Block.m_Columns[hcSpaClock].Add(Status.m_Time.m_Hour * 60 + Status.m_Time.m_Minute);
+	Block.m_Columns[hcCurrentTemp].Add(Status.m_CurrentTemp);
+	Block.m_Columns[hcSetPointTemp].Add(Status.m_SetPointTemp);
+	Block.m_Columns[hcFlags].Add(PackFlags(Status));
+
+	Block.m_llLastTime = llTime;
+	Block.m_cRecords++;
+
+	m_llLastTime = llTime;
+	m_cRecords++;
+
+	return TRUE;
+}
+
+
+size_t
+CStatusHistory::Scan(
+	LONGLONG llStart,
+	LONGLONG llEnd,
+	IStatusHistoryVisitor &Visitor) const
+{
+	size_t cVisited = 0;
+
+	//  Blocks are in time order; find the first one that could overlap.
+	auto pBlock = std::lower_bound(m_Blocks.cbegin(), m_Blocks.cend(), llStart,
+		[](const std::unique_ptr<Block> &pBlock, LONGLONG llTime) { return pBlock->m_llLastTime < llTime; });
+
+	for (; (pBlock != m_Blocks.cend()) && ((*pBlock)->m_llFirstTime < llEnd); pBlock++)
+	{
+		const Block &Block = **pBlock;
+		CColumnCursor Cursors[hcColumnCount];
+
+		for (UINT i = 0; i < hcColumnCount; i++)
+		{
+			const Column &Column = Block.m_Columns[i];
+
+			Cursors[i].Init(Column.m_Encoded, Column.m_uiRunValue, Column.m_uiRunLength);
+		}
+
+		//  Walk the time column alone up to the start of the range, then
+		//  skip the others forward in one go.
+		LONGLONG llTime = Block.m_llFirstTime;
+		UINT uiRecord = 0;
+
+		while (uiRecord < Block.m_cRecords)
+		{
+			LONGLONG llNextTime = llTime + Cursors[hcTime].Next();
+
+			if (llNextTime >= llStart)
+			{
+				llTime = llNextTime;
+				break;
+			}
+			llTime = llNextTime;
+			uiRecord++;
+		}
+
+		for (UINT i = hcTime + 1; i < hcColumnCount; i++)
+		{
+			Cursors[i].Skip(uiRecord);
+		}
+
+		StatusInfo Status;
+
+		while ((uiRecord < Block.m_cRecords) && (llTime < llEnd))
+		{
+			UINT uiSpaClock = Cursors[hcSpaClock].Next();
+
+			Status.m_Time.m_Hour = (BYTE)(uiSpaClock / 60);
+			Status.m_Time.m_Minute = (BYTE)(uiSpaClock % 60);
+			Status.m_CurrentTemp = (BYTE)Cursors[hcCurrentTemp].Next();
+			Status.m_SetPointTemp = (BYTE)Cursors[hcSetPointTemp].Next();
+			UnpackFlags(Cursors[hcFlags].Next(), Status);
+
+			Visitor.OnStatus(llTime, Status);
+			cVisited++;
+
+			if (++uiRecord < Block.m_cRecords)
+			{
+				llTime += Cursors[hcTime].Next();
+			}
+		}
+	}
+
+	return cVisited;
+}
+
+
+void
+CStatusHistory::Clear(void)
+{
+	m_Blocks.clear();
+	m_llLastTime = 0;
+	m_cRecords = 0;
+}
+
+
+size_t
+CStatusHistory::GetRecordCount(void) const
+{
+	return m_cRecords;
+}
+
+
+BOOL
+CStatusHistory::GetTimeRange(
+	LONGLONG &llFirst,
+	LONGLONG &llLast) const
+{
+	if (m_Blocks.empty())
+	{
+		return FALSE;
+	}
+
+	llFirst = m_Blocks.front()->m_llFirstTime;
+	llLast = m_Blocks.back()->m_llLastTime;
+
+	return TRUE;
+}
+
+
+size_t
+CStatusHistory::GetEncodedSize(void) const
+{
+	size_t cbSize = 0;
+
+	for (auto pBlock = m_Blocks.cbegin(); pBlock != m_Blocks.cend(); pBlock++)
+	{
+		cbSize += sizeof(LONGLONG) * 2 + sizeof(DWORD);
+
+		for (UINT i = 0; i < hcColumnCount; i++)
+		{
+			cbSize += sizeof(DWORD) + (*pBlock)->m_Columns[i].GetEncodedSize();
+		}
+	}
+
+	return cbSize;
+}
+
+
+//  File layout, all little endian:
+//    DWORD magic, DWORD version, DWORD block count
+//    For each block:
+//      LONGLONG first time, LONGLONG last time, DWORD record count
+//      For each column: DWORD byte count, encoded runs
+BOOL
+CStatusHistory::Save(
+	const WCHAR *szFileName) const
+{
+	FILE *fhOut;
+
+	if (_wfopen_s(&fhOut, szFileName, L"wb") != 0)
+	{
+		return FALSE;
+	}
+
+	DWORD FileHeader[3] = { dwHistoryFileMagic, dwHistoryFileVersion, (DWORD)m_Blocks.size() };
+	BOOL fOK = (fwrite(FileHeader, sizeof(FileHeader), 1, fhOut) == 1);
+
+	for (auto pBlock = m_Blocks.cbegin(); fOK && (pBlock != m_Blocks.cend()); pBlock++)
+	{
+		const Block &Block = **pBlock;
+		DWORD cRecords = Block.m_cRecords;
+
+		fOK = (fwrite(&Block.m_llFirstTime, sizeof(LONGLONG), 1, fhOut) == 1) &&
+			(fwrite(&Block.m_llLastTime, sizeof(LONGLONG), 1, fhOut) == 1) &&
+			(fwrite(&cRecords, sizeof(cRecords), 1, fhOut) == 1);
+
+		for (UINT i = 0; fOK && (i < hcColumnCount); i++)
+		{
+			//  Open block; write the pending run out along with the rest.
+			Column Column = Block.m_Columns[i];
+
+			Column.FlushRun();
+
+			DWORD cbEncoded = (DWORD)Column.m_Encoded.size();
+
+			fOK = (fwrite(&cbEncoded, sizeof(cbEncoded), 1, fhOut) == 1) &&
+				((cbEncoded == 0) || (fwrite(&Column.m_Encoded[0], cbEncoded, 1, fhOut) == 1));
+		}
+	}
+
+	return (fclose(fhOut) == 0) && fOK;
+}
+
+
+BOOL
+CStatusHistory::Load(
+	const WCHAR *szFileName)
+{
+	FILE *fhIn;
+
+	if (_wfopen_s(&fhIn, szFileName, L"rb") != 0)
+	{
+		return FALSE;
+	}
+
+	Clear();
+
+	DWORD FileHeader[3];
+	BOOL fOK = (fread(FileHeader, sizeof(FileHeader), 1, fhIn) == 1) &&
+		(FileHeader[0] == dwHistoryFileMagic) &&
+		(FileHeader[1] == dwHistoryFileVersion);
+
+	for (DWORD iBlock = 0; fOK && (iBlock < FileHeader[2]); iBlock++)
+	{
+		LONGLONG llFirstTime, llLastTime;
+		DWORD cRecords;
+
+		fOK = (fread(&llFirstTime, sizeof(llFirstTime), 1, fhIn) == 1) &&
+			(fread(&llLastTime, sizeof(llLastTime), 1, fhIn) == 1) &&
+			(fread(&cRecords, sizeof(cRecords), 1, fhIn) == 1) &&
+			(cRecords != 0) && (llFirstTime <= llLastTime) && (llFirstTime >= m_llLastTime);
+
+		if (!fOK)
+		{
+			break;
+		}
+
+		auto pBlock = std::make_unique<Block>(llFirstTime);
+
+		pBlock->m_llLastTime = llLastTime;
+		pBlock->m_cRecords = cRecords;
+
+		for (UINT i = 0; fOK && (i < hcColumnCount); i++)
+		{
+			DWORD cbEncoded;
+
+			fOK = (fread(&cbEncoded, sizeof(cbEncoded), 1, fhIn) == 1) &&
+				(cbEncoded <= cRecords * 10);	//  Sanity check, two varints a record at most
+
+			if (fOK && (cbEncoded != 0))
+			{
+				CByteArray &Encoded = pBlock->m_Columns[i].m_Encoded;
+
+				Encoded.resize(cbEncoded);
+				fOK = (fread(&Encoded[0], cbEncoded, 1, fhIn) == 1);
+			}
+
+			fOK = fOK && ValidateColumn(pBlock->m_Columns[i].m_Encoded, cRecords);
+		}
+
+		//  Appends go into a new block.
+		pBlock->m_fSealed = TRUE;
+
+		m_Blocks.push_back(std::move(pBlock));
+		m_llLastTime = llLastTime;
+		m_cRecords += cRecords;
+	}
+
+	fclose(fhIn);
+
+	if (!fOK)
+	{
+		Clear();
+	}
+
+	return fOK;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+//  Compact, append only history of decoded status messages.
+//
+//  Records are grouped into blocks of up to cStatusHistoryBlockSize, and
+//  each block stores its fields as separate run length encoded columns:
+//  time (as deltas), spa clock, current temp, set point, and everything else
+//  bit packed into one word.  A spa at rest repeats the same values for
+//  hours, so most columns are a handful of runs per block.  Blocks carry
+//  their time range, so a scan only decodes the blocks it overlaps.
+
+const UINT cStatusHistoryBlockSize = 4096;
+
+
+//  Called for each record of a scan, in time order.
+class IStatusHistoryVisitor
+{
+public:
+	virtual void OnStatus(LONGLONG llTime, const StatusInfo &) = 0;
+};
+
+
+class CStatusHistory
+{
+public:
+	CStatusHistory();
+	~CStatusHistory();
+
+	//  llTime is in seconds (e.g. from _time64()), and mustn't go backwards.
+	BOOL Append(LONGLONG llTime, const StatusInfo &);
+
+	//  Visits every record with llStart <= time < llEnd.  Returns the number
+	//  visited.
+	size_t Scan(LONGLONG llStart, LONGLONG llEnd, IStatusHistoryVisitor &) const;
+
+	void Clear(void);
+
+	size_t GetRecordCount(void) const;
+	BOOL GetTimeRange(LONGLONG &llFirst, LONGLONG &llLast) const;
+
+	//  Bytes of encoded column data, which is also (near enough) the size on
+	//  disk.
+	size_t GetEncodedSize(void) const;
+
+	BOOL Save(const WCHAR *szFileName) const;
+	BOOL Load(const WCHAR *szFileName);
+
+private:
+	struct Column;
+	struct Block;
+
+	Block &GetAppendBlock(LONGLONG llTime);
+
+	std::vector<std::unique_ptr<Block>> m_Blocks;
+	LONGLONG m_llLastTime;
+	size_t m_cRecords;
+
+	//  Disallowed operations.
+	const CStatusHistory & operator=(const CStatusHistory &) { return *this; };
+};
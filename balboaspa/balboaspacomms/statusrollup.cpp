@@ -0,0 +1,206 @@
+#include "stdafx.h"
+#include "MonitorCallback.h"
+#include "StatusHistory.h"
+#include "StatusRollup.h"
+
+
+const LONGLONG llPeriodSeconds[rpPeriodCount] = { 60, 60 * 60, 24 * 60 * 60 };
+
+//  A day of minutes, a week of hours, a year of days.
+const size_t cRollupsKept[rpPeriodCount] = { 24 * 60, 7 * 24, 366 };
+
+//  m_llStart of a bucket that hasn't been opened yet.
+const LONGLONG llNoBucket = LLONG_MIN;
+
+
+static void
+ResetRollup(
+	StatusRollup &Rollup,
+	LONGLONG llStart)
+{
+	memset(&Rollup, 0, sizeof(Rollup));
+	Rollup.m_llStart = llStart;
+	Rollup.m_MinTemp = 0xff;
+}
+
+//  Rounds down, including for times before the epoch.
+static LONGLONG
+BucketStart(
+	LONGLONG llTime,
+	LONGLONG llPeriod)
+{
+	return llTime - (((llTime % llPeriod) + llPeriod) % llPeriod);
+}
+
+
+double
+StatusRollup::GetMeanTemp(void) const
+{
+	return (m_uiTempSeconds != 0) ? (double)m_uiTempSum / m_uiTempSeconds : 0.0;
+}
+
+double
+StatusRollup::GetHeatingDutyCycle(void) const
+{
+	return (m_uiSeconds != 0) ? (double)m_uiHeatingSeconds / m_uiSeconds : 0.0;
+}
+
+
+CStatusRollups::CStatusRollups()
+{
+	Clear();
+}
+
+
+void
+CStatusRollups::Clear(void)
+{
+	m_fHaveStatus = FALSE;
+	m_llLastTime = 0;
+	memset(&m_LastStatus, 0, sizeof(m_LastStatus));
+
+	for (UINT i = 0; i < rpPeriodCount; i++)
+	{
+		ResetRollup(m_Current[i], llNoBucket);
+		m_Completed[i].clear();
+	}
+}
+
+
+BOOL
+CStatusRollups::AddStatus(
+	LONGLONG llTime,
+	const StatusInfo &Status)
+{
+	if (m_fHaveStatus)
+	{
+		if (llTime < m_llLastTime)
+		{
+			return FALSE;
+		}
+
+		//  The previous status held from when it arrived until now.
+		AddInterval(m_llLastTime, (std::min)(llTime, m_llLastTime + cMaxStatusHoldSeconds), m_LastStatus);
+	}
+
+	m_fHaveStatus = TRUE;
+	m_llLastTime = llTime;
+	m_LastStatus = Status;
+
+	return TRUE;
+}
+
+
+//  Intervals are at most cMaxStatusHoldSeconds long, so this only ever
+//  touches one or two buckets per period.
+void
+CStatusRollups::AddInterval(
+	LONGLONG llStart,
+	LONGLONG llEnd,
+	const StatusInfo &Status)
+{
+	for (UINT i = 0; i < rpPeriodCount; i++)
+	{
+		RollupPeriod Period = static_cast<RollupPeriod>(i);
+		StatusRollup &Rollup = m_Current[Period];
+		LONGLONG llFrom = llStart;
+
+		while (llFrom < llEnd)
+		{
+			LONGLONG llBucket = BucketStart(llFrom, llPeriodSeconds[Period]);
+
+			if (llBucket != Rollup.m_llStart)
+			{
+				CloseBucket(Period);
+				ResetRollup(Rollup, llBucket);
+			}
+
+			LONGLONG llTo = (std::min)(llEnd, llBucket + llPeriodSeconds[Period]);
+			UINT uiSeconds = (UINT)(llTo - llFrom);
+
+			Rollup.m_uiSeconds += uiSeconds;
+
+			if (Status.m_CurrentTemp != byUNKNOWN_TEMP)
+			{
+				Rollup.m_uiTempSeconds += uiSeconds;
+				Rollup.m_MinTemp = (std::min)(Rollup.m_MinTemp, Status.m_CurrentTemp);
+				Rollup.m_MaxTemp = (std::max)(Rollup.m_MaxTemp, Status.m_CurrentTemp);
+				Rollup.m_uiTempSum += (UINT64)Status.m_CurrentTemp * uiSeconds;
+			}
+
+			if (Status.m_fHeating)
+			{
+				Rollup.m_uiHeatingSeconds += uiSeconds;
+			}
+
+			if ((UINT)Status.m_Pump1Status < 3)
+			{
+				Rollup.m_uiPump1Seconds[Status.m_Pump1Status] += uiSeconds;
+			}
+
+			if ((UINT)Status.m_Pump2Status < 3)
+			{
+				Rollup.m_uiPump2Seconds[Status.m_Pump2Status] += uiSeconds;
+			}
+
+			if (Status.m_fLights)
+			{
+				Rollup.m_uiLightsSeconds += uiSeconds;
+			}
+
+			llFrom = llTo;
+		}
+	}
+}
+
+
+void
+CStatusRollups::CloseBucket(
+	RollupPeriod Period)
+{
+	const StatusRollup &Rollup = m_Current[Period];
+
+	if (Rollup.m_uiSeconds == 0)
+	{
+		//  Never opened, or nothing in it.
+		return;
+	}
+
+	std::deque<StatusRollup> &Completed = m_Completed[Period];
+
+	Completed.push_back(Rollup);
+
+	if (Completed.size() > cRollupsKept[Period])
+	{
+		Completed.pop_front();
+	}
+}
+
+
+void
+CStatusRollups::GetRollups(
+	RollupPeriod Period,
+	std::vector<StatusRollup> &Rollups) const
+{
+	_ASSERT(Period < rpPeriodCount);
+
+	Rollups.assign(m_Completed[Period].cbegin(), m_Completed[Period].cend());
+}
+
+
+BOOL
+CStatusRollups::GetCurrentRollup(
+	RollupPeriod Period,
+	StatusRollup &Rollup) const
+{
+	_ASSERT(Period < rpPeriodCount);
+
+	if (m_Current[Period].m_uiSeconds == 0)
+	{
+		return FALSE;
+	}
+
+	Rollup = m_Current[Period];
+
+	return TRUE;
+}
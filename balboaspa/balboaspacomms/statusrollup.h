@@ -0,0 +1,84 @@
+#pragma once
+
+//  Incremental 1 minute, 1 hour and 1 day rollups of the status stream, so
+//  dashboards can read precomputed figures instead of scanning history.
+//
+//  Each status is taken to hold until the next one (up to
+//  cMaxStatusHoldSeconds), and its time is split across the buckets it
+//  covers, so results are time weighted and don't depend on how often
+//  statuses arrive (e.g. with coalescing on).  Buckets are aligned to UTC
+//  minute/hour/day boundaries.  The only input is (time, status), so feeding
+//  the same sequence live or from a replay (e.g. CStatusHistory::Scan())
+//  gives identical results.
+//
+//  Not thread safe; callers serialize access.
+
+//  A status older than this is assumed stale; the time after it isn't
+//  counted as anything.
+const UINT cMaxStatusHoldSeconds = 120;
+
+enum RollupPeriod
+{
+	rpMinute,
+	rpHour,
+	rpDay,
+	rpPeriodCount
+};
+
+
+struct StatusRollup
+{
+	LONGLONG m_llStart;				//  Seconds, same clock as AddStatus()
+	UINT m_uiSeconds;				//  Seconds covered by a status
+
+	//  Current temp; unknown readings aren't included.
+	UINT m_uiTempSeconds;
+	BYTE m_MinTemp;
+	BYTE m_MaxTemp;
+	UINT64 m_uiTempSum;				//  Temp * seconds
+
+	UINT m_uiHeatingSeconds;
+	UINT m_uiPump1Seconds[3];		//  Indexed by PumpStatus
+	UINT m_uiPump2Seconds[3];
+	UINT m_uiLightsSeconds;
+
+	double GetMeanTemp(void) const;
+	double GetHeatingDutyCycle(void) const;
+};
+
+
+class CStatusRollups :
+	public IStatusHistoryVisitor
+{
+public:
+	CStatusRollups();
+
+	//  O(1) per status.  Times mustn't go backwards.
+	BOOL AddStatus(LONGLONG llTime, const StatusInfo &);
+
+	//  For replaying history.
+	void OnStatus(LONGLONG llTime, const StatusInfo &Status) { AddStatus(llTime, Status); };
+
+	//  Completed buckets, oldest first.  Only buckets with some coverage are
+	//  kept, up to a day of minutes, a week of hours, and a year of days.
+	void GetRollups(RollupPeriod, std::vector<StatusRollup> &) const;
+
+	//  Bucket still being filled in, up to the latest status.
+	BOOL GetCurrentRollup(RollupPeriod, StatusRollup &) const;
+
+	void Clear(void);
+
+private:
+	void AddInterval(LONGLONG llStart, LONGLONG llEnd, const StatusInfo &);
+	void CloseBucket(RollupPeriod);
+
+	BOOL m_fHaveStatus;
+	LONGLONG m_llLastTime;
+	StatusInfo m_LastStatus;
+
+	StatusRollup m_Current[rpPeriodCount];
+	std::deque<StatusRollup> m_Completed[rpPeriodCount];
+
+	//  Disallowed operations.
+	const CStatusRollups & operator=(const CStatusRollups &) { return *this; };
+};